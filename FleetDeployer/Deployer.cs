@@ -0,0 +1,349 @@
+﻿using System;
+using System.Collections.Generic;
+using System.Diagnostics;
+using System.Threading;
+using Pololu.UsbWrapper;
+using Pololu.Usc;
+using Pololu.Jrk;
+using Pololu.SimpleMotorControllerG2;
+
+namespace Pololu.FleetDeployer
+{
+    /// <summary>
+    /// What happened when deploying to one device.  Times are in milliseconds.
+    /// </summary>
+    class DeviceReport
+    {
+        public ManifestEntry entry;
+        public String product = "";
+        public Int32 busId = -1;
+        public double waitTime;
+        public double connectTime;
+        public double applyTime;
+        public double verifyTime;
+        public double totalTime;
+
+        /// <summary>
+        /// For a Maestro, false if the script was not written because the
+        /// device already had it.
+        /// </summary>
+        public bool scriptWritten = true;
+
+        public List<String> warnings = new List<String>();
+
+        /// <summary>
+        /// null if the deployment succeeded.
+        /// </summary>
+        public Exception error;
+    }
+
+    /// <summary>
+    /// Loads settings into many devices at once.  Every device gets its own
+    /// thread, but only a limited number of devices on each USB bus are
+    /// worked on at the same time, because they share the bus's bandwidth.
+    /// </summary>
+    class Deployer
+    {
+        readonly int perBus;
+        readonly bool verify;
+        readonly bool force;
+        readonly bool scriptIfChanged;
+        readonly SettingsCache cache;
+
+        /// <param name="perBus">The maximum number of devices on one bus to work on at once.</param>
+        /// <param name="verify">Read the settings back after applying them and check that they match.</param>
+        /// <param name="force">Apply settings even if fixing them for the device produced warnings.</param>
+        /// <param name="useScriptCache">Keep compiled Maestro scripts on disk next to the settings files.</param>
+        /// <param name="scriptIfChanged">Don't write a Maestro's script if its script CRC matches the new script (see Usc.loadScript).</param>
+        public Deployer(int perBus, bool verify, bool force, bool useScriptCache, bool scriptIfChanged)
+        {
+            this.perBus = perBus;
+            this.verify = verify;
+            this.force = force;
+            this.scriptIfChanged = scriptIfChanged;
+            cache = new SettingsCache(useScriptCache);
+        }
+
+        /// <summary>
+        /// The settings files that were read, and the compiled scripts.
+        /// </summary>
+        public SettingsCache settingsCache
+        {
+            get { return cache; }
+        }
+
+        enum DeviceType { Maestro, Jrk, Smc }
+
+        class Target
+        {
+            public DeviceListItem item;
+            public DeviceType type;
+        }
+
+        /// <summary>
+        /// Deploys the settings to every device in the manifest and returns a
+        /// report for each one, in the same order as the manifest.
+        /// </summary>
+        public List<DeviceReport> deploy(IList<ManifestEntry> entries)
+        {
+            // Enumerate each kind of device once, rather than once per device.
+            Dictionary<String, Target> targets = new Dictionary<String, Target>();
+            addTargets(targets, Usc.Usc.getConnectedDevices(), DeviceType.Maestro);
+            addTargets(targets, Jrk.Jrk.getConnectedDevices(), DeviceType.Jrk);
+            addTargets(targets, Smc.getConnectedDevices(), DeviceType.Smc);
+
+            List<DeviceReport> reports = new List<DeviceReport>();
+            Dictionary<Int32, Semaphore> buses = new Dictionary<Int32, Semaphore>();
+            List<Thread> threads = new List<Thread>();
+
+            foreach (ManifestEntry entry in entries)
+            {
+                DeviceReport report = new DeviceReport();
+                report.entry = entry;
+                reports.Add(report);
+
+                Target target;
+                if (!targets.TryGetValue(entry.serialNumber, out target))
+                {
+                    report.error = new Exception("Could not find a device with serial number " + entry.serialNumber + ".");
+                    continue;
+                }
+
+                report.busId = target.item.busId;
+                Semaphore bus;
+                if (!buses.TryGetValue(report.busId, out bus))
+                {
+                    bus = new Semaphore(perBus, perBus);
+                    buses[report.busId] = bus;
+                }
+
+                Thread thread = new Thread(delegate()
+                {
+                    deployToDevice(target, report, bus);
+                });
+                thread.Start();
+                threads.Add(thread);
+            }
+
+            foreach (Thread thread in threads)
+            {
+                thread.Join();
+            }
+            foreach (Semaphore bus in buses.Values)
+            {
+                bus.Close();
+            }
+            return reports;
+        }
+
+        static void addTargets(Dictionary<String, Target> targets, List<DeviceListItem> list, DeviceType type)
+        {
+            foreach (DeviceListItem item in list)
+            {
+                Target target = new Target();
+                target.item = item;
+                target.type = type;
+                targets[item.serialNumber] = target;
+            }
+        }
+
+        void deployToDevice(Target target, DeviceReport report, Semaphore bus)
+        {
+            Stopwatch total = Stopwatch.StartNew();
+            bus.WaitOne();
+            try
+            {
+                report.waitTime = total.Elapsed.TotalMilliseconds;
+                switch (target.type)
+                {
+                    case DeviceType.Maestro: deployMaestro(target.item, report); break;
+                    case DeviceType.Jrk: deployJrk(target.item, report); break;
+                    case DeviceType.Smc: deploySmc(target.item, report); break;
+                }
+            }
+            catch (Exception exception)
+            {
+                report.error = exception;
+            }
+            finally
+            {
+                bus.Release();
+                report.totalTime = total.Elapsed.TotalMilliseconds;
+            }
+        }
+
+        void deployMaestro(DeviceListItem item, DeviceReport report)
+        {
+            report.product = "Maestro";
+            Stopwatch stopwatch = Stopwatch.StartNew();
+            Usc.Usc usc = new Usc.Usc(item);
+            try
+            {
+                report.connectTime = lap(stopwatch);
+
+                UscSettings settings = cache.getMaestroSettings(report.entry.fileName, usc, report.warnings);
+                if (report.warnings.Count != 0 && !force)
+                {
+                    throw new Exception("There were problems with the settings file.  Use the --force option to apply the settings anyway.");
+                }
+
+                // With scriptIfChanged, devices that already have the script
+                // from an earlier deployment are not written again.  It is
+                // off by default because a device's script CRC can be stale.
+                usc.setUscSettings(settings, false);
+                report.scriptWritten = usc.loadScript(settings.script, settings.compiledScript, scriptIfChanged);
+                usc.reinitialize();
+                report.applyTime = lap(stopwatch);
+
+                if (verify)
+                {
+                    usc.scriptCache = cache.getScriptCache(report.entry.fileName);
+                    verifyMaestro(settings, usc.getUscSettings());
+                    report.verifyTime = lap(stopwatch);
+                }
+            }
+            finally
+            {
+                usc.disconnect();
+            }
+        }
+
+        void deployJrk(DeviceListItem item, DeviceReport report)
+        {
+            report.product = "Jrk";
+            Stopwatch stopwatch = Stopwatch.StartNew();
+            Jrk.Jrk jrk = new Jrk.Jrk(item);
+            try
+            {
+                report.connectTime = lap(stopwatch);
+
+                JrkParameterList parameters = cache.getJrkParameters(report.entry.fileName);
+                foreach (jrkParameter parameter in parameters.parameterList)
+                {
+                    jrk.setJrkParameter(parameter, parameters.getJrkParameter(parameter));
+                }
+                jrk.reinitialize();
+                report.applyTime = lap(stopwatch);
+
+                if (verify)
+                {
+                    foreach (jrkParameter parameter in parameters.parameterList)
+                    {
+                        uint expected = parameters.getJrkParameter(parameter);
+                        uint actual = jrk.getJrkParameter(parameter);
+                        if (actual != expected)
+                        {
+                            throw new Exception("Verification failed: " + parameter + " is " + actual + " instead of " + expected + ".");
+                        }
+                    }
+                    report.verifyTime = lap(stopwatch);
+                }
+            }
+            finally
+            {
+                jrk.disconnect();
+            }
+        }
+
+        void deploySmc(DeviceListItem item, DeviceReport report)
+        {
+            report.product = Smc.productIdToShortModelString(item.productId);
+            Stopwatch stopwatch = Stopwatch.StartNew();
+            Smc smc = new Smc(item);
+            try
+            {
+                report.connectTime = lap(stopwatch);
+
+                SmcSettings settings = cache.getSmcSettings(report.entry.fileName, smc, report.warnings);
+                if (report.warnings.Count != 0 && !force)
+                {
+                    throw new Exception("There were problems with the settings file.  Use the --force option to apply the settings anyway.");
+                }
+                smc.setSmcSettings(settings);
+                report.applyTime = lap(stopwatch);
+
+                if (verify)
+                {
+                    if (!smc.getSmcSettings().Equals(settings))
+                    {
+                        throw new Exception("Verification failed: the settings read from the device do not match.");
+                    }
+                    report.verifyTime = lap(stopwatch);
+                }
+            }
+            finally
+            {
+                smc.disconnect();
+            }
+        }
+
+        /// <summary>
+        /// Checks the settings read back from a Maestro against the ones that
+        /// were written.  Values that the Maestro stores with less precision
+        /// (like the minimum, which is stored in units of 16 microseconds) are
+        /// compared at the precision that is stored.  Speeds are not compared
+        /// because the way they are stored does not round trip exactly.
+        /// </summary>
+        static void verifyMaestro(UscSettings expected, UscSettings actual)
+        {
+            check("serial mode", expected.serialMode, actual.serialMode);
+            check("serial device number", expected.serialDeviceNumber, actual.serialDeviceNumber);
+            check("Mini SSC offset", expected.miniSscOffset, actual.miniSscOffset);
+            check("serial timeout", expected.serialTimeout, actual.serialTimeout);
+            check("CRC enabled", expected.enableCrc, actual.enableCrc);
+            check("never suspend", expected.neverSuspend, actual.neverSuspend);
+            check("number of channels", expected.servoCount, actual.servoCount);
+            if (actual.scriptInconsistent || actual.script != expected.script)
+            {
+                throw new Exception("Verification failed: the script on the device does not match.");
+            }
+
+            for (int i = 0; i < expected.servoCount; i++)
+            {
+                ChannelSetting e = expected.channelSettings[i];
+                ChannelSetting a = actual.channelSettings[i];
+                String channel = "channel " + i + " ";
+                check(channel + "name", e.name, a.name);
+                check(channel + "mode", e.mode, a.mode);
+                check(channel + "minimum", e.minimum / 64 * 64, a.minimum);
+                check(channel + "maximum", e.maximum / 64 * 64, a.maximum);
+                check(channel + "neutral", e.neutral, a.neutral);
+                check(channel + "range", e.range / 127 * 127, a.range);
+                check(channel + "acceleration", e.acceleration, a.acceleration);
+                if (e.mode != ChannelMode.Input)
+                {
+                    check(channel + "home mode", e.homeMode, a.homeMode);
+                    if (e.homeMode == HomeMode.Goto)
+                    {
+                        check(channel + "home", e.home, a.home);
+                    }
+                }
+            }
+        }
+
+        static void check(String name, Object expected, Object actual)
+        {
+            if (!expected.Equals(actual))
+            {
+                throw new Exception("Verification failed: the " + name + " is " + actual + " instead of " + expected + ".");
+            }
+        }
+
+        static void check(String name, int expected, int actual)
+        {
+            check(name, (Object)expected, (Object)actual);
+        }
+
+        /// <summary>
+        /// Returns the milliseconds since the stopwatch was last restarted,
+        /// and restarts it.
+        /// </summary>
+        static double lap(Stopwatch stopwatch)
+        {
+            double milliseconds = stopwatch.Elapsed.TotalMilliseconds;
+            stopwatch.Reset();
+            stopwatch.Start();
+            return milliseconds;
+        }
+    }
+}
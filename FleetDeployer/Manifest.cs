@@ -0,0 +1,84 @@
+﻿using System;
+using System.Collections.Generic;
+using System.IO;
+
+namespace Pololu.FleetDeployer
+{
+    /// <summary>
+    /// One line of a manifest: a device and the settings file to load into it.
+    /// </summary>
+    class ManifestEntry
+    {
+        public readonly String serialNumber;
+        public readonly String fileName;
+        public readonly int lineNumber;
+
+        public ManifestEntry(String serialNumber, String fileName, int lineNumber)
+        {
+            this.serialNumber = serialNumber;
+            this.fileName = fileName;
+            this.lineNumber = lineNumber;
+        }
+    }
+
+    /// <summary>
+    /// Reads manifest files, which say which settings file to load into each
+    /// device.  Each line has a serial number followed by the name of a
+    /// settings file, separated by spaces or tabs.  The rest of the line after
+    /// the serial number is the file name, so it can contain spaces.  File
+    /// names are relative to the folder the manifest is in.  Blank lines and
+    /// lines starting with # are ignored.  For example:
+    ///
+    ///   # serial number   settings file
+    ///   00012345          arm_maestro.txt
+    ///   00012346          arm_maestro.txt
+    ///   00023456          lift jrk.txt
+    ///
+    /// The type of each device (Maestro, jrk or Simple Motor Controller G2)
+    /// is found from the connected devices, so the file must be the right
+    /// kind for that device.
+    /// </summary>
+    static class Manifest
+    {
+        public static List<ManifestEntry> read(String fileName)
+        {
+            String folder = Path.GetDirectoryName(Path.GetFullPath(fileName));
+            List<ManifestEntry> entries = new List<ManifestEntry>();
+            Dictionary<String, int> lineOfSerialNumber = new Dictionary<String, int>();
+
+            using (StreamReader reader = new StreamReader(fileName))
+            {
+                int lineNumber = 0;
+                String line;
+                while ((line = reader.ReadLine()) != null)
+                {
+                    lineNumber++;
+                    line = line.Trim();
+                    if (line == "" || line.StartsWith("#"))
+                    {
+                        continue;
+                    }
+
+                    int separator = line.IndexOfAny(new char[] { ' ', '\t' });
+                    if (separator < 0)
+                    {
+                        throw new Exception("Error reading manifest: missing settings file name on line " + lineNumber + ".");
+                    }
+
+                    String serialNumber = line.Substring(0, separator);
+                    String settingsFile = line.Substring(separator + 1).Trim();
+
+                    if (lineOfSerialNumber.ContainsKey(serialNumber))
+                    {
+                        throw new Exception("Error reading manifest: serial number " + serialNumber + " on line " + lineNumber +
+                            " was already listed on line " + lineOfSerialNumber[serialNumber] + ".");
+                    }
+                    lineOfSerialNumber[serialNumber] = lineNumber;
+
+                    entries.Add(new ManifestEntry(serialNumber, Path.Combine(folder, settingsFile), lineNumber));
+                }
+            }
+            return entries;
+        }
+    }
+}
@@ -0,0 +1,137 @@
+﻿using System;
+using System.Collections.Generic;
+using System.Diagnostics;
+using System.Reflection;
+
+namespace Pololu.FleetDeployer
+{
+    /// <summary>
+    /// This class represents the executable commandline utility FleetDeployer.exe,
+    /// which loads settings files into many Maestros, jrks, and Simple Motor
+    /// Controller G2s at once.
+    /// </summary>
+    class Program
+    {
+        static void Main(string[] args)
+        {
+            CommandOptions opts = new CommandOptions(Assembly.GetExecutingAssembly().GetName()+"\n"+
+                "Options:\n"+
+                "  --manifest FILE          load the settings listed in FILE into the devices\n"+
+                "  --per-bus NUM            maximum number of devices on the same USB bus\n"+
+                "                           to work on at once (default 4)\n"+
+                "  --no-verify              don't read the settings back to check them\n"+
+                "  --force                  apply settings even if there were problems with\n"+
+                "                           them\n"+
+                "  --no-script-cache        compile Maestro scripts every time instead of\n"+
+                "                           keeping them compiled in a maestro-script-cache\n"+
+                "                           directory next to the settings files\n"+
+                "  --if-changed             don't write a Maestro's script if the device's\n"+
+                "                           script CRC matches it\n"+
+                "Each line of the manifest has a serial number followed by a settings file:\n"+
+                "  # serial number   settings file\n"+
+                "  00012345          arm_maestro.txt\n"+
+                "  00023456          lift_jrk.txt\n"+
+                "The settings files are the ones written by UscCmd --getconf,\n"+
+                "JrkCmd --getconf, and SmcG2Cmd --get-settings.\n",
+                args);
+
+            if (opts["manifest"] == null || opts["manifest"] == "")
+                opts.error("A manifest is required.");
+
+            int perBus = 4;
+            if (opts["per-bus"] != null)
+            {
+                try
+                {
+                    perBus = int.Parse(opts["per-bus"]);
+                }
+                catch (FormatException)
+                {
+                    opts.error("Invalid number.");
+                }
+                if (perBus < 1)
+                    opts.error("The number of devices per bus must be at least 1.");
+            }
+
+            try
+            {
+                List<ManifestEntry> entries = Manifest.read(opts["manifest"]);
+                Deployer deployer = new Deployer(perBus, opts["no-verify"] == null, opts["force"] != null,
+                    opts["no-script-cache"] == null, opts["if-changed"] != null);
+
+                Stopwatch stopwatch = Stopwatch.StartNew();
+                List<DeviceReport> reports = deployer.deploy(entries);
+                double seconds = stopwatch.Elapsed.TotalSeconds;
+
+                int failures = printReports(reports);
+                Console.WriteLine((reports.Count - failures) + " of " + reports.Count + " devices deployed in " +
+                    seconds.ToString("0.00") + " s.");
+
+                int compiled, cached;
+                deployer.settingsCache.getScriptCounts(out compiled, out cached);
+                if (compiled + cached != 0)
+                {
+                    Console.WriteLine("Maestro scripts: " + compiled + " compiled, " + cached + " already compiled.");
+                }
+                if (failures != 0)
+                {
+                    Environment.Exit(1);
+                }
+            }
+            catch (Exception exception)
+            {
+                printException(exception);
+                Environment.Exit(1);
+            }
+        }
+
+        /// <summary>
+        /// Prints a table with the timing of each device, followed by the
+        /// warnings and errors.  Returns the number of devices that failed.
+        /// </summary>
+        static int printReports(List<DeviceReport> reports)
+        {
+            Console.WriteLine("{0,-10} {1,-10} {2,5} {3,9} {4,9} {5,9} {6,9} {7,9}  {8}",
+                "Serial", "Product", "Bus", "Wait ms", "Open ms", "Apply ms", "Verify ms", "Total ms", "Result");
+
+            int failures = 0;
+            foreach (DeviceReport report in reports)
+            {
+                Console.WriteLine("{0,-10} {1,-10} {2,5} {3,9:0.0} {4,9:0.0} {5,9:0.0} {6,9:0.0} {7,9:0.0}  {8}",
+                    report.entry.serialNumber, report.product, report.busId < 0 ? "-" : report.busId.ToString(),
+                    report.waitTime, report.connectTime, report.applyTime, report.verifyTime, report.totalTime,
+                    report.error != null ? "FAILED" : report.scriptWritten ? "OK" : "OK (same script)");
+                if (report.error != null)
+                {
+                    failures++;
+                }
+            }
+
+            foreach (DeviceReport report in reports)
+            {
+                foreach (String warning in report.warnings)
+                {
+                    Console.WriteLine("Warning for #" + report.entry.serialNumber + ": " + warning);
+                }
+                if (report.error != null)
+                {
+                    Console.Write("Error for #" + report.entry.serialNumber + " (manifest line " + report.entry.lineNumber + "): ");
+                    printException(report.error);
+                }
+            }
+            return failures;
+        }
+
+        /// <summary>
+        /// Prints the exception and all its inner exceptions.
+        /// </summary>
+        static void printException(Exception exception)
+        {
+            while (exception != null)
+            {
+                Console.WriteLine(exception.Message);
+                exception = exception.InnerException;
+            }
+        }
+    }
+}
@@ -0,0 +1,197 @@
+﻿using System;
+using System.Collections.Generic;
+using System.IO;
+using Pololu.Usc;
+using Pololu.Jrk;
+using Pololu.SimpleMotorControllerG2;
+
+namespace Pololu.FleetDeployer
+{
+    /// <summary>
+    /// The parameters from a jrk configuration file, in the order they appear
+    /// in the file, so they can be loaded into many jrks without reading the
+    /// file again.
+    /// </summary>
+    class JrkParameterList : IJrkParameterHolder
+    {
+        readonly List<jrkParameter> parameters = new List<jrkParameter>();
+        readonly Dictionary<jrkParameter, uint> values = new Dictionary<jrkParameter, uint>();
+
+        public void setJrkParameter(jrkParameter parameter, uint value)
+        {
+            if (!values.ContainsKey(parameter))
+            {
+                parameters.Add(parameter);
+            }
+            values[parameter] = value;
+        }
+
+        public uint getJrkParameter(jrkParameter parameter)
+        {
+            return values[parameter];
+        }
+
+        public IList<jrkParameter> parameterList
+        {
+            get { return parameters; }
+        }
+    }
+
+    /// <summary>
+    /// Reads and parses each settings file only once, no matter how many
+    /// devices it is loaded into.  The settings are also fixed up (the way
+    /// the command-line utilities do before applying them) only once for each
+    /// kind of device.  All devices that use the same entry share the same
+    /// settings object, so it must not be modified.
+    /// </summary>
+    /// <remarks>
+    /// This class is thread-safe.  If reading a file fails, the failure is
+    /// remembered and reported to every device that uses the file.
+    /// Compiled Maestro scripts are also kept on disk, in a ScriptCache
+    /// next to each settings file, so later runs do not compile them again.
+    /// </remarks>
+    class SettingsCache
+    {
+        class Entry
+        {
+            public Object settings;
+            public List<String> warnings = new List<String>();
+            public Exception error;
+        }
+
+        delegate Object Loader(List<String> warnings);
+
+        readonly Object sync = new Object();
+        readonly Dictionary<String, Entry> entries = new Dictionary<String, Entry>();
+        readonly Dictionary<String, ScriptCache> scriptCaches = new Dictionary<String, ScriptCache>();
+        readonly bool useScriptCache;
+
+        /// <param name="useScriptCache">Keep compiled Maestro scripts on disk next to the settings files.</param>
+        public SettingsCache(bool useScriptCache)
+        {
+            this.useScriptCache = useScriptCache;
+        }
+
+        /// <summary>
+        /// Gets the cache of compiled scripts for the directory a settings
+        /// file is in, or null if the script cache is not used.
+        /// </summary>
+        public ScriptCache getScriptCache(String fileName)
+        {
+            if (!useScriptCache)
+            {
+                return null;
+            }
+
+            String directory = ScriptCache.getDefaultDirectory(fileName);
+            lock (sync)
+            {
+                ScriptCache scriptCache;
+                if (!scriptCaches.TryGetValue(directory, out scriptCache))
+                {
+                    scriptCache = new ScriptCache(directory);
+                    scriptCaches[directory] = scriptCache;
+                }
+                return scriptCache;
+            }
+        }
+
+        /// <summary>
+        /// The number of scripts that were compiled and the number that were
+        /// found already compiled, in all the script caches.
+        /// </summary>
+        public void getScriptCounts(out int compiled, out int cached)
+        {
+            compiled = 0;
+            cached = 0;
+            lock (sync)
+            {
+                foreach (ScriptCache scriptCache in scriptCaches.Values)
+                {
+                    compiled += scriptCache.misses;
+                    cached += scriptCache.hits;
+                }
+            }
+        }
+
+        /// <summary>
+        /// Gets the settings for a Maestro.  The settings are fixed for the
+        /// number of channels the Maestro has (which also determines its
+        /// model) and its firmware version, and the script in them has
+        /// already been compiled.
+        /// </summary>
+        public UscSettings getMaestroSettings(String fileName, Usc.Usc usc, List<String> warnings)
+        {
+            String key = "usc|" + usc.servoCount + "|" + usc.firmwareVersionString + "|" + fileName;
+            return (UscSettings)get(key, warnings, delegate(List<String> w)
+            {
+                UscSettings settings;
+                using (StreamReader reader = new StreamReader(fileName))
+                {
+                    settings = Usc.ConfigurationFile.load(reader, w, getScriptCache(fileName));
+                }
+                usc.fixSettings(settings, w);
+                return settings;
+            });
+        }
+
+        public JrkParameterList getJrkParameters(String fileName)
+        {
+            return (JrkParameterList)get("jrk|" + fileName, null, delegate(List<String> w)
+            {
+                JrkParameterList parameters = new JrkParameterList();
+                using (StreamReader reader = new StreamReader(fileName))
+                {
+                    Jrk.ConfigurationFile.load(reader, parameters);
+                }
+                return parameters;
+            });
+        }
+
+        /// <summary>
+        /// Gets the settings for a Simple Motor Controller G2, fixed for its
+        /// product ID and firmware version.
+        /// </summary>
+        public SmcSettings getSmcSettings(String fileName, Smc smc, List<String> warnings)
+        {
+            UInt16 firmwareVersion = smc.getFirmwareVersion();
+            return (SmcSettings)get("smc|" + smc.productId + "|" + firmwareVersion + "|" + fileName, warnings, delegate(List<String> w)
+            {
+                SmcSettings settings = SettingsFile.load(fileName, w);
+                Smc.fixSettings(settings, w, smc.productId, firmwareVersion);
+                return settings;
+            });
+        }
+
+        Object get(String key, List<String> warnings, Loader load)
+        {
+            Entry entry;
+            lock (sync)
+            {
+                if (!entries.TryGetValue(key, out entry))
+                {
+                    entry = new Entry();
+                    try
+                    {
+                        entry.settings = load(entry.warnings);
+                    }
+                    catch (Exception exception)
+                    {
+                        entry.error = exception;
+                    }
+                    entries[key] = entry;
+                }
+            }
+
+            if (entry.error != null)
+            {
+                throw new Exception("There was an error reading the settings file.", entry.error);
+            }
+            if (warnings != null)
+            {
+                warnings.AddRange(entry.warnings);
+            }
+            return entry.settings;
+        }
+    }
+}
@@ -0,0 +1,19 @@
+# Generate a unique list of files that need to be in the same
+# directory as FleetDeployer at runtime (runtime dependencies).
+FleetDeployer_runtime := $(sort $(Usc_lib) $(Jrk_lib) $(SmcG2_lib))
+
+# Compile-time dependencies.
+FleetDeployer_dlls := $(Bytecode)/Bytecode.dll $(UsbWrapper)/UsbWrapper.dll $(Usc)/Usc.dll $(Jrk)/Jrk.dll $(SmcG2)/SmcG2.dll
+FleetDeployer_csfiles := $(FleetDeployer)/CommandOptions.cs $(FleetDeployer)/Deployer.cs $(FleetDeployer)/Manifest.cs $(FleetDeployer)/Program.cs $(FleetDeployer)/SettingsCache.cs $(FleetDeployer)/Properties/AssemblyInfo.cs
+
+# Required module variables
+Targets += $(FleetDeployer)/FleetDeployer
+Byproducts += $(foreach dll, $(FleetDeployer_runtime), $(FleetDeployer)/$(notdir $(dll)))
+
+$(FleetDeployer)/FleetDeployer: $(FleetDeployer_csfiles) $(FleetDeployer_runtime)
+	cp $(FleetDeployer_runtime) $(FleetDeployer)
+	$(CS) -target:exe -out:$@.exe $(FleetDeployer_csfiles) $(foreach dll, $(FleetDeployer_dlls),-r:$(FleetDeployer)/$(notdir $(dll)))
+	mv $@.exe $@
+
+# Alias so you can type "make fleetdeployer"
+fleetdeployer: $(FleetDeployer)/FleetDeployer
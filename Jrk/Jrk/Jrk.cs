@@ -152,28 +152,92 @@ namespace Pololu.Jrk
         {
             requireArgumentRange(target, 0, 4095, "target");
 
-            try
+            int status = trySetTarget(target);
+            if (status < 0)
             {
-                controlTransfer(0x40, (byte)jrkRequest.REQUEST_SET_TARGET, target, 0);
+                throw UsbStatus.toException(status, "There was an error setting the target.");
             }
-            catch (Exception exception)
+        }
+
+        /// <summary>
+        /// Same as setTarget, but returns a UsbStatus code instead of throwing
+        /// an exception if there is a problem.  A target above 4095 gives
+        /// UsbStatus.InvalidParameter.
+        /// </summary>
+        /// <returns>UsbStatus.Success (0) or a negative UsbStatus error code.</returns>
+        public int trySetTarget(UInt16 target)
+        {
+            if (target > 4095)
+            {
+                return UsbStatus.InvalidParameter;
+            }
+
+            CoalescingWriter writer = coalescer;
+            if (writer != null)
             {
-                throw new Exception("There was an error setting the target.", exception);
+                return writer.post(0, target);
             }
+            return sendTarget(target);
         }
 
-        public void motorOff()
+        /// <summary>
+        /// Sends a target to the device right away, even in coalescing mode.
+        /// </summary>
+        int sendTarget(UInt16 target)
         {
-            try
+            return tryControlTransfer(0x40, (byte)jrkRequest.REQUEST_SET_TARGET, target, 0);
+        }
+
+        /// <summary>
+        /// Puts the jrk in coalescing mode: setTarget and trySetTarget store
+        /// the target and return right away, and a background thread sends
+        /// it.  If a new target is set before the last one was sent, only
+        /// the new one is sent.  This is for control loops that calculate
+        /// targets faster than USB can send them.  Errors are returned by a
+        /// later call instead of the one that caused them, and the counters
+        /// are in coalescer.  motorOff drops a target that was not sent yet,
+        /// so it is never undone by an older target.
+        /// Call stopCoalescing to go back to sending targets right away.
+        /// </summary>
+        public void startCoalescing()
+        {
+            startCoalescing(1, writeCoalesced);
+        }
+
+        int writeCoalesced(int key, int value)
+        {
+            return sendTarget((UInt16)value);
+        }
+
+        void cancelCoalescedTarget()
+        {
+            CoalescingWriter writer = coalescer;
+            if (writer != null)
             {
-                controlTransfer(0x40, (byte)jrkRequest.REQUEST_MOTOR_OFF, 0, 0);
+                writer.cancel(0);
             }
-            catch (Exception exception)
+        }
+
+        public void motorOff()
+        {
+            int status = tryMotorOff();
+            if (status < 0)
             {
-                throw new Exception("There was an error turning off the motor.", exception);
+                throw UsbStatus.toException(status, "There was an error turning off the motor.");
             }
         }
 
+        /// <summary>
+        /// Same as motorOff, but returns a UsbStatus code instead of throwing
+        /// an exception if there is a problem.
+        /// </summary>
+        /// <returns>UsbStatus.Success (0) or a negative UsbStatus error code.</returns>
+        public int tryMotorOff()
+        {
+            cancelCoalescedTarget();
+            return tryControlTransfer(0x40, (byte)jrkRequest.REQUEST_MOTOR_OFF, 0, 0);
+        }
+
         /// <summary>
         /// Gets the jrk parameter.  The only one that is modified by this function relative to
         /// what is actually on the device is the serial baud rate.
@@ -334,25 +398,32 @@ namespace Pololu.Jrk
             return value;
         }
 
-        public unsafe jrkVariables getVariables()
+        public jrkVariables getVariables()
         {
-            byte[] array = new byte[sizeof(jrkVariables)];
-            uint lengthTransferred = controlTransfer(0xC0, (Byte)jrkRequest.REQUEST_GET_VARIABLES, 0, 0, array);
-
-            if (lengthTransferred != sizeof(jrkVariables))
-            {
-                throw new Exception("Error getting variables from Jrk.  Expected " + sizeof(jrkVariables) + " bytes, received " + lengthTransferred + ".");
-            }
-
             jrkVariables variables;
-            fixed (byte* pointer = array)
+            int status = tryGetVariables(out variables);
+            if (status < 0)
             {
-                variables = *(jrkVariables*)pointer;
+                throw UsbStatus.toException(status, "Error getting variables from Jrk.");
             }
-
             return variables;
         }
 
+        /// <summary>
+        /// Same as getVariables, but does not allocate memory and returns a
+        /// UsbStatus code instead of throwing an exception if there is a problem.
+        /// </summary>
+        /// <returns>UsbStatus.Success (0) or a negative UsbStatus error code.</returns>
+        public unsafe int tryGetVariables(out jrkVariables variables)
+        {
+            jrkVariables tmp = new jrkVariables();
+            int result = tryControlTransfer(0xC0, (Byte)jrkRequest.REQUEST_GET_VARIABLES, 0, 0, &tmp, (ushort)sizeof(jrkVariables));
+            variables = tmp;
+            if (result < 0) { return result; }
+            if (result != sizeof(jrkVariables)) { return UsbStatus.ShortTransfer; }
+            return UsbStatus.Success;
+        }
+
         UInt16 privateFirmwareVersionMajor = 0xFFFF;
         Byte privateFirmwareVersionMinor = 0xFF;
 
@@ -0,0 +1,461 @@
+﻿using System;
+using System.Diagnostics;
+using System.Threading;
+using Pololu.UsbWrapper;
+
+namespace Pololu.Jrk
+{
+    /// <summary>
+    /// The state of one cycle of a JrkControlLoop.  The loop passes the
+    /// same object to the callback every cycle, so nothing is allocated.
+    /// </summary>
+    public class JrkControlCycle
+    {
+        /// <summary>
+        /// The number of the cycle, counting from 0.  Cycles skipped because
+        /// of a missed deadline are counted too, so this is always the time
+        /// divided by the period.
+        /// </summary>
+        public long number;
+
+        /// <summary>
+        /// The time the cycle was scheduled to start, in microseconds since
+        /// the loop was started.
+        /// </summary>
+        public double time;
+
+        /// <summary>
+        /// How late the cycle started, in microseconds.
+        /// </summary>
+        public double lateness;
+
+        /// <summary>
+        /// The variables read from the jrk this cycle.  If the read failed,
+        /// these are the variables from the last successful read.
+        /// </summary>
+        public jrkVariables variables;
+
+        /// <summary>
+        /// The UsbStatus code of this cycle's read: 0 if it succeeded, or a
+        /// negative error code.
+        /// </summary>
+        public int readStatus;
+
+        /// <summary>
+        /// The target to send to the jrk (0-4095).  The callback sets this
+        /// and setTarget.
+        /// </summary>
+        public UInt16 target;
+
+        /// <summary>
+        /// True to send target this cycle.  It is false at the start of
+        /// every cycle.
+        /// </summary>
+        public bool setTarget;
+
+        /// <summary>
+        /// True to stop the loop after this cycle.
+        /// </summary>
+        public bool stop;
+    }
+
+    /// <summary>
+    /// Computes one cycle of a control loop.  It is called on the loop's
+    /// thread and should not allocate memory, block, or take long.
+    /// </summary>
+    public delegate void JrkControlCallback(JrkControlCycle cycle);
+
+    /// <summary>
+    /// Runs a control loop on the computer that reads a jrk's variables,
+    /// calls a callback to compute a new target, and sends it, at a fixed
+    /// rate.
+    /// </summary>
+    /// <remarks>
+    /// <para>
+    /// The cycles are scheduled on the Stopwatch clock at whole multiples
+    /// of the period from the start, so errors in one cycle's timing do not
+    /// add up.  The loop's thread sleeps until shortly before each cycle
+    /// and then yields until it is time.  The time it stops sleeping is
+    /// set by how long a one-millisecond sleep takes: it jumps up to any
+    /// sleep that took longer, so one late wakeup does not make the next
+    /// cycles late too, and then decays by a sixteenth of the difference
+    /// for every shorter sleep, so a single slow sleep (when the computer
+    /// was busy, for example) does not keep the loop yielding for good.
+    /// A cycle that ends after the next one was due is counted in
+    /// missedDeadlines, and the cycles that could not start on time are
+    /// skipped, so the loop never runs behind.
+    /// </para>
+    /// <para>
+    /// While it yields, the loop's thread keeps a CPU busy whenever no
+    /// other thread is waiting for it.  That is about one sleep (usually
+    /// 1 to 2 ms on an idle computer) out of every period, so with a
+    /// period of 2 ms or less the loop takes most of a CPU.
+    /// </para>
+    /// <para>
+    /// The target is given to the jrk's coalescing writer (see
+    /// Jrk.startCoalescing), so the loop does not wait for it to be sent:
+    /// the write of one cycle overlaps the wait for the next cycle and its
+    /// read.  If the writer has not sent a target before the next one is
+    /// set, the older one is dropped.  The loop starts coalescing mode if
+    /// it was not started, and stops it again when the loop stops, whether
+    /// it was stopped with stop() or stopped by itself.
+    /// </para>
+    /// <para>
+    /// Nothing is allocated while the loop runs, as long as the callback
+    /// does not allocate, so the garbage collector does not interrupt it.
+    /// If the callback throws an exception, the loop stops, the motor is
+    /// turned off, and the exception is kept in error.
+    /// </para>
+    /// </remarks>
+    public class JrkControlLoop : IDisposable
+    {
+        readonly Jrk jrk;
+        readonly JrkControlCallback callback;
+        readonly long periodTicks;
+        readonly JrkControlCycle cycle = new JrkControlCycle();
+
+        readonly LatencyHistogram privateJitter = new LatencyHistogram();
+        readonly LatencyHistogram privateLoopLatency = new LatencyHistogram();
+        readonly LatencyHistogram privateReadLatency = new LatencyHistogram();
+
+        long privateCycles;
+        long privateMissedDeadlines;
+        long privateSkippedCycles;
+        long privateReadFailures;
+        long privateWriteFailures;
+        Exception privateError;
+
+        long sleepTicks;
+        bool startedCoalescing;
+        Thread thread;
+        volatile bool running;
+        readonly object sync = new object();
+
+        /// <param name="jrk">The jrk to control.</param>
+        /// <param name="period">The time between cycles, in microseconds.  2000 to 1000 (500 Hz to 1 kHz) is practical.</param>
+        /// <param name="callback">Computes the target of each cycle.</param>
+        public JrkControlLoop(Jrk jrk, double period, JrkControlCallback callback)
+        {
+            if (!(period >= 100))
+            {
+                throw new ArgumentOutOfRangeException("period", "The period must be at least 100 microseconds.");
+            }
+            if (callback == null)
+            {
+                throw new ArgumentNullException("callback");
+            }
+
+            this.jrk = jrk;
+            this.callback = callback;
+            periodTicks = (long)Math.Round(period * Stopwatch.Frequency / 1e6);
+            sleepTicks = 2 * Stopwatch.Frequency / 1000;
+        }
+
+        /// <summary>
+        /// The time between cycles, in microseconds.
+        /// </summary>
+        public double period
+        {
+            get { return toMicroseconds(periodTicks); }
+        }
+
+        /// <summary>
+        /// True while the loop is running.
+        /// </summary>
+        public bool isRunning
+        {
+            get { return running; }
+        }
+
+        /// <summary>
+        /// The number of cycles that ran.
+        /// </summary>
+        public long cycles
+        {
+            get { return Interlocked.Read(ref privateCycles); }
+        }
+
+        /// <summary>
+        /// The number of cycles that ended after the next cycle was due.
+        /// </summary>
+        public long missedDeadlines
+        {
+            get { return Interlocked.Read(ref privateMissedDeadlines); }
+        }
+
+        /// <summary>
+        /// The number of cycles that were skipped because the loop was more
+        /// than a period late.
+        /// </summary>
+        public long skippedCycles
+        {
+            get { return Interlocked.Read(ref privateSkippedCycles); }
+        }
+
+        /// <summary>
+        /// The number of reads that failed.
+        /// </summary>
+        public long readFailures
+        {
+            get { return Interlocked.Read(ref privateReadFailures); }
+        }
+
+        /// <summary>
+        /// The number of targets that the jrk did not accept.  Errors from the
+        /// coalescing writer are reported one cycle or more late.
+        /// </summary>
+        public long writeFailures
+        {
+            get { return Interlocked.Read(ref privateWriteFailures); }
+        }
+
+        /// <summary>
+        /// The exception that stopped the loop, or null.
+        /// </summary>
+        public Exception error
+        {
+            get { return privateError; }
+        }
+
+        /// <summary>
+        /// How late each cycle started.
+        /// </summary>
+        public LatencyHistogram jitter
+        {
+            get { return privateJitter; }
+        }
+
+        /// <summary>
+        /// The time from the start of each cycle's read until its target
+        /// was handed to the writer.
+        /// </summary>
+        public LatencyHistogram loopLatency
+        {
+            get { return privateLoopLatency; }
+        }
+
+        /// <summary>
+        /// How long each read took.
+        /// </summary>
+        public LatencyHistogram readLatency
+        {
+            get { return privateReadLatency; }
+        }
+
+        /// <summary>
+        /// Starts the loop on a thread of its own, with the highest
+        /// priority.  The first cycle starts right away.
+        /// </summary>
+        public void start()
+        {
+            lock (sync)
+            {
+                if (thread != null)
+                {
+                    return;
+                }
+
+                startedCoalescing = jrk.coalescer == null;
+                jrk.startCoalescing();
+
+                privateError = null;
+                cycle.stop = false;
+                running = true;
+                thread = new Thread(run);
+                thread.Name = "Jrk control loop " + jrk.getSerialNumber();
+                thread.IsBackground = true;
+                thread.Priority = ThreadPriority.Highest;
+                thread.Start();
+            }
+        }
+
+        /// <summary>
+        /// Stops the loop and waits for the current cycle to finish.  The
+        /// motor is left running with the last target.
+        /// </summary>
+        public void stop()
+        {
+            Thread t;
+            lock (sync)
+            {
+                t = thread;
+                if (t == null)
+                {
+                    return;
+                }
+                running = false;
+            }
+            if (Thread.CurrentThread != t)
+            {
+                t.Join();
+            }
+            finish(t);
+        }
+
+        /// <summary>
+        /// Forgets the given thread and stops coalescing mode if start()
+        /// started it, unless that was already done for the thread.
+        /// </summary>
+        void finish(Thread t)
+        {
+            lock (sync)
+            {
+                if (thread != t)
+                {
+                    return;
+                }
+                thread = null;
+                running = false;
+
+                if (startedCoalescing)
+                {
+                    jrk.stopCoalescing();
+                    startedCoalescing = false;
+                }
+            }
+        }
+
+        /// <summary>
+        /// Waits for the loop to stop by itself (when the callback sets
+        /// JrkControlCycle.stop or throws an exception).
+        /// </summary>
+        /// <param name="timeout">The most time to wait, in milliseconds, or -1 to wait as long as it takes.</param>
+        /// <returns>True if the loop stopped, false if the time ran out.</returns>
+        public bool wait(int timeout)
+        {
+            Thread t = thread;
+            return t == null || t.Join(timeout);
+        }
+
+        public void Dispose()
+        {
+            stop();
+        }
+
+        static double toMicroseconds(long ticks)
+        {
+            return ticks * 1e6 / Stopwatch.Frequency;
+        }
+
+        /// <summary>
+        /// Waits until the given time, sleeping while there is time to
+        /// spare.  Returns the time it woke up.
+        /// </summary>
+        long waitUntil(long deadline)
+        {
+            long t = Stopwatch.GetTimestamp();
+            while (deadline - t > sleepTicks && running)
+            {
+                Thread.Sleep(1);
+                long after = Stopwatch.GetTimestamp();
+                long slept = after - t;
+                if (slept > sleepTicks)
+                {
+                    sleepTicks = slept;
+                }
+                else
+                {
+                    sleepTicks -= (sleepTicks - slept) >> 4;
+                }
+                t = after;
+            }
+            while (t < deadline && running)
+            {
+                Thread.Sleep(0);
+                t = Stopwatch.GetTimestamp();
+            }
+            return t;
+        }
+
+        void run()
+        {
+            try
+            {
+                runCycles();
+            }
+            finally
+            {
+                finish(Thread.CurrentThread);
+            }
+        }
+
+        void runCycles()
+        {
+            long origin = Stopwatch.GetTimestamp();
+            long number = 0;
+            jrkVariables lastVariables = new jrkVariables();
+
+            while (running)
+            {
+                long deadline = origin + number * periodTicks;
+                long start = waitUntil(deadline);
+                if (!running)
+                {
+                    break;
+                }
+                privateJitter.record(start - deadline);
+
+                jrkVariables variables;
+                int status = jrk.tryGetVariables(out variables);
+                long read = Stopwatch.GetTimestamp();
+                privateReadLatency.record(read - start);
+                if (status < 0)
+                {
+                    Interlocked.Increment(ref privateReadFailures);
+                    variables = lastVariables;
+                }
+                else
+                {
+                    lastVariables = variables;
+                }
+
+                cycle.number = number;
+                cycle.time = toMicroseconds(deadline - origin);
+                cycle.lateness = toMicroseconds(start - deadline);
+                cycle.variables = variables;
+                cycle.readStatus = status;
+                cycle.setTarget = false;
+
+                try
+                {
+                    callback(cycle);
+                }
+                catch (Exception exception)
+                {
+                    privateError = exception;
+                    jrk.tryMotorOff();
+                    running = false;
+                    break;
+                }
+
+                if (cycle.setTarget)
+                {
+                    if (jrk.trySetTarget(cycle.target) < 0)
+                    {
+                        Interlocked.Increment(ref privateWriteFailures);
+                    }
+                }
+                long end = Stopwatch.GetTimestamp();
+                privateLoopLatency.record(end - start);
+                Interlocked.Increment(ref privateCycles);
+
+                if (cycle.stop)
+                {
+                    running = false;
+                    break;
+                }
+
+                // Skip the cycles whose time has already passed.
+                long next = number + 1;
+                if (end > origin + next * periodTicks)
+                {
+                    Interlocked.Increment(ref privateMissedDeadlines);
+                    long due = (end - origin) / periodTicks + 1;
+                    Interlocked.Add(ref privateSkippedCycles, due - next);
+                    next = due;
+                }
+                number = next;
+            }
+        }
+    }
+}
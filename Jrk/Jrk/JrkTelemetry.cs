@@ -0,0 +1,235 @@
+﻿using System;
+
+namespace Pololu.Jrk
+{
+    /// <summary>
+    /// A block of Jrk variable samples stored as one array per variable
+    /// (columns) instead of one jrkVariables struct per sample.  This is the
+    /// layout to use when analyzing a large number of samples: a calculation
+    /// that only needs a few of the variables reads only those arrays, and
+    /// the conversions below run as simple loops over them.
+    /// </summary>
+    /// <remarks>
+    /// Only the first count elements of each array are valid.  The arrays
+    /// are replaced with bigger ones when the capacity runs out, so do not
+    /// hold on to them across calls to add or decode.
+    /// </remarks>
+    public class JrkTelemetry
+    {
+        public UInt16[] input;
+        public UInt16[] target;
+        public UInt16[] feedback;
+        public UInt16[] scaledFeedback;
+        public Int16[] errorSum;
+        public Int16[] dutyCycleTarget;
+        public Int16[] dutyCycle;
+        public Byte[] current;
+        public Byte[] pidPeriodExceeded;
+        public UInt16[] pidPeriodCount;
+        public UInt16[] errorFlagBits;
+        public UInt16[] errorOccurredBits;
+
+        int privateCount;
+
+        /// <summary>
+        /// The number of samples stored.
+        /// </summary>
+        public int count
+        {
+            get { return privateCount; }
+        }
+
+        /// <summary>
+        /// The number of samples that can be stored before the arrays have
+        /// to be replaced.
+        /// </summary>
+        public int capacity
+        {
+            get { return input.Length; }
+        }
+
+        /// <summary>
+        /// The size of one raw sample: the response to REQUEST_GET_VARIABLES.
+        /// </summary>
+        public static unsafe int rawSampleSize
+        {
+            get { return sizeof(jrkVariables); }
+        }
+
+        public JrkTelemetry(int capacity)
+        {
+            allocate(Math.Max(1, capacity));
+        }
+
+        /// <summary>
+        /// Removes all the samples, keeping the arrays.
+        /// </summary>
+        public void clear()
+        {
+            privateCount = 0;
+        }
+
+        public void add(jrkVariables variables)
+        {
+            ensureCapacity(privateCount + 1);
+            int i = privateCount++;
+            input[i] = variables.input;
+            target[i] = variables.target;
+            feedback[i] = variables.feedback;
+            scaledFeedback[i] = variables.scaledFeedback;
+            errorSum[i] = variables.errorSum;
+            dutyCycleTarget[i] = variables.dutyCycleTarget;
+            dutyCycle[i] = variables.dutyCycle;
+            current[i] = variables.current;
+            pidPeriodExceeded[i] = variables.pidPeriodExceeded;
+            pidPeriodCount[i] = variables.pidPeriodCount;
+            errorFlagBits[i] = variables.errorFlagBits;
+            errorOccurredBits[i] = variables.errorOccurredBits;
+        }
+
+        /// <summary>
+        /// Appends samples from a buffer holding raw responses to
+        /// REQUEST_GET_VARIABLES (rawSampleSize bytes each) back to back.
+        /// </summary>
+        /// <param name="buffer">The raw data.</param>
+        /// <param name="offset">The position of the first sample in the buffer.</param>
+        /// <param name="samples">The number of samples to decode.</param>
+        public unsafe void decode(byte[] buffer, int offset, int samples)
+        {
+            if (samples < 0 || offset < 0 || offset + samples * sizeof(jrkVariables) > buffer.Length)
+            {
+                throw new ArgumentOutOfRangeException("samples", "The buffer is not big enough to hold " + samples + " samples.");
+            }
+            if (samples == 0)
+            {
+                return;
+            }
+
+            ensureCapacity(privateCount + samples);
+            int start = privateCount;
+
+            fixed (byte* pointer = &buffer[0])
+            fixed (UInt16* inputColumn = input, targetColumn = target, feedbackColumn = feedback, scaledFeedbackColumn = scaledFeedback)
+            fixed (Int16* errorSumColumn = errorSum, dutyCycleTargetColumn = dutyCycleTarget, dutyCycleColumn = dutyCycle)
+            fixed (Byte* currentColumn = current, pidPeriodExceededColumn = pidPeriodExceeded)
+            fixed (UInt16* pidPeriodCountColumn = pidPeriodCount, errorFlagBitsColumn = errorFlagBits, errorOccurredBitsColumn = errorOccurredBits)
+            {
+                jrkVariables* source = (jrkVariables*)(pointer + offset);
+                for (int i = 0; i < samples; i++)
+                {
+                    int j = start + i;
+                    inputColumn[j] = source[i].input;
+                    targetColumn[j] = source[i].target;
+                    feedbackColumn[j] = source[i].feedback;
+                    scaledFeedbackColumn[j] = source[i].scaledFeedback;
+                    errorSumColumn[j] = source[i].errorSum;
+                    dutyCycleTargetColumn[j] = source[i].dutyCycleTarget;
+                    dutyCycleColumn[j] = source[i].dutyCycle;
+                    currentColumn[j] = source[i].current;
+                    pidPeriodExceededColumn[j] = source[i].pidPeriodExceeded;
+                    pidPeriodCountColumn[j] = source[i].pidPeriodCount;
+                    errorFlagBitsColumn[j] = source[i].errorFlagBits;
+                    errorOccurredBitsColumn[j] = source[i].errorOccurredBits;
+                }
+            }
+
+            privateCount += samples;
+        }
+
+        /// <summary>
+        /// Converts the raw current readings of all the samples to milliamps.
+        /// </summary>
+        /// <param name="calibrationForward">PARAMETER_MOTOR_CURRENT_CALIBRATION_FORWARD.</param>
+        /// <param name="calibrationReverse">PARAMETER_MOTOR_CURRENT_CALIBRATION_REVERSE.</param>
+        /// <param name="divideCurrent">Jrk.divideCurrent of the Jrk the samples came from.</param>
+        /// <param name="milliamps">An array of at least count elements that receives the currents.</param>
+        public unsafe void getCurrentMilliamps(Byte calibrationForward, Byte calibrationReverse, bool divideCurrent, Int32[] milliamps)
+        {
+            if (milliamps.Length < privateCount)
+            {
+                throw new ArgumentException("The array is too small.", "milliamps");
+            }
+            if (privateCount == 0)
+            {
+                return;
+            }
+
+            fixed (Byte* currentColumn = current)
+            fixed (Int16* dutyCycleColumn = dutyCycle)
+            fixed (Int32* result = milliamps)
+            {
+                if (divideCurrent)
+                {
+                    for (int i = 0; i < privateCount; i++)
+                    {
+                        int d = dutyCycleColumn[i];
+                        int c = currentColumn[i] * (d > 0 ? calibrationForward : calibrationReverse);
+                        result[i] = d == 0 ? 0 : c * 600 / d;
+                    }
+                }
+                else
+                {
+                    for (int i = 0; i < privateCount; i++)
+                    {
+                        result[i] = currentColumn[i] * (dutyCycleColumn[i] > 0 ? calibrationForward : calibrationReverse);
+                    }
+                }
+            }
+        }
+
+        /// <summary>
+        /// Converts one raw current reading to milliamps, the same way
+        /// getCurrentMilliamps does.  The result has the sign of the duty
+        /// cycle when divideCurrent is true.
+        /// </summary>
+        public static int currentToMilliamps(Byte rawCurrent, Int16 dutyCycle, Byte calibrationForward, Byte calibrationReverse, bool divideCurrent)
+        {
+            int current = rawCurrent * (dutyCycle > 0 ? calibrationForward : calibrationReverse);
+            if (divideCurrent)
+            {
+                current = dutyCycle == 0 ? 0 : current * 600 / dutyCycle;
+            }
+            return current;
+        }
+
+        void ensureCapacity(int needed)
+        {
+            if (needed > input.Length)
+            {
+                resize(Math.Max(needed, input.Length * 2));
+            }
+        }
+
+        void allocate(int size)
+        {
+            input = new UInt16[size];
+            target = new UInt16[size];
+            feedback = new UInt16[size];
+            scaledFeedback = new UInt16[size];
+            errorSum = new Int16[size];
+            dutyCycleTarget = new Int16[size];
+            dutyCycle = new Int16[size];
+            current = new Byte[size];
+            pidPeriodExceeded = new Byte[size];
+            pidPeriodCount = new UInt16[size];
+            errorFlagBits = new UInt16[size];
+            errorOccurredBits = new UInt16[size];
+        }
+
+        void resize(int size)
+        {
+            Array.Resize(ref input, size);
+            Array.Resize(ref target, size);
+            Array.Resize(ref feedback, size);
+            Array.Resize(ref scaledFeedback, size);
+            Array.Resize(ref errorSum, size);
+            Array.Resize(ref dutyCycleTarget, size);
+            Array.Resize(ref dutyCycle, size);
+            Array.Resize(ref current, size);
+            Array.Resize(ref pidPeriodExceeded, size);
+            Array.Resize(ref pidPeriodCount, size);
+            Array.Resize(ref errorFlagBits, size);
+            Array.Resize(ref errorOccurredBits, size);
+        }
+    }
+}
@@ -0,0 +1,533 @@
+﻿using System;
+using System.Collections.Generic;
+using System.Diagnostics;
+using System.Threading;
+using Pololu.UsbWrapper;
+
+namespace Pololu.Jrk
+{
+    /// <summary>
+    /// A set of PID coefficients as the Jrk stores them: each coefficient is
+    /// a multiplier (0-1023) divided by two to the power of an exponent (0-15).
+    /// </summary>
+    public struct PidGains
+    {
+        public UInt16 proportionalMultiplier;
+        public Byte proportionalExponent;
+        public UInt16 integralMultiplier;
+        public Byte integralExponent;
+        public UInt16 derivativeMultiplier;
+        public Byte derivativeExponent;
+
+        public double proportional
+        {
+            get { return coefficient(proportionalMultiplier, proportionalExponent); }
+        }
+
+        public double integral
+        {
+            get { return coefficient(integralMultiplier, integralExponent); }
+        }
+
+        public double derivative
+        {
+            get { return coefficient(derivativeMultiplier, derivativeExponent); }
+        }
+
+        static double coefficient(UInt16 multiplier, Byte exponent)
+        {
+            return multiplier / (double)(1 << exponent);
+        }
+
+        /// <summary>
+        /// Returns the gains closest to the given coefficients that the Jrk
+        /// can represent.
+        /// </summary>
+        public static PidGains fromCoefficients(double proportional, double integral, double derivative)
+        {
+            PidGains gains = new PidGains();
+            toMultiplierAndExponent(proportional, out gains.proportionalMultiplier, out gains.proportionalExponent);
+            toMultiplierAndExponent(integral, out gains.integralMultiplier, out gains.integralExponent);
+            toMultiplierAndExponent(derivative, out gains.derivativeMultiplier, out gains.derivativeExponent);
+            return gains;
+        }
+
+        /// <summary>
+        /// Finds the multiplier and exponent that represent a coefficient most
+        /// precisely: the largest exponent that keeps the multiplier in range.
+        /// </summary>
+        static void toMultiplierAndExponent(double value, out UInt16 multiplier, out Byte exponent)
+        {
+            if (value < 0 || value > 1023 || Double.IsNaN(value))
+            {
+                throw new ArgumentException("PID coefficients must be between 0 and 1023, but the value given was " + value + ".");
+            }
+
+            exponent = 0;
+            while (exponent < 15 && Math.Round(value * (1 << (exponent + 1))) <= 1023)
+            {
+                exponent++;
+            }
+            multiplier = (UInt16)Math.Round(value * (1 << exponent));
+
+            // Use the simplest representation of the same number.
+            while (exponent > 0 && multiplier % 2 == 0)
+            {
+                multiplier /= 2;
+                exponent--;
+            }
+        }
+
+        /// <summary>
+        /// Reads the gains from a Jrk's parameters.
+        /// </summary>
+        public static PidGains read(Jrk jrk)
+        {
+            PidGains gains = new PidGains();
+            gains.proportionalMultiplier = (UInt16)jrk.getJrkParameter(jrkParameter.PARAMETER_PROPORTIONAL_MULTIPLIER);
+            gains.proportionalExponent = (Byte)jrk.getJrkParameter(jrkParameter.PARAMETER_PROPORTIONAL_EXPONENT);
+            gains.integralMultiplier = (UInt16)jrk.getJrkParameter(jrkParameter.PARAMETER_INTEGRAL_MULTIPLIER);
+            gains.integralExponent = (Byte)jrk.getJrkParameter(jrkParameter.PARAMETER_INTEGRAL_EXPONENT);
+            gains.derivativeMultiplier = (UInt16)jrk.getJrkParameter(jrkParameter.PARAMETER_DERIVATIVE_MULTIPLIER);
+            gains.derivativeExponent = (Byte)jrk.getJrkParameter(jrkParameter.PARAMETER_DERIVATIVE_EXPONENT);
+            return gains;
+        }
+
+        /// <summary>
+        /// Writes the gains to a Jrk's parameters and reinitializes it so they
+        /// take effect.  Like any parameter change, this writes to the Jrk's
+        /// EEPROM.
+        /// </summary>
+        public void write(Jrk jrk)
+        {
+            jrk.setJrkParameter(jrkParameter.PARAMETER_PROPORTIONAL_MULTIPLIER, proportionalMultiplier);
+            jrk.setJrkParameter(jrkParameter.PARAMETER_PROPORTIONAL_EXPONENT, proportionalExponent);
+            jrk.setJrkParameter(jrkParameter.PARAMETER_INTEGRAL_MULTIPLIER, integralMultiplier);
+            jrk.setJrkParameter(jrkParameter.PARAMETER_INTEGRAL_EXPONENT, integralExponent);
+            jrk.setJrkParameter(jrkParameter.PARAMETER_DERIVATIVE_MULTIPLIER, derivativeMultiplier);
+            jrk.setJrkParameter(jrkParameter.PARAMETER_DERIVATIVE_EXPONENT, derivativeExponent);
+            jrk.reinitialize();
+        }
+
+        public override String ToString()
+        {
+            return "P=" + proportionalMultiplier + "/2^" + proportionalExponent +
+                " I=" + integralMultiplier + "/2^" + integralExponent +
+                " D=" + derivativeMultiplier + "/2^" + derivativeExponent;
+        }
+    }
+
+    /// <summary>
+    /// How the feedback of a Jrk responded to a step change of the target.
+    /// Times are in milliseconds from when the new target was sent.
+    /// </summary>
+    public class StepResponse
+    {
+        /// <summary>
+        /// The time it took to go from 10% to 90% of the way to the new
+        /// target, or NaN if the feedback never got to 90%.
+        /// </summary>
+        public double riseTime = Double.NaN;
+
+        /// <summary>
+        /// How far the feedback went past the new target, as a percentage
+        /// of the size of the step.
+        /// </summary>
+        public double overshoot;
+
+        /// <summary>
+        /// The time after which the feedback stayed within 5% of the step
+        /// size from the new target, or NaN if it did not settle.
+        /// </summary>
+        public double settlingTime = Double.NaN;
+
+        /// <summary>
+        /// The mean distance between the feedback and the target over the
+        /// last tenth of the capture, in feedback counts.
+        /// </summary>
+        public double steadyStateError;
+
+        /// <summary>
+        /// The number of samples captured.
+        /// </summary>
+        public int samples;
+
+        /// <summary>
+        /// The number of times reading the variables failed during the capture.
+        /// </summary>
+        public int errors;
+    }
+
+    /// <summary>
+    /// The result of trying one set of gains.
+    /// </summary>
+    public class PidSweepResult
+    {
+        public PidGains gains;
+
+        /// <summary>The response to a step from lowTarget to highTarget.</summary>
+        public StepResponse up;
+
+        /// <summary>The response to a step from highTarget to lowTarget.</summary>
+        public StepResponse down;
+
+        /// <summary>
+        /// The mean of the scores of the two steps.  Lower is better;
+        /// PositiveInfinity means the feedback did not reach the target.
+        /// </summary>
+        public double score;
+    }
+
+    /// <summary>
+    /// Finds good PID gains for a Jrk by trying every combination of a list
+    /// of proportional, integral and derivative coefficients (a grid search).
+    /// Each combination is written to the Jrk, the target is stepped from
+    /// lowTarget to highTarget and back, and the feedback is captured as fast
+    /// as the Jrk can be polled.
+    /// </summary>
+    /// <remarks>
+    /// The Jrk must be using the Serial input mode with feedback, and the motor
+    /// must be free to move between lowTarget and highTarget.
+    /// The sample buffers are allocated when the tuner is created, so
+    /// capturing does not allocate memory or cause garbage collections.
+    /// To tune several Jrks at once, create one tuner for each and pass them
+    /// all to sweepParallel.
+    /// </remarks>
+    public class PidTuner
+    {
+        readonly Jrk privateJrk;
+        readonly long[] sampleTimes;
+        readonly UInt16[] sampleFeedback;
+        readonly List<PidSweepResult> privateResults = new List<PidSweepResult>();
+
+        UInt16 privateLowTarget = 1548;
+        UInt16 privateHighTarget = 2548;
+        UInt32 privateCaptureTime = 1000;
+        UInt32 privateSettleTime = 500;
+        double privateOvershootWeight = 5;
+        double privateSteadyStateErrorWeight = 1;
+
+        /// <summary>
+        /// Creates a tuner for a Jrk.
+        /// </summary>
+        /// <param name="jrk">The Jrk to tune.  The tuner should be the only thing using it.</param>
+        /// <param name="maxSamples">The size of the capture buffers, in samples.  One sample is kept per PID period, and capturing stops early if the buffers fill up.</param>
+        public PidTuner(Jrk jrk, int maxSamples)
+        {
+            privateJrk = jrk;
+            sampleTimes = new long[maxSamples];
+            sampleFeedback = new UInt16[maxSamples];
+        }
+
+        public PidTuner(Jrk jrk) : this(jrk, 10000)
+        {
+        }
+
+        public Jrk jrk
+        {
+            get { return privateJrk; }
+        }
+
+        /// <summary>
+        /// The lower of the two targets used for the steps.  The default is 1548.
+        /// </summary>
+        public UInt16 lowTarget
+        {
+            get { return privateLowTarget; }
+            set { privateLowTarget = value; }
+        }
+
+        /// <summary>
+        /// The higher of the two targets used for the steps.  The default is 2548.
+        /// </summary>
+        public UInt16 highTarget
+        {
+            get { return privateHighTarget; }
+            set { privateHighTarget = value; }
+        }
+
+        /// <summary>
+        /// How long to capture the feedback after each step, in milliseconds.
+        /// The default is 1000.
+        /// </summary>
+        public UInt32 captureTime
+        {
+            get { return privateCaptureTime; }
+            set { privateCaptureTime = value; }
+        }
+
+        /// <summary>
+        /// How long to wait at the starting target before each pair of steps,
+        /// in milliseconds.  The default is 500.
+        /// </summary>
+        public UInt32 settleTime
+        {
+            get { return privateSettleTime; }
+            set { privateSettleTime = value; }
+        }
+
+        /// <summary>
+        /// How many milliseconds of rise time one percent of overshoot is
+        /// worth in the score.  The default is 5.
+        /// </summary>
+        public double overshootWeight
+        {
+            get { return privateOvershootWeight; }
+            set { privateOvershootWeight = value; }
+        }
+
+        /// <summary>
+        /// How many milliseconds of rise time one count of steady state error
+        /// is worth in the score.  The default is 1.
+        /// </summary>
+        public double steadyStateErrorWeight
+        {
+            get { return privateSteadyStateErrorWeight; }
+            set { privateSteadyStateErrorWeight = value; }
+        }
+
+        /// <summary>
+        /// The results of the last sweep, in the order they were tried.
+        /// </summary>
+        public IList<PidSweepResult> results
+        {
+            get { return privateResults; }
+        }
+
+        /// <summary>
+        /// The result with the lowest score from the last sweep, or null.
+        /// </summary>
+        public PidSweepResult best
+        {
+            get
+            {
+                PidSweepResult best = null;
+                foreach (PidSweepResult result in privateResults)
+                {
+                    if (best == null || result.score < best.score)
+                    {
+                        best = result;
+                    }
+                }
+                return best;
+            }
+        }
+
+        /// <summary>
+        /// Tries every combination of the given coefficients.  Afterwards, the
+        /// Jrk is left with the best gains if applyBest is true, or with the
+        /// gains it had before otherwise, and the motor is turned off.
+        /// </summary>
+        /// <returns>The best result.</returns>
+        public PidSweepResult sweep(double[] proportional, double[] integral, double[] derivative, bool applyBest)
+        {
+            if (privateHighTarget <= privateLowTarget || privateHighTarget > 4095)
+            {
+                throw new ArgumentException("The high target must be above the low target and at most 4095.");
+            }
+
+            privateResults.Clear();
+            PidGains original = PidGains.read(privateJrk);
+            bool restored = false;
+            try
+            {
+                foreach (double p in proportional)
+                {
+                    foreach (double i in integral)
+                    {
+                        foreach (double d in derivative)
+                        {
+                            privateResults.Add(evaluate(PidGains.fromCoefficients(p, i, d)));
+                        }
+                    }
+                }
+
+                PidSweepResult bestResult = best;
+                if (applyBest && bestResult != null && !Double.IsInfinity(bestResult.score))
+                {
+                    bestResult.gains.write(privateJrk);
+                }
+                else
+                {
+                    original.write(privateJrk);
+                }
+                restored = true;
+                return bestResult;
+            }
+            finally
+            {
+                if (!restored)
+                {
+                    original.write(privateJrk);
+                }
+                privateJrk.motorOff();
+            }
+        }
+
+        /// <summary>
+        /// Writes a set of gains to the Jrk and measures its response to a
+        /// step up and a step down.
+        /// </summary>
+        public PidSweepResult evaluate(PidGains gains)
+        {
+            gains.write(privateJrk);
+            privateJrk.clearErrors();
+
+            PidSweepResult result = new PidSweepResult();
+            result.gains = gains;
+
+            privateJrk.setTarget(privateLowTarget);
+            Thread.Sleep((int)privateSettleTime);
+            result.up = measureStep(privateLowTarget, privateHighTarget);
+            result.down = measureStep(privateHighTarget, privateLowTarget);
+            result.score = (score(result.up) + score(result.down)) / 2;
+            return result;
+        }
+
+        double score(StepResponse response)
+        {
+            if (Double.IsNaN(response.riseTime))
+            {
+                return Double.PositiveInfinity;
+            }
+            return response.riseTime + privateOvershootWeight * response.overshoot +
+                privateSteadyStateErrorWeight * response.steadyStateError;
+        }
+
+        /// <summary>
+        /// Changes the target and captures the feedback for captureTime
+        /// milliseconds.  The Jrk should already be at the starting target.
+        /// </summary>
+        public StepResponse measureStep(UInt16 from, UInt16 to)
+        {
+            StepResponse response = new StepResponse();
+            long duration = privateCaptureTime * Stopwatch.Frequency / 1000;
+
+            privateJrk.setTarget(to);
+            long start = Stopwatch.GetTimestamp();
+            int count = 0;
+            long now = start;
+            int lastPidPeriod = -1;
+            while (now - start < duration && count < sampleTimes.Length)
+            {
+                jrkVariables variables;
+                int status = privateJrk.tryGetVariables(out variables);
+                now = Stopwatch.GetTimestamp();
+                if (status < 0)
+                {
+                    response.errors++;
+                    continue;
+                }
+
+                // The feedback only changes once per PID period, so keep
+                // just the first sample from each period.
+                if (variables.pidPeriodCount == lastPidPeriod)
+                {
+                    continue;
+                }
+                lastPidPeriod = variables.pidPeriodCount;
+
+                sampleTimes[count] = now - start;
+                sampleFeedback[count] = variables.scaledFeedback;
+                count++;
+            }
+
+            analyze(response, count, from, to);
+            return response;
+        }
+
+        /// <summary>
+        /// Computes the rise time, overshoot, settling time and steady state
+        /// error from the captured samples.
+        /// </summary>
+        void analyze(StepResponse response, int count, UInt16 from, UInt16 to)
+        {
+            response.samples = count;
+            if (count == 0)
+            {
+                return;
+            }
+
+            double step = to - from;
+            double peak = 0;
+            long time10 = -1, time90 = -1;
+            long settled = 0;
+            for (int i = 0; i < count; i++)
+            {
+                // Progress from the starting target (0) to the new target (1).
+                double progress = (sampleFeedback[i] - from) / step;
+                if (time10 < 0 && progress >= 0.1) { time10 = sampleTimes[i]; }
+                if (time90 < 0 && progress >= 0.9) { time90 = sampleTimes[i]; }
+                peak = Math.Max(peak, progress);
+                if (Math.Abs(progress - 1) > 0.05)
+                {
+                    settled = (i + 1 < count) ? sampleTimes[i + 1] : -1;
+                }
+            }
+
+            if (time90 >= 0)
+            {
+                response.riseTime = ticksToMilliseconds(time90 - time10);
+            }
+            response.overshoot = Math.Max(0, peak - 1) * 100;
+            if (settled >= 0)
+            {
+                response.settlingTime = ticksToMilliseconds(settled);
+            }
+
+            int tailStart = count - Math.Max(1, count / 10);
+            double errorSum = 0;
+            for (int i = tailStart; i < count; i++)
+            {
+                errorSum += Math.Abs(sampleFeedback[i] - to);
+            }
+            response.steadyStateError = errorSum / (count - tailStart);
+        }
+
+        static double ticksToMilliseconds(long ticks)
+        {
+            return ticks * 1000.0 / Stopwatch.Frequency;
+        }
+
+        /// <summary>
+        /// Runs the same sweep on several Jrks at once, one thread per Jrk.
+        /// If any sweep fails, the others still finish, and then an exception
+        /// is thrown.
+        /// </summary>
+        public static void sweepParallel(IList<PidTuner> tuners, double[] proportional, double[] integral, double[] derivative, bool applyBest)
+        {
+            Thread[] threads = new Thread[tuners.Count];
+            Exception[] exceptions = new Exception[tuners.Count];
+            for (int i = 0; i < tuners.Count; i++)
+            {
+                int index = i;
+                threads[i] = new Thread(delegate()
+                {
+                    try
+                    {
+                        tuners[index].sweep(proportional, integral, derivative, applyBest);
+                    }
+                    catch (Exception exception)
+                    {
+                        exceptions[index] = exception;
+                    }
+                });
+                threads[i].Start();
+            }
+
+            foreach (Thread thread in threads)
+            {
+                thread.Join();
+            }
+
+            for (int i = 0; i < tuners.Count; i++)
+            {
+                if (exceptions[i] != null)
+                {
+                    throw new Exception("There was an error tuning the Jrk with serial number " +
+                        tuners[i].jrk.getSerialNumber() + ".", exceptions[i]);
+                }
+            }
+        }
+    }
+}
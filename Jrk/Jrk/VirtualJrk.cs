@@ -0,0 +1,369 @@
+﻿using System;
+using Pololu.UsbWrapper;
+
+namespace Pololu.Jrk
+{
+    /// <summary>
+    /// An emulated Jrk with a simulated motor and feedback potentiometer.
+    /// Add it to the device list with Usb.addVirtualDevice to test programs
+    /// that use the Jrk class without hardware.
+    /// </summary>
+    /// <remarks>
+    /// The parameters are stored like on a real Jrk, so getJrkParameter and
+    /// setJrkParameter work.  The PID loop uses the PID coefficients, the
+    /// integral limit, the PID period, and the duty cycle and acceleration
+    /// limits.  The motor is modeled as a first-order system whose speed is
+    /// proportional to the duty cycle, turning a potentiometer that is read
+    /// as analog feedback.  Input scaling, current limiting, and the serial
+    /// settings are stored but have no effect.
+    /// </remarks>
+    public class VirtualJrk : VirtualUsbDevice
+    {
+        readonly byte[] parameters = new byte[136];
+
+        UInt16 target = 2048;
+        Int16 errorSum;
+        Int16 dutyCycleTarget;
+        Int16 dutyCycle;
+        Int32 lastError;
+        UInt16 pidPeriodCount;
+        UInt16 errorFlagBits = 1 << (byte)jrkError.ERROR_AWAITING_COMMAND;
+        UInt16 errorOccurredBits;
+
+        /// <summary>
+        /// Time since the last PID period, in microseconds.
+        /// </summary>
+        UInt64 pidTime;
+
+        /// <summary>
+        /// The simulated position of the feedback potentiometer (0-4095).
+        /// </summary>
+        double position = 2048;
+
+        /// <summary>
+        /// The simulated speed of the motor in feedback counts per second.
+        /// </summary>
+        double velocity;
+
+        double privateMaxSpeed = 4000;
+        double privateTimeConstant = 0.05;
+
+        /// <summary>
+        /// Creates an emulated Jrk with default settings.
+        /// </summary>
+        /// <param name="productId">0x83 for the Jrk 21v3 or 0x85 for the Jrk 12v12.</param>
+        /// <param name="serialNumber">The serial number to report, like "00012345".</param>
+        public VirtualJrk(UInt16 productId, String serialNumber)
+            : base(0x1ffb, productId, serialNumber)
+        {
+            if (productId != 0x83 && productId != 0x85)
+            {
+                throw new ArgumentException("The product ID must be 0x83 or 0x85.", "productId");
+            }
+            loadDefaultParameters();
+        }
+
+        public override Guid deviceInterfaceGuid
+        {
+            get { return Jrk.deviceInterfaceGuid; }
+        }
+
+        protected override UInt16 firmwareVersionBcd
+        {
+            get { return 0x0013; }
+        }
+
+        /// <summary>
+        /// The speed of the simulated motor at 100% duty cycle, in feedback
+        /// counts per second.  The default is 4000.
+        /// </summary>
+        public double maxSpeed
+        {
+            get { return privateMaxSpeed; }
+            set { lock (sync) { privateMaxSpeed = value; } }
+        }
+
+        /// <summary>
+        /// The time constant of the simulated motor, in seconds: how long it
+        /// takes to reach 63% of its final speed after the duty cycle changes.
+        /// The default is 0.05.
+        /// </summary>
+        public double timeConstant
+        {
+            get { return privateTimeConstant; }
+            set { lock (sync) { privateTimeConstant = value; } }
+        }
+
+        /// <summary>
+        /// Moves the simulated potentiometer to the given position (0-4095),
+        /// for example to simulate an external force.
+        /// </summary>
+        public void setFeedback(UInt16 feedback)
+        {
+            lock (sync)
+            {
+                position = Math.Min((int)feedback, 4095);
+                velocity = 0;
+            }
+        }
+
+        private void setParameter(jrkParameter parameter, UInt16 value)
+        {
+            parameters[(byte)parameter] = (byte)value;
+            if (parameter.range().bytes == 2)
+            {
+                parameters[(byte)parameter + 1] = (byte)(value >> 8);
+            }
+        }
+
+        private UInt16 getParameter(jrkParameter parameter)
+        {
+            UInt16 value = parameters[(byte)parameter];
+            if (parameter.range().bytes == 2)
+            {
+                value |= (UInt16)(parameters[(byte)parameter + 1] << 8);
+            }
+            return value;
+        }
+
+        /// <summary>
+        /// Puts the parameters in a reasonable state for a Jrk with analog
+        /// feedback controlled over USB.
+        /// </summary>
+        private void loadDefaultParameters()
+        {
+            Array.Clear(parameters, 0, parameters.Length);
+            setParameter(jrkParameter.PARAMETER_INPUT_MODE, (byte)jrkInputMode.INPUT_MODE_SERIAL);
+            setParameter(jrkParameter.PARAMETER_INPUT_MAXIMUM, 4095);
+            setParameter(jrkParameter.PARAMETER_OUTPUT_NEUTRAL, 2048);
+            setParameter(jrkParameter.PARAMETER_OUTPUT_MAXIMUM, 4095);
+            setParameter(jrkParameter.PARAMETER_INPUT_DISCONNECT_MAXIMUM, 4095);
+            setParameter(jrkParameter.PARAMETER_INPUT_NEUTRAL_MAXIMUM, 2048);
+            setParameter(jrkParameter.PARAMETER_INPUT_NEUTRAL_MINIMUM, 2048);
+            setParameter(jrkParameter.PARAMETER_SERIAL_FIXED_BAUD_RATE, 1249); // 9600 bps
+            setParameter(jrkParameter.PARAMETER_SERIAL_DEVICE_NUMBER, 11);
+            setParameter(jrkParameter.PARAMETER_FEEDBACK_MODE, (byte)jrkFeedbackMode.FEEDBACK_MODE_ANALOG);
+            setParameter(jrkParameter.PARAMETER_FEEDBACK_MAXIMUM, 4095);
+            setParameter(jrkParameter.PARAMETER_FEEDBACK_DISCONNECT_MAXIMUM, 4095);
+            setParameter(jrkParameter.PARAMETER_PROPORTIONAL_MULTIPLIER, 1);
+            setParameter(jrkParameter.PARAMETER_PID_PERIOD, 10);
+            setParameter(jrkParameter.PARAMETER_PID_INTEGRAL_LIMIT, 1000);
+            setParameter(jrkParameter.PARAMETER_MOTOR_MAX_DUTY_CYCLE_WHILE_FEEDBACK_OUT_OF_RANGE, 600);
+            setParameter(jrkParameter.PARAMETER_MOTOR_MAX_ACCELERATION_FORWARD, 600);
+            setParameter(jrkParameter.PARAMETER_MOTOR_MAX_ACCELERATION_REVERSE, 600);
+            setParameter(jrkParameter.PARAMETER_MOTOR_MAX_DUTY_CYCLE_FORWARD, 600);
+            setParameter(jrkParameter.PARAMETER_MOTOR_MAX_DUTY_CYCLE_REVERSE, 600);
+        }
+
+        private double coefficient(jrkParameter multiplier, jrkParameter exponent)
+        {
+            return getParameter(multiplier) / (double)(1 << getParameter(exponent));
+        }
+
+        private UInt16 scaledFeedback
+        {
+            get
+            {
+                int minimum = getParameter(jrkParameter.PARAMETER_FEEDBACK_MINIMUM);
+                int maximum = getParameter(jrkParameter.PARAMETER_FEEDBACK_MAXIMUM);
+                if (maximum <= minimum)
+                {
+                    return 0;
+                }
+                int scaled = ((int)Math.Round(position) - minimum) * 4095 / (maximum - minimum);
+                scaled = Math.Max(0, Math.Min(4095, scaled));
+                if (parameters[(byte)jrkParameter.PARAMETER_FEEDBACK_INVERT] != 0)
+                {
+                    scaled = 4095 - scaled;
+                }
+                return (UInt16)scaled;
+            }
+        }
+
+        protected override void advance(UInt64 microseconds)
+        {
+            UInt64 period = (UInt64)Math.Max((UInt16)1, getParameter(jrkParameter.PARAMETER_PID_PERIOD)) * 1000;
+            pidTime += microseconds;
+            while (pidTime >= period)
+            {
+                pidTime -= period;
+                updatePid();
+                updateMotor(period / 1000000.0);
+            }
+        }
+
+        /// <summary>
+        /// Runs one iteration of the PID loop, like the Jrk does once per
+        /// PID period.
+        /// </summary>
+        private void updatePid()
+        {
+            pidPeriodCount++;
+
+            if ((jrkFeedbackMode)getParameter(jrkParameter.PARAMETER_FEEDBACK_MODE) == jrkFeedbackMode.FEEDBACK_MODE_NONE)
+            {
+                dutyCycleTarget = (Int16)((target - 2048) * 600 / 2047);
+            }
+            else
+            {
+                int error = target - scaledFeedback;
+                int sum = errorSum + error;
+                int limit = getParameter(jrkParameter.PARAMETER_PID_INTEGRAL_LIMIT);
+                errorSum = (Int16)Math.Max(-limit, Math.Min(limit, sum));
+
+                double output = coefficient(jrkParameter.PARAMETER_PROPORTIONAL_MULTIPLIER, jrkParameter.PARAMETER_PROPORTIONAL_EXPONENT) * error
+                    + coefficient(jrkParameter.PARAMETER_INTEGRAL_MULTIPLIER, jrkParameter.PARAMETER_INTEGRAL_EXPONENT) * errorSum
+                    + coefficient(jrkParameter.PARAMETER_DERIVATIVE_MULTIPLIER, jrkParameter.PARAMETER_DERIVATIVE_EXPONENT) * (error - lastError);
+                lastError = error;
+
+                dutyCycleTarget = (Int16)Math.Max(-600, Math.Min(600, Math.Round(output)));
+                if (Math.Abs(output) >= 600 && parameters[(byte)jrkParameter.PARAMETER_PID_RESET_INTEGRAL] != 0)
+                {
+                    errorSum = 0;
+                }
+            }
+
+            int goal = dutyCycleTarget;
+            if (errorFlagBits != 0)
+            {
+                goal = 0;
+                errorSum = 0;
+            }
+            goal = Math.Min(goal, (int)getParameter(jrkParameter.PARAMETER_MOTOR_MAX_DUTY_CYCLE_FORWARD));
+            goal = Math.Max(goal, -(int)getParameter(jrkParameter.PARAMETER_MOTOR_MAX_DUTY_CYCLE_REVERSE));
+
+            // Like the Jrk, only increases in the magnitude of the duty cycle
+            // are limited by the acceleration limits.
+            if (goal > dutyCycle && dutyCycle >= 0)
+            {
+                goal = Math.Min(goal, dutyCycle + getParameter(jrkParameter.PARAMETER_MOTOR_MAX_ACCELERATION_FORWARD));
+            }
+            else if (goal < dutyCycle && dutyCycle <= 0)
+            {
+                goal = Math.Max(goal, dutyCycle - getParameter(jrkParameter.PARAMETER_MOTOR_MAX_ACCELERATION_REVERSE));
+            }
+            dutyCycle = (Int16)goal;
+        }
+
+        private void updateMotor(double seconds)
+        {
+            int duty = dutyCycle;
+            if (parameters[(byte)jrkParameter.PARAMETER_MOTOR_INVERT] != 0)
+            {
+                duty = -duty;
+            }
+
+            double speed = privateMaxSpeed * duty / 600;
+            if (privateTimeConstant > 0)
+            {
+                velocity += (speed - velocity) * Math.Min(1, seconds / privateTimeConstant);
+            }
+            else
+            {
+                velocity = speed;
+            }
+
+            position += velocity * seconds;
+            if (position < 0 || position > 4095)
+            {
+                // The potentiometer hit the end of its travel.
+                position = Math.Max(0, Math.Min(4095, position));
+                velocity = 0;
+            }
+        }
+
+        protected override unsafe int handleControlTransfer(byte requestType, byte request, ushort value, ushort index, byte* data, ushort length)
+        {
+            switch ((jrkRequest)request)
+            {
+                case jrkRequest.REQUEST_GET_PARAMETER:
+                    {
+                        int bytes = Math.Min((int)length, 2);
+                        if (index + bytes > parameters.Length)
+                        {
+                            return UsbStatus.Pipe;
+                        }
+                        for (int i = 0; i < bytes; i++)
+                        {
+                            data[i] = parameters[index + i];
+                        }
+                        return bytes;
+                    }
+
+                case jrkRequest.REQUEST_SET_PARAMETER:
+                    {
+                        int bytes = index >> 8;
+                        int parameter = index & 0xFF;
+                        if (bytes < 1 || bytes > 2 || parameter + bytes > parameters.Length)
+                        {
+                            return UsbStatus.Pipe;
+                        }
+                        parameters[parameter] = (byte)value;
+                        if (bytes == 2)
+                        {
+                            parameters[parameter + 1] = (byte)(value >> 8);
+                        }
+                        return 0;
+                    }
+
+                case jrkRequest.REQUEST_GET_VARIABLES:
+                    {
+                        jrkVariables variables = new jrkVariables();
+                        variables.input = target;
+                        variables.target = target;
+                        variables.feedback = (UInt16)Math.Round(position);
+                        variables.scaledFeedback = scaledFeedback;
+                        variables.errorSum = errorSum;
+                        variables.dutyCycleTarget = dutyCycleTarget;
+                        variables.dutyCycle = dutyCycle;
+                        variables.current = (Byte)(Math.Abs((int)dutyCycle) / 10);
+                        variables.pidPeriodCount = pidPeriodCount;
+                        variables.errorFlagBits = errorFlagBits;
+                        variables.errorOccurredBits = (UInt16)(errorOccurredBits | errorFlagBits);
+                        errorOccurredBits = 0;
+                        return respond(data, length, &variables, sizeof(jrkVariables));
+                    }
+
+                case jrkRequest.REQUEST_SET_TARGET:
+                    if (value > 4095)
+                    {
+                        return UsbStatus.Pipe;
+                    }
+                    target = value;
+                    errorFlagBits &= unchecked((UInt16)~(1 << (byte)jrkError.ERROR_AWAITING_COMMAND));
+                    return 0;
+
+                case jrkRequest.REQUEST_CLEAR_ERRORS:
+                    errorOccurredBits |= errorFlagBits;
+                    errorFlagBits &= (UInt16)(1 << (byte)jrkError.ERROR_AWAITING_COMMAND);
+                    return 0;
+
+                case jrkRequest.REQUEST_MOTOR_OFF:
+                    errorFlagBits |= (UInt16)(1 << (byte)jrkError.ERROR_AWAITING_COMMAND);
+                    return 0;
+
+                case jrkRequest.REQUEST_REINITIALIZE:
+                    if (parameters[(byte)jrkParameter.PARAMETER_INITIALIZED] == 0xFF)
+                    {
+                        loadDefaultParameters();
+                    }
+                    errorSum = 0;
+                    lastError = 0;
+                    return 0;
+
+                case jrkRequest.REQUEST_START_BOOTLOADER:
+                    connected = false;
+                    return 0;
+            }
+
+            return UsbStatus.Pipe;
+        }
+    }
+}
+
+// Local Variables: **
+// mode: java **
+// c-basic-offset: 4 **
+// tab-width: 4 **
+// indent-tabs-mode: nil **
+// end: **
@@ -38,6 +38,17 @@ namespace Pololu.Jrk.JrkCmd
                 "     --configure FILE    load configuration file into device\n" +
                 "     --getconf FILE      read device settings and write to file\n" + 
                 "     --bootloader        put device in to bootloader (firmware upgrade) mode\n" +
+                "     --stats             print USB transfer statistics at the end\n" +
+                "     --trace FILE        record every USB transfer in FILE\n" +
+                "     --convert-trace FILE  convert a trace to FILE.json for chrome://tracing\n" +
+                "PID tuning options:\n" +
+                "     --tune              try combinations of PID coefficients by stepping the\n" +
+                "                         target back and forth, then keep the best ones.\n" +
+                "                         This changes the settings saved on the device.\n" +
+                "     --tune-p LIST       proportional coefficients to try (default 0.25,0.5,1,2,4)\n" +
+                "     --tune-i LIST       integral coefficients to try (default 0,0.0625,0.25)\n" +
+                "     --tune-d LIST       derivative coefficients to try (default 0,1,4)\n" +
+                "     --tune-targets LOW,HIGH  targets to step between (default 1548,2548)\n" +
                 "Stream-related options:\n" +
                 "     --stream            stream variables from Jrk\n" +
                 "     --interval NUM      milliseconds between readings (default 20)\n" +
@@ -59,7 +70,16 @@ namespace Pololu.Jrk.JrkCmd
         {
             try
             {
-                MainWithExceptions(args);
+                try
+                {
+                    MainWithExceptions(args);
+                }
+                finally
+                {
+                    // Write out the trace even if something failed, since that
+                    // is when it is most useful.
+                    TransferTracer.stop();
+                }
             }
             catch (Exception exception)
             {
@@ -124,6 +144,15 @@ namespace Pololu.Jrk.JrkCmd
                 return;
             }
 
+            if (opts.ContainsKey("convert-trace"))
+            {
+                if (args.Length > 2) { throw new ArgumentException("If --convert-trace is present, it must be the only option."); }
+                string filename = opts["convert-trace"];
+                TransferTracer.convertToChromeTrace(filename, filename + ".json");
+                Console.WriteLine("Wrote " + filename + ".json.");
+                return;
+            }
+
             // Otherwise, we have to connect to a device.
 
             List<DeviceListItem> list = Jrk.getConnectedDevices();
@@ -168,6 +197,11 @@ namespace Pololu.Jrk.JrkCmd
             // Connect to the device.
             jrk = new Jrk(item);
 
+            if (opts.ContainsKey("trace"))
+            {
+                TransferTracer.start(opts["trace"]);
+            }
+
             if (opts.ContainsKey("bootloader"))
             {
                 jrk.startBootloader();
@@ -224,6 +258,11 @@ namespace Pololu.Jrk.JrkCmd
                 jrk.motorOff();
             }
 
+            if (opts.ContainsKey("tune"))
+            {
+                tunePid(jrk, opts);
+            }
+
             if (opts.ContainsKey("status"))
             {
                 displayStatus(jrk);
@@ -234,6 +273,11 @@ namespace Pololu.Jrk.JrkCmd
                 streamVariables(jrk, opts);
             }
 
+            if (opts.ContainsKey("stats"))
+            {
+                jrk.transferStatistics.writeReport(Console.Out);
+            }
+
             jrk.disconnect();
         }
 
@@ -283,6 +327,64 @@ namespace Pololu.Jrk.JrkCmd
             }
         }
 
+        static double[] parseCoefficients(Dictionary<String, String> opts, string name, string defaultValue)
+        {
+            string text = opts.ContainsKey(name) ? opts[name] : defaultValue;
+            try
+            {
+                List<double> values = new List<double>();
+                foreach (string part in text.Split(','))
+                {
+                    values.Add(double.Parse(part, System.Globalization.CultureInfo.InvariantCulture));
+                }
+                return values.ToArray();
+            }
+            catch (Exception exception)
+            {
+                throw new ArgumentException("Invalid --" + name + " parameter \"" + text + "\".", exception);
+            }
+        }
+
+        static void tunePid(Jrk jrk, Dictionary<String, String> opts)
+        {
+            double[] proportional = parseCoefficients(opts, "tune-p", "0.25,0.5,1,2,4");
+            double[] integral = parseCoefficients(opts, "tune-i", "0,0.0625,0.25");
+            double[] derivative = parseCoefficients(opts, "tune-d", "0,1,4");
+
+            PidTuner tuner = new PidTuner(jrk);
+            if (opts.ContainsKey("tune-targets"))
+            {
+                string[] targets = opts["tune-targets"].Split(',');
+                if (targets.Length != 2)
+                {
+                    throw new ArgumentException("The --tune-targets parameter must be two numbers separated by a comma.");
+                }
+                tuner.lowTarget = stringToU12(targets[0]);
+                tuner.highTarget = stringToU12(targets[1]);
+            }
+
+            tuner.sweep(proportional, integral, derivative, true);
+
+            Console.WriteLine("{0,-30} {1,8} {2,8} {3,8} {4,8} {5,8}",
+                "Gains", "Score", "Rise up", "Rise dn", "OS up %", "OS dn %");
+            foreach (PidSweepResult result in tuner.results)
+            {
+                Console.WriteLine("{0,-30} {1,8:0.0} {2,8:0.0} {3,8:0.0} {4,8:0.0} {5,8:0.0}",
+                    result.gains, result.score, result.up.riseTime, result.down.riseTime,
+                    result.up.overshoot, result.down.overshoot);
+            }
+
+            PidSweepResult best = tuner.best;
+            if (best == null || Double.IsInfinity(best.score))
+            {
+                Console.WriteLine("None of the gains reached the targets; the original gains were kept.");
+            }
+            else
+            {
+                Console.WriteLine("Using " + best.gains + ".");
+            }
+        }
+
         static void streamVariables(Jrk jrk, Dictionary<String, String> opts)
         {
             // Determine what interval to use (the time between each reading).
@@ -562,29 +664,8 @@ namespace Pololu.Jrk.JrkCmd
         /// to the sign of the duty cycle.</returns>
         static int currentToMilliamps(byte rawCurrent, short dutyCycle)
         {
-            int current = rawCurrent;
-
-            if (dutyCycle > 0)
-            {
-                current *= currentCalibrationForward;
-            }
-            else
-            {
-                current *= currentCalibrationReverse;
-            }
-
-            if (jrk.divideCurrent)
-            {
-                if (dutyCycle == 0)
-                {
-                    current = 0;
-                }
-                else
-                {
-                    current = (current * 600) / dutyCycle;
-                }
-            }
-            return current;
+            return JrkTelemetry.currentToMilliamps(rawCurrent, dutyCycle,
+                currentCalibrationForward, currentCalibrationReverse, jrk.divideCurrent);
         }
 
         /// <summary>
@@ -10,12 +10,56 @@ namespace Pololu.Usc.Sequencer
     public class Sequence
     {
         public string name;
-        public List<Frame> frames = new List<Frame>();
+
+        /// <summary>
+        /// Reads the frames of a sequence that was read without them.
+        /// </summary>
+        internal delegate List<Frame> FrameLoader();
+
+        List<Frame> privateFrames = new List<Frame>();
+        FrameLoader frameLoader;
 
         public Sequence(string name) { this.name = name; }
 
     	public Sequence() { }
 
+        /// <summary>
+        /// Creates a sequence whose frames are read by the loader the first
+        /// time they are used.
+        /// </summary>
+        internal Sequence(string name, FrameLoader frameLoader)
+        {
+            this.name = name;
+            this.frameLoader = frameLoader;
+            privateFrames = null;
+        }
+
+        public List<Frame> frames
+        {
+            get
+            {
+                loadFrames();
+                return privateFrames;
+            }
+            set
+            {
+                privateFrames = value;
+                frameLoader = null;
+            }
+        }
+
+        /// <summary>
+        /// Reads the frames now, if they have not been read yet.
+        /// </summary>
+        internal void loadFrames()
+        {
+            if (frameLoader != null)
+            {
+                privateFrames = frameLoader();
+                frameLoader = null;
+            }
+        }
+
         /// <summary>
         /// Saves sequences in the registry in the "sequences" subkey of the given key.
         /// </summary>
@@ -76,9 +120,6 @@ namespace Pololu.Usc.Sequencer
             if (sequencesKey == null)
                 return sequences;
 
-            FrameKeyNameComparer fknc = new FrameKeyNameComparer();
-
-            if (sequencesKey == null) return sequences;
 
             foreach (string sequenceKeyName in sequencesKey.GetSubKeyNames())
             {
@@ -89,10 +130,18 @@ namespace Pololu.Usc.Sequencer
 
                 Sequence sequence = new Sequence(sequenceName);
 
-                List<string> frameKeyNames = new List<String>(sequenceKey.GetSubKeyNames());
+                string[] frameKeyNames = sequenceKey.GetSubKeyNames();
 
-                // Make sure the frames are in the right order.
-                frameKeyNames.Sort(fknc);
+                // Make sure the frames are in the right order.  The names
+                // (e.g. "0013") are converted to integers once here rather
+                // than in every comparison.
+                int[] frameNumbers = new int[frameKeyNames.Length];
+                for (int i = 0; i < frameKeyNames.Length; i++)
+                {
+                    ushort number;
+                    frameNumbers[i] = ushort.TryParse(frameKeyNames[i], out number) ? number : int.MaxValue;
+                }
+                Array.Sort(frameNumbers, frameKeyNames);
 
                 List<Frame> frames = new List<Frame>(sequenceKey.SubKeyCount);
                 foreach (string frameKeyName in frameKeyNames)
@@ -344,26 +393,6 @@ namespace Pololu.Usc.Sequencer
             }
             return script;
         }
-
-        /// <summary>
-        /// We want the frame names to be sorted correctly when retrieved from the registry.
-        /// This means converting the names (e.g. "0013") to integers.
-        /// </summary>
-        /// <remarks>http://msdn.microsoft.com/en-us/library/system.collections.icomparer.compare.aspx</remarks>
-        private class FrameKeyNameComparer : IComparer<String>
-        {
-            public int Compare(string x, string y)
-            {
-                try
-                {
-                    return ushort.Parse(x) - ushort.Parse(y);
-                }
-                catch
-                {
-                    return 0;
-                }
-            }
-        }
     }
 }
 
@@ -0,0 +1,880 @@
+using System;
+using System.Collections.Generic;
+using System.IO;
+using System.Text;
+
+namespace Pololu.Usc.Sequencer
+{
+    /// <summary>
+    /// Stores the sequences for one Maestro in a single file.
+    /// </summary>
+    /// <remarks>
+    /// The file is a log of records.  Each record holds one frame, the name
+    /// and length of one sequence, or the number of sequences, and a later
+    /// record for the same thing replaces an earlier one.  Saving only appends
+    /// records for the things that changed, so editing one frame of a long
+    /// sequence writes one small record instead of the whole sequence.
+    /// The records written between two calls to flush() are followed by a
+    /// commit record and only take effect together, once it is there, so
+    /// saveSequences either saves the whole list or nothing.
+    /// When the file is opened, every record is checked against its hash,
+    /// and the index of where everything is gets built from the committed
+    /// records; frames are only parsed when they are requested.
+    /// When more than half of the file is made of replaced records, it gets
+    /// rewritten without them.
+    ///
+    /// File format (all numbers are little-endian):
+    ///   "PSEQ", UInt16 version (1), UInt16 reserved (0)
+    ///   Then any number of records, each with a 17-byte header:
+    ///     Byte type, UInt16 sequence index, UInt16 frame index,
+    ///     Int32 payload length, UInt64 payload hash (64-bit FNV-1a)
+    ///   followed by the payload:
+    ///     Frame: String name, UInt16 duration in ms, Byte target count, UInt16 targets
+    ///     Sequence: String name, UInt16 frame count
+    ///     Count: UInt16 number of sequences
+    ///     Commit: nothing
+    ///   Strings are written the way BinaryWriter writes them (a 7-bit encoded
+    ///   length followed by UTF-8).
+    /// Records after the last commit record, or after the first record whose
+    /// payload does not match its hash (for example because a crash cut it
+    /// off or left zeros at the end of the file), are ignored and removed
+    /// the next time the file is opened.  Compaction writes a new file next to
+    /// the old one (path + ".tmp") and then swaps them, keeping the old one
+    /// as path + ".bak" until the swap is done; if a crash interrupts the
+    /// swap, the store is recovered from those files when it is opened.
+    /// </remarks>
+    public class SequenceStore : IDisposable
+    {
+        const byte RecordFrame = 1;
+        const byte RecordSequence = 2;
+        const byte RecordCount = 3;
+        const byte RecordCommit = 4;
+
+        const int FileHeaderSize = 8;
+        const int RecordHeaderSize = 17;
+        const UInt16 Version = 1;
+
+        /// <summary>
+        /// Files smaller than this are never compacted.
+        /// </summary>
+        const long MinimumCompactionSize = 64 * 1024;
+
+        private class Record
+        {
+            /// <summary>The location of the payload in the file.</summary>
+            public long offset;
+            public int length;
+            public UInt64 hash;
+        }
+
+        /// <summary>
+        /// A record read by scan that has not been committed yet.
+        /// </summary>
+        private class PendingRecord
+        {
+            public byte type;
+            public UInt16 sequenceIndex;
+            public UInt16 frameIndex;
+            public Record record;
+        }
+
+        private class SequenceEntry
+        {
+            public String name;
+            public int frameCount;
+            public Record record;
+            public List<Record> frames = new List<Record>();
+        }
+
+        readonly String privatePath;
+        readonly byte servoCount;
+        FileStream stream;
+        BinaryReader reader;
+        BinaryWriter writer;
+
+        readonly List<SequenceEntry> sequences = new List<SequenceEntry>();
+        int privateSequenceCount;
+        Record countRecord;
+
+        /// <summary>
+        /// The number of bytes in the file taken up by records that have been
+        /// replaced by later ones.
+        /// </summary>
+        long garbage;
+
+        /// <summary>
+        /// True if records have been written since the last commit record.
+        /// </summary>
+        bool uncommitted;
+
+        /// <summary>
+        /// The sequences returned by readSequencesOnDemand whose frames might
+        /// not have been read yet, by full path.  Compacting a file moves its
+        /// records, so the frames are read before that happens.
+        /// </summary>
+        static readonly Dictionary<String, List<WeakReference>> sequencesOnDemand = new Dictionary<String, List<WeakReference>>();
+
+        // Reused when serializing records so that saving does not allocate
+        // a new buffer for every frame.
+        readonly MemoryStream payloadStream = new MemoryStream();
+        readonly BinaryWriter payloadWriter;
+
+        /// <summary>
+        /// Opens a sequence file, creating it if it does not exist.
+        /// </summary>
+        /// <param name="path">The name of the file.</param>
+        /// <param name="servoCount">The number of channels on the Maestro.  Frames read from the file will have this many targets.</param>
+        public SequenceStore(String path, byte servoCount)
+        {
+            privatePath = path;
+            this.servoCount = servoCount;
+            payloadWriter = new BinaryWriter(payloadStream, Encoding.UTF8);
+            open();
+        }
+
+        /// <summary>
+        /// Returns the file that the Maestro with the given serial number
+        /// uses to store its sequences.  The file is in a "Pololu" folder
+        /// inside the user's application data folder.
+        /// </summary>
+        /// <param name="deviceName">The name of the type of device, e.g. "Maestro USB servo controller".</param>
+        public static String getDefaultPath(String deviceName, String serialNumber)
+        {
+            String folder = Path.Combine(Environment.GetFolderPath(Environment.SpecialFolder.ApplicationData), "Pololu");
+            return Path.Combine(Path.Combine(folder, deviceName), serialNumber + ".seq");
+        }
+
+        public String path
+        {
+            get { return privatePath; }
+        }
+
+        /// <summary>
+        /// Returns true if there is a sequence file at the given path.  If a
+        /// compaction of the file was interrupted, this finishes it first, so
+        /// a store whose file is missing but can be recovered counts as
+        /// existing.
+        /// </summary>
+        public static bool exists(String path)
+        {
+            recover(path);
+            return File.Exists(path);
+        }
+
+        /// <summary>
+        /// Cleans up after a compaction that was interrupted by a crash.
+        /// The temporary file is only renamed once it is complete, and the
+        /// old file is only deleted once the new one is in place, so if the
+        /// file is missing, the temporary file or else the backup holds the
+        /// sequences.  Files left over next to a complete store are deleted.
+        /// </summary>
+        private static void recover(String path)
+        {
+            String temporaryPath = path + ".tmp";
+            String backupPath = path + ".bak";
+            if (!File.Exists(path))
+            {
+                if (File.Exists(temporaryPath))
+                {
+                    File.Move(temporaryPath, path);
+                }
+                else if (File.Exists(backupPath))
+                {
+                    File.Move(backupPath, path);
+                }
+            }
+            if (File.Exists(temporaryPath))
+            {
+                File.Delete(temporaryPath);
+            }
+            if (File.Exists(backupPath))
+            {
+                File.Delete(backupPath);
+            }
+        }
+
+        /// <summary>
+        /// The number of sequences stored.
+        /// </summary>
+        public int sequenceCount
+        {
+            get { return privateSequenceCount; }
+        }
+
+        private void open()
+        {
+            String directory = Path.GetDirectoryName(privatePath);
+            if (directory != "" && !Directory.Exists(directory))
+            {
+                Directory.CreateDirectory(directory);
+            }
+            recover(privatePath);
+
+            stream = new FileStream(privatePath, FileMode.OpenOrCreate, FileAccess.ReadWrite, FileShare.Read);
+            reader = new BinaryReader(stream, Encoding.UTF8);
+            writer = new BinaryWriter(stream, Encoding.UTF8);
+
+            try
+            {
+                if (stream.Length == 0)
+                {
+                    writer.Write(Encoding.ASCII.GetBytes("PSEQ"));
+                    writer.Write(Version);
+                    writer.Write((UInt16)0);
+                    writer.Flush();
+                }
+                else
+                {
+                    scan();
+                }
+            }
+            catch
+            {
+                stream.Close();
+                throw;
+            }
+        }
+
+        /// <summary>
+        /// Reads all the records to build the index, and truncates the file
+        /// after the last commit record that only good records come before.
+        /// </summary>
+        private void scan()
+        {
+            if (stream.Length < FileHeaderSize ||
+                Encoding.ASCII.GetString(reader.ReadBytes(4)) != "PSEQ")
+            {
+                throw new Exception("The file " + privatePath + " is not a sequence file.");
+            }
+
+            UInt16 version = reader.ReadUInt16();
+            if (version != Version)
+            {
+                throw new Exception("The sequence file " + privatePath + " has version " + version + ", which is not supported.");
+            }
+            reader.ReadUInt16();
+
+            long position = FileHeaderSize;
+            long committed = position;
+            long length = stream.Length;
+            List<PendingRecord> pending = new List<PendingRecord>();
+            byte[] payload = new byte[256];
+            while (position + RecordHeaderSize <= length)
+            {
+                stream.Position = position;
+                PendingRecord p = new PendingRecord();
+                p.type = reader.ReadByte();
+                p.sequenceIndex = reader.ReadUInt16();
+                p.frameIndex = reader.ReadUInt16();
+                p.record = new Record();
+                p.record.length = reader.ReadInt32();
+                p.record.hash = reader.ReadUInt64();
+                p.record.offset = position + RecordHeaderSize;
+
+                if (p.record.length < 0 || p.record.offset + p.record.length > length)
+                {
+                    // This record was not finished.
+                    break;
+                }
+
+                if (payload.Length < p.record.length)
+                {
+                    payload = new byte[p.record.length];
+                }
+                if (!readFully(stream, payload, p.record.length) || fnv1a(payload, p.record.length) != p.record.hash)
+                {
+                    // This record was not written completely.
+                    break;
+                }
+                position = p.record.offset + p.record.length;
+
+                if (p.type == RecordCommit)
+                {
+                    foreach (PendingRecord r in pending)
+                    {
+                        apply(r);
+                    }
+                    pending.Clear();
+                    committed = position;
+                }
+                else
+                {
+                    pending.Add(p);
+                }
+            }
+
+            if (committed != length)
+            {
+                // Get rid of the records that were not committed.
+                stream.SetLength(committed);
+            }
+        }
+
+        /// <summary>
+        /// Adds a committed record to the index.
+        /// </summary>
+        private void apply(PendingRecord p)
+        {
+            switch (p.type)
+            {
+                case RecordFrame:
+                    setFrameRecord(p.sequenceIndex, p.frameIndex, p.record);
+                    break;
+
+                case RecordSequence:
+                    readSequenceRecord(getSequenceEntry(p.sequenceIndex), p.record);
+                    break;
+
+                case RecordCount:
+                    stream.Position = p.record.offset;
+                    privateSequenceCount = reader.ReadUInt16();
+                    replace(ref countRecord, p.record);
+                    dropSequences(privateSequenceCount);
+                    break;
+            }
+        }
+
+        private SequenceEntry getSequenceEntry(int sequenceIndex)
+        {
+            while (sequences.Count <= sequenceIndex)
+            {
+                sequences.Add(new SequenceEntry());
+            }
+            return sequences[sequenceIndex];
+        }
+
+        private void setFrameRecord(int sequenceIndex, int frameIndex, Record record)
+        {
+            List<Record> frames = getSequenceEntry(sequenceIndex).frames;
+            while (frames.Count <= frameIndex)
+            {
+                frames.Add(null);
+            }
+            Record old = frames[frameIndex];
+            replace(ref old, record);
+            frames[frameIndex] = old;
+        }
+
+        private void replace(ref Record current, Record record)
+        {
+            if (current != null)
+            {
+                garbage += RecordHeaderSize + current.length;
+            }
+            current = record;
+        }
+
+        private void readSequenceRecord(SequenceEntry entry, Record record)
+        {
+            stream.Position = record.offset;
+            entry.name = reader.ReadString();
+            entry.frameCount = reader.ReadUInt16();
+            replace(ref entry.record, record);
+            dropFrames(entry, entry.frameCount);
+        }
+
+        /// <summary>
+        /// Forgets the frame records past the end of a sequence, and counts
+        /// them as garbage.  The frames are always written before the
+        /// sequence record that changes the frame count, so any that are
+        /// past the end at that point have been dropped.
+        /// </summary>
+        private void dropFrames(SequenceEntry entry, int frameCount)
+        {
+            for (int i = frameCount; i < entry.frames.Count; i++)
+            {
+                Record record = entry.frames[i];
+                if (record != null)
+                {
+                    garbage += RecordHeaderSize + record.length;
+                }
+            }
+            if (frameCount < entry.frames.Count)
+            {
+                entry.frames.RemoveRange(frameCount, entry.frames.Count - frameCount);
+            }
+        }
+
+        /// <summary>
+        /// Forgets the sequences past the given count, and counts their
+        /// records as garbage.
+        /// </summary>
+        private void dropSequences(int count)
+        {
+            for (int i = count; i < sequences.Count; i++)
+            {
+                SequenceEntry entry = sequences[i];
+                dropFrames(entry, 0);
+                if (entry.record != null)
+                {
+                    garbage += RecordHeaderSize + entry.record.length;
+                }
+            }
+            if (count < sequences.Count)
+            {
+                sequences.RemoveRange(count, sequences.Count - count);
+            }
+        }
+
+        /// <summary>
+        /// Returns the name of a sequence.
+        /// </summary>
+        public String getSequenceName(int sequenceIndex)
+        {
+            requireSequence(sequenceIndex);
+            SequenceEntry entry = sequences[sequenceIndex];
+            return entry.name ?? ("Sequence " + sequenceIndex.ToString("d2"));
+        }
+
+        /// <summary>
+        /// Returns the number of frames in a sequence.
+        /// </summary>
+        public int getFrameCount(int sequenceIndex)
+        {
+            requireSequence(sequenceIndex);
+            return sequences[sequenceIndex].frameCount;
+        }
+
+        /// <summary>
+        /// Reads one frame from the file.
+        /// </summary>
+        public Frame getFrame(int sequenceIndex, int frameIndex)
+        {
+            requireSequence(sequenceIndex);
+            SequenceEntry entry = sequences[sequenceIndex];
+            if (frameIndex < 0 || frameIndex >= entry.frameCount)
+            {
+                throw new ArgumentOutOfRangeException("frameIndex");
+            }
+
+            Record record = frameIndex < entry.frames.Count ? entry.frames[frameIndex] : null;
+            writer.Flush();
+            return readFrame(stream, privatePath, servoCount, record, frameIndex);
+        }
+
+        /// <summary>
+        /// Reads the frame stored in a record, or returns an empty frame if
+        /// the record is null.
+        /// </summary>
+        private static Frame readFrame(Stream file, String path, byte servoCount, Record record, int frameIndex)
+        {
+            Frame frame = new Frame();
+            if (record == null)
+            {
+                frame.name = "Frame " + frameIndex.ToString("d4");
+                frame.targets = new ushort[servoCount];
+                return frame;
+            }
+
+            byte[] payload = readPayload(file, path, record);
+            BinaryReader payloadReader = new BinaryReader(new MemoryStream(payload, false), Encoding.UTF8);
+            frame.name = payloadReader.ReadString();
+            frame.length_ms = payloadReader.ReadUInt16();
+            int count = payloadReader.ReadByte();
+            ushort[] targets = new ushort[servoCount];
+            for (int i = 0; i < count; i++)
+            {
+                ushort target = payloadReader.ReadUInt16();
+                if (i < servoCount)
+                {
+                    targets[i] = target;
+                }
+            }
+            frame.targets = targets;
+            return frame;
+        }
+
+        /// <summary>
+        /// Reads one sequence, including all of its frames, from the file.
+        /// </summary>
+        public Sequence getSequence(int sequenceIndex)
+        {
+            Sequence sequence = new Sequence(getSequenceName(sequenceIndex));
+            int frameCount = getFrameCount(sequenceIndex);
+            sequence.frames = new List<Frame>(frameCount);
+            for (int frameIndex = 0; frameIndex < frameCount; frameIndex++)
+            {
+                sequence.frames.Add(getFrame(sequenceIndex, frameIndex));
+            }
+            return sequence;
+        }
+
+        /// <summary>
+        /// Reads all of the sequences from the file.
+        /// </summary>
+        public List<Sequence> readSequences()
+        {
+            List<Sequence> list = new List<Sequence>(privateSequenceCount);
+            for (int sequenceIndex = 0; sequenceIndex < privateSequenceCount; sequenceIndex++)
+            {
+                list.Add(getSequence(sequenceIndex));
+            }
+            return list;
+        }
+
+        /// <summary>
+        /// Returns all of the sequences without reading their frames.  The
+        /// frames of a sequence are read from the file the first time they
+        /// are used, even if this store has been disposed by then, and are
+        /// the ones that were stored when this was called.
+        /// </summary>
+        public List<Sequence> readSequencesOnDemand()
+        {
+            // The frames are read through another stream, so it has to see
+            // everything written through this one.
+            writer.Flush();
+            stream.Flush();
+
+            List<Sequence> list = new List<Sequence>(privateSequenceCount);
+            List<WeakReference> pending = getSequencesOnDemand(privatePath);
+            lock (sequencesOnDemand)
+            {
+                pending.RemoveAll(delegate(WeakReference r) { return !r.IsAlive; });
+                for (int sequenceIndex = 0; sequenceIndex < privateSequenceCount; sequenceIndex++)
+                {
+                    SequenceEntry entry = sequences[sequenceIndex];
+                    Record[] records = new Record[entry.frameCount];
+                    for (int frameIndex = 0; frameIndex < entry.frameCount && frameIndex < entry.frames.Count; frameIndex++)
+                    {
+                        records[frameIndex] = entry.frames[frameIndex];
+                    }
+
+                    String path = privatePath;
+                    byte servoCount = this.servoCount;
+                    Sequence sequence = new Sequence(getSequenceName(sequenceIndex), delegate()
+                    {
+                        return readFrames(path, servoCount, records);
+                    });
+                    pending.Add(new WeakReference(sequence));
+                    list.Add(sequence);
+                }
+            }
+            return list;
+        }
+
+        private static List<WeakReference> getSequencesOnDemand(String path)
+        {
+            String fullPath = Path.GetFullPath(path);
+            lock (sequencesOnDemand)
+            {
+                List<WeakReference> list;
+                if (!sequencesOnDemand.TryGetValue(fullPath, out list))
+                {
+                    list = new List<WeakReference>();
+                    sequencesOnDemand[fullPath] = list;
+                }
+                return list;
+            }
+        }
+
+        /// <summary>
+        /// Reads the frames of every sequence returned by
+        /// readSequencesOnDemand for this file that still needs them.
+        /// </summary>
+        private void loadSequencesOnDemand()
+        {
+            List<WeakReference> pending = getSequencesOnDemand(privatePath);
+            List<Sequence> loading = new List<Sequence>();
+            lock (sequencesOnDemand)
+            {
+                foreach (WeakReference r in pending)
+                {
+                    Sequence sequence = r.Target as Sequence;
+                    if (sequence != null)
+                    {
+                        loading.Add(sequence);
+                    }
+                }
+                pending.Clear();
+            }
+
+            writer.Flush();
+            stream.Flush();
+            foreach (Sequence sequence in loading)
+            {
+                sequence.loadFrames();
+            }
+        }
+
+        /// <summary>
+        /// Reads the frames stored in the given records.
+        /// </summary>
+        private static List<Frame> readFrames(String path, byte servoCount, Record[] records)
+        {
+            List<Frame> frames = new List<Frame>(records.Length);
+            using (FileStream file = new FileStream(path, FileMode.Open, FileAccess.Read, FileShare.ReadWrite))
+            {
+                for (int frameIndex = 0; frameIndex < records.Length; frameIndex++)
+                {
+                    frames.Add(readFrame(file, path, servoCount, records[frameIndex], frameIndex));
+                }
+            }
+            return frames;
+        }
+
+        /// <summary>
+        /// Saves a list of sequences, replacing the ones in the file.  Only
+        /// the frames and sequence names that differ from what is already in
+        /// the file get written.
+        /// </summary>
+        public void saveSequences(IList<Sequence> list)
+        {
+            if (list.Count > UInt16.MaxValue)
+            {
+                throw new ArgumentException("Too many sequences.");
+            }
+
+            stream.Seek(0, SeekOrigin.End);
+            for (int sequenceIndex = 0; sequenceIndex < list.Count; sequenceIndex++)
+            {
+                Sequence sequence = list[sequenceIndex];
+                if (sequence.frames.Count > UInt16.MaxValue)
+                {
+                    throw new ArgumentException("Sequence " + sequenceIndex + " has too many frames.");
+                }
+
+                for (int frameIndex = 0; frameIndex < sequence.frames.Count; frameIndex++)
+                {
+                    setFrame(sequenceIndex, frameIndex, sequence.frames[frameIndex]);
+                }
+                setSequence(sequenceIndex, sequence.name, sequence.frames.Count);
+            }
+            setSequenceCount(list.Count);
+            flush();
+        }
+
+        /// <summary>
+        /// Stores one frame.  Nothing is written if the frame is the same as
+        /// the one already stored.  Call flush() afterwards to commit the
+        /// changes and make sure they are written to the disk; until then,
+        /// they are lost if the program stops.
+        /// </summary>
+        public void setFrame(int sequenceIndex, int frameIndex, Frame frame)
+        {
+            startPayload();
+            payloadWriter.Write(frame.name ?? "");
+            payloadWriter.Write(frame.length_ms);
+            payloadWriter.Write(servoCount);
+            for (int channel = 0; channel < servoCount; channel++)
+            {
+                payloadWriter.Write(frame[channel]);
+            }
+
+            List<Record> frames = getSequenceEntry(sequenceIndex).frames;
+            Record old = frameIndex < frames.Count ? frames[frameIndex] : null;
+            Record record = appendIfChanged(RecordFrame, sequenceIndex, frameIndex, old);
+            if (record != old)
+            {
+                setFrameRecord(sequenceIndex, frameIndex, record);
+            }
+        }
+
+        /// <summary>
+        /// Sets the name and number of frames of a sequence.  If the sequence
+        /// is made shorter, the frames past the end are dropped.
+        /// </summary>
+        public void setSequence(int sequenceIndex, String name, int frameCount)
+        {
+            startPayload();
+            payloadWriter.Write(name ?? "");
+            payloadWriter.Write((UInt16)frameCount);
+
+            SequenceEntry entry = getSequenceEntry(sequenceIndex);
+            Record record = appendIfChanged(RecordSequence, sequenceIndex, 0, entry.record);
+            if (record != entry.record)
+            {
+                replace(ref entry.record, record);
+                entry.name = name ?? "";
+                entry.frameCount = frameCount;
+            }
+            dropFrames(entry, frameCount);
+        }
+
+        /// <summary>
+        /// Sets the number of sequences.  Sequences past the end are dropped.
+        /// </summary>
+        public void setSequenceCount(int count)
+        {
+            startPayload();
+            payloadWriter.Write((UInt16)count);
+            Record record = appendIfChanged(RecordCount, 0, 0, countRecord);
+            if (record != countRecord)
+            {
+                replace(ref countRecord, record);
+                privateSequenceCount = count;
+                while (sequences.Count < count)
+                {
+                    sequences.Add(new SequenceEntry());
+                }
+            }
+            dropSequences(count);
+        }
+
+        /// <summary>
+        /// Commits the changes made since the last flush, writes them to the
+        /// disk, and rewrites the file if most of it is taken up by old
+        /// records.
+        /// </summary>
+        public void flush()
+        {
+            if (uncommitted)
+            {
+                stream.Seek(0, SeekOrigin.End);
+                writer.Write(RecordCommit);
+                writer.Write((UInt16)0);
+                writer.Write((UInt16)0);
+                writer.Write(0);
+                writer.Write(fnv1a(new byte[0], 0));
+                uncommitted = false;
+            }
+            writer.Flush();
+            stream.Flush();
+
+            if (stream.Length >= MinimumCompactionSize && garbage * 2 > stream.Length)
+            {
+                compact();
+            }
+        }
+
+        /// <summary>
+        /// Rewrites the file so that it only contains the current records.
+        /// </summary>
+        public void compact()
+        {
+            loadSequencesOnDemand();
+            List<Sequence> list = readSequences();
+            String temporaryPath = privatePath + ".tmp";
+            if (File.Exists(temporaryPath))
+            {
+                File.Delete(temporaryPath);
+            }
+            using (SequenceStore compacted = new SequenceStore(temporaryPath, servoCount))
+            {
+                compacted.saveSequences(list);
+            }
+
+            // Replace keeps the old file as a backup until the new one is
+            // in place, so there is always a complete file to recover.
+            close();
+            File.Replace(temporaryPath, privatePath, privatePath + ".bak");
+            File.Delete(privatePath + ".bak");
+
+            sequences.Clear();
+            privateSequenceCount = 0;
+            countRecord = null;
+            garbage = 0;
+            open();
+        }
+
+        private void requireSequence(int sequenceIndex)
+        {
+            if (sequenceIndex < 0 || sequenceIndex >= privateSequenceCount)
+            {
+                throw new ArgumentOutOfRangeException("sequenceIndex");
+            }
+        }
+
+        private void startPayload()
+        {
+            payloadStream.SetLength(0);
+        }
+
+        /// <summary>
+        /// Appends a record with the payload in payloadStream, unless the
+        /// current record has the same payload.  Returns the record that is
+        /// now current.
+        /// </summary>
+        private Record appendIfChanged(byte type, int sequenceIndex, int frameIndex, Record current)
+        {
+            payloadWriter.Flush();
+            byte[] payload = payloadStream.GetBuffer();
+            int length = (int)payloadStream.Length;
+            UInt64 hash = fnv1a(payload, length);
+
+            // Comparing the hashes instead of the stored bytes means that
+            // saving does not have to read the unchanged records back in.
+            if (current != null && current.hash == hash && current.length == length)
+            {
+                return current;
+            }
+
+            stream.Seek(0, SeekOrigin.End);
+            Record record = new Record();
+            record.offset = stream.Position + RecordHeaderSize;
+            record.length = length;
+            record.hash = hash;
+
+            writer.Write(type);
+            writer.Write((UInt16)sequenceIndex);
+            writer.Write((UInt16)frameIndex);
+            writer.Write(length);
+            writer.Write(hash);
+            writer.Write(payload, 0, length);
+            uncommitted = true;
+            return record;
+        }
+
+        private static byte[] readPayload(Stream file, String path, Record record)
+        {
+            file.Position = record.offset;
+            byte[] payload = new byte[record.length];
+            if (!readFully(file, payload, record.length) || fnv1a(payload, payload.Length) != record.hash)
+            {
+                throw new Exception("The sequence file " + path + " is corrupt.");
+            }
+            return payload;
+        }
+
+        /// <summary>
+        /// Reads length bytes from the current position.  Returns false if
+        /// the stream ends first.
+        /// </summary>
+        private static bool readFully(Stream file, byte[] buffer, int length)
+        {
+            int count = 0;
+            while (count < length)
+            {
+                int read = file.Read(buffer, count, length - count);
+                if (read == 0)
+                {
+                    return false;
+                }
+                count += read;
+            }
+            return true;
+        }
+
+        private static UInt64 fnv1a(byte[] data, int length)
+        {
+            UInt64 hash = 14695981039346656037;
+            for (int i = 0; i < length; i++)
+            {
+                hash ^= data[i];
+                hash *= 1099511628211;
+            }
+            return hash;
+        }
+
+        private void close()
+        {
+            if (stream != null)
+            {
+                writer.Flush();
+                stream.Close();
+                stream = null;
+            }
+        }
+
+        public void Dispose()
+        {
+            close();
+        }
+    }
+}
+
+// Local Variables: **
+// mode: java **
+// c-basic-offset: 4 **
+// tab-width: 4 **
+// indent-tabs-mode: nil **
+// end: **
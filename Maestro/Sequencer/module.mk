@@ -1,7 +1,7 @@
 Sequencer_lib := $(Sequencer)/Sequencer.dll
 Targets += $(Sequencer)/Sequencer.dll
 
-Sequencer_files := $(Sequencer)/Sequence.cs $(Sequencer)/Frame.cs
+Sequencer_files := $(Sequencer)/Sequence.cs $(Sequencer)/SequenceStore.cs $(Sequencer)/Frame.cs
 
 $(Sequencer)/Sequencer.dll: $(Sequencer_files)
 	$(CS) -target:library -out:$@ $(Sequencer_files) -r:System.Windows.Forms
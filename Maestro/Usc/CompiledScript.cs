@@ -0,0 +1,105 @@
+﻿using System;
+using System.Collections.Generic;
+using Pololu.Usc.Bytecode;
+
+namespace Pololu.Usc
+{
+    /// <summary>
+    /// The parts of a compiled script that are loaded into a Maestro: the
+    /// bytecode, the subroutine table and the CRC.  Unlike a
+    /// BytecodeProgram, this can be saved and read back without compiling
+    /// the script again (see ScriptCache).
+    /// </summary>
+    public class CompiledScript
+    {
+        /// <summary>
+        /// The size of the subroutine table in the Maestro's memory: two
+        /// bytes for each of the 128 subroutines that have their own
+        /// command byte.
+        /// </summary>
+        public const int subroutineTableSize = 256;
+
+        readonly byte[] privateBytecode;
+        readonly byte[] privateSubroutineTable;
+        readonly ushort privateCrc;
+
+        /// <summary>
+        /// Takes the parts of a compiled BytecodeProgram.
+        /// </summary>
+        public CompiledScript(BytecodeProgram program)
+        {
+            privateBytecode = program.getByteList().ToArray();
+            privateSubroutineTable = buildSubroutineTable(program.subroutineAddresses, program.subroutineCommands);
+            privateCrc = program.getCRC();
+        }
+
+        /// <summary>
+        /// Creates a compiled script from parts that were saved earlier.
+        /// </summary>
+        public CompiledScript(byte[] bytecode, byte[] subroutineTable, ushort crc)
+        {
+            if (subroutineTable.Length != subroutineTableSize)
+            {
+                throw new ArgumentException("The subroutine table must be " + subroutineTableSize + " bytes long.", "subroutineTable");
+            }
+            privateBytecode = (byte[])bytecode.Clone();
+            privateSubroutineTable = (byte[])subroutineTable.Clone();
+            privateCrc = crc;
+        }
+
+        /// <summary>
+        /// The bytecode, without the QUIT that is added at the end when it is
+        /// loaded into a device that has room for it.
+        /// </summary>
+        public byte[] bytecode
+        {
+            get { return privateBytecode; }
+        }
+
+        /// <summary>
+        /// The subroutine table, as written to the device by
+        /// Usc.setSubroutines.
+        /// </summary>
+        public byte[] subroutineTable
+        {
+            get { return privateSubroutineTable; }
+        }
+
+        /// <summary>
+        /// The checksum of the bytecode that is stored in the device's
+        /// PARAMETER_SCRIPT_CRC, from BytecodeProgram.getCRC.
+        /// </summary>
+        public ushort crc
+        {
+            get { return privateCrc; }
+        }
+
+        /// <summary>
+        /// Builds the subroutine table that tells the Maestro where each
+        /// subroutine is.  Subroutines called with the CALL command do not
+        /// have an entry; the unused entries are 0xFF (erased flash).
+        /// </summary>
+        public static byte[] buildSubroutineTable(Dictionary<string, ushort> subroutineAddresses,
+                                                  Dictionary<string, byte> subroutineCommands)
+        {
+            byte[] subroutineData = new byte[subroutineTableSize];
+
+            for (int i = 0; i < subroutineTableSize; i++)
+                subroutineData[i] = 0xFF; // initialize to the default flash state
+
+            foreach (KeyValuePair<string, ushort> kvp in subroutineAddresses)
+            {
+                string name = kvp.Key;
+                byte bytecode = subroutineCommands[name];
+
+                if (bytecode == (byte)Opcode.CALL)
+                    continue; // skip CALLs - these do not get a position in the subroutine memory
+
+                subroutineData[2 * (bytecode - 128)] = (byte)(kvp.Value % 256);
+                subroutineData[2 * (bytecode - 128) + 1] = (byte)(kvp.Value >> 8);
+            }
+
+            return subroutineData;
+        }
+    }
+}
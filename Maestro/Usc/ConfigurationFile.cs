@@ -26,6 +26,18 @@ namespace Pololu.Usc
         /// <remarks>This function is messy.  Maybe I should have tried the XPath
         /// library.</remarks>
         public static UscSettings load(StreamReader sr, List<String> warnings)
+        {
+            return load(sr, warnings, null);
+        }
+
+        /// <summary>
+        /// Parses a saved configuration file and returns a UscSettings object,
+        /// getting the compiled script from a cache if it is there.
+        /// </summary>
+        /// <param name="sr">The file to read from.</param>
+        /// <param name="warnings">A list of warnings (see the other overload).</param>
+        /// <param name="scriptCache">The cache of compiled scripts, or null to always compile the script.</param>
+        public static UscSettings load(StreamReader sr, List<String> warnings, ScriptCache scriptCache)
         {
             XmlReader reader = XmlReader.Create(sr);
 
@@ -211,7 +223,14 @@ namespace Pololu.Usc
 
             try
             {
-                settings.setAndCompileScript(script);
+                if (scriptCache != null)
+                {
+                    settings.setScript(script, scriptCache.compile(script, settings.servoCount != 6));
+                }
+                else
+                {
+                    settings.setAndCompileScript(script);
+                }
             }
             catch (Exception e)
             {
@@ -0,0 +1,133 @@
+﻿using System;
+using System.Runtime.InteropServices;
+
+namespace Pololu.Usc
+{
+    /// <summary>
+    /// Receives the parts of a Maestro's state read by Usc.tryGetStatus.
+    /// One object can be used for any number of reads, so polling with it
+    /// does not allocate memory.
+    /// </summary>
+    /// <remarks>
+    /// The transfers are done straight in to one buffer that is pinned for
+    /// the life of the object, so that it does not have to be pinned or
+    /// copied for every read.  Dispose the object to unpin the buffer.
+    /// Only the parts named by fields, and only the channels from
+    /// firstServo to firstServo + servoCount - 1, are updated by a read; the
+    /// rest keep their old values.
+    /// </remarks>
+    public unsafe class MaestroStatus : IDisposable
+    {
+        /// <summary>
+        /// The miscellaneous variables, if fields includes Variables.
+        /// </summary>
+        public MaestroVariables variables;
+
+        /// <summary>
+        /// The status of each channel, indexed by channel number.
+        /// </summary>
+        public readonly ServoStatus[] servos;
+
+        /// <summary>
+        /// The data stack.  Only the first stackCount values are valid.
+        /// </summary>
+        public readonly short[] stack;
+
+        /// <summary>
+        /// The number of values on the data stack.
+        /// </summary>
+        public int stackCount;
+
+        /// <summary>
+        /// The call stack.  Only the first callStackCount values are valid.
+        /// </summary>
+        public readonly ushort[] callStack;
+
+        /// <summary>
+        /// The number of return addresses on the call stack.
+        /// </summary>
+        public int callStackCount;
+
+        /// <summary>
+        /// The parts that were read by the last successful read, or None if
+        /// it failed.
+        /// </summary>
+        public MaestroFields fields;
+
+        /// <summary>
+        /// The first channel read by the last read.
+        /// </summary>
+        public byte firstServo;
+
+        /// <summary>
+        /// The number of channels read by the last read.
+        /// </summary>
+        public byte servoCount;
+
+        readonly byte[] buffer;
+        GCHandle handle;
+        byte* privatePointer;
+
+        /// <summary>
+        /// Creates an object for a Maestro with the given number of channels
+        /// (Usc.servoCount).
+        /// </summary>
+        public MaestroStatus(byte servoCount)
+        {
+            servos = new ServoStatus[servoCount];
+            stack = new short[Math.Max(Usc.MicroMaestroStackSize, Usc.MiniMaestroStackSize)];
+            callStack = new ushort[Math.Max(Usc.MicroMaestroCallStackSize, Usc.MiniMaestroCallStackSize)];
+
+            int size = sizeof(MicroMaestroVariables) + servoCount * sizeof(ServoStatus);
+            size = Math.Max(size, sizeof(MiniMaestroVariables));
+            size = Math.Max(size, Usc.MiniMaestroStackSize * sizeof(short));
+            size = Math.Max(size, Usc.MiniMaestroCallStackSize * sizeof(ushort));
+            buffer = new byte[size];
+            handle = GCHandle.Alloc(buffer, GCHandleType.Pinned);
+            privatePointer = (byte*)handle.AddrOfPinnedObject();
+        }
+
+        ~MaestroStatus()
+        {
+            free();
+        }
+
+        /// <summary>
+        /// The pinned buffer that the transfers are done in to.
+        /// </summary>
+        internal byte* pointer
+        {
+            get
+            {
+                if (privatePointer == null)
+                {
+                    throw new ObjectDisposedException("MaestroStatus");
+                }
+                return privatePointer;
+            }
+        }
+
+        /// <summary>
+        /// The size of the buffer, in bytes.
+        /// </summary>
+        internal int bufferSize
+        {
+            get { return buffer.Length; }
+        }
+
+        public void Dispose()
+        {
+            free();
+            GC.SuppressFinalize(this);
+        }
+
+        void free()
+        {
+            if (handle.IsAllocated)
+            {
+                handle.Free();
+            }
+            privatePointer = null;
+        }
+    }
+}
@@ -0,0 +1,297 @@
+﻿using System;
+using System.Collections.Generic;
+using System.IO;
+using System.Security.Cryptography;
+using System.Text;
+using Pololu.Usc.Bytecode;
+
+namespace Pololu.Usc
+{
+    /// <summary>
+    /// Keeps compiled Maestro scripts in a directory so that a script only
+    /// has to be compiled once, no matter how many times or into how many
+    /// devices it is loaded.
+    /// </summary>
+    /// <remarks>
+    /// <para>
+    /// Each compiled script is stored in a file named after a SHA-256 hash
+    /// of the script, whether it is for a Micro Maestro or a Mini Maestro
+    /// (they are compiled differently), and the version of the compiler, so
+    /// changing any of those gives a new entry instead of a stale one.  The
+    /// file holds the bytecode, the subroutine table and the CRC (see
+    /// CompiledScript).  Scripts that do not compile are not cached, so the
+    /// compiler reports the error every time.
+    /// </para>
+    /// <para>
+    /// The cache is only an optimization: if the directory cannot be
+    /// written or a file in it is damaged, the script is compiled as if it
+    /// was not cached.  Files are written under a temporary name and then
+    /// renamed, so other processes sharing the directory never see half a
+    /// file.  This class is thread-safe.
+    /// </para>
+    /// </remarks>
+    public class ScriptCache
+    {
+        /// <summary>
+        /// The name of the directory that getDefaultDirectory puts next to
+        /// a configuration or script file.
+        /// </summary>
+        public const string defaultDirectoryName = "maestro-script-cache";
+
+        const uint magic = 0x4353504D; // "MPSC"
+        const ushort version = 1;
+        const int hashSize = 32;
+
+        readonly string privateDirectory;
+        readonly object sync = new object();
+        readonly Dictionary<string, CompiledScript> loaded = new Dictionary<string, CompiledScript>();
+        int privateHits;
+        int privateMisses;
+
+        /// <summary>
+        /// Identifies the build of Bytecode.dll, so that scripts compiled by
+        /// a different compiler are not used.
+        /// </summary>
+        static readonly string compilerVersion = typeof(BytecodeReader).Module.ModuleVersionId.ToString();
+
+        /// <param name="directory">The directory to keep the compiled scripts in.  It is created if it does not exist.</param>
+        public ScriptCache(string directory)
+        {
+            privateDirectory = directory;
+        }
+
+        /// <summary>
+        /// Returns the directory to use for the scripts of the given
+        /// configuration or script file: a directory named
+        /// defaultDirectoryName next to it.
+        /// </summary>
+        public static string getDefaultDirectory(string fileName)
+        {
+            return Path.Combine(Path.GetDirectoryName(Path.GetFullPath(fileName)), defaultDirectoryName);
+        }
+
+        public string directory
+        {
+            get { return privateDirectory; }
+        }
+
+        /// <summary>
+        /// The number of times compile found the script in the cache.
+        /// </summary>
+        public int hits
+        {
+            get { lock (sync) { return privateHits; } }
+        }
+
+        /// <summary>
+        /// The number of times compile had to compile the script.
+        /// </summary>
+        public int misses
+        {
+            get { lock (sync) { return privateMisses; } }
+        }
+
+        /// <summary>
+        /// Gets the compiled form of a script, compiling it only if it is not
+        /// in the cache.
+        /// </summary>
+        /// <param name="script">The text of the script.</param>
+        /// <param name="isMiniMaestro">True for a Mini Maestro, false for a Micro Maestro (6 channels).</param>
+        public CompiledScript compile(string script, bool isMiniMaestro)
+        {
+            BytecodeProgram program;
+            return compile(script, isMiniMaestro, out program);
+        }
+
+        /// <summary>
+        /// Gets the compiled form of a script, compiling it only if it is not
+        /// in the cache.
+        /// </summary>
+        /// <param name="script">The text of the script.</param>
+        /// <param name="isMiniMaestro">True for a Mini Maestro, false for a Micro Maestro (6 channels).</param>
+        /// <param name="program">Receives the BytecodeProgram if the script was compiled, or null if it was in the cache.</param>
+        public CompiledScript compile(string script, bool isMiniMaestro, out BytecodeProgram program)
+        {
+            byte[] hash = getHash(script, isMiniMaestro);
+            string key = toHex(hash);
+            program = null;
+
+            lock (sync)
+            {
+                CompiledScript compiled;
+                if (loaded.TryGetValue(key, out compiled))
+                {
+                    privateHits++;
+                    return compiled;
+                }
+
+                compiled = read(key, hash);
+                if (compiled != null)
+                {
+                    privateHits++;
+                    loaded[key] = compiled;
+                    return compiled;
+                }
+            }
+
+            // Compile outside the lock so that other scripts can be looked
+            // up in the meantime.  If two threads compile the same script,
+            // they get the same result.
+            program = BytecodeReader.Read(script, isMiniMaestro);
+            CompiledScript result = new CompiledScript(program);
+
+            lock (sync)
+            {
+                privateMisses++;
+                loaded[key] = result;
+                write(key, hash, result);
+            }
+            return result;
+        }
+
+        /// <summary>
+        /// Returns the key that the compiled script is stored under: a hex
+        /// string that changes whenever the script, the kind of Maestro or
+        /// the compiler changes.  It can be used to tell whether files made
+        /// from a script (like a listing) are out of date.
+        /// </summary>
+        public static string getKey(string script, bool isMiniMaestro)
+        {
+            return toHex(getHash(script, isMiniMaestro));
+        }
+
+        static byte[] getHash(string script, bool isMiniMaestro)
+        {
+            byte[] input = Encoding.UTF8.GetBytes(compilerVersion + "\n" + (isMiniMaestro ? "mini" : "micro") + "\n" + script);
+            using (SHA256 sha = SHA256.Create())
+            {
+                return sha.ComputeHash(input);
+            }
+        }
+
+        static string toHex(byte[] bytes)
+        {
+            StringBuilder builder = new StringBuilder(bytes.Length * 2);
+            foreach (byte b in bytes)
+            {
+                builder.Append(b.ToString("x2"));
+            }
+            return builder.ToString();
+        }
+
+        string getPath(string key)
+        {
+            return Path.Combine(privateDirectory, key + ".bin");
+        }
+
+        /// <summary>
+        /// Reads a compiled script from the directory.  Returns null if it is
+        /// not there or cannot be read.
+        /// </summary>
+        CompiledScript read(string key, byte[] hash)
+        {
+            string path = getPath(key);
+            if (!File.Exists(path))
+            {
+                return null;
+            }
+
+            try
+            {
+                using (BinaryReader reader = new BinaryReader(File.OpenRead(path)))
+                {
+                    if (reader.ReadUInt32() != magic || reader.ReadUInt16() != version)
+                    {
+                        return null;
+                    }
+
+                    byte[] storedHash = reader.ReadBytes(hashSize);
+                    for (int i = 0; i < hashSize; i++)
+                    {
+                        if (storedHash.Length != hashSize || storedHash[i] != hash[i])
+                        {
+                            return null;
+                        }
+                    }
+
+                    ushort crc = reader.ReadUInt16();
+                    int length = reader.ReadInt32();
+                    if (length < 0 || length > 0x10000)
+                    {
+                        return null;
+                    }
+                    byte[] bytecode = reader.ReadBytes(length);
+                    byte[] subroutineTable = reader.ReadBytes(CompiledScript.subroutineTableSize);
+                    if (bytecode.Length != length || subroutineTable.Length != CompiledScript.subroutineTableSize)
+                    {
+                        return null;
+                    }
+                    return new CompiledScript(bytecode, subroutineTable, crc);
+                }
+            }
+            catch (IOException)
+            {
+                return null;
+            }
+            catch (UnauthorizedAccessException)
+            {
+                return null;
+            }
+        }
+
+        /// <summary>
+        /// Writes a compiled script to the directory, if possible.
+        /// </summary>
+        void write(string key, byte[] hash, CompiledScript compiled)
+        {
+            string path = getPath(key);
+            string temporaryPath = path + "." + Guid.NewGuid().ToString("N") + ".tmp";
+            try
+            {
+                Directory.CreateDirectory(privateDirectory);
+                using (BinaryWriter writer = new BinaryWriter(File.Create(temporaryPath)))
+                {
+                    writer.Write(magic);
+                    writer.Write(version);
+                    writer.Write(hash);
+                    writer.Write(compiled.crc);
+                    writer.Write(compiled.bytecode.Length);
+                    writer.Write(compiled.bytecode);
+                    writer.Write(compiled.subroutineTable);
+                }
+
+                if (File.Exists(path))
+                {
+                    // Another process wrote the same script first.
+                    File.Delete(temporaryPath);
+                }
+                else
+                {
+                    File.Move(temporaryPath, path);
+                }
+            }
+            catch (IOException)
+            {
+                deleteQuietly(temporaryPath);
+            }
+            catch (UnauthorizedAccessException)
+            {
+                deleteQuietly(temporaryPath);
+            }
+        }
+
+        static void deleteQuietly(string path)
+        {
+            try
+            {
+                File.Delete(path);
+            }
+            catch (IOException)
+            {
+            }
+            catch (UnauthorizedAccessException)
+            {
+            }
+        }
+    }
+}
@@ -0,0 +1,1083 @@
+﻿using System;
+using System.Collections.Generic;
+using Pololu.Usc.Bytecode;
+
+namespace Pololu.Usc
+{
+    /// <summary>
+    /// Runs compiled Maestro scripts (BytecodeProgram objects) on the computer
+    /// instead of on a Maestro.  Time is simulated, so a script that would take
+    /// minutes to run on a real device can be tested in a fraction of a second.
+    /// </summary>
+    /// <remarks>
+    /// This is a model of the Maestro, not an exact copy of its firmware.
+    /// The stack and call stack have the same sizes and overflow behavior as
+    /// the real device and servos obey their speed and acceleration limits,
+    /// but the timing of individual instructions and the exact shape of an
+    /// accelerating servo's movement are approximations.
+    ///
+    /// The state of the emulator can be read with getVariables, which returns
+    /// the same structures as Usc.getVariables, so code that checks a real
+    /// Maestro can check the emulator too.
+    /// </remarks>
+    public class ScriptEmulator
+    {
+        /// <summary>
+        /// The time between servo updates, in microseconds.  Speed limits are
+        /// applied once per update, so speed is in units of (0.25 us)/(10 ms)
+        /// and acceleration is in units of (0.25 us)/(10 ms)/(80 ms).
+        /// </summary>
+        public const UInt32 servoUpdatePeriod = 10000;
+
+        /// <summary>
+        /// The maximum number of values the data stack can hold.
+        /// </summary>
+        public readonly int stackSize;
+
+        /// <summary>
+        /// The maximum number of return addresses the call stack can hold.
+        /// </summary>
+        public readonly int callStackSize;
+
+        /// <summary>
+        /// The number of servo channels.
+        /// </summary>
+        public readonly byte servoCount;
+
+        /// <summary>
+        /// The simulated time it takes to run one instruction, in microseconds.
+        /// The default is a rough estimate.  It must not be zero if the script
+        /// has a loop that does not call delay.
+        /// </summary>
+        public UInt32 instructionTime = 50;
+
+        /// <summary>
+        /// Bytes sent by the serial_send_byte command.
+        /// </summary>
+        public readonly List<byte> serialOutput = new List<byte>();
+
+        /// <summary>
+        /// True if the script has turned on the red LED.
+        /// </summary>
+        public bool ledOn
+        {
+            get { return privateLedOn; }
+        }
+
+        /// <summary>
+        /// The on time set by the most recent pwm command, in units of 1/48 us.
+        /// </summary>
+        public UInt16 pwmOnTime
+        {
+            get { return privatePwmOnTime; }
+        }
+
+        /// <summary>
+        /// The period set by the most recent pwm command, in units of 1/48 us.
+        /// </summary>
+        public UInt16 pwmPeriod
+        {
+            get { return privatePwmPeriod; }
+        }
+
+        /// <summary>
+        /// The simulated time since the emulator was created, in microseconds.
+        /// </summary>
+        public UInt64 time
+        {
+            get { return privateTime; }
+        }
+
+        /// <summary>
+        /// The number of instructions executed since the emulator was created.
+        /// </summary>
+        public UInt64 instructionCount
+        {
+            get { return privateInstructionCount; }
+        }
+
+        /// <summary>
+        /// True if the script is stopped, because it executed QUIT, because
+        /// of an error, or because stop was called.
+        /// </summary>
+        public bool scriptDone
+        {
+            get { return privateScriptDone; }
+        }
+
+        /// <summary>
+        /// The error register.  Each bit stands for a different error (see uscError).
+        /// </summary>
+        public UInt16 errors
+        {
+            get { return privateErrors; }
+        }
+
+        byte[] program;
+        ushort[] subroutineTable = new ushort[128];
+        Dictionary<string, ushort> subroutineAddresses;
+
+        short[] stack;
+        int stackPointer;
+        ushort[] callStack;
+        int callStackPointer;
+        ushort programCounter;
+
+        ChannelSetting[] channelSettings;
+        UInt16[] position;
+        UInt16[] target;
+        UInt16[] speed;
+        Byte[] acceleration;
+
+        /// <summary>
+        /// Current velocity of each servo in units of (0.25 us)/(10 ms)/8,
+        /// so that acceleration (which applies over 80 ms) can be added to
+        /// it on every update.  Always positive.
+        /// </summary>
+        UInt32[] velocity;
+
+        UInt64 privateTime;
+        UInt64 nextServoUpdate = servoUpdatePeriod;
+        UInt64 delayEndTime;
+        UInt64 privateInstructionCount;
+        bool privateScriptDone;
+        UInt16 privateErrors;
+        bool privateLedOn;
+        UInt16 privatePwmOnTime;
+        UInt16 privatePwmPeriod;
+
+        /// <summary>
+        /// Creates an emulator for the given program.  The channels start with
+        /// default settings and no targets.
+        /// </summary>
+        /// <param name="program">The compiled script.</param>
+        /// <param name="servoCount">
+        ///   The number of channels on the Maestro to emulate: 6 for the Micro Maestro,
+        ///   or 12, 18, or 24 for the Mini Maestros.
+        /// </param>
+        public ScriptEmulator(BytecodeProgram program, byte servoCount)
+            : this(program, defaultChannelSettings(servoCount))
+        {
+        }
+
+        /// <summary>
+        /// Creates an emulator that runs the script from the given settings.
+        /// The channel limits, home positions, speeds and accelerations are
+        /// taken from the settings.  If settings.scriptDone is true, the
+        /// script does not run until restart is called.
+        /// </summary>
+        public ScriptEmulator(UscSettings settings)
+            : this(settings.bytecodeProgram, settings.channelSettings.ToArray())
+        {
+            if (settings.scriptDone)
+            {
+                privateScriptDone = true;
+            }
+        }
+
+        private ScriptEmulator(BytecodeProgram program, ChannelSetting[] channelSettings)
+            : this(getProgramBytes(program), getSubroutineTable(program), channelSettings)
+        {
+            subroutineAddresses = program.subroutineAddresses;
+        }
+
+        /// <summary>
+        /// Creates an emulator that runs bytecode that is already in the form
+        /// it takes in the Maestro's flash.  Used by VirtualMaestro.
+        /// </summary>
+        /// <param name="program">The script area of the flash.</param>
+        /// <param name="subroutineTable">
+        ///   The addresses of the subroutines called by opcodes 128-255,
+        ///   with 0xFFFF for unused entries.
+        /// </param>
+        internal ScriptEmulator(byte[] program, ushort[] subroutineTable, ChannelSetting[] channelSettings)
+        {
+            this.channelSettings = channelSettings;
+            servoCount = (byte)channelSettings.Length;
+
+            if (servoCount == 6)
+            {
+                stackSize = Usc.MicroMaestroStackSize;
+                callStackSize = Usc.MicroMaestroCallStackSize;
+            }
+            else
+            {
+                stackSize = Usc.MiniMaestroStackSize;
+                callStackSize = Usc.MiniMaestroCallStackSize;
+            }
+            stack = new short[stackSize];
+            callStack = new ushort[callStackSize];
+
+            this.program = program;
+            Array.Copy(subroutineTable, this.subroutineTable, this.subroutineTable.Length);
+            subroutineAddresses = new Dictionary<string, ushort>();
+
+            position = new UInt16[servoCount];
+            target = new UInt16[servoCount];
+            speed = new UInt16[servoCount];
+            acceleration = new Byte[servoCount];
+            velocity = new UInt32[servoCount];
+            for (int i = 0; i < servoCount; i++)
+            {
+                ChannelSetting setting = channelSettings[i];
+                speed[i] = setting.speed;
+                acceleration[i] = setting.acceleration;
+                if (setting.homeMode == HomeMode.Goto)
+                {
+                    position[i] = target[i] = setting.home;
+                }
+            }
+        }
+
+        private static byte[] getProgramBytes(BytecodeProgram program)
+        {
+            if (program == null)
+            {
+                throw new ArgumentNullException("program");
+            }
+
+            // Like setUscSettings, add a QUIT to the end so the script can not
+            // run off the end in to erased flash.
+            List<byte> byteList = program.getByteList();
+            byteList.Add((byte)Opcode.QUIT);
+            return byteList.ToArray();
+        }
+
+        /// <summary>
+        /// Builds the table used by the one-byte subroutine call opcodes
+        /// (128-255), the same way that Usc.setSubroutines does.
+        /// </summary>
+        private static ushort[] getSubroutineTable(BytecodeProgram program)
+        {
+            ushort[] table = new ushort[128];
+            for (int i = 0; i < table.Length; i++)
+            {
+                table[i] = 0xFFFF;
+            }
+            foreach (KeyValuePair<string, ushort> kvp in program.subroutineAddresses)
+            {
+                byte bytecode = program.subroutineCommands[kvp.Key];
+                if (bytecode == (byte)Opcode.CALL)
+                    continue;
+                table[bytecode - 128] = kvp.Value;
+            }
+            return table;
+        }
+
+        private static ChannelSetting[] defaultChannelSettings(byte servoCount)
+        {
+            if (servoCount != 6 && servoCount != 12 && servoCount != 18 && servoCount != 24)
+            {
+                throw new ArgumentException("The number of servos must be 6, 12, 18, or 24.", "servoCount");
+            }
+
+            ChannelSetting[] settings = new ChannelSetting[servoCount];
+            for (int i = 0; i < servoCount; i++)
+            {
+                settings[i] = new ChannelSetting();
+            }
+            return settings;
+        }
+
+        /// <summary>
+        /// Stops the script.  Equivalent to Usc.setScriptDone(1).
+        /// </summary>
+        public void stop()
+        {
+            privateScriptDone = true;
+        }
+
+        /// <summary>
+        /// Clears the stacks and starts the script from the beginning.
+        /// Equivalent to Usc.restartScript.
+        /// </summary>
+        public void restart()
+        {
+            restartAtAddress(0);
+        }
+
+        /// <summary>
+        /// Clears the stacks and starts the script at the named subroutine.
+        /// Equivalent to Usc.restartScriptAtSubroutine.
+        /// </summary>
+        public void restartAtSubroutine(string name)
+        {
+            ushort address;
+            if (!subroutineAddresses.TryGetValue(name, out address))
+            {
+                throw new ArgumentException("There is no subroutine named \"" + name + "\".", "name");
+            }
+            restartAtAddress(address);
+        }
+
+        /// <summary>
+        /// Clears the stacks, puts the parameter on the stack, and starts the
+        /// script at the named subroutine.
+        /// Equivalent to Usc.restartScriptAtSubroutineWithParameter.
+        /// </summary>
+        public void restartAtSubroutine(string name, short parameter)
+        {
+            restartAtSubroutine(name);
+            stack[stackPointer++] = parameter;
+        }
+
+        /// <summary>
+        /// Clears the stacks and starts the script at the subroutine with the
+        /// given number (the opcode that calls it, minus 128), like
+        /// REQUEST_RESTART_SCRIPT_AT_SUBROUTINE.
+        /// </summary>
+        internal void restartAtSubroutine(byte subroutine)
+        {
+            restartAtAddress(subroutineTable[subroutine & 127]);
+            if (programCounter >= program.Length)
+            {
+                error(uscError.ERROR_SCRIPT_PROGRAM_COUNTER);
+            }
+        }
+
+        internal void restartAtSubroutine(byte subroutine, short parameter)
+        {
+            restartAtSubroutine(subroutine);
+            stack[stackPointer++] = parameter;
+        }
+
+        private void restartAtAddress(ushort address)
+        {
+            stackPointer = 0;
+            callStackPointer = 0;
+            programCounter = address;
+            delayEndTime = 0;
+            privateScriptDone = false;
+        }
+
+        /// <summary>
+        /// Lets a stopped script continue from where it was, like
+        /// Usc.setScriptDone(0).
+        /// </summary>
+        internal void resume()
+        {
+            privateScriptDone = false;
+        }
+
+        /// <summary>
+        /// Sets the PWM output, like Usc.setPwm.
+        /// </summary>
+        internal void setPwm(ushort onTime, ushort period)
+        {
+            privatePwmOnTime = onTime;
+            privatePwmPeriod = period;
+        }
+
+        /// <summary>
+        /// Clears the error register.  Equivalent to Usc.clearErrors.
+        /// </summary>
+        public void clearErrors()
+        {
+            privateErrors = 0;
+        }
+
+        /// <summary>
+        /// Sets the target of a channel, as if it came from USB.
+        /// </summary>
+        public void setTarget(byte servo, ushort value)
+        {
+            requireServo(servo);
+            setTargetInternal(servo, value);
+        }
+
+        /// <summary>
+        /// Sets the speed limit of a channel, as if it came from USB.
+        /// </summary>
+        public void setSpeed(byte servo, ushort value)
+        {
+            requireServo(servo);
+            speed[servo] = value;
+        }
+
+        /// <summary>
+        /// Sets the acceleration limit of a channel, as if it came from USB.
+        /// </summary>
+        public void setAcceleration(byte servo, byte value)
+        {
+            requireServo(servo);
+            acceleration[servo] = value;
+        }
+
+        /// <summary>
+        /// Sets the value that get_position will return for a channel.
+        /// Use this to simulate the voltage on a channel configured as an input.
+        /// </summary>
+        public void setInput(byte servo, ushort value)
+        {
+            requireServo(servo);
+            position[servo] = target[servo] = value;
+            velocity[servo] = 0;
+        }
+
+        /// <summary>
+        /// Returns the current position of a channel.
+        /// </summary>
+        public ushort getPosition(byte servo)
+        {
+            requireServo(servo);
+            return position[servo];
+        }
+
+        /// <summary>
+        /// Returns true if any servo is still moving towards its target.
+        /// Equivalent to the get_moving_state command.
+        /// </summary>
+        public bool moving
+        {
+            get
+            {
+                for (int i = 0; i < servoCount; i++)
+                {
+                    if (position[i] != target[i])
+                    {
+                        return true;
+                    }
+                }
+                return false;
+            }
+        }
+
+        private void requireServo(byte servo)
+        {
+            if (servo >= servoCount)
+            {
+                throw new ArgumentException("Servo number must be less than " + servoCount + ".", "servo");
+            }
+        }
+
+        /// <summary>
+        /// Gets the state of the emulated Maestro, in the same form as
+        /// Usc.getVariables.
+        /// </summary>
+        public void getVariables(out MaestroVariables variables, out short[] stack, out ushort[] callStack, out ServoStatus[] servos)
+        {
+            variables = new MaestroVariables();
+            variables.stackPointer = (byte)stackPointer;
+            variables.callStackPointer = (byte)callStackPointer;
+            variables.errors = privateErrors;
+            variables.programCounter = programCounter;
+            variables.scriptDone = (byte)(privateScriptDone ? 1 : 0);
+
+            stack = new short[stackPointer];
+            Array.Copy(this.stack, stack, stackPointer);
+
+            callStack = new ushort[callStackPointer];
+            Array.Copy(this.callStack, callStack, callStackPointer);
+
+            servos = new ServoStatus[servoCount];
+            for (int i = 0; i < servoCount; i++)
+            {
+                servos[i].position = position[i];
+                servos[i].target = target[i];
+                servos[i].speed = speed[i];
+                servos[i].acceleration = acceleration[i];
+            }
+        }
+
+        /// <summary>
+        /// Copies the state of the emulator in to the structure returned by
+        /// a Micro Maestro for REQUEST_GET_VARIABLES, without allocating memory.
+        /// </summary>
+        internal unsafe void getVariables(MicroMaestroVariables* variables)
+        {
+            variables->stackPointer = (byte)stackPointer;
+            variables->callStackPointer = (byte)callStackPointer;
+            variables->errors = privateErrors;
+            variables->programCounter = programCounter;
+            variables->scriptDone = (byte)(privateScriptDone ? 1 : 0);
+            for (int i = 0; i < stackPointer && i < 32; i++)
+            {
+                variables->stack[i] = stack[i];
+            }
+            for (int i = 0; i < callStackPointer && i < 10; i++)
+            {
+                variables->callStack[i] = callStack[i];
+            }
+        }
+
+        /// <summary>
+        /// Copies the state of the emulator in to the structure returned by
+        /// a Mini Maestro for REQUEST_GET_VARIABLES.
+        /// </summary>
+        internal unsafe void getVariables(MiniMaestroVariables* variables)
+        {
+            variables->stackPointer = (byte)stackPointer;
+            variables->callStackPointer = (byte)callStackPointer;
+            variables->errors = privateErrors;
+            variables->programCounter = programCounter;
+            variables->scriptDone = (byte)(privateScriptDone ? 1 : 0);
+            variables->performanceFlags = 0;
+        }
+
+        /// <summary>
+        /// Copies the status of every servo in to the given array, which must
+        /// have room for servoCount entries.
+        /// </summary>
+        internal unsafe void getServos(ServoStatus* servos)
+        {
+            for (int i = 0; i < servoCount; i++)
+            {
+                servos[i].position = position[i];
+                servos[i].target = target[i];
+                servos[i].speed = speed[i];
+                servos[i].acceleration = acceleration[i];
+            }
+        }
+
+        /// <summary>
+        /// Copies as much of the stack as fits and returns the number of
+        /// entries copied.
+        /// </summary>
+        internal unsafe int getStack(short* buffer, int maxCount)
+        {
+            int count = Math.Min(stackPointer, maxCount);
+            for (int i = 0; i < count; i++)
+            {
+                buffer[i] = stack[i];
+            }
+            return count;
+        }
+
+        /// <summary>
+        /// Copies as much of the call stack as fits and returns the number
+        /// of entries copied.
+        /// </summary>
+        internal unsafe int getCallStack(ushort* buffer, int maxCount)
+        {
+            int count = Math.Min(callStackPointer, maxCount);
+            for (int i = 0; i < count; i++)
+            {
+                buffer[i] = callStack[i];
+            }
+            return count;
+        }
+
+        /// <summary>
+        /// Advances the simulated time by the given number of microseconds.
+        /// </summary>
+        internal void advance(UInt64 microseconds)
+        {
+            runUntil(privateTime + microseconds);
+        }
+
+        /// <summary>
+        /// Advances the simulated time by the given number of milliseconds,
+        /// running the script and moving the servos.
+        /// </summary>
+        public void run(UInt32 milliseconds)
+        {
+            runUntil(privateTime + (UInt64)milliseconds * 1000);
+        }
+
+        /// <summary>
+        /// Runs until the script is done or the given number of simulated
+        /// milliseconds have passed, whichever comes first.
+        /// </summary>
+        /// <returns>True if the script is done.</returns>
+        public bool runUntilDone(UInt32 maxMilliseconds)
+        {
+            UInt64 endTime = privateTime + (UInt64)maxMilliseconds * 1000;
+            while (!privateScriptDone && privateTime < endTime)
+            {
+                if (privateTime < delayEndTime)
+                {
+                    advanceTime(Math.Min(delayEndTime, endTime));
+                    continue;
+                }
+                execute();
+                advanceTime(privateTime + instructionTime);
+            }
+            return privateScriptDone;
+        }
+
+        /// <summary>
+        /// Executes one instruction, first waiting for the current delay
+        /// (if any) to finish.  Equivalent to Usc.setScriptDone(2).
+        /// Does nothing if the script is done.
+        /// </summary>
+        public void step()
+        {
+            if (privateScriptDone)
+            {
+                return;
+            }
+            if (privateTime < delayEndTime)
+            {
+                advanceTime(delayEndTime);
+            }
+            execute();
+            advanceTime(privateTime + instructionTime);
+        }
+
+        private void runUntil(UInt64 endTime)
+        {
+            while (privateTime < endTime)
+            {
+                if (privateScriptDone)
+                {
+                    advanceTime(endTime);
+                }
+                else if (privateTime < delayEndTime)
+                {
+                    advanceTime(Math.Min(delayEndTime, endTime));
+                }
+                else
+                {
+                    execute();
+                    advanceTime(Math.Min(privateTime + instructionTime, endTime));
+                }
+            }
+        }
+
+        private void advanceTime(UInt64 newTime)
+        {
+            while (nextServoUpdate <= newTime)
+            {
+                updateServos();
+                nextServoUpdate += servoUpdatePeriod;
+            }
+            privateTime = newTime;
+        }
+
+        private void updateServos()
+        {
+            for (int i = 0; i < servoCount; i++)
+            {
+                if (position[i] == target[i])
+                {
+                    velocity[i] = 0;
+                    continue;
+                }
+
+                UInt32 distance = (UInt32)Math.Abs(target[i] - position[i]);
+                UInt32 step;
+
+                if (acceleration[i] == 0)
+                {
+                    step = speed[i] == 0 ? distance : speed[i];
+                }
+                else
+                {
+                    // Speed up until the speed limit is reached, but slow down
+                    // in time to stop at the target.
+                    UInt32 v = velocity[i] + acceleration[i];
+                    if (speed[i] != 0 && v > (UInt32)speed[i] * 8)
+                    {
+                        v = (UInt32)speed[i] * 8;
+                    }
+
+                    UInt32 stoppingDistance = (UInt32)((UInt64)velocity[i] * velocity[i] / (16UL * acceleration[i]));
+                    if (stoppingDistance >= distance && velocity[i] > acceleration[i])
+                    {
+                        v = velocity[i] - acceleration[i];
+                    }
+
+                    velocity[i] = v;
+                    step = Math.Max(1, v / 8);
+                }
+
+                if (step >= distance)
+                {
+                    position[i] = target[i];
+                    velocity[i] = 0;
+                }
+                else if (target[i] > position[i])
+                {
+                    position[i] += (UInt16)step;
+                }
+                else
+                {
+                    position[i] -= (UInt16)step;
+                }
+            }
+        }
+
+        private void setTargetInternal(int servo, ushort value)
+        {
+            if (value != 0)
+            {
+                ChannelSetting setting = channelSettings[servo];
+                if (value < setting.minimum) value = setting.minimum;
+                if (value > setting.maximum) value = setting.maximum;
+            }
+
+            target[servo] = value;
+
+            // A channel that is off has no position to move from, so it
+            // goes straight to the target.  Turning a channel off stops it.
+            if (position[servo] == 0 || value == 0)
+            {
+                position[servo] = value;
+                velocity[servo] = 0;
+            }
+        }
+
+        private void error(uscError e)
+        {
+            privateErrors |= (UInt16)(1 << (byte)e);
+            privateScriptDone = true;
+        }
+
+        private bool require(int count)
+        {
+            if (stackPointer < count)
+            {
+                error(uscError.ERROR_SCRIPT_STACK);
+                return false;
+            }
+            return true;
+        }
+
+        private void push(int value)
+        {
+            if (stackPointer >= stackSize)
+            {
+                error(uscError.ERROR_SCRIPT_STACK);
+                return;
+            }
+            stack[stackPointer++] = (short)value;
+        }
+
+        private short pop()
+        {
+            return stack[--stackPointer];
+        }
+
+        private byte fetch()
+        {
+            if (programCounter >= program.Length)
+            {
+                error(uscError.ERROR_SCRIPT_PROGRAM_COUNTER);
+                return (byte)Opcode.QUIT;
+            }
+            return program[programCounter++];
+        }
+
+        private ushort fetch16()
+        {
+            byte low = fetch();
+            return (ushort)(low | (fetch() << 8));
+        }
+
+        private void jump(ushort address)
+        {
+            if (address >= program.Length)
+            {
+                error(uscError.ERROR_SCRIPT_PROGRAM_COUNTER);
+                return;
+            }
+            programCounter = address;
+        }
+
+        private void call(ushort address)
+        {
+            if (callStackPointer >= callStackSize)
+            {
+                error(uscError.ERROR_SCRIPT_CALL_STACK);
+                return;
+            }
+            callStack[callStackPointer++] = programCounter;
+            jump(address);
+        }
+
+        /// <summary>
+        /// Executes the instruction at the program counter.  Stack errors
+        /// leave the stack as it was and stop the script, like on the Maestro.
+        /// </summary>
+        private void execute()
+        {
+            privateInstructionCount++;
+
+            ushort start = programCounter;
+            byte opcode = fetch();
+            if (privateScriptDone)
+            {
+                return;
+            }
+
+            if (opcode >= 128)
+            {
+                call(subroutineTable[opcode - 128]);
+                return;
+            }
+
+            int a, b, c;
+
+            switch ((Opcode)opcode)
+            {
+                case Opcode.QUIT:
+                    programCounter = start;
+                    privateScriptDone = true;
+                    break;
+
+                case Opcode.LITERAL:
+                    push((short)fetch16());
+                    break;
+
+                case Opcode.LITERAL8:
+                    push(fetch());
+                    break;
+
+                case Opcode.LITERAL_N:
+                    a = fetch() / 2;
+                    while (a-- > 0 && !privateScriptDone)
+                    {
+                        push((short)fetch16());
+                    }
+                    break;
+
+                case Opcode.LITERAL8_N:
+                    a = fetch();
+                    while (a-- > 0 && !privateScriptDone)
+                    {
+                        push(fetch());
+                    }
+                    break;
+
+                case Opcode.RETURN:
+                    if (callStackPointer == 0)
+                    {
+                        error(uscError.ERROR_SCRIPT_CALL_STACK);
+                        break;
+                    }
+                    jump(callStack[--callStackPointer]);
+                    break;
+
+                case Opcode.JUMP:
+                    jump(fetch16());
+                    break;
+
+                case Opcode.JUMP_Z:
+                    a = fetch16();
+                    if (!require(1)) break;
+                    if (pop() == 0)
+                    {
+                        jump((ushort)a);
+                    }
+                    break;
+
+                case Opcode.CALL:
+                    call(fetch16());
+                    break;
+
+                case Opcode.DELAY:
+                    if (!require(1)) break;
+                    delayEndTime = privateTime + (UInt64)(ushort)pop() * 1000;
+                    break;
+
+                case Opcode.GET_MS:
+                    push((int)(privateTime / 1000));
+                    break;
+
+                case Opcode.DEPTH:
+                    push(stackPointer);
+                    break;
+
+                case Opcode.DROP:
+                    if (!require(1)) break;
+                    stackPointer--;
+                    break;
+
+                case Opcode.DUP:
+                    if (!require(1)) break;
+                    push(stack[stackPointer - 1]);
+                    break;
+
+                case Opcode.OVER:
+                    if (!require(2)) break;
+                    push(stack[stackPointer - 2]);
+                    break;
+
+                case Opcode.PICK:
+                    if (!require(1)) break;
+                    a = stack[stackPointer - 1];
+                    if (a < 0 || !require(a + 2)) { error(uscError.ERROR_SCRIPT_STACK); break; }
+                    stack[stackPointer - 1] = stack[stackPointer - 2 - a];
+                    break;
+
+                case Opcode.SWAP:
+                    if (!require(2)) break;
+                    a = stack[stackPointer - 1];
+                    stack[stackPointer - 1] = stack[stackPointer - 2];
+                    stack[stackPointer - 2] = (short)a;
+                    break;
+
+                case Opcode.ROT:
+                    if (!require(3)) break;
+                    a = stack[stackPointer - 3];
+                    stack[stackPointer - 3] = stack[stackPointer - 2];
+                    stack[stackPointer - 2] = stack[stackPointer - 1];
+                    stack[stackPointer - 1] = (short)a;
+                    break;
+
+                case Opcode.ROLL:
+                    if (!require(1)) break;
+                    a = stack[stackPointer - 1];
+                    if (a < 0 || !require(a + 2)) { error(uscError.ERROR_SCRIPT_STACK); break; }
+                    stackPointer--;
+                    b = stackPointer - 1 - a;
+                    c = stack[b];
+                    Array.Copy(stack, b + 1, stack, b, a);
+                    stack[stackPointer - 1] = (short)c;
+                    break;
+
+                case Opcode.PEEK:
+                    if (!require(1)) break;
+                    a = stack[stackPointer - 1];
+                    if (a < 0 || a >= stackPointer - 1) { error(uscError.ERROR_SCRIPT_STACK); break; }
+                    stack[stackPointer - 1] = stack[a];
+                    break;
+
+                case Opcode.POKE:
+                    if (!require(2)) break;
+                    a = stack[stackPointer - 1];
+                    if (a < 0 || a >= stackPointer - 2) { error(uscError.ERROR_SCRIPT_STACK); break; }
+                    stack[a] = stack[stackPointer - 2];
+                    stackPointer -= 2;
+                    break;
+
+                case Opcode.BITWISE_NOT: unary(~top()); break;
+                case Opcode.LOGICAL_NOT: unary(top() == 0 ? 1 : 0); break;
+                case Opcode.NEGATE: unary(-top()); break;
+                case Opcode.POSITIVE: unary(top() > 0 ? 1 : 0); break;
+                case Opcode.NEGATIVE: unary(top() < 0 ? 1 : 0); break;
+                case Opcode.NONZERO: unary(top() != 0 ? 1 : 0); break;
+
+                case Opcode.BITWISE_AND:
+                case Opcode.BITWISE_OR:
+                case Opcode.BITWISE_XOR:
+                case Opcode.SHIFT_RIGHT:
+                case Opcode.SHIFT_LEFT:
+                case Opcode.LOGICAL_AND:
+                case Opcode.LOGICAL_OR:
+                case Opcode.PLUS:
+                case Opcode.MINUS:
+                case Opcode.TIMES:
+                case Opcode.DIVIDE:
+                case Opcode.MOD:
+                case Opcode.EQUALS:
+                case Opcode.NOT_EQUALS:
+                case Opcode.MIN:
+                case Opcode.MAX:
+                case Opcode.LESS_THAN:
+                case Opcode.GREATER_THAN:
+                    if (!require(2)) break;
+                    b = pop();
+                    a = pop();
+                    push(binary((Opcode)opcode, a, b));
+                    break;
+
+                case Opcode.SERVO:
+                    if (!require(2)) break;
+                    a = pop();
+                    b = pop();
+                    if (a >= 0 && a < servoCount) setTargetInternal(a, (ushort)b);
+                    break;
+
+                case Opcode.SERVO_8BIT:
+                    if (!require(2)) break;
+                    a = pop();
+                    b = pop() & 0xFF;
+                    if (a >= 0 && a < servoCount)
+                    {
+                        ChannelSetting setting = channelSettings[a];
+                        setTargetInternal(a, (ushort)(setting.neutral + (b - 127) * setting.range / 127));
+                    }
+                    break;
+
+                case Opcode.SPEED:
+                    if (!require(2)) break;
+                    a = pop();
+                    b = pop();
+                    if (a >= 0 && a < servoCount) speed[a] = (ushort)b;
+                    break;
+
+                case Opcode.ACCELERATION:
+                    if (!require(2)) break;
+                    a = pop();
+                    b = pop();
+                    if (a >= 0 && a < servoCount) acceleration[a] = (byte)b;
+                    break;
+
+                case Opcode.GET_POSITION:
+                    if (!require(1)) break;
+                    a = stack[stackPointer - 1];
+                    stack[stackPointer - 1] = (short)((a >= 0 && a < servoCount) ? position[a] : 0);
+                    break;
+
+                case Opcode.GET_MOVING_STATE:
+                    push(moving ? 1 : 0);
+                    break;
+
+                case Opcode.LED_ON:
+                    privateLedOn = true;
+                    break;
+
+                case Opcode.LED_OFF:
+                    privateLedOn = false;
+                    break;
+
+                case Opcode.PWM:
+                    if (!require(2)) break;
+                    privatePwmPeriod = (ushort)pop();
+                    privatePwmOnTime = (ushort)pop();
+                    break;
+
+                case Opcode.SERIAL_SEND_BYTE:
+                    if (!require(1)) break;
+                    serialOutput.Add((byte)pop());
+                    break;
+
+                default:
+                    // Not a valid instruction.
+                    programCounter = start;
+                    error(uscError.ERROR_SCRIPT_PROGRAM_COUNTER);
+                    break;
+            }
+        }
+
+        private int top()
+        {
+            return stackPointer == 0 ? 0 : stack[stackPointer - 1];
+        }
+
+        private void unary(int result)
+        {
+            if (require(1))
+            {
+                stack[stackPointer - 1] = (short)result;
+            }
+        }
+
+        private static int binary(Opcode opcode, int a, int b)
+        {
+            switch (opcode)
+            {
+                case Opcode.BITWISE_AND: return a & b;
+                case Opcode.BITWISE_OR: return a | b;
+                case Opcode.BITWISE_XOR: return a ^ b;
+                case Opcode.SHIFT_RIGHT: return (b < 0 || b > 15) ? (a < 0 ? -1 : 0) : a >> b;
+                case Opcode.SHIFT_LEFT: return (b < 0 || b > 15) ? 0 : a << b;
+                case Opcode.LOGICAL_AND: return (a != 0 && b != 0) ? 1 : 0;
+                case Opcode.LOGICAL_OR: return (a != 0 || b != 0) ? 1 : 0;
+                case Opcode.PLUS: return a + b;
+                case Opcode.MINUS: return a - b;
+                case Opcode.TIMES: return a * b;
+                case Opcode.DIVIDE: return b == 0 ? 0 : a / b;
+                case Opcode.MOD: return b == 0 ? 0 : a % b;
+                case Opcode.EQUALS: return a == b ? 1 : 0;
+                case Opcode.NOT_EQUALS: return a != b ? 1 : 0;
+                case Opcode.MIN: return Math.Min(a, b);
+                case Opcode.MAX: return Math.Max(a, b);
+                case Opcode.LESS_THAN: return a < b ? 1 : 0;
+                case Opcode.GREATER_THAN: return a > b ? 1 : 0;
+                default: return 0;
+            }
+        }
+    }
+}
@@ -0,0 +1,286 @@
+﻿using System;
+using System.Collections.Generic;
+using System.Diagnostics;
+using System.Reflection;
+using System.Runtime.CompilerServices;
+using System.Threading;
+using Pololu.UsbWrapper;
+
+namespace Pololu.Usc
+{
+    /// <summary>
+    /// The outcome of ScriptTrigger.fire.  Times are in microseconds,
+    /// measured from the moment the Maestros were released.
+    /// </summary>
+    public class ScriptTriggerResult
+    {
+        /// <summary>
+        /// When each Maestro's transfer started, in the order the Maestros
+        /// were given to the trigger.
+        /// </summary>
+        public double[] startTimes;
+
+        /// <summary>
+        /// When each Maestro's transfer finished.
+        /// </summary>
+        public double[] completionTimes;
+
+        /// <summary>
+        /// The UsbStatus code of each Maestro's transfer: 0 if it succeeded,
+        /// or a negative error code.
+        /// </summary>
+        public int[] statuses;
+
+        /// <summary>
+        /// The number of transfers that failed.
+        /// </summary>
+        public int failures;
+
+        /// <summary>
+        /// The time between the first and the last transfer that started.
+        /// </summary>
+        public double startSkew;
+
+        /// <summary>
+        /// The time between the first and the last successful transfer that
+        /// finished.  The scripts started within about this much time of
+        /// each other (plus the time it takes each Maestro to act on the
+        /// request, which is the same for all of them).
+        /// </summary>
+        public double skew;
+
+        /// <summary>
+        /// The time until the last transfer finished.
+        /// </summary>
+        public double duration;
+    }
+
+    /// <summary>
+    /// Restarts the scripts of several Maestros at a subroutine as close
+    /// to the same time as possible, for choreographies that span more
+    /// than one Maestro.
+    /// </summary>
+    /// <remarks>
+    /// <para>
+    /// Calling restartScriptAtSubroutine on each Maestro in turn starts the
+    /// last one a transfer time (a millisecond or more) after the one
+    /// before it, which adds up to tens of milliseconds over a dozen
+    /// Maestros.  The trigger instead gives each Maestro a thread of its
+    /// own, which waits with the request already built.  fire releases all
+    /// of the threads with one event, so the transfers are handed to the
+    /// USB host controller together and finish in the same or adjacent
+    /// USB frames.  The Maestros on one bus still share it, so spreading
+    /// them over several buses gives the lowest skew.
+    /// </para>
+    /// <para>
+    /// Use it in two steps: prepare, which builds the requests and gets the
+    /// threads ready, and fire, which sends them and reports when each one
+    /// finished.  The Maestros must stay connected until the trigger is
+    /// disposed, and nothing else should use them during fire.  A trigger
+    /// can be prepared and fired any number of times.
+    /// </para>
+    /// </remarks>
+    public class ScriptTrigger : IDisposable
+    {
+        class Worker
+        {
+            public Usc usc;
+            public Thread thread;
+
+            // Set by prepare, read by the worker's thread.
+            public byte request;
+            public ushort value;
+            public ushort index;
+
+            // Set by the worker's thread, read by fire.
+            public long start;
+            public long end;
+            public int status;
+        }
+
+        readonly Worker[] workers;
+
+        // Round n releases the workers with go[n % 2]; the other event is
+        // reset first, so a worker that finished round n waits for round
+        // n + 1 instead of running again.
+        readonly ManualResetEvent[] go = new ManualResetEvent[] { new ManualResetEvent(false), new ManualResetEvent(false) };
+        readonly ManualResetEvent done = new ManualResetEvent(false);
+        int round;
+        int remaining;
+        bool prepared;
+        volatile bool running = true;
+
+        /// <param name="maestros">The Maestros to trigger, which must already be connected.</param>
+        public ScriptTrigger(IList<Usc> maestros)
+        {
+            if (maestros == null || maestros.Count == 0)
+            {
+                throw new ArgumentException("There must be at least one Maestro.", "maestros");
+            }
+
+            // Compile the transfer code now so that the first fire does not
+            // wait for the JIT compiler.
+            MethodInfo send = typeof(Usc).GetMethod("sendRequest", BindingFlags.Instance | BindingFlags.NonPublic);
+            RuntimeHelpers.PrepareMethod(send.MethodHandle);
+
+            workers = new Worker[maestros.Count];
+            for (int i = 0; i < workers.Length; i++)
+            {
+                Worker worker = new Worker();
+                worker.usc = maestros[i];
+                worker.thread = new Thread(delegate() { run(worker); });
+                worker.thread.Name = "Script trigger " + worker.usc.getSerialNumber();
+                worker.thread.IsBackground = true;
+                worker.thread.Priority = ThreadPriority.AboveNormal;
+                workers[i] = worker;
+            }
+            foreach (Worker worker in workers)
+            {
+                worker.thread.Start();
+            }
+        }
+
+        /// <summary>
+        /// The number of Maestros.
+        /// </summary>
+        public int count
+        {
+            get { return workers.Length; }
+        }
+
+        /// <summary>
+        /// Makes the next fire restart the scripts at the given subroutine
+        /// (see Usc.restartScriptAtSubroutine).
+        /// </summary>
+        public void prepare(byte subroutine)
+        {
+            prepare((byte)uscRequest.REQUEST_RESTART_SCRIPT_AT_SUBROUTINE, 0, subroutine);
+        }
+
+        /// <summary>
+        /// Makes the next fire restart the scripts at the given subroutine,
+        /// with a parameter on the stack (see
+        /// Usc.restartScriptAtSubroutineWithParameter).
+        /// </summary>
+        public void prepare(byte subroutine, short parameter)
+        {
+            prepare((byte)uscRequest.REQUEST_RESTART_SCRIPT_AT_SUBROUTINE_WITH_PARAMETER, (ushort)parameter, subroutine);
+        }
+
+        void prepare(byte request, ushort value, ushort index)
+        {
+            if (!running)
+            {
+                throw new ObjectDisposedException("ScriptTrigger");
+            }
+            foreach (Worker worker in workers)
+            {
+                worker.request = request;
+                worker.value = value;
+                worker.index = index;
+            }
+            go[(round + 1) % 2].Reset();
+            prepared = true;
+        }
+
+        /// <summary>
+        /// Sends the prepared request to all the Maestros at once and waits
+        /// for all of the transfers to finish.  A Maestro whose transfer
+        /// fails does not stop the others; check ScriptTriggerResult.failures.
+        /// </summary>
+        public ScriptTriggerResult fire()
+        {
+            if (!running)
+            {
+                throw new ObjectDisposedException("ScriptTrigger");
+            }
+            if (!prepared)
+            {
+                throw new InvalidOperationException("The trigger must be prepared before it is fired.");
+            }
+            prepared = false;
+
+            done.Reset();
+            Thread.VolatileWrite(ref remaining, workers.Length);
+            long release = Stopwatch.GetTimestamp();
+            go[round % 2].Set();
+            done.WaitOne();
+            round++;
+
+            ScriptTriggerResult result = new ScriptTriggerResult();
+            result.startTimes = new double[workers.Length];
+            result.completionTimes = new double[workers.Length];
+            result.statuses = new int[workers.Length];
+            double firstStart = Double.MaxValue, lastStart = Double.MinValue;
+            double firstEnd = Double.MaxValue, lastEnd = Double.MinValue;
+            for (int i = 0; i < workers.Length; i++)
+            {
+                Worker worker = workers[i];
+                double start = toMicroseconds(worker.start - release);
+                double end = toMicroseconds(worker.end - release);
+                result.startTimes[i] = start;
+                result.completionTimes[i] = end;
+                result.statuses[i] = worker.status;
+                result.duration = Math.Max(result.duration, end);
+                firstStart = Math.Min(firstStart, start);
+                lastStart = Math.Max(lastStart, start);
+                if (worker.status < 0)
+                {
+                    result.failures++;
+                    continue;
+                }
+                firstEnd = Math.Min(firstEnd, end);
+                lastEnd = Math.Max(lastEnd, end);
+            }
+            result.startSkew = lastStart - firstStart;
+            result.skew = result.failures < workers.Length ? lastEnd - firstEnd : 0;
+            return result;
+        }
+
+        /// <summary>
+        /// Stops the threads.  The Maestros stay connected.
+        /// </summary>
+        public void Dispose()
+        {
+            if (!running)
+            {
+                return;
+            }
+            running = false;
+            go[0].Set();
+            go[1].Set();
+            foreach (Worker worker in workers)
+            {
+                worker.thread.Join();
+            }
+        }
+
+        static double toMicroseconds(long ticks)
+        {
+            return ticks * 1000000.0 / Stopwatch.Frequency;
+        }
+
+        void run(Worker worker)
+        {
+            int n = 0;
+            while (true)
+            {
+                go[n % 2].WaitOne();
+                if (!running)
+                {
+                    break;
+                }
+
+                worker.start = Stopwatch.GetTimestamp();
+                worker.status = worker.usc.sendRequest(worker.request, worker.value, worker.index);
+                worker.end = Stopwatch.GetTimestamp();
+                n++;
+
+                if (Interlocked.Decrement(ref remaining) == 0)
+                {
+                    done.Set();
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,543 @@
+﻿using System;
+using System.Diagnostics;
+using System.Threading;
+using Pololu.UsbWrapper;
+
+namespace Pololu.Usc
+{
+    /// <summary>
+    /// Sends targets to a Maestro just before the start of each servo frame,
+    /// so that they take effect at the next frame instead of sometimes
+    /// missing it.
+    /// </summary>
+    /// <remarks>
+    /// <para>
+    /// The Maestro applies new targets once per frame (servo period).  A
+    /// target that arrives just after the start of a frame waits for the
+    /// next one, so targets sent at arbitrary times are delayed by anything
+    /// from nothing to a whole frame (20 ms with the default settings).
+    /// The scheduler collects the targets given to setTarget (only the
+    /// newest target for each channel is kept) and sends them in one batch
+    /// shortly before the next frame starts.
+    /// </para>
+    /// <para>
+    /// The Maestro does not say when its frames start, so the scheduler
+    /// works it out: it reads the servo positions right after sending a
+    /// batch and again until the frame has started, and when a position
+    /// changes between two reads, a frame started between the first read
+    /// and the end of the second.  Intersecting these intervals, modulo the
+    /// frame period, narrows down the phase of the frames to within a small
+    /// fraction of a millisecond.  The positions only change when a servo
+    /// is moving, so until a target is set, the phase is unknown and
+    /// targets are sent right away.  The uncertainty grows slowly between
+    /// observations to allow for the difference between the computer's
+    /// clock and the Maestro's.
+    /// </para>
+    /// <para>
+    /// The batch is released early enough to be sent before the earliest
+    /// time the frame could start, based on how long setting a target takes.
+    /// A batch that might have finished after the start of its frame is
+    /// counted in missedFrames.  averagePhaseError and maxPhaseError show
+    /// how well the frame times were predicted.
+    /// </para>
+    /// <para>
+    /// The frame period must be right for this to work; by default it is
+    /// read from the device (see Usc.getPeriodInMicroseconds).  While the
+    /// scheduler is running, it reads the device's variables several times
+    /// per frame.
+    /// </para>
+    /// </remarks>
+    public class ServoFrameScheduler : IDisposable
+    {
+        /// <summary>
+        /// How much the computer's clock and the Maestro's may differ, as a
+        /// fraction.  The phase uncertainty grows by this much of the time
+        /// since the last observation.
+        /// </summary>
+        const double clockTolerance = 0.0005;
+
+        readonly Usc usc;
+        readonly double privateFramePeriod;
+        readonly long origin = Stopwatch.GetTimestamp();
+
+        readonly object sync = new object();
+
+        // Protected by sync.
+        readonly ushort[] pendingTargets;
+        readonly bool[] pending;
+        int pendingCount;
+        double privateGuardTime = 500;
+        bool privatePhaseLocked;
+        double phase;
+        double phaseHalfWidth;
+        long privateFrames;
+        long privateMissedFrames;
+        long privateObservations;
+        long privateFailures;
+        double totalPhaseError;
+        double privateMaxPhaseError;
+
+        // Only used by the scheduling thread.
+        readonly ushort[] batchServos;
+        readonly ushort[] batchTargets;
+        ServoStatus[] servos;
+        ServoStatus[] previousServos;
+        double previousReadStart = Double.NaN;
+        double lastObservation;
+        double transferTime = 1000;
+        double readTime = 1000;
+        double sleepTime = 2000;
+
+        Thread thread;
+        volatile bool running;
+
+        /// <summary>
+        /// Creates a scheduler, reading the frame period from the device.
+        /// </summary>
+        public ServoFrameScheduler(Usc usc)
+            : this(usc, (double)usc.getPeriodInMicroseconds())
+        {
+        }
+
+        /// <param name="usc">The Maestro to send the targets to.</param>
+        /// <param name="framePeriod">The time between frames, in microseconds (see UscSettings.periodInMicroseconds).</param>
+        public ServoFrameScheduler(Usc usc, double framePeriod)
+        {
+            if (!(framePeriod >= 1000))
+            {
+                throw new ArgumentOutOfRangeException("framePeriod", "The frame period must be at least 1000 microseconds.");
+            }
+
+            this.usc = usc;
+            privateFramePeriod = framePeriod;
+            pendingTargets = new ushort[usc.servoCount];
+            pending = new bool[usc.servoCount];
+            batchServos = new ushort[usc.servoCount];
+            batchTargets = new ushort[usc.servoCount];
+            servos = new ServoStatus[usc.servoCount];
+            previousServos = new ServoStatus[usc.servoCount];
+        }
+
+        /// <summary>
+        /// The time between frames, in microseconds.
+        /// </summary>
+        public double framePeriod
+        {
+            get { return privateFramePeriod; }
+        }
+
+        /// <summary>
+        /// How long before the earliest possible start of a frame the batch
+        /// should be finished, in microseconds, to allow for the thread
+        /// being late.  The default is 500.
+        /// </summary>
+        public double guardTime
+        {
+            get { lock (sync) { return privateGuardTime; } }
+            set
+            {
+                if (!(value >= 0))
+                {
+                    throw new ArgumentOutOfRangeException("value", "The guard time must not be negative.");
+                }
+                lock (sync) { privateGuardTime = value; }
+            }
+        }
+
+        /// <summary>
+        /// Sets the target of a channel at the next frame.  If the channel
+        /// already has a target waiting to be sent, it is replaced.
+        /// </summary>
+        /// <param name="servo">The channel number.</param>
+        /// <param name="target">The target, in units of quarter-microseconds.</param>
+        public void setTarget(byte servo, ushort target)
+        {
+            if (servo >= pending.Length)
+            {
+                throw new ArgumentOutOfRangeException("servo", "The channel number must be less than " + pending.Length + ".");
+            }
+
+            lock (sync)
+            {
+                if (!pending[servo])
+                {
+                    pending[servo] = true;
+                    pendingCount++;
+                }
+                pendingTargets[servo] = target;
+            }
+        }
+
+        /// <summary>
+        /// Starts the scheduling thread.
+        /// </summary>
+        public void start()
+        {
+            if (thread != null)
+            {
+                return;
+            }
+            running = true;
+            thread = new Thread(run);
+            thread.IsBackground = true;
+            thread.Priority = ThreadPriority.Highest;
+            thread.Start();
+        }
+
+        /// <summary>
+        /// Stops the scheduling thread.  Targets that were not sent yet
+        /// stay pending until it is started again.
+        /// </summary>
+        public void stop()
+        {
+            if (thread == null)
+            {
+                return;
+            }
+            running = false;
+            thread.Join();
+            thread = null;
+        }
+
+        public void Dispose()
+        {
+            stop();
+        }
+
+        /// <summary>
+        /// True once the phase of the frames has been observed.
+        /// </summary>
+        public bool phaseLocked
+        {
+            get { lock (sync) { return privatePhaseLocked; } }
+        }
+
+        /// <summary>
+        /// How far the real start of each frame may be from the estimate, in
+        /// microseconds.
+        /// </summary>
+        public double phaseUncertainty
+        {
+            get { lock (sync) { return getUncertainty(now()); } }
+        }
+
+        /// <summary>
+        /// The number of batches of targets sent.
+        /// </summary>
+        public long frames
+        {
+            get { lock (sync) { return privateFrames; } }
+        }
+
+        /// <summary>
+        /// The number of batches that might have been sent after the start of
+        /// the frame they were meant for.
+        /// </summary>
+        public long missedFrames
+        {
+            get { lock (sync) { return privateMissedFrames; } }
+        }
+
+        /// <summary>
+        /// The number of times a position change showed when a frame started.
+        /// </summary>
+        public long observations
+        {
+            get { lock (sync) { return privateObservations; } }
+        }
+
+        /// <summary>
+        /// The number of transfers that failed.
+        /// </summary>
+        public long failures
+        {
+            get { lock (sync) { return privateFailures; } }
+        }
+
+        /// <summary>
+        /// The average distance between the predicted start of a frame and
+        /// the interval in which it was observed to start, in microseconds.
+        /// 0 means every observation agreed with the prediction.
+        /// </summary>
+        public double averagePhaseError
+        {
+            get
+            {
+                lock (sync)
+                {
+                    return privateObservations <= 1 ? 0 : totalPhaseError / (privateObservations - 1);
+                }
+            }
+        }
+
+        /// <summary>
+        /// The largest distance between the predicted start of a frame and
+        /// the interval in which it was observed to start, in microseconds.
+        /// </summary>
+        public double maxPhaseError
+        {
+            get { lock (sync) { return privateMaxPhaseError; } }
+        }
+
+        /// <summary>
+        /// Sets frames, missedFrames, failures and the phase errors to zero.
+        /// The phase estimate is kept.
+        /// </summary>
+        public void resetStatistics()
+        {
+            lock (sync)
+            {
+                privateFrames = 0;
+                privateMissedFrames = 0;
+                privateFailures = 0;
+                privateObservations = privatePhaseLocked ? 1 : 0;
+                totalPhaseError = 0;
+                privateMaxPhaseError = 0;
+            }
+        }
+
+        /// <summary>
+        /// The time since the scheduler was created, in microseconds.
+        /// </summary>
+        double now()
+        {
+            return (Stopwatch.GetTimestamp() - origin) * 1e6 / Stopwatch.Frequency;
+        }
+
+        /// <summary>
+        /// The phase uncertainty at the given time, including the drift
+        /// allowed for since the last observation.  Must be called with sync
+        /// locked.
+        /// </summary>
+        double getUncertainty(double time)
+        {
+            return phaseHalfWidth + clockTolerance * Math.Max(0, time - lastObservation);
+        }
+
+        /// <summary>
+        /// Returns x plus or minus a whole number of frame periods, so that
+        /// it is between -framePeriod/2 and framePeriod/2.
+        /// </summary>
+        double wrap(double x)
+        {
+            return x - privateFramePeriod * Math.Floor(x / privateFramePeriod + 0.5);
+        }
+
+        void run()
+        {
+            while (running)
+            {
+                double boundary, earliest, lead;
+                bool locked;
+                int count;
+                double uncertainty;
+                lock (sync)
+                {
+                    double time = now();
+                    uncertainty = getUncertainty(time);
+                    if (uncertainty > privateFramePeriod / 4)
+                    {
+                        // Nothing has moved for so long that the phase could
+                        // have drifted too far to be useful.
+                        privatePhaseLocked = false;
+                    }
+                    locked = privatePhaseLocked;
+                    count = pendingCount;
+                    lead = uncertainty + privateGuardTime + Math.Max(count, 1) * transferTime;
+
+                    // The first frame start that leaves time to send the
+                    // batch.
+                    boundary = phase + privateFramePeriod * Math.Ceiling((time + lead - phase) / privateFramePeriod);
+                    earliest = boundary - uncertainty;
+                }
+
+                if (!locked)
+                {
+                    // Send right away and watch the positions until a frame
+                    // start is seen.
+                    sendBatch(Double.PositiveInfinity);
+                    readPositions();
+                    Thread.Sleep(count == 0 ? 1 : 0);
+                    continue;
+                }
+
+                waitUntil(boundary - lead);
+                if (!running)
+                {
+                    break;
+                }
+                sendBatch(earliest);
+
+                // Read the positions until the frame has surely started, so
+                // that a servo that moves shows when it started.
+                double end = boundary + uncertainty + readTime;
+                do
+                {
+                    readPositions();
+                }
+                while (running && now() < end);
+            }
+            previousReadStart = Double.NaN;
+        }
+
+        /// <summary>
+        /// Waits until the given time, sleeping while it is far away and
+        /// then yielding so other threads can still run on a computer with
+        /// one processor.
+        /// </summary>
+        void waitUntil(double time)
+        {
+            double t = now();
+            while (time - t > sleepTime && running)
+            {
+                Thread.Sleep(1);
+                double after = now();
+                sleepTime = Math.Max(sleepTime, after - t);
+                t = after;
+            }
+            while (t < time && running)
+            {
+                Thread.Sleep(0);
+                t = now();
+            }
+        }
+
+        /// <summary>
+        /// Sends the pending targets.
+        /// </summary>
+        /// <param name="deadline">The earliest time the frame could start, or infinity if it is not known.</param>
+        void sendBatch(double deadline)
+        {
+            int count = 0;
+            lock (sync)
+            {
+                for (int i = 0; i < pending.Length; i++)
+                {
+                    if (pending[i])
+                    {
+                        batchServos[count] = (ushort)i;
+                        batchTargets[count] = pendingTargets[i];
+                        pending[i] = false;
+                        count++;
+                    }
+                }
+                pendingCount = 0;
+            }
+            if (count == 0)
+            {
+                return;
+            }
+
+            long failed = 0;
+            double start = now();
+            for (int i = 0; i < count; i++)
+            {
+                if (usc.sendTarget((byte)batchServos[i], batchTargets[i]) < 0)
+                {
+                    failed++;
+                }
+            }
+            double end = now();
+
+            // Remember a little more than the longest recent transfer time,
+            // slowly forgetting old ones.
+            transferTime = Math.Max(transferTime * 0.99, (end - start) / count * 1.25);
+
+            lock (sync)
+            {
+                privateFrames++;
+                privateFailures += failed;
+                if (end > deadline)
+                {
+                    privateMissedFrames++;
+                }
+            }
+        }
+
+        /// <summary>
+        /// Reads the servo positions, and if any changed since the last read,
+        /// records that a frame started between the two.
+        /// </summary>
+        void readPositions()
+        {
+            MaestroVariables variables;
+            double start = now();
+            int status = usc.tryGetVariables(out variables, servos);
+            double end = now();
+            readTime = Math.Max(readTime * 0.99, end - start);
+
+            if (status < 0)
+            {
+                lock (sync) { privateFailures++; }
+                previousReadStart = Double.NaN;
+                return;
+            }
+
+            if (!Double.IsNaN(previousReadStart))
+            {
+                for (int i = 0; i < servos.Length; i++)
+                {
+                    if (servos[i].position != previousServos[i].position)
+                    {
+                        observe(previousReadStart, end);
+                        break;
+                    }
+                }
+            }
+
+            ServoStatus[] swap = previousServos;
+            previousServos = servos;
+            servos = swap;
+            previousReadStart = start;
+        }
+
+        /// <summary>
+        /// Narrows down the phase given that a frame started between two
+        /// times.
+        /// </summary>
+        void observe(double from, double to)
+        {
+            double width = to - from;
+            if (width > privateFramePeriod / 2)
+            {
+                // The reads were too far apart to tell which frame it was.
+                return;
+            }
+
+            lock (sync)
+            {
+                privateObservations++;
+                if (privatePhaseLocked)
+                {
+                    phaseHalfWidth = getUncertainty(to);
+
+                    // Work relative to the predicted frame start nearest to
+                    // the interval.
+                    double low = wrap(from - phase);
+                    double high = low + width;
+                    double error = low > 0 ? low : (high < 0 ? -high : 0);
+                    totalPhaseError += error;
+                    privateMaxPhaseError = Math.Max(privateMaxPhaseError, error);
+
+                    double newLow = Math.Max(low, -phaseHalfWidth);
+                    double newHigh = Math.Min(high, phaseHalfWidth);
+                    if (newLow <= newHigh)
+                    {
+                        phase = wrap(phase + (newLow + newHigh) / 2);
+                        phaseHalfWidth = (newHigh - newLow) / 2;
+                        lastObservation = to;
+                        return;
+                    }
+
+                    // The observation does not fit the estimate, so the
+                    // estimate was wrong; start again from the observation.
+                }
+
+                phase = wrap(from + width / 2);
+                phaseHalfWidth = width / 2;
+                lastObservation = to;
+                privatePhaseLocked = true;
+            }
+        }
+    }
+}
@@ -0,0 +1,241 @@
+﻿using System;
+
+namespace Pololu.Usc
+{
+    /// <summary>
+    /// A block of servo status samples from a Maestro, stored as one array
+    /// per variable per channel (columns) instead of an array of ServoStatus
+    /// structs per sample.  This is the layout to use when analyzing a large
+    /// number of samples: looking at the positions of one channel only reads
+    /// that channel's position array.
+    /// </summary>
+    /// <remarks>
+    /// Only the first count elements of each array are valid.  The arrays
+    /// are replaced with bigger ones when the capacity runs out, so do not
+    /// hold on to them across calls to add or decode.
+    /// </remarks>
+    public class ServoTelemetry
+    {
+        /// <summary>
+        /// The positions in quarter-microseconds, indexed by channel and then sample.
+        /// </summary>
+        public UInt16[][] position;
+
+        /// <summary>
+        /// The targets in quarter-microseconds, indexed by channel and then sample.
+        /// </summary>
+        public UInt16[][] target;
+
+        /// <summary>
+        /// The speed limits, indexed by channel and then sample.
+        /// </summary>
+        public UInt16[][] speed;
+
+        /// <summary>
+        /// The acceleration limits, indexed by channel and then sample.
+        /// </summary>
+        public Byte[][] acceleration;
+
+        public readonly byte servoCount;
+
+        int privateCount;
+        int privateCapacity;
+
+        const int decodeChunkSize = 256;
+
+        /// <summary>
+        /// The number of samples stored.
+        /// </summary>
+        public int count
+        {
+            get { return privateCount; }
+        }
+
+        /// <summary>
+        /// The number of samples that can be stored before the arrays have
+        /// to be replaced.
+        /// </summary>
+        public int capacity
+        {
+            get { return privateCapacity; }
+        }
+
+        /// <summary>
+        /// The size of the servo statuses of one sample: the response to
+        /// REQUEST_GET_SERVO_SETTINGS on a Mini Maestro.
+        /// </summary>
+        public unsafe int rawSampleSize
+        {
+            get { return servoCount * sizeof(ServoStatus); }
+        }
+
+        public ServoTelemetry(byte servoCount, int capacity)
+        {
+            this.servoCount = servoCount;
+            position = new UInt16[servoCount][];
+            target = new UInt16[servoCount][];
+            speed = new UInt16[servoCount][];
+            acceleration = new Byte[servoCount][];
+            resize(Math.Max(1, capacity));
+        }
+
+        /// <summary>
+        /// Removes all the samples, keeping the arrays.
+        /// </summary>
+        public void clear()
+        {
+            privateCount = 0;
+        }
+
+        /// <summary>
+        /// Appends one sample.
+        /// </summary>
+        /// <param name="servos">The status of each channel, as returned by Usc.getVariables.</param>
+        public void add(ServoStatus[] servos)
+        {
+            if (servos.Length < servoCount)
+            {
+                throw new ArgumentException("There must be a status for each of the " + servoCount + " channels.", "servos");
+            }
+
+            ensureCapacity(privateCount + 1);
+            int i = privateCount++;
+            for (int channel = 0; channel < servoCount; channel++)
+            {
+                position[channel][i] = servos[channel].position;
+                target[channel][i] = servos[channel].target;
+                speed[channel][i] = servos[channel].speed;
+                acceleration[channel][i] = servos[channel].acceleration;
+            }
+        }
+
+        /// <summary>
+        /// Appends samples from a buffer of raw servo statuses.
+        /// </summary>
+        /// <param name="buffer">The raw data.</param>
+        /// <param name="offset">The position of the first channel's status in the first sample.</param>
+        /// <param name="stride">
+        ///   The distance in bytes from one sample to the next.  For responses to
+        ///   REQUEST_GET_SERVO_SETTINGS stored back to back this is rawSampleSize.
+        ///   For responses to REQUEST_GET_VARIABLES from a Micro Maestro it is
+        ///   sizeof(MicroMaestroVariables) + rawSampleSize, and the offset should
+        ///   skip the first MicroMaestroVariables.
+        /// </param>
+        /// <param name="samples">The number of samples to decode.</param>
+        public unsafe void decode(byte[] buffer, int offset, int stride, int samples)
+        {
+            if (stride < rawSampleSize)
+            {
+                throw new ArgumentOutOfRangeException("stride", "The stride must be at least " + rawSampleSize + " bytes.");
+            }
+            if (samples < 0 || offset < 0 || (samples > 0 && offset + (samples - 1) * stride + rawSampleSize > buffer.Length))
+            {
+                throw new ArgumentOutOfRangeException("samples", "The buffer is not big enough to hold " + samples + " samples.");
+            }
+            if (samples == 0)
+            {
+                return;
+            }
+
+            ensureCapacity(privateCount + samples);
+            int start = privateCount;
+
+            fixed (byte* pointer = &buffer[0])
+            {
+                // Decode one channel at a time so that each loop writes to
+                // only four arrays, and a few hundred samples at a time so
+                // that the raw data for the later channels is still in the
+                // cache.
+                for (int chunk = 0; chunk < samples; chunk += decodeChunkSize)
+                {
+                    int end = start + Math.Min(samples, chunk + decodeChunkSize);
+                    for (int channel = 0; channel < servoCount; channel++)
+                    {
+                        fixed (UInt16* positionColumn = position[channel], targetColumn = target[channel], speedColumn = speed[channel])
+                        fixed (Byte* accelerationColumn = acceleration[channel])
+                        {
+                            byte* source = pointer + offset + chunk * stride + channel * sizeof(ServoStatus);
+                            for (int i = start + chunk; i < end; i++)
+                            {
+                                ServoStatus* status = (ServoStatus*)source;
+                                positionColumn[i] = status->position;
+                                targetColumn[i] = status->target;
+                                speedColumn[i] = status->speed;
+                                accelerationColumn[i] = status->acceleration;
+                                source += stride;
+                            }
+                        }
+                    }
+                }
+            }
+
+            privateCount += samples;
+        }
+
+        /// <summary>
+        /// Converts the positions of one channel to microseconds.  See
+        /// Usc.positionToMicroseconds.
+        /// </summary>
+        /// <param name="channel">The channel.</param>
+        /// <param name="microseconds">An array of at least count elements that receives the positions.</param>
+        public void getPositionMicroseconds(byte channel, double[] microseconds)
+        {
+            toMicroseconds(position[channel], privateCount, microseconds);
+        }
+
+        /// <summary>
+        /// Converts the targets of one channel to microseconds.
+        /// </summary>
+        public void getTargetMicroseconds(byte channel, double[] microseconds)
+        {
+            toMicroseconds(target[channel], privateCount, microseconds);
+        }
+
+        /// <summary>
+        /// Converts positions or targets from quarter-microseconds to
+        /// microseconds.  Quarters are exact in a double, so this gives the
+        /// same values as Usc.positionToMicroseconds without the cost of
+        /// decimal arithmetic.
+        /// </summary>
+        public static unsafe void toMicroseconds(UInt16[] positions, int count, double[] microseconds)
+        {
+            if (positions.Length < count || microseconds.Length < count)
+            {
+                throw new ArgumentException("The arrays must have at least " + count + " elements.");
+            }
+            if (count == 0)
+            {
+                return;
+            }
+
+            fixed (UInt16* source = positions)
+            fixed (double* result = microseconds)
+            {
+                for (int i = 0; i < count; i++)
+                {
+                    result[i] = source[i] * 0.25;
+                }
+            }
+        }
+
+        void ensureCapacity(int needed)
+        {
+            if (needed > privateCapacity)
+            {
+                resize(Math.Max(needed, privateCapacity * 2));
+            }
+        }
+
+        void resize(int size)
+        {
+            for (int channel = 0; channel < servoCount; channel++)
+            {
+                Array.Resize(ref position[channel], size);
+                Array.Resize(ref target[channel], size);
+                Array.Resize(ref speed[channel], size);
+                Array.Resize(ref acceleration[channel], size);
+            }
+            privateCapacity = size;
+        }
+    }
+}
@@ -4,6 +4,7 @@
 
 using System;
 using System.Collections.Generic;
+using System.IO;
 using System.Text;
 using Pololu.UsbWrapper;
 using Microsoft.Win32;
@@ -73,7 +74,7 @@ namespace Pololu.Usc
             }
         }
 
-        private static ushort exponentialSpeedToNormalSpeed(byte exponentialSpeed)
+        internal static ushort exponentialSpeedToNormalSpeed(byte exponentialSpeed)
         {
             // Maximum value of normalSpeed is 31*(1<<7)=3968
 
@@ -412,22 +413,17 @@ namespace Pololu.Usc
         public void setSubroutines(Dictionary<string, ushort> subroutineAddresses,
                                    Dictionary<string, byte> subroutineCommands)
         {
-            byte[] subroutineData = new byte[256];
-
-            ushort i;
-            for (i = 0; i < 256; i++)
-                subroutineData[i] = 0xFF; // initialize to the default flash state
+            setSubroutines(CompiledScript.buildSubroutineTable(subroutineAddresses, subroutineCommands));
+        }
 
-            foreach (KeyValuePair<string, ushort> kvp in subroutineAddresses)
+        /// <summary>
+        /// Writes a subroutine table made by CompiledScript.buildSubroutineTable.
+        /// </summary>
+        public void setSubroutines(byte[] subroutineData)
+        {
+            if (subroutineData.Length != CompiledScript.subroutineTableSize)
             {
-                string name = kvp.Key;
-                byte bytecode = subroutineCommands[name];
-
-                if (bytecode == (byte)Opcode.CALL)
-                    continue; // skip CALLs - these do not get a position in the subroutine memory
-
-                subroutineData[2 * (bytecode - 128)] = (byte)(kvp.Value % 256);
-                subroutineData[2 * (bytecode - 128) + 1] = (byte)(kvp.Value >> 8);
+                throw new ArgumentException("The subroutine table must be " + CompiledScript.subroutineTableSize + " bytes long.", "subroutineData");
             }
 
             ushort block;
@@ -538,20 +534,16 @@ namespace Pololu.Usc
         /// <remarks>If you are using a Mini Maestro and do not need all of
         /// the data provided by this function, you can save some CPU time
         /// by using the overloads with fewer arguments.</remarks>
-        public unsafe void getVariables(out MaestroVariables variables, out short[] stack, out ushort[] callStack, out ServoStatus[] servos)
+        public void getVariables(out MaestroVariables variables, out short[] stack, out ushort[] callStack, out ServoStatus[] servos)
         {
-            if (microMaestro)
+            // On the Micro Maestro, this function requires just one control
+            // transfer.  On the Mini Maestro, it requires four.
+            using (MaestroStatus status = getStatus(MaestroFields.All))
             {
-                // On the Micro Maestro, this function requires just one control transfer:
-                getVariablesMicroMaestro(out variables, out stack, out callStack, out servos);
-            }
-            else
-            {
-                // On the Mini Maestro, this function requires four control transfers:
-                getVariablesMiniMaestro(out variables);
-                getVariablesMiniMaestro(out servos);
-                getVariablesMiniMaestro(out stack);
-                getVariablesMiniMaestro(out callStack);
+                variables = status.variables;
+                stack = copyStack(status);
+                callStack = copyCallStack(status);
+                servos = (ServoStatus[])status.servos.Clone();
             }
         }
 
@@ -566,16 +558,10 @@ namespace Pololu.Usc
         /// </remarks>
         public void getVariables(out MaestroVariables variables)
         {
-            if (microMaestro)
-            {
-                ServoStatus[] servos;
-                short[] stack;
-                ushort[] callStack;
-                getVariablesMicroMaestro(out variables, out stack, out callStack, out servos);
-            }
-            else
+            int result = tryGetVariables(out variables, null);
+            if (result < 0)
             {
-                getVariablesMiniMaestro(out variables);
+                throw UsbStatus.toException(result, "There was an error getting the device variables.");
             }
         }
 
@@ -590,16 +576,9 @@ namespace Pololu.Usc
         /// </remarks>
         public void getVariables(out ServoStatus[] servos)
         {
-            if (microMaestro)
+            using (MaestroStatus status = getStatus(MaestroFields.Servos))
             {
-                MaestroVariables variables;
-                short[] stack;
-                ushort[] callStack;
-                getVariablesMicroMaestro(out variables, out stack, out callStack, out servos);
-            }
-            else
-            {
-                getVariablesMiniMaestro(out servos);
+                servos = (ServoStatus[])status.servos.Clone();
             }
         }
 
@@ -614,16 +593,9 @@ namespace Pololu.Usc
         /// </remarks>
         public void getVariables(out short[] stack)
         {
-            if (microMaestro)
-            {
-                MaestroVariables variables;
-                ServoStatus[] servos;
-                ushort[] callStack;
-                getVariablesMicroMaestro(out variables, out stack, out callStack, out servos);
-            }
-            else
+            using (MaestroStatus status = getStatus(MaestroFields.Stack))
             {
-                getVariablesMiniMaestro(out stack);
+                stack = copyStack(status);
             }
         }
 
@@ -638,16 +610,9 @@ namespace Pololu.Usc
         /// </remarks>
         public void getVariables(out ushort[] callStack)
         {
-            if (microMaestro)
-            {
-                MaestroVariables variables;
-                short[] stack;
-                ServoStatus[] servos;
-                getVariablesMicroMaestro(out variables, out stack, out callStack, out servos);
-            }
-            else
+            using (MaestroStatus status = getStatus(MaestroFields.CallStack))
             {
-                getVariablesMiniMaestro(out callStack);
+                callStack = copyCallStack(status);
             }
         }
 
@@ -657,172 +622,373 @@ namespace Pololu.Usc
         public const int MiniMaestroStackSize = 126;
         public const int MiniMaestroCallStackSize = 126;
 
-        private unsafe void getVariablesMicroMaestro(out MaestroVariables variables, out short[] stack, out ushort[] callStack, out ServoStatus[] servos)
+        /// <summary>
+        /// Reads the miscellaneous variables and (optionally) the servo
+        /// statuses without allocating memory or throwing an exception.
+        /// The stacks are not read.
+        /// </summary>
+        /// <param name="variables">Receives the miscellaneous variables.</param>
+        /// <param name="servos">
+        ///   An array of at least servoCount elements that receives the status
+        ///   of each servo, or null if the servo statuses are not needed.
+        ///   On a Micro Maestro they come from the same transfer as the variables,
+        ///   so passing null only saves a transfer on the Mini Maestros.
+        /// </param>
+        /// <returns>UsbStatus.Success (0) or a negative UsbStatus error code.</returns>
+        public unsafe int tryGetVariables(out MaestroVariables variables, ServoStatus[] servos)
         {
-            byte[] array = new byte[sizeof(MicroMaestroVariables) + servoCount * sizeof(ServoStatus)];
+            variables = new MaestroVariables();
 
-            try
+            if (servos != null && servos.Length < servoCount)
             {
-                controlTransfer(0xC0, (byte)uscRequest.REQUEST_GET_VARIABLES, 0, 0, array);
-            }
-            catch (Exception e)
-            {
-                throw new Exception("There was an error getting the device variables.", e);
+                return UsbStatus.InvalidParameter;
             }
 
-            fixed (byte* pointer = array)
+            if (microMaestro)
             {
-                // copy the variable data
-                MicroMaestroVariables tmp = *(MicroMaestroVariables*)pointer;
-                variables.stackPointer = tmp.stackPointer;
-                variables.callStackPointer = tmp.callStackPointer;
-                variables.errors = tmp.errors;
-                variables.programCounter = tmp.programCounter;
-                variables.scriptDone = tmp.scriptDone;
+                int length = sizeof(MicroMaestroVariables) + servoCount * sizeof(ServoStatus);
+                byte* buffer = stackalloc byte[length];
+                int result = tryControlTransfer(0xC0, (byte)uscRequest.REQUEST_GET_VARIABLES, 0, 0, buffer, (ushort)length);
+                if (result < 0) { return result; }
+                if (result != length) { return UsbStatus.ShortTransfer; }
+
+                MicroMaestroVariables* tmp = (MicroMaestroVariables*)buffer;
+                variables.stackPointer = tmp->stackPointer;
+                variables.callStackPointer = tmp->callStackPointer;
+                variables.errors = tmp->errors;
+                variables.programCounter = tmp->programCounter;
+                variables.scriptDone = tmp->scriptDone;
                 variables.performanceFlags = 0;
 
-                servos = new ServoStatus[servoCount];
-                for (byte i = 0; i < servoCount; i++)
+                if (servos != null)
                 {
-                    servos[i] = *(ServoStatus*)(pointer + sizeof(MicroMaestroVariables) + sizeof(ServoStatus) * i);
+                    ServoStatus* status = (ServoStatus*)(buffer + sizeof(MicroMaestroVariables));
+                    for (byte i = 0; i < servoCount; i++)
+                    {
+                        servos[i] = status[i];
+                    }
                 }
-
-                stack = new short[variables.stackPointer];
-                for(byte i = 0; i < stack.Length; i++) { stack[i] = *(tmp.stack+i); }
-
-                callStack = new ushort[variables.callStackPointer];
-                for (byte i = 0; i < callStack.Length; i++) { callStack[i] = *(tmp.callStack + i); }
             }
-        }
-
-        private unsafe void getVariablesMiniMaestro(out MaestroVariables variables)
-        {
-            try
+            else
             {
-                // Get miscellaneous variables.
                 MiniMaestroVariables tmp;
-                UInt32 bytesRead = controlTransfer(0xC0, (byte)uscRequest.REQUEST_GET_VARIABLES, 0, 0, &tmp, (ushort)sizeof(MiniMaestroVariables));
-                if (bytesRead != sizeof(MiniMaestroVariables))
-                {
-                    throw new Exception("Short read: " + bytesRead + " < " + sizeof(MiniMaestroVariables) + ".");
-                }
+                int result = tryControlTransfer(0xC0, (byte)uscRequest.REQUEST_GET_VARIABLES, 0, 0, &tmp, (ushort)sizeof(MiniMaestroVariables));
+                if (result < 0) { return result; }
+                if (result != sizeof(MiniMaestroVariables)) { return UsbStatus.ShortTransfer; }
 
-                // Copy the variable data
                 variables.stackPointer = tmp.stackPointer;
                 variables.callStackPointer = tmp.callStackPointer;
                 variables.errors = tmp.errors;
                 variables.programCounter = tmp.programCounter;
                 variables.scriptDone = tmp.scriptDone;
                 variables.performanceFlags = tmp.performanceFlags;
+
+                if (servos != null)
+                {
+                    int length = servoCount * sizeof(ServoStatus);
+                    ServoStatus* status = stackalloc ServoStatus[servoCount];
+                    result = tryControlTransfer(0xC0, (byte)uscRequest.REQUEST_GET_SERVO_SETTINGS, 0, 0, status, (ushort)length);
+                    if (result < 0) { return result; }
+                    if (result != length) { return UsbStatus.ShortTransfer; }
+
+                    for (byte i = 0; i < servoCount; i++)
+                    {
+                        servos[i] = status[i];
+                    }
+                }
             }
-            catch (Exception e)
-            {
-                throw new Exception("Error getting variables from device.", e);
-            }
+
+            return UsbStatus.Success;
         }
 
-        private unsafe void getVariablesMiniMaestro(out ServoStatus[] servos)
+        /// <summary>
+        /// Reads the chosen parts of the Maestro's state in to a MaestroStatus,
+        /// without allocating memory or throwing an exception.  This is the
+        /// same as tryGetStatus(fields, status, 0, servoCount).
+        /// </summary>
+        /// <returns>UsbStatus.Success (0) or a negative UsbStatus error code.</returns>
+        public int tryGetStatus(MaestroFields fields, MaestroStatus status)
         {
-            try
+            return tryGetStatus(fields, status, 0, servoCount);
+        }
+
+        /// <summary>
+        /// Reads the chosen parts of the Maestro's state in to a MaestroStatus,
+        /// without allocating memory or throwing an exception.
+        /// </summary>
+        /// <remarks>
+        /// Only the transfers needed for the chosen parts are done: on a Mini
+        /// Maestro, reading only the servos or only the variables takes one
+        /// transfer instead of the four that getVariables does.  The Micro
+        /// Maestro sends everything in one transfer.  The device always sends
+        /// the channels starting from channel 0, so the transfer stops after
+        /// the last channel asked for, and only the channels asked for are
+        /// copied to status.servos.
+        /// </remarks>
+        /// <param name="fields">The parts to read.</param>
+        /// <param name="status">Receives the parts that were read.  Must have been created for this Maestro's servoCount.</param>
+        /// <param name="firstServo">The first channel to read, if fields includes Servos.</param>
+        /// <param name="count">The number of channels to read, if fields includes Servos.</param>
+        /// <returns>UsbStatus.Success (0) or a negative UsbStatus error code.</returns>
+        public unsafe int tryGetStatus(MaestroFields fields, MaestroStatus status, byte firstServo, byte count)
+        {
+            if (status == null || status.servos.Length < servoCount || firstServo + count > servoCount)
             {
-                byte[] servoSettingsArray = new byte[servoCount * sizeof(ServoStatus)];
+                return UsbStatus.InvalidParameter;
+            }
 
-                // Get the raw data from the device.
-                UInt32 bytesRead = controlTransfer(0xC0, (byte)uscRequest.REQUEST_GET_SERVO_SETTINGS, 0, 0, servoSettingsArray);
-                if (bytesRead != servoSettingsArray.Length)
-                {
-                    throw new Exception("Short read: " + bytesRead + " < " + servoSettingsArray.Length + ".");
-                }
+            status.fields = MaestroFields.None;
+            byte* buffer = status.pointer;
+            int servoEnd = (fields & MaestroFields.Servos) != 0 ? firstServo + count : 0;
+            int result;
 
-                // Put the data in to a managed array object.
-                servos = new ServoStatus[servoCount];
-                fixed (byte* pointer = servoSettingsArray)
+            if (microMaestro)
+            {
+                if (fields != MaestroFields.None)
                 {
-                    for (byte i = 0; i < servoCount; i++)
+                    int length = sizeof(MicroMaestroVariables) + servoEnd * sizeof(ServoStatus);
+                    result = tryControlTransfer(0xC0, (byte)uscRequest.REQUEST_GET_VARIABLES, 0, 0, buffer, (ushort)length);
+                    if (result < 0) { return result; }
+                    if (result != length) { return UsbStatus.ShortTransfer; }
+
+                    MicroMaestroVariables* tmp = (MicroMaestroVariables*)buffer;
+                    status.variables.stackPointer = tmp->stackPointer;
+                    status.variables.callStackPointer = tmp->callStackPointer;
+                    status.variables.errors = tmp->errors;
+                    status.variables.programCounter = tmp->programCounter;
+                    status.variables.scriptDone = tmp->scriptDone;
+                    status.variables.performanceFlags = 0;
+
+                    ServoStatus* servos = (ServoStatus*)(buffer + sizeof(MicroMaestroVariables));
+                    for (int i = firstServo; i < servoEnd; i++)
+                    {
+                        status.servos[i] = servos[i];
+                    }
+
+                    if ((fields & MaestroFields.Stack) != 0)
+                    {
+                        status.stackCount = Math.Min((int)tmp->stackPointer, MicroMaestroStackSize);
+                        for (int i = 0; i < status.stackCount; i++) { status.stack[i] = tmp->stack[i]; }
+                    }
+                    if ((fields & MaestroFields.CallStack) != 0)
                     {
-                        servos[i] = *(ServoStatus*)(pointer + sizeof(ServoStatus) * i);
+                        status.callStackCount = Math.Min((int)tmp->callStackPointer, MicroMaestroCallStackSize);
+                        for (int i = 0; i < status.callStackCount; i++) { status.callStack[i] = tmp->callStack[i]; }
                     }
                 }
             }
-            catch (Exception e)
+            else
             {
-                throw new Exception("Error getting channel settings from device.", e);
+                if ((fields & MaestroFields.Variables) != 0)
+                {
+                    result = tryControlTransfer(0xC0, (byte)uscRequest.REQUEST_GET_VARIABLES, 0, 0, buffer, (ushort)sizeof(MiniMaestroVariables));
+                    if (result < 0) { return result; }
+                    if (result != sizeof(MiniMaestroVariables)) { return UsbStatus.ShortTransfer; }
+
+                    MiniMaestroVariables* tmp = (MiniMaestroVariables*)buffer;
+                    status.variables.stackPointer = tmp->stackPointer;
+                    status.variables.callStackPointer = tmp->callStackPointer;
+                    status.variables.errors = tmp->errors;
+                    status.variables.programCounter = tmp->programCounter;
+                    status.variables.scriptDone = tmp->scriptDone;
+                    status.variables.performanceFlags = tmp->performanceFlags;
+                }
+
+                if (servoEnd != 0)
+                {
+                    int length = servoEnd * sizeof(ServoStatus);
+                    result = tryControlTransfer(0xC0, (byte)uscRequest.REQUEST_GET_SERVO_SETTINGS, 0, 0, buffer, (ushort)length);
+                    if (result < 0) { return result; }
+                    if (result != length) { return UsbStatus.ShortTransfer; }
+
+                    ServoStatus* servos = (ServoStatus*)buffer;
+                    for (int i = firstServo; i < servoEnd; i++)
+                    {
+                        status.servos[i] = servos[i];
+                    }
+                }
+
+                if ((fields & MaestroFields.Stack) != 0)
+                {
+                    result = tryControlTransfer(0xC0, (byte)uscRequest.REQUEST_GET_STACK, 0, 0, buffer, (ushort)(MiniMaestroStackSize * sizeof(short)));
+                    if (result < 0) { return result; }
+                    status.stackCount = result / sizeof(short);
+                    for (int i = 0; i < status.stackCount; i++) { status.stack[i] = ((short*)buffer)[i]; }
+                }
+
+                if ((fields & MaestroFields.CallStack) != 0)
+                {
+                    result = tryControlTransfer(0xC0, (byte)uscRequest.REQUEST_GET_CALL_STACK, 0, 0, buffer, (ushort)(MiniMaestroCallStackSize * sizeof(ushort)));
+                    if (result < 0) { return result; }
+                    status.callStackCount = result / sizeof(ushort);
+                    for (int i = 0; i < status.callStackCount; i++) { status.callStack[i] = ((ushort*)buffer)[i]; }
+                }
             }
+
+            status.fields = fields;
+            status.firstServo = firstServo;
+            status.servoCount = (fields & MaestroFields.Servos) != 0 ? count : (byte)0;
+            return UsbStatus.Success;
         }
 
-        private unsafe void getVariablesMiniMaestro(out short[] stack)
+        /// <summary>
+        /// Reads the chosen parts of the Maestro's state in to a new
+        /// MaestroStatus, which the caller must dispose.  Throws an exception
+        /// if there is a problem.
+        /// </summary>
+        private MaestroStatus getStatus(MaestroFields fields)
         {
-            try
+            MaestroStatus status = new MaestroStatus(servoCount);
+            int result = tryGetStatus(fields, status);
+            if (result < 0)
             {
-                // Get the data stack.
-                stack = new short[MiniMaestroStackSize];
-                fixed (short* pointer = stack)
-                {
-                    UInt32 bytesRead = controlTransfer(0xC0, (byte)uscRequest.REQUEST_GET_STACK, 0, 0, pointer, (ushort)(sizeof(short) * stack.Length));
-                    Array.Resize<short>(ref stack, (int)(bytesRead / sizeof(short)));
-                }
+                status.Dispose();
+                throw UsbStatus.toException(result, "There was an error getting the device variables.");
             }
-            catch (Exception e)
+            return status;
+        }
+
+        private static short[] copyStack(MaestroStatus status)
+        {
+            short[] stack = new short[status.stackCount];
+            Array.Copy(status.stack, stack, stack.Length);
+            return stack;
+        }
+
+        private static ushort[] copyCallStack(MaestroStatus status)
+        {
+            ushort[] callStack = new ushort[status.callStackCount];
+            Array.Copy(status.callStack, callStack, callStack.Length);
+            return callStack;
+        }
+
+        public void setTarget(byte servo, ushort value)
+        {
+            int status = trySetTarget(servo, value);
+            if (status < 0)
             {
-                throw new Exception("Error getting stack from device.", e);
+                throw UsbStatus.toException(status, "Failed to set target of servo " + servo + " to " + value + ".");
             }
         }
 
-        private unsafe void getVariablesMiniMaestro(out ushort[] callStack)
+        /// <summary>
+        /// Same as setTarget, but returns a UsbStatus code instead of throwing
+        /// an exception if there is a problem.  This is meant for loops that
+        /// call it many times per second and want to handle errors themselves.
+        /// </summary>
+        /// <returns>UsbStatus.Success (0) or a negative UsbStatus error code.</returns>
+        public int trySetTarget(byte servo, ushort value)
         {
-            try
+            CoalescingWriter writer = coalescer;
+            if (writer != null)
             {
-                callStack = new ushort[MiniMaestroCallStackSize];
-                fixed (ushort* pointer = callStack)
+                if (servo >= servoCount)
                 {
-                    UInt32 bytesRead = controlTransfer(0xC0, (byte)uscRequest.REQUEST_GET_CALL_STACK, 0, 0, pointer, (ushort)(sizeof(ushort) * callStack.Length));
-                    Array.Resize<ushort>(ref callStack, (int)(bytesRead / sizeof(ushort)));
+                    return UsbStatus.InvalidParameter;
                 }
+                return writer.post(servoCount + servo, value);
             }
-            catch (Exception e)
-            {
-                throw new Exception("Error getting call stack from device.", e);
-            }
+            return sendTarget(servo, value);
         }
 
-        public void setTarget(byte servo, ushort value)
+        /// <summary>
+        /// Sends a target to the device right away, even in coalescing mode.
+        /// </summary>
+        internal int sendTarget(byte servo, ushort value)
         {
-            try
-            {
-                controlTransfer(0x40, (byte)uscRequest.REQUEST_SET_TARGET, value, servo);
-            }
-            catch (Exception e)
-            {
-                throw new Exception("Failed to set target of servo " + servo + " to " + value + ".", e);
-            }
+            return tryControlTransfer(0x40, (byte)uscRequest.REQUEST_SET_TARGET, value, servo);
+        }
+
+        /// <summary>
+        /// Sends a request that has no data stage, without throwing an
+        /// exception.  Used by ScriptTrigger.
+        /// </summary>
+        internal int sendRequest(byte request, ushort value, ushort index)
+        {
+            return tryControlTransfer(0x40, request, value, index);
         }
 
         public void setSpeed(byte servo, ushort value)
         {
-            try
+            int status = trySetSpeed(servo, value);
+            if (status < 0)
             {
-                controlTransfer(0x40, (byte)uscRequest.REQUEST_SET_SERVO_VARIABLE, value, servo);
+                throw UsbStatus.toException(status, "Failed to set speed of servo " + servo + " to " + value + ".");
             }
-            catch (Exception e)
+        }
+
+        /// <summary>
+        /// Same as setSpeed, but returns a UsbStatus code instead of throwing
+        /// an exception if there is a problem.
+        /// </summary>
+        /// <returns>UsbStatus.Success (0) or a negative UsbStatus error code.</returns>
+        public int trySetSpeed(byte servo, ushort value)
+        {
+            CoalescingWriter writer = coalescer;
+            if (writer != null)
             {
-                throw new Exception("Failed to set speed of servo " + servo + " to " + value + ".", e);
+                if (servo >= servoCount)
+                {
+                    return UsbStatus.InvalidParameter;
+                }
+                return writer.post(servo, value);
             }
+            return sendSpeed(servo, value);
         }
 
-        public void setAcceleration(byte servo, ushort value)
+        /// <summary>
+        /// Sends a speed to the device right away, even in coalescing mode.
+        /// </summary>
+        int sendSpeed(byte servo, ushort value)
         {
-            // set the high bit of servo to specify acceleration
-            try
+            return tryControlTransfer(0x40, (byte)uscRequest.REQUEST_SET_SERVO_VARIABLE, value, servo);
+        }
+
+        /// <summary>
+        /// Puts the Maestro in coalescing mode: setTarget, trySetTarget,
+        /// setSpeed and trySetSpeed store the value and return right away,
+        /// and a background thread sends the values.  If a channel gets a
+        /// new target (or speed) before the last one was sent, only the new
+        /// one is sent.  This is for programs that calculate targets faster
+        /// than USB can send them.  Errors are returned by a later call
+        /// instead of the one that caused them.  Speeds are sent before
+        /// targets, and the counters are in coalescer.
+        /// Call stopCoalescing to go back to sending values right away.
+        /// </summary>
+        public void startCoalescing()
+        {
+            startCoalescing(2 * servoCount, writeCoalesced);
+        }
+
+        int writeCoalesced(int key, int value)
+        {
+            if (key < servoCount)
             {
-                controlTransfer(0x40, (byte)uscRequest.REQUEST_SET_SERVO_VARIABLE,
-                                       value, (byte)(servo | 0x80));
+                return sendSpeed((byte)key, (ushort)value);
             }
-            catch (Exception e)
+            return sendTarget((byte)(key - servoCount), (ushort)value);
+        }
+
+        public void setAcceleration(byte servo, ushort value)
+        {
+            int status = trySetAcceleration(servo, value);
+            if (status < 0)
             {
-                throw new Exception("Failed to set acceleration of servo " + servo + " to " + value + ".", e);
+                throw UsbStatus.toException(status, "Failed to set acceleration of servo " + servo + " to " + value + ".");
             }
         }
 
+        /// <summary>
+        /// Same as setAcceleration, but returns a UsbStatus code instead of
+        /// throwing an exception if there is a problem.
+        /// </summary>
+        /// <returns>UsbStatus.Success (0) or a negative UsbStatus error code.</returns>
+        public int trySetAcceleration(byte servo, ushort value)
+        {
+            // set the high bit of servo to specify acceleration
+            return tryControlTransfer(0x40, (byte)uscRequest.REQUEST_SET_SERVO_VARIABLE, value, (byte)(servo | 0x80));
+        }
+
         public void setUscSettings(UscSettings settings, bool newScript)
         {
             setRawParameter(uscParameter.PARAMETER_SERIAL_MODE, (byte)settings.serialMode);
@@ -932,35 +1098,72 @@ namespace Pololu.Usc
 
             if (newScript)
             {
-                setScriptDone(1); // stop the script
-
-                // load the new script
-                BytecodeProgram program = settings.bytecodeProgram;
-                List<byte> byteList = program.getByteList();
-                if (byteList.Count > maxScriptLength)
-                {
-                    throw new Exception("Script too long for device (" + byteList.Count + " bytes)");
-                }
-                if (byteList.Count < maxScriptLength)
-                {
-                    // if possible, add QUIT to the end to prevent mysterious problems with
-                    // unterminated scripts
-                    byteList.Add((byte)Opcode.QUIT);
-                }
-                eraseScript();
-                setSubroutines(program.subroutineAddresses, program.subroutineCommands);
-                writeScript(byteList);
-                setRawParameter(uscParameter.PARAMETER_SCRIPT_CRC, program.getCRC());
+                writeCompiledScript(settings.compiledScript);
 
                 // Save the script in the registry
                 key.SetValue("script", settings.script, RegistryValueKind.String);
             }
 
-            Sequencer.Sequence.saveSequencesInRegistry(settings.sequences, key);
+            using (Sequencer.SequenceStore store = openSequenceStore())
+            {
+                store.saveSequences(settings.sequences);
+            }
 
             key.Close(); // This might be needed to flush the changes.
         }
 
+        /// <summary>
+        /// Loads a compiled script into the device (but not the rest of the
+        /// settings), and remembers the text of the script so that
+        /// getUscSettings can return it.
+        /// </summary>
+        /// <param name="script">The text of the script.</param>
+        /// <param name="compiledScript">The compiled script, for example from a ScriptCache.</param>
+        /// <param name="onlyIfChanged">
+        ///   If true, the script is not written if the device already has a
+        ///   script with the same CRC.  Writing the script takes about 100
+        ///   transfers for a small script and more for a big one.  The
+        ///   script itself can not be read back, and older versions of
+        ///   UscCmd --program did not update the CRC, so only use this for
+        ///   devices whose scripts were written by this version.
+        /// </param>
+        /// <returns>True if the script was written.</returns>
+        public bool loadScript(string script, CompiledScript compiledScript, bool onlyIfChanged)
+        {
+            bool changed = !onlyIfChanged || getRawParameter(uscParameter.PARAMETER_SCRIPT_CRC) != compiledScript.crc;
+            if (changed)
+            {
+                writeCompiledScript(compiledScript);
+            }
+
+            RegistryKey key = openRegistryKey();
+            key.SetValue("script", script, RegistryValueKind.String);
+            key.Close();
+            return changed;
+        }
+
+        void writeCompiledScript(CompiledScript compiledScript)
+        {
+            setScriptDone(1); // stop the script
+
+            // load the new script
+            List<byte> byteList = new List<byte>(compiledScript.bytecode);
+            if (byteList.Count > maxScriptLength)
+            {
+                throw new Exception("Script too long for device (" + byteList.Count + " bytes)");
+            }
+            if (byteList.Count < maxScriptLength)
+            {
+                // if possible, add QUIT to the end to prevent mysterious problems with
+                // unterminated scripts
+                byteList.Add((byte)Opcode.QUIT);
+            }
+            eraseScript();
+            setSubroutines(compiledScript.subroutineTable);
+            writeScript(byteList);
+            setRawParameter(uscParameter.PARAMETER_SCRIPT_CRC, compiledScript.crc);
+        }
+
         /// <summary>
         /// Tries to open the registry key that holds the information for this device.
         /// If the key does not exist, creates it.  Returns the key.
@@ -977,6 +1180,34 @@ namespace Pololu.Usc
             return key;
         }
 
+        /// <summary>
+        /// Opens the file that holds the sequences for this device.
+        /// If the file does not exist, creates it.
+        /// </summary>
+        private Sequencer.SequenceStore openSequenceStore()
+        {
+            return new Sequencer.SequenceStore(Sequencer.SequenceStore.getDefaultPath(englishName, getSerialNumber()), servoCount);
+        }
+
+        /// <summary>
+        /// Reads the sequences for this device.  Older versions of this
+        /// library kept them in the registry, so they are read from there
+        /// if there is no sequence file yet.  Frames are only read from the
+        /// sequence file when they are used.
+        /// </summary>
+        private List<Sequencer.Sequence> readSequences(RegistryKey key)
+        {
+            if (!Sequencer.SequenceStore.exists(Sequencer.SequenceStore.getDefaultPath(englishName, getSerialNumber())))
+            {
+                return Sequencer.Sequence.readSequencesFromRegistry(key, servoCount);
+            }
+
+            using (Sequencer.SequenceStore store = openSequenceStore())
+            {
+                return store.readSequencesOnDemand();
+            }
+        }
+
         private void setRawParameter(uscParameter parameter, ushort value)
         {
             Range range = Usc.getRange(parameter);
@@ -1036,6 +1267,25 @@ namespace Pololu.Usc
             return value;
         }
 
+        /// <summary>
+        /// Reads the servo period from the device, without reading the rest
+        /// of the settings.  This is the same as
+        /// UscSettings.periodInMicroseconds.
+        /// </summary>
+        /// <returns>The time between the pulses of the servos that are not multiplied, in microseconds.</returns>
+        public decimal getPeriodInMicroseconds()
+        {
+            if (servoCount == 6)
+            {
+                return periodToMicroseconds(getRawParameter(uscParameter.PARAMETER_SERVO_PERIOD),
+                    (byte)getRawParameter(uscParameter.PARAMETER_SERVOS_AVAILABLE));
+            }
+
+            UInt32 period = (UInt32)(getRawParameter(uscParameter.PARAMETER_MINI_MAESTRO_SERVO_PERIOD_HU) << 8);
+            period |= (byte)getRawParameter(uscParameter.PARAMETER_MINI_MAESTRO_SERVO_PERIOD_L);
+            return period / 4;
+        }
+
         /// <summary>
         /// Gets a settings object, pulling some info from the registry and some from the device.
         /// If there is an inconsistency, a special flag is set.
@@ -1160,14 +1410,21 @@ namespace Pololu.Usc
                 try
                 {
                     // compile it to get the checksum
-                    settings.setAndCompileScript(script);
+                    if (scriptCache != null)
+                    {
+                        settings.setScript(script, scriptCache.compile(script, servoCount != 6));
+                    }
+                    else
+                    {
+                        settings.setAndCompileScript(script);
+                    }
 
-                    BytecodeProgram program = settings.bytecodeProgram;
-                    if (program.getByteList().Count > this.maxScriptLength)
+                    CompiledScript compiledScript = settings.compiledScript;
+                    if (compiledScript.bytecode.Length > this.maxScriptLength)
                     {
                         throw new Exception();
                     }
-                    if (program.getCRC() != (ushort)getRawParameter(uscParameter.PARAMETER_SCRIPT_CRC))
+                    if (compiledScript.crc != (ushort)getRawParameter(uscParameter.PARAMETER_SCRIPT_CRC))
                     {
                         throw new Exception();
                     }
@@ -1178,8 +1435,8 @@ namespace Pololu.Usc
                     settings.scriptInconsistent = true;
                 }
 
-                // Get the sequences from the registry.
-                settings.sequences = Sequencer.Sequence.readSequencesFromRegistry(key, servoCount);
+                // Get the sequences.
+                settings.sequences = readSequences(key);
             }
 
             return settings;
@@ -1200,6 +1457,13 @@ namespace Pololu.Usc
             }
         }
 
+        /// <summary>
+        /// If not null, getUscSettings uses this to get the compiled form of
+        /// the script (which it needs to check the script's CRC) instead of
+        /// compiling the script every time.
+        /// </summary>
+        public ScriptCache scriptCache;
+
         private static void requireArgumentRange(uint argumentValue, Int32 minimum, Int32 maximum, String argumentName)
         {
             if (argumentValue < minimum || argumentValue > maximum)
@@ -139,6 +139,7 @@ namespace Pololu.Usc
 
         private string privateScript = null;
         private BytecodeProgram privateProgram;
+        private CompiledScript privateCompiledScript;
 
         public string script
         {
@@ -151,6 +152,7 @@ namespace Pololu.Usc
         public void setAndCompileScript(string script)
         {
             privateScript = null;
+            privateCompiledScript = null;
 
             privateProgram = BytecodeReader.Read(script, servoCount != 6);
 
@@ -158,6 +160,19 @@ namespace Pololu.Usc
             privateScript = script;
         }
 
+        /// <summary>
+        /// Sets the script using a compiled form of it that was made earlier,
+        /// for example by a ScriptCache, instead of compiling it.  The
+        /// BytecodeProgram is only made (by compiling the script) if
+        /// something asks for bytecodeProgram.
+        /// </summary>
+        public void setScript(string script, CompiledScript compiledScript)
+        {
+            privateScript = script;
+            privateProgram = null;
+            privateCompiledScript = compiledScript;
+        }
+
         public decimal periodInMicroseconds
         {
             get
@@ -177,7 +192,29 @@ namespace Pololu.Usc
 
         public BytecodeProgram bytecodeProgram
         {
-            get { return privateProgram; }
+            get
+            {
+                if (privateProgram == null && privateScript != null)
+                {
+                    privateProgram = BytecodeReader.Read(privateScript, servoCount != 6);
+                }
+                return privateProgram;
+            }
+        }
+
+        /// <summary>
+        /// The parts of the compiled script that are loaded into the device.
+        /// </summary>
+        public CompiledScript compiledScript
+        {
+            get
+            {
+                if (privateCompiledScript == null && privateScript != null)
+                {
+                    privateCompiledScript = new CompiledScript(bytecodeProgram);
+                }
+                return privateCompiledScript;
+            }
         }
 
         public UscSettings()
@@ -0,0 +1,184 @@
+﻿using System;
+using System.Diagnostics;
+using System.Threading;
+using Pololu.UsbWrapper;
+
+namespace Pololu.Usc
+{
+    public partial class Usc
+    {
+        UInt32 privateMotionUpdatePeriod = 10000;
+
+        /// <summary>
+        /// The time between the Maestro's updates of the servo positions, in
+        /// microseconds, which is the time unit of the speed and acceleration
+        /// limits.  This is used to predict when servos will reach their
+        /// targets.  The default is 10000 (10 ms), which is right for the
+        /// Micro Maestro and for the Mini Maestros with the default servo
+        /// period.
+        /// </summary>
+        public UInt32 motionUpdatePeriod
+        {
+            get { return privateMotionUpdatePeriod; }
+            set
+            {
+                if (value == 0)
+                {
+                    throw new ArgumentException("The motion update period must not be zero.");
+                }
+                privateMotionUpdatePeriod = value;
+            }
+        }
+
+        /// <summary>
+        /// Predicts how long it will take a servo to get from its current
+        /// position to its target, given its speed and acceleration limits.
+        /// </summary>
+        /// <param name="status">The status of the servo, from getVariables.</param>
+        /// <param name="updatePeriod">The time between servo position updates, in microseconds (see motionUpdatePeriod).</param>
+        /// <param name="earliest">
+        ///   Receives the earliest time the servo could arrive, in microseconds.
+        ///   The prediction assumes the servo starts from rest, but the Maestro
+        ///   does not report how fast a servo is already moving, so a servo
+        ///   that is already moving toward its target can arrive sooner.
+        /// </param>
+        /// <returns>The predicted time until the servo arrives, in microseconds.  0 if it is already there.</returns>
+        public static double predictArrivalTime(ServoStatus status, UInt32 updatePeriod, out double earliest)
+        {
+            earliest = 0;
+            if (status.target == 0 || status.position == status.target)
+            {
+                // The servo is off or already at its target.
+                return 0;
+            }
+
+            // Distances are in quarter-microseconds and times are in updates.
+            double distance = Math.Abs(status.target - status.position);
+            double updates;
+
+            if (status.acceleration == 0)
+            {
+                updates = status.speed == 0 ? 1 : Math.Ceiling(distance / status.speed);
+                earliest = updates;
+            }
+            else
+            {
+                // The acceleration limit is the change in speed every 8 updates.
+                double acceleration = status.acceleration / 8.0;
+                double accelerationDistance = status.speed == 0 ? Double.PositiveInfinity :
+                    (double)status.speed * status.speed / (2 * acceleration);
+
+                if (distance >= 2 * accelerationDistance)
+                {
+                    // Speed up to the speed limit, move at the speed limit,
+                    // then slow down.
+                    updates = distance / status.speed + status.speed / acceleration;
+                    earliest = distance / status.speed + status.speed / (2 * acceleration);
+                }
+                else
+                {
+                    // Speed up half way and then slow down.
+                    updates = 2 * Math.Sqrt(distance / acceleration);
+                    earliest = Math.Sqrt(2 * distance / acceleration);
+                }
+            }
+
+            earliest *= updatePeriod;
+            return updates * updatePeriod;
+        }
+
+        /// <summary>
+        /// Waits until all of the given channels have reached their targets,
+        /// without flooding the USB bus with requests.
+        /// </summary>
+        /// <remarks>
+        /// Instead of reading the servo positions over and over, this reads
+        /// them once, predicts when the slowest servo will arrive from its
+        /// distance, speed limit and acceleration limit, sleeps until shortly
+        /// before then, and reads them again.  A move usually takes only a
+        /// few reads, no matter how long it is.
+        /// Channels that are off (target 0) are treated as having arrived.
+        /// </remarks>
+        /// <param name="channels">The channels to wait for.</param>
+        /// <param name="timeout">The maximum time to wait in milliseconds, or -1 to wait forever.</param>
+        /// <returns>True if the servos reached their targets, or false if the timeout elapsed first.</returns>
+        public bool waitForMotion(byte[] channels, int timeout)
+        {
+            foreach (byte channel in channels)
+            {
+                if (channel >= servoCount)
+                {
+                    throw new ArgumentException("Channel " + channel + " does not exist on this Maestro.");
+                }
+            }
+
+            Stopwatch stopwatch = Stopwatch.StartNew();
+
+            // Wake up a little early, so that a slightly slow prediction does
+            // not make us late, and poll no more often than the servos update.
+            int margin = (int)(privateMotionUpdatePeriod / 1000);
+            int minimumSleep = Math.Max(1, margin);
+
+            // Only the servo statuses are read, which on a Mini Maestro saves
+            // the transfer that reads the variables.
+            using (MaestroStatus status = new MaestroStatus(servoCount))
+            {
+                ServoStatus[] servos = status.servos;
+                while (true)
+                {
+                    int result = tryGetStatus(MaestroFields.Servos, status);
+                    if (result < 0)
+                    {
+                        throw UsbStatus.toException(result, "There was an error getting the servo positions.");
+                    }
+
+                    double earliest = 0;
+                    bool moving = false;
+                    foreach (byte channel in channels)
+                    {
+                        if (servos[channel].target == 0 || servos[channel].position == servos[channel].target)
+                        {
+                            continue;
+                        }
+                        moving = true;
+
+                        double channelEarliest;
+                        predictArrivalTime(servos[channel], privateMotionUpdatePeriod, out channelEarliest);
+                        earliest = Math.Max(earliest, channelEarliest);
+                    }
+
+                    if (!moving)
+                    {
+                        return true;
+                    }
+
+                    int sleep = Math.Max(minimumSleep, (int)(earliest / 1000) - margin);
+                    if (timeout >= 0)
+                    {
+                        int remaining = timeout - (int)stopwatch.ElapsedMilliseconds;
+                        if (remaining <= 0)
+                        {
+                            return false;
+                        }
+                        sleep = Math.Min(sleep, remaining);
+                    }
+                    Thread.Sleep(sleep);
+                }
+            }
+        }
+
+        /// <summary>
+        /// Waits until all channels have reached their targets.  See
+        /// waitForMotion(byte[], int).
+        /// </summary>
+        public bool waitForMotion(int timeout)
+        {
+            byte[] channels = new byte[servoCount];
+            for (byte i = 0; i < servoCount; i++)
+            {
+                channels[i] = i;
+            }
+            return waitForMotion(channels, timeout);
+        }
+    }
+}
@@ -102,6 +102,31 @@ namespace Pololu.Usc
         public Byte performanceFlags;
     }
 
+    /// <summary>
+    /// Selects the parts of a Maestro's state that Usc.tryGetStatus reads.
+    /// Each part the Mini Maestros have to send with a separate request,
+    /// so reading fewer parts takes fewer transfers.
+    /// </summary>
+    [Flags]
+    public enum MaestroFields
+    {
+        None = 0,
+
+        /// <summary>The errors, program counter and other MaestroVariables.</summary>
+        Variables = 1,
+
+        /// <summary>The positions, targets, speeds and accelerations of the channels.</summary>
+        Servos = 2,
+
+        /// <summary>The script's data stack.</summary>
+        Stack = 4,
+
+        /// <summary>The script's call stack.</summary>
+        CallStack = 8,
+
+        All = Variables | Servos | Stack | CallStack
+    }
+
     /// <summary>
     /// Represents the non-channel-specific variables that can be read from
     /// a Micro Maestro using REQUEST_GET_VARIABLES.
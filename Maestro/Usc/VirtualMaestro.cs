@@ -0,0 +1,384 @@
+﻿using System;
+using Pololu.UsbWrapper;
+using Pololu.Usc.Bytecode;
+
+namespace Pololu.Usc
+{
+    /// <summary>
+    /// An emulated Maestro that can be added to the device list with
+    /// Usb.addVirtualDevice, so that programs using the Usc class can be
+    /// tested without hardware.
+    /// </summary>
+    /// <remarks>
+    /// The emulator stores parameters and the script the same way the
+    /// Maestro does, so getUscSettings and setUscSettings work.  The script
+    /// and servos are simulated by a ScriptEmulator that is rebuilt from the
+    /// stored parameters and flash whenever the device is reinitialized.
+    /// Channel modes, the serial port, and the servo period are stored but
+    /// have no effect.
+    /// </remarks>
+    public class VirtualMaestro : VirtualUsbDevice
+    {
+        /// <summary>
+        /// The number of channels: 6, 12, 18, or 24.
+        /// </summary>
+        public readonly byte servoCount;
+
+        /// <summary>
+        /// The parameter storage (EEPROM), indexed by uscParameter.
+        /// Two bytes longer than the largest parameter number so that
+        /// any 2-byte parameter fits.
+        /// </summary>
+        readonly byte[] parameters = new byte[258];
+
+        /// <summary>
+        /// The script flash: the script itself followed by the 256-byte
+        /// subroutine address table.
+        /// </summary>
+        readonly byte[] flash;
+
+        readonly int scriptSize;
+
+        ScriptEmulator emulator;
+
+        /// <summary>
+        /// Creates an emulated Maestro with default settings and no script.
+        /// </summary>
+        /// <param name="servoCount">6 for the Micro Maestro, or 12, 18, or 24.</param>
+        /// <param name="serialNumber">The serial number to report, like "00012345".</param>
+        public VirtualMaestro(byte servoCount, String serialNumber)
+            : base(Usc.vendorID, productIdFor(servoCount), serialNumber)
+        {
+            this.servoCount = servoCount;
+            scriptSize = (servoCount == 6) ? 1024 : 8192;
+            flash = new byte[scriptSize + 256];
+            for (int i = 0; i < flash.Length; i++)
+            {
+                flash[i] = 0xFF;
+            }
+
+            // Start with an empty script, as if one had been loaded with
+            // setUscSettings, so the script stops cleanly instead of running
+            // in to erased flash.
+            flash[0] = (byte)Opcode.QUIT;
+
+            loadDefaultParameters();
+            reinitialize();
+        }
+
+        private static UInt16 productIdFor(byte servoCount)
+        {
+            switch (servoCount)
+            {
+                case 6: return 0x89;
+                case 12: return 0x8A;
+                case 18: return 0x8B;
+                case 24: return 0x8C;
+                default: throw new ArgumentException("The number of servos must be 6, 12, 18, or 24.", "servoCount");
+            }
+        }
+
+        public override Guid deviceInterfaceGuid
+        {
+            get { return Usc.deviceInterfaceGuid; }
+        }
+
+        protected override UInt16 firmwareVersionBcd
+        {
+            get { return 0x0104; }
+        }
+
+        private bool microMaestro
+        {
+            get { return servoCount == 6; }
+        }
+
+        /// <summary>
+        /// Sets the value that a channel configured as an input will report.
+        /// </summary>
+        public void setInput(byte channel, UInt16 value)
+        {
+            lock (sync)
+            {
+                emulator.setInput(channel, value);
+            }
+        }
+
+        protected override void advance(UInt64 microseconds)
+        {
+            emulator.advance(microseconds);
+        }
+
+        private void setParameter(uscParameter parameter, int bytes, UInt16 value)
+        {
+            parameters[(byte)parameter] = (byte)value;
+            if (bytes == 2)
+            {
+                parameters[(byte)parameter + 1] = (byte)(value >> 8);
+            }
+        }
+
+        private UInt16 getParameter(int parameter, int bytes)
+        {
+            UInt16 value = parameters[parameter];
+            if (bytes == 2)
+            {
+                value |= (UInt16)(parameters[parameter + 1] << 8);
+            }
+            return value;
+        }
+
+        /// <summary>
+        /// Puts the parameters in the state they are in on a new Maestro.
+        /// </summary>
+        private void loadDefaultParameters()
+        {
+            Array.Clear(parameters, 0, parameters.Length);
+            setParameter(uscParameter.PARAMETER_SERVOS_AVAILABLE, 1, 6);
+            setParameter(uscParameter.PARAMETER_SERVO_PERIOD, 1, 156);
+            setParameter(uscParameter.PARAMETER_SERIAL_MODE, 1, (byte)uscSerialMode.SERIAL_MODE_UART_DETECT_BAUD_RATE);
+            setParameter(uscParameter.PARAMETER_SERIAL_FIXED_BAUD_RATE, 2, 1249); // 9600 bps
+            setParameter(uscParameter.PARAMETER_SERIAL_DEVICE_NUMBER, 1, 12);
+            if (!microMaestro)
+            {
+                // 80000 quarter-microseconds = 20 ms
+                setParameter(uscParameter.PARAMETER_MINI_MAESTRO_SERVO_PERIOD_L, 1, 0x80);
+                setParameter(uscParameter.PARAMETER_MINI_MAESTRO_SERVO_PERIOD_HU, 2, 0x138);
+            }
+
+            for (byte i = 0; i < servoCount; i++)
+            {
+                setParameter(specifyServo(uscParameter.PARAMETER_SERVO0_MIN, i), 1, 3968 / 64);
+                setParameter(specifyServo(uscParameter.PARAMETER_SERVO0_MAX, i), 1, 8000 / 64);
+                setParameter(specifyServo(uscParameter.PARAMETER_SERVO0_NEUTRAL, i), 2, 6000);
+                setParameter(specifyServo(uscParameter.PARAMETER_SERVO0_RANGE, i), 1, 1905 / 127);
+            }
+        }
+
+        private static uscParameter specifyServo(uscParameter p, byte servo)
+        {
+            return (uscParameter)((byte)p + servo * 9);
+        }
+
+        /// <summary>
+        /// Restarts the emulated firmware: the servos go to their home
+        /// positions and the script starts from the beginning unless the
+        /// "script done" parameter is set.
+        /// </summary>
+        private void reinitialize()
+        {
+            if (parameters[(byte)uscParameter.PARAMETER_INITIALIZED] == 0xFF)
+            {
+                loadDefaultParameters();
+            }
+
+            ChannelSetting[] channelSettings = new ChannelSetting[servoCount];
+            for (byte i = 0; i < servoCount; i++)
+            {
+                ChannelSetting setting = new ChannelSetting();
+                UInt16 home = getParameter((byte)specifyServo(uscParameter.PARAMETER_SERVO0_HOME, i), 2);
+                if (home == 0)
+                {
+                    setting.homeMode = HomeMode.Off;
+                }
+                else if (home == 1)
+                {
+                    setting.homeMode = HomeMode.Ignore;
+                }
+                else
+                {
+                    setting.homeMode = HomeMode.Goto;
+                    setting.home = home;
+                }
+                setting.minimum = (UInt16)(64 * getParameter((byte)specifyServo(uscParameter.PARAMETER_SERVO0_MIN, i), 1));
+                setting.maximum = (UInt16)(64 * getParameter((byte)specifyServo(uscParameter.PARAMETER_SERVO0_MAX, i), 1));
+                setting.speed = Usc.exponentialSpeedToNormalSpeed((byte)getParameter((byte)specifyServo(uscParameter.PARAMETER_SERVO0_SPEED, i), 1));
+                setting.acceleration = (byte)getParameter((byte)specifyServo(uscParameter.PARAMETER_SERVO0_ACCELERATION, i), 1);
+                channelSettings[i] = setting;
+            }
+
+            byte[] program = new byte[scriptSize];
+            Array.Copy(flash, program, scriptSize);
+
+            ushort[] subroutineTable = new ushort[128];
+            for (int i = 0; i < subroutineTable.Length; i++)
+            {
+                subroutineTable[i] = (ushort)(flash[scriptSize + 2 * i] | (flash[scriptSize + 2 * i + 1] << 8));
+            }
+
+            emulator = new ScriptEmulator(program, subroutineTable, channelSettings);
+            if (parameters[(byte)uscParameter.PARAMETER_SCRIPT_DONE] != 0)
+            {
+                emulator.stop();
+            }
+        }
+
+        protected override unsafe int handleControlTransfer(byte requestType, byte request, ushort value, ushort index, byte* data, ushort length)
+        {
+            switch ((uscRequest)request)
+            {
+                case uscRequest.REQUEST_GET_PARAMETER:
+                    {
+                        int bytes = Math.Min((int)length, 2);
+                        if ((index & 0xFF) + bytes > parameters.Length)
+                        {
+                            return UsbStatus.Pipe;
+                        }
+                        for (int i = 0; i < bytes; i++)
+                        {
+                            data[i] = parameters[(index & 0xFF) + i];
+                        }
+                        return bytes;
+                    }
+
+                case uscRequest.REQUEST_SET_PARAMETER:
+                    {
+                        int bytes = index >> 8;
+                        int parameter = index & 0xFF;
+                        if (bytes < 1 || bytes > 2)
+                        {
+                            return UsbStatus.Pipe;
+                        }
+                        parameters[parameter] = (byte)value;
+                        if (bytes == 2)
+                        {
+                            parameters[parameter + 1] = (byte)(value >> 8);
+                        }
+                        return 0;
+                    }
+
+                case uscRequest.REQUEST_GET_VARIABLES:
+                    if (microMaestro)
+                    {
+                        byte* buffer = stackalloc byte[sizeof(MicroMaestroVariables) + 6 * sizeof(ServoStatus)];
+                        *(MicroMaestroVariables*)buffer = new MicroMaestroVariables();
+                        emulator.getVariables((MicroMaestroVariables*)buffer);
+                        emulator.getServos((ServoStatus*)(buffer + sizeof(MicroMaestroVariables)));
+                        return respond(data, length, buffer, sizeof(MicroMaestroVariables) + 6 * sizeof(ServoStatus));
+                    }
+                    else
+                    {
+                        MiniMaestroVariables variables;
+                        emulator.getVariables(&variables);
+                        return respond(data, length, &variables, sizeof(MiniMaestroVariables));
+                    }
+
+                case uscRequest.REQUEST_SET_SERVO_VARIABLE:
+                    if ((index & 0x7F) >= servoCount)
+                    {
+                        return UsbStatus.Pipe;
+                    }
+                    if ((index & 0x80) != 0)
+                    {
+                        emulator.setAcceleration((byte)(index & 0x7F), (byte)value);
+                    }
+                    else
+                    {
+                        emulator.setSpeed((byte)index, value);
+                    }
+                    return 0;
+
+                case uscRequest.REQUEST_SET_TARGET:
+                    if (index >= servoCount)
+                    {
+                        return UsbStatus.Pipe;
+                    }
+                    emulator.setTarget((byte)index, value);
+                    return 0;
+
+                case uscRequest.REQUEST_CLEAR_ERRORS:
+                    emulator.clearErrors();
+                    return 0;
+
+                case uscRequest.REQUEST_REINITIALIZE:
+                    reinitialize();
+                    return 0;
+
+                case uscRequest.REQUEST_ERASE_SCRIPT:
+                    for (int i = 0; i < flash.Length; i++)
+                    {
+                        flash[i] = 0xFF;
+                    }
+                    return 0;
+
+                case uscRequest.REQUEST_WRITE_SCRIPT:
+                    if ((index + 1) * 16 > flash.Length || length != 16)
+                    {
+                        return UsbStatus.Pipe;
+                    }
+                    for (int i = 0; i < 16; i++)
+                    {
+                        flash[index * 16 + i] = data[i];
+                    }
+                    return 16;
+
+                case uscRequest.REQUEST_SET_SCRIPT_DONE:
+                    if (value == 0)
+                    {
+                        emulator.resume();
+                    }
+                    else if (value == 1)
+                    {
+                        emulator.stop();
+                    }
+                    else if (value == 2)
+                    {
+                        emulator.resume();
+                        emulator.step();
+                        emulator.stop();
+                    }
+                    else
+                    {
+                        return UsbStatus.Pipe;
+                    }
+                    return 0;
+
+                case uscRequest.REQUEST_RESTART_SCRIPT_AT_SUBROUTINE:
+                    emulator.restartAtSubroutine((byte)index);
+                    emulator.stop();
+                    return 0;
+
+                case uscRequest.REQUEST_RESTART_SCRIPT_AT_SUBROUTINE_WITH_PARAMETER:
+                    emulator.restartAtSubroutine((byte)index, (short)value);
+                    emulator.stop();
+                    return 0;
+
+                case uscRequest.REQUEST_RESTART_SCRIPT:
+                    emulator.restart();
+                    return 0;
+
+                case uscRequest.REQUEST_START_BOOTLOADER:
+                    connected = false;
+                    return 0;
+            }
+
+            if (microMaestro)
+            {
+                // The remaining requests are only supported by the Mini Maestros.
+                return UsbStatus.Pipe;
+            }
+
+            switch ((uscRequest)request)
+            {
+                case uscRequest.REQUEST_GET_SERVO_SETTINGS:
+                    {
+                        ServoStatus* servos = stackalloc ServoStatus[servoCount];
+                        emulator.getServos(servos);
+                        return respond(data, length, servos, servoCount * sizeof(ServoStatus));
+                    }
+
+                case uscRequest.REQUEST_GET_STACK:
+                    return emulator.getStack((short*)data, length / sizeof(short)) * sizeof(short);
+
+                case uscRequest.REQUEST_GET_CALL_STACK:
+                    return emulator.getCallStack((ushort*)data, length / sizeof(ushort)) * sizeof(ushort);
+
+                case uscRequest.REQUEST_SET_PWM:
+                    emulator.setPwm(value, index);
+                    return 0;
+            }
+
+            return UsbStatus.Pipe;
+        }
+    }
+}
@@ -1,11 +1,20 @@
 Usc_lib := $(UsbWrapper_lib) $(Bytecode_lib) $(Sequencer_lib) $(Usc)/Usc.dll
 Targets += $(Usc)/Usc.dll
 
-Usc_csfiles := $(Usc)/ConfigurationFile.cs \
+Usc_csfiles := $(Usc)/CompiledScript.cs \
+  $(Usc)/ConfigurationFile.cs \
   $(Usc)/IUscSettingsHolder.cs \
+  $(Usc)/MaestroStatus.cs \
+  $(Usc)/ScriptCache.cs \
+  $(Usc)/ScriptEmulator.cs \
+  $(Usc)/ScriptTrigger.cs \
+  $(Usc)/ServoFrameScheduler.cs \
+  $(Usc)/ServoTelemetry.cs \
   $(Usc)/Usc.cs \
+  $(Usc)/Usc_motion.cs \
   $(Usc)/Usc_protocol.cs \
-  $(Usc)/UscSettings.cs
+  $(Usc)/UscSettings.cs \
+  $(Usc)/VirtualMaestro.cs
 
 Usc_dlls := $(Bytecode)/Bytecode.dll $(UsbWrapper)/UsbWrapper.dll $(Sequencer)/Sequencer.dll
 
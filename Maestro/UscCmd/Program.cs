@@ -18,6 +18,20 @@ namespace Pololu.Usc.UscCmd
     class Program
     {
         static void Main(string[] args)
+        {
+            try
+            {
+                run(args);
+            }
+            finally
+            {
+                // Write out the trace even if something failed, since that
+                // is when it is most useful.
+                TransferTracer.stop();
+            }
+        }
+
+        static void run(string[] args)
         {
             CommandOptions opts = new CommandOptions(Assembly.GetExecutingAssembly().GetName()+"\n"+
                 "Select one of the following actions:\n"+
@@ -40,7 +54,13 @@ namespace Pololu.Usc.UscCmd
                 "  --speed NUM,SPEED        sets the speed limit of servo NUM\n"+      
                 "  --accel NUM,ACCEL        sets the acceleration of servo NUM to a value 0-255\n"+
                 "Select which device to perform the action on (optional):\n"+
-                "  --device 00001430        (optional) select device #00001430\n",
+                "  --device 00001430        (optional) select device #00001430\n"+
+                "Other options:\n"+
+                "  --stats                  print USB transfer statistics after the action\n"+
+                "  --trace FILE             record every USB transfer in FILE\n"+
+                "  --convert-trace FILE     convert a trace to FILE.json for chrome://tracing\n"+
+                "  --if-changed             with --program or --configure, don't write the\n"+
+                "                           script if the device's script CRC matches it\n",
                 args);
 
             if (opts["list"] != null)
@@ -51,6 +71,16 @@ namespace Pololu.Usc.UscCmd
                 return;
             }
 
+            if (opts["convert-trace"] != null)
+            {
+                if (opts.Count > 1)
+                    opts.error();
+                string filename = opts["convert-trace"];
+                TransferTracer.convertToChromeTrace(filename, filename + ".json");
+                Console.WriteLine("Wrote " + filename + ".json.");
+                return;
+            }
+
             if (opts.Count == 0)
                 opts.error();
 
@@ -97,6 +127,11 @@ namespace Pololu.Usc.UscCmd
 
             Usc usc = new Usc(item);
 
+            if (opts["trace"] != null)
+            {
+                TransferTracer.start(opts["trace"]);
+            }
+
             if (opts["bootloader"] != null)
             {
                 if (opts.Count > 2)
@@ -117,7 +152,7 @@ namespace Pololu.Usc.UscCmd
             }
             else if (opts["configure"] != null)
             {
-                configure(usc, opts["configure"]);
+                configure(usc, opts["configure"], opts["if-changed"] != null);
             }
             else if (opts["restoredefaults"] != null)
             {
@@ -127,7 +162,7 @@ namespace Pololu.Usc.UscCmd
             }
             else if (opts["program"] != null)
             {
-                program(usc, opts["program"]);
+                program(usc, opts["program"], opts["if-changed"] != null);
             }
             else if (opts["stop"] != null)
             {
@@ -252,7 +287,13 @@ namespace Pololu.Usc.UscCmd
                 }
                 Console.WriteLine("");
             }
-            else opts.error();
+            else if (opts["stats"] == null)
+                opts.error();
+
+            if (opts["stats"] != null)
+            {
+                usc.transferStatistics.writeReport(Console.Out);
+            }
         }
 
         static void setScriptDone(Usc usc, byte value)
@@ -352,47 +393,99 @@ namespace Pololu.Usc.UscCmd
             file.Close();
         }
 
-        static void configure(Usc usc, string filename)
+        static void configure(Usc usc, string filename, bool onlyIfChanged)
         {
             Stream file = File.Open(filename, FileMode.Open);
             StreamReader sr = new StreamReader(file);
             List<String> warnings = new List<string>();
-            UscSettings settings = ConfigurationFile.load(sr, warnings);
+            ScriptCache cache = new ScriptCache(ScriptCache.getDefaultDirectory(filename));
+            UscSettings settings = ConfigurationFile.load(sr, warnings, cache);
             usc.fixSettings(settings, warnings);
-            usc.setUscSettings(settings, true);
+            usc.setUscSettings(settings, false);
+            if (!usc.loadScript(settings.script, settings.compiledScript, onlyIfChanged))
+            {
+                System.Console.WriteLine("The device already has this script.");
+            }
             sr.Close();
             file.Close();
             usc.reinitialize();
         }
 
-        static void program(Usc usc, string filename)
+        static void program(Usc usc, string filename, bool onlyIfChanged)
         {
             string text = (new StreamReader(filename)).ReadToEnd();
-            BytecodeProgram program = BytecodeReader.Read(text, usc.servoCount != 6);
-            BytecodeReader.WriteListing(program,filename+".lst");
-
-            usc.setScriptDone(1);
-            usc.eraseScript();
 
-            List<byte> byteList = program.getByteList();
-            if (byteList.Count > usc.maxScriptLength)
+            // The compiled script is kept next to the script file, so
+            // loading the same script again does not compile it again.
+            ScriptCache cache = new ScriptCache(ScriptCache.getDefaultDirectory(filename));
+            BytecodeProgram program;
+            CompiledScript compiledScript = cache.compile(text, usc.servoCount != 6, out program);
+
+            // The listing is written again whenever the script changed since
+            // it was last written, even if the script was in the cache.  The
+            // key of the script it was written for is kept in the cache.
+            string listing = filename + ".lst";
+            string key = ScriptCache.getKey(text, usc.servoCount != 6);
+            string keyFile = Path.Combine(cache.directory, Path.GetFileName(listing) + ".key");
+            if (program != null || !File.Exists(listing) || readKey(keyFile) != key)
             {
-                throw new Exception("Script too long for device (" + byteList.Count + " bytes)");
+                if (program == null)
+                {
+                    program = BytecodeReader.Read(text, usc.servoCount != 6);
+                }
+                BytecodeReader.WriteListing(program, listing);
+                writeKey(keyFile, key);
             }
-            if (byteList.Count < usc.maxScriptLength)
+
+            System.Console.WriteLine("Loading "+compiledScript.bytecode.Length+" bytes...");
+            if (!usc.loadScript(text, compiledScript, onlyIfChanged))
             {
-                byteList.Add((byte)Opcode.QUIT);
+                System.Console.WriteLine("The device already has this script.");
             }
 
-            System.Console.WriteLine("Setting up subroutines...");
-            usc.setSubroutines(program.subroutineAddresses, program.subroutineCommands);
-            
-            System.Console.WriteLine("Loading "+byteList.Count+" bytes...");
-
-            usc.writeScript(byteList);
             System.Console.WriteLine("Restarting...");
             usc.reinitialize();
         }
+
+        /// <summary>
+        /// Reads the script key that a listing was written for, or returns
+        /// null if it is not known.
+        /// </summary>
+        static string readKey(string keyFile)
+        {
+            try
+            {
+                return File.ReadAllText(keyFile);
+            }
+            catch (IOException)
+            {
+                return null;
+            }
+            catch (UnauthorizedAccessException)
+            {
+                return null;
+            }
+        }
+
+        /// <summary>
+        /// Records the script key that a listing was written for, if
+        /// possible.  If it cannot be written, the listing is just written
+        /// again next time.
+        /// </summary>
+        static void writeKey(string keyFile, string key)
+        {
+            try
+            {
+                Directory.CreateDirectory(Path.GetDirectoryName(keyFile));
+                File.WriteAllText(keyFile, key);
+            }
+            catch (IOException)
+            {
+            }
+            catch (UnauthorizedAccessException)
+            {
+            }
+        }
     }
 }
 
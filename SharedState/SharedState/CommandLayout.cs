@@ -0,0 +1,140 @@
+﻿using System;
+using System.Runtime.InteropServices;
+
+namespace Pololu.SharedState
+{
+    /// <summary>
+    /// The commands that can be sent through a command ring.
+    /// </summary>
+    public enum CommandType : byte
+    {
+        None = 0,
+
+        /// <summary>Usc.trySetTarget(channel, value)</summary>
+        MaestroSetTarget = 1,
+
+        /// <summary>Usc.trySetSpeed(channel, value)</summary>
+        MaestroSetSpeed = 2,
+
+        /// <summary>Usc.setAcceleration(channel, value)</summary>
+        MaestroSetAcceleration = 3,
+
+        /// <summary>Jrk.trySetTarget(value)</summary>
+        JrkSetTarget = 4,
+
+        /// <summary>Jrk.motorOff()</summary>
+        JrkMotorOff = 5,
+
+        /// <summary>Smc.trySetSpeed(value)</summary>
+        SmcSetSpeed = 6,
+    }
+
+    /// <summary>
+    /// A command taken from a command ring.
+    /// </summary>
+    public struct Command
+    {
+        /// <summary>
+        /// The number that CommandSender.send returned for this command.
+        /// </summary>
+        public Int64 sequence;
+
+        /// <summary>
+        /// When the command was sent, from Stopwatch.GetTimestamp().
+        /// </summary>
+        public Int64 timestamp;
+
+        public CommandType type;
+
+        /// <summary>
+        /// The slot of the device in the StatePublisher of the process that
+        /// owns the devices.
+        /// </summary>
+        public UInt16 slot;
+
+        /// <summary>
+        /// The Maestro channel, or 0 for other devices.
+        /// </summary>
+        public Byte channel;
+
+        public Int32 value;
+    }
+
+    /// <summary>
+    /// Carries out a command.
+    /// </summary>
+    /// <returns>UsbStatus.Success (0) or a negative UsbStatus error code.</returns>
+    public delegate int CommandExecutor(ref Command command);
+
+    /// <summary>
+    /// The layout of a command ring's shared memory.
+    /// </summary>
+    /// <remarks>
+    /// <code>
+    ///   ring: header (192 bytes) entry[capacity]
+    /// </code>
+    /// The header is split into three 64-byte parts so that the position
+    /// the senders write, the counters the owner writes, and the constant
+    /// fields are on different cache lines.
+    /// </remarks>
+    internal static unsafe class CommandLayout
+    {
+        public const UInt32 magic = 0x52435350;  // "PSCR"
+        public const UInt16 version = 1;
+        public const int headerSize = 192;
+
+        /// <summary>
+        /// The number of channels per device used for coalescing; enough
+        /// for a Mini Maestro 24.
+        /// </summary>
+        public const int maxChannels = 24;
+
+        [StructLayout(LayoutKind.Explicit)]
+        public struct Header
+        {
+            [FieldOffset(0)] public UInt32 magic;
+            [FieldOffset(4)] public UInt16 version;
+            [FieldOffset(8)] public Int32 capacity;
+            [FieldOffset(12)] public Int32 entrySize;
+            [FieldOffset(16)] public Int32 processId;
+            [FieldOffset(24)] public Int64 timestampFrequency;
+
+            /// <summary>
+            /// The number of commands that have been claimed by senders.
+            /// </summary>
+            [FieldOffset(64)] public Int64 writePosition;
+
+            /// <summary>
+            /// The number of commands taken by the owner.
+            /// </summary>
+            [FieldOffset(128)] public Int64 readPosition;
+
+            /// <summary>
+            /// The sequence number of the last command that was carried out
+            /// or dropped; every command up to it is done.
+            /// </summary>
+            [FieldOffset(136)] public Int64 completed;
+            [FieldOffset(144)] public Int64 executed;
+            [FieldOffset(152)] public Int64 coalesced;
+            [FieldOffset(160)] public Int64 failed;
+            [FieldOffset(168)] public Int64 lastFailureSequence;
+            [FieldOffset(176)] public Int32 lastFailureStatus;
+        }
+
+        [StructLayout(LayoutKind.Sequential, Pack = 1)]
+        public struct Entry
+        {
+            /// <summary>
+            /// Equal to the write position when the entry is free, and to the
+            /// write position plus one when it holds that command.
+            /// </summary>
+            public Int64 sequence;
+            public Int64 timestamp;
+            public Int32 value;
+            public UInt16 slot;
+            public CommandType type;
+            public Byte channel;
+            private Int64 reserved;
+        }
+    }
+}
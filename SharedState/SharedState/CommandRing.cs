@@ -0,0 +1,260 @@
+﻿using System;
+using System.Diagnostics;
+using System.Threading;
+
+namespace Pololu.SharedState
+{
+    /// <summary>
+    /// A queue in shared memory that lets any number of processes send
+    /// commands to the devices that one process owns.
+    /// </summary>
+    /// <remarks>
+    /// <para>
+    /// Only one process can connect to a device at a time.  That process
+    /// creates a CommandRing and calls drain regularly; other processes
+    /// open it with a CommandSender and send commands like "set the target
+    /// of channel 3 of the Maestro in slot 0".  Each command gets a sequence
+    /// number, and the owner publishes the sequence number of the last
+    /// command it has carried out, so senders can wait for their commands.
+    /// </para>
+    /// <para>
+    /// The queue is a fixed-size ring of entries, each with its own
+    /// sequence number that says whether it is free or full (a bounded
+    /// queue as described by Dmitry Vyukov).  Senders claim an entry by
+    /// incrementing the ring's write position with a compare-and-swap, so
+    /// they never wait for each other except when they claim the same
+    /// entry at the same time.  The owner copies the commands out and frees
+    /// the entries before it starts any USB transfers, so the ring is only
+    /// full if the senders get a whole ring ahead of the devices.
+    /// If a sender process dies between claiming an entry and filling it in,
+    /// the ring stops at that entry.
+    /// </para>
+    /// <para>
+    /// Before carrying out the commands it took from the ring, drain drops
+    /// the ones that a later command in the same batch makes pointless: a
+    /// command is dropped if the next command for the same device and
+    /// channel is of the same type (for example two targets for the same
+    /// servo in a row; only the second is sent).  Dropped commands count as
+    /// carried out.
+    /// </para>
+    /// </remarks>
+    public unsafe class CommandRing : IDisposable
+    {
+        readonly SharedMemory memory;
+        readonly CommandLayout.Header* header;
+        readonly CommandLayout.Entry* entries;
+        readonly int privateCapacity;
+        readonly int maxDevices;
+
+        // Buffers for drain, so it does not allocate memory.
+        readonly Command[] batch;
+        readonly bool[] superseded;
+        readonly CommandType[] nextType;
+        readonly int[] touched;
+
+        /// <summary>
+        /// Creates the shared memory for the ring.
+        /// </summary>
+        /// <param name="name">The name that senders will use to find the ring.</param>
+        /// <param name="capacity">The number of commands the ring holds; rounded up to a power of two.</param>
+        /// <param name="maxDevices">The number of device slots that commands can refer to.</param>
+        public CommandRing(String name, int capacity, int maxDevices)
+        {
+            if (capacity < 2 || capacity > (1 << 20))
+            {
+                throw new ArgumentException("The capacity must be between 2 and " + (1 << 20) + ".");
+            }
+            if (maxDevices < 1 || maxDevices > UInt16.MaxValue)
+            {
+                throw new ArgumentException("The maximum number of devices must be between 1 and " + UInt16.MaxValue + ".");
+            }
+
+            privateCapacity = 2;
+            while (privateCapacity < capacity)
+            {
+                privateCapacity *= 2;
+            }
+            this.maxDevices = maxDevices;
+
+            memory = SharedMemory.create(name, CommandLayout.headerSize + privateCapacity * sizeof(CommandLayout.Entry));
+            header = (CommandLayout.Header*)memory.pointer;
+            entries = (CommandLayout.Entry*)(memory.pointer + CommandLayout.headerSize);
+
+            // Entry i is free for the command with write position i.
+            for (int i = 0; i < privateCapacity; i++)
+            {
+                entries[i].sequence = i;
+            }
+            header->version = CommandLayout.version;
+            header->capacity = privateCapacity;
+            header->entrySize = sizeof(CommandLayout.Entry);
+            header->processId = Process.GetCurrentProcess().Id;
+            header->timestampFrequency = Stopwatch.Frequency;
+            Thread.VolatileWrite(ref header->magic, CommandLayout.magic);
+
+            batch = new Command[privateCapacity];
+            superseded = new bool[privateCapacity];
+            nextType = new CommandType[maxDevices * CommandLayout.maxChannels];
+            touched = new int[privateCapacity];
+        }
+
+        /// <summary>
+        /// The number of commands the ring holds.
+        /// </summary>
+        public int capacity
+        {
+            get { return privateCapacity; }
+        }
+
+        /// <summary>
+        /// The number of commands that were carried out and worked.
+        /// </summary>
+        public Int64 executed
+        {
+            get { return header->executed; }
+        }
+
+        /// <summary>
+        /// The number of commands that were dropped because a later command
+        /// made them pointless.
+        /// </summary>
+        public Int64 coalesced
+        {
+            get { return header->coalesced; }
+        }
+
+        /// <summary>
+        /// The number of commands that were carried out and failed.
+        /// </summary>
+        public Int64 failed
+        {
+            get { return header->failed; }
+        }
+
+        /// <summary>
+        /// Takes all the commands that are in the ring, drops the ones that
+        /// later commands make pointless, and carries out the rest in order.
+        /// </summary>
+        /// <param name="execute">Carries out one command.</param>
+        /// <returns>The number of commands taken from the ring.</returns>
+        public int drain(CommandExecutor execute)
+        {
+            int count = take();
+            if (count == 0)
+            {
+                return 0;
+            }
+
+            coalesce(count);
+
+            Int64 executedCount = 0, coalescedCount = 0, failedCount = 0;
+            for (int i = 0; i < count; i++)
+            {
+                if (superseded[i])
+                {
+                    coalescedCount++;
+                    continue;
+                }
+
+                int status = execute(ref batch[i]);
+                if (status < 0)
+                {
+                    failedCount++;
+                    header->lastFailureStatus = status;
+                    Interlocked.Exchange(ref header->lastFailureSequence, batch[i].sequence);
+                }
+                else
+                {
+                    executedCount++;
+                }
+            }
+
+            header->executed += executedCount;
+            header->coalesced += coalescedCount;
+            header->failed += failedCount;
+
+            // Tell the senders that everything up to here is done.
+            Interlocked.Exchange(ref header->completed, batch[count - 1].sequence);
+            return count;
+        }
+
+        /// <summary>
+        /// Copies the commands out of the ring into batch and frees their
+        /// entries.
+        /// </summary>
+        int take()
+        {
+            Int64 position = header->readPosition;
+            int count = 0;
+            while (count < privateCapacity)
+            {
+                CommandLayout.Entry* entry = &entries[position & (privateCapacity - 1)];
+                if (Interlocked.Read(ref entry->sequence) != position + 1)
+                {
+                    // Not filled in yet.
+                    break;
+                }
+
+                batch[count].sequence = position + 1;
+                batch[count].timestamp = entry->timestamp;
+                batch[count].type = entry->type;
+                batch[count].slot = entry->slot;
+                batch[count].channel = entry->channel;
+                batch[count].value = entry->value;
+                count++;
+
+                // Free the entry for the command that is a whole ring later.
+                Interlocked.Exchange(ref entry->sequence, position + privateCapacity);
+                position++;
+            }
+            header->readPosition = position;
+            return count;
+        }
+
+        /// <summary>
+        /// Marks the commands in batch that are followed by another command
+        /// of the same type for the same device and channel.
+        /// </summary>
+        void coalesce(int count)
+        {
+            int touchedCount = 0;
+            for (int i = count - 1; i >= 0; i--)
+            {
+                superseded[i] = false;
+                if (batch[i].slot >= maxDevices || batch[i].channel >= CommandLayout.maxChannels)
+                {
+                    continue;
+                }
+
+                int key = batch[i].slot * CommandLayout.maxChannels + batch[i].channel;
+                if (nextType[key] == CommandType.None)
+                {
+                    touched[touchedCount++] = key;
+                }
+                else if (nextType[key] == batch[i].type)
+                {
+                    superseded[i] = true;
+                }
+                nextType[key] = batch[i].type;
+            }
+
+            for (int i = 0; i < touchedCount; i++)
+            {
+                nextType[touched[i]] = CommandType.None;
+            }
+        }
+
+        /// <summary>
+        /// Removes the shared memory.  Commands that were not taken are lost.
+        /// </summary>
+        public void close()
+        {
+            memory.close();
+        }
+
+        public void Dispose()
+        {
+            close();
+        }
+    }
+}
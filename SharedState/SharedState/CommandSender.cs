@@ -0,0 +1,212 @@
+﻿using System;
+using System.Diagnostics;
+using System.Threading;
+
+namespace Pololu.SharedState
+{
+    /// <summary>
+    /// Sends commands through a CommandRing to the process that owns the
+    /// devices.
+    /// </summary>
+    /// <remarks>
+    /// Sending a command only copies it into the shared memory; it does not
+    /// take any locks, make any system calls, or allocate memory.  Any
+    /// number of senders in any number of processes can send at the same
+    /// time, and one sender can be used by several threads at once.
+    /// </remarks>
+    public unsafe class CommandSender : IDisposable
+    {
+        readonly SharedMemory memory;
+        readonly CommandLayout.Header* header;
+        readonly CommandLayout.Entry* entries;
+        readonly int capacity;
+
+        /// <summary>
+        /// Opens a command ring.
+        /// </summary>
+        /// <param name="name">The name that was given to the CommandRing.</param>
+        public CommandSender(String name)
+        {
+            memory = SharedMemory.open(name, true);
+            try
+            {
+                header = (CommandLayout.Header*)memory.pointer;
+                if (memory.size < CommandLayout.headerSize || Thread.VolatileRead(ref header->magic) != CommandLayout.magic)
+                {
+                    throw new Exception("The shared memory " + name + " is not a command ring, or its owner has not finished starting.");
+                }
+                if (header->version != CommandLayout.version)
+                {
+                    throw new Exception("The command ring " + name + " has version " + header->version + ", which is not supported.");
+                }
+
+                capacity = header->capacity;
+                if (capacity < 2 || (capacity & (capacity - 1)) != 0 || header->entrySize != sizeof(CommandLayout.Entry) ||
+                    CommandLayout.headerSize + (long)capacity * sizeof(CommandLayout.Entry) > memory.size)
+                {
+                    throw new Exception("The command ring " + name + " is corrupt.");
+                }
+                entries = (CommandLayout.Entry*)(memory.pointer + CommandLayout.headerSize);
+            }
+            catch
+            {
+                memory.close();
+                throw;
+            }
+        }
+
+        /// <summary>
+        /// Puts a command in the ring.
+        /// </summary>
+        /// <param name="type">The command.</param>
+        /// <param name="slot">The slot of the device, as shown by a StateReader of the same owner.</param>
+        /// <param name="channel">The Maestro channel, or 0 for other devices.</param>
+        /// <param name="value">The target, speed or acceleration.</param>
+        /// <param name="sequence">Receives the sequence number of the command, to pass to isComplete or waitForCompletion.</param>
+        /// <returns>False if the ring is full.</returns>
+        public bool trySend(CommandType type, int slot, byte channel, int value, out Int64 sequence)
+        {
+            Int64 position = Interlocked.Read(ref header->writePosition);
+            CommandLayout.Entry* entry;
+            while (true)
+            {
+                entry = &entries[position & (capacity - 1)];
+                Int64 difference = Interlocked.Read(ref entry->sequence) - position;
+                if (difference == 0)
+                {
+                    // The entry is free; try to claim it.
+                    Int64 previous = Interlocked.CompareExchange(ref header->writePosition, position + 1, position);
+                    if (previous == position)
+                    {
+                        break;
+                    }
+                    position = previous;
+                }
+                else if (difference < 0)
+                {
+                    // The owner has not taken the command a whole ring ago yet.
+                    sequence = 0;
+                    return false;
+                }
+                else
+                {
+                    // Another sender claimed the entry first.
+                    position = Interlocked.Read(ref header->writePosition);
+                }
+            }
+
+            entry->type = type;
+            entry->slot = (UInt16)slot;
+            entry->channel = channel;
+            entry->value = value;
+            entry->timestamp = Stopwatch.GetTimestamp();
+
+            // Interlocked.Exchange makes the command visible before the new sequence.
+            Interlocked.Exchange(ref entry->sequence, position + 1);
+            sequence = position + 1;
+            return true;
+        }
+
+        /// <summary>
+        /// Puts a command in the ring.
+        /// </summary>
+        /// <returns>The sequence number of the command.</returns>
+        /// <exception cref="Exception">The ring is full.</exception>
+        public Int64 send(CommandType type, int slot, byte channel, int value)
+        {
+            Int64 sequence;
+            if (!trySend(type, slot, channel, value, out sequence))
+            {
+                throw new Exception("The command ring is full.  The process that owns the devices might have stopped.");
+            }
+            return sequence;
+        }
+
+        /// <summary>
+        /// The sequence number of the last command that was carried out or
+        /// dropped.  Every command with a smaller sequence number is done too.
+        /// </summary>
+        public Int64 completed
+        {
+            get { return Interlocked.Read(ref header->completed); }
+        }
+
+        public bool isComplete(Int64 sequence)
+        {
+            return completed >= sequence;
+        }
+
+        /// <summary>
+        /// Waits until a command has been carried out or dropped.
+        /// </summary>
+        /// <param name="sequence">The sequence number returned by send.</param>
+        /// <param name="timeout">The longest time to wait, in milliseconds.</param>
+        /// <returns>False if the time ran out.</returns>
+        public bool waitForCompletion(Int64 sequence, int timeout)
+        {
+            Stopwatch stopwatch = Stopwatch.StartNew();
+            for (int attempt = 0; !isComplete(sequence); attempt++)
+            {
+                if (stopwatch.ElapsedMilliseconds >= timeout)
+                {
+                    return false;
+                }
+                if (attempt < 100)
+                {
+                    Thread.SpinWait(20);
+                }
+                else
+                {
+                    Thread.Sleep(attempt < 1000 ? 0 : 1);
+                }
+            }
+            return true;
+        }
+
+        /// <summary>
+        /// The number of commands that were carried out and worked.
+        /// </summary>
+        public Int64 executed
+        {
+            get { return Interlocked.Read(ref header->executed); }
+        }
+
+        /// <summary>
+        /// The number of commands that were dropped because a later command
+        /// made them pointless.
+        /// </summary>
+        public Int64 coalesced
+        {
+            get { return Interlocked.Read(ref header->coalesced); }
+        }
+
+        /// <summary>
+        /// The number of commands that were carried out and failed.
+        /// </summary>
+        public Int64 failed
+        {
+            get { return Interlocked.Read(ref header->failed); }
+        }
+
+        /// <summary>
+        /// Gets the most recent command that failed.
+        /// </summary>
+        /// <param name="sequence">Receives its sequence number, or 0 if no command has failed.</param>
+        /// <param name="status">Receives the negative UsbStatus error code.</param>
+        public void getLastFailure(out Int64 sequence, out int status)
+        {
+            sequence = Interlocked.Read(ref header->lastFailureSequence);
+            status = Thread.VolatileRead(ref header->lastFailureStatus);
+        }
+
+        public void close()
+        {
+            memory.close();
+        }
+
+        public void Dispose()
+        {
+            close();
+        }
+    }
+}
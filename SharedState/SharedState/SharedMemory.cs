@@ -0,0 +1,374 @@
+﻿using System;
+using System.IO;
+using System.Runtime.InteropServices;
+
+namespace Pololu.SharedState
+{
+    /// <summary>
+    /// A named block of memory that several processes can map at the same
+    /// time.  On Linux this is a file in /dev/shm (which is what shm_open
+    /// uses) mapped with mmap; on Windows it is a named file mapping backed
+    /// by the page file.
+    /// </summary>
+    /// <remarks>
+    /// The memory is not cleared or synchronized in any way; that is up to
+    /// the caller.  The .NET Framework 3.5 does not have memory-mapped files,
+    /// so this class calls the operating system directly.
+    /// </remarks>
+    public unsafe class SharedMemory : IDisposable
+    {
+        byte* privatePointer;
+        readonly int privateSize;
+        readonly String name;
+        readonly bool owner;
+        readonly bool privateWritable;
+
+        // Unix: the file that backs the memory, and the lock file that the
+        // owner holds while it publishes.  Windows: the mapping handle.
+        FileStream file;
+        int lockFile = -1;
+        IntPtr mapping;
+
+        static bool isWindows
+        {
+            get
+            {
+                PlatformID platform = Environment.OSVersion.Platform;
+                return platform != PlatformID.Unix && platform != PlatformID.MacOSX && (int)platform != 128;
+            }
+        }
+
+        /// <summary>
+        /// Creates a new block of shared memory filled with zeros.  If a
+        /// block with the same name was left behind by a process that exited,
+        /// it is replaced; processes that still have the old block mapped
+        /// keep seeing the old block.  If another process is still
+        /// publishing a block with the same name, this throws an exception.
+        /// </summary>
+        /// <param name="name">The name of the block.  Only letters, digits, dashes, dots and underscores are allowed.</param>
+        /// <param name="size">The size of the block in bytes.</param>
+        public static SharedMemory create(String name, int size)
+        {
+            return new SharedMemory(name, size, true, true);
+        }
+
+        /// <summary>
+        /// Opens a block of shared memory that another process created.  The
+        /// memory is mapped read-only.
+        /// </summary>
+        /// <param name="name">The name of the block.</param>
+        public static SharedMemory open(String name)
+        {
+            return new SharedMemory(name, 0, false, false);
+        }
+
+        /// <summary>
+        /// Opens a block of shared memory that another process created.
+        /// </summary>
+        /// <param name="name">The name of the block.</param>
+        /// <param name="writable">True to map the memory so it can be written.</param>
+        public static SharedMemory open(String name, bool writable)
+        {
+            return new SharedMemory(name, 0, false, writable);
+        }
+
+        SharedMemory(String name, int size, bool owner, bool writable)
+        {
+            checkName(name);
+            this.name = name;
+            this.owner = owner;
+            this.privateWritable = writable;
+
+            try
+            {
+                if (isWindows)
+                {
+                    privateSize = mapWindows(size);
+                }
+                else
+                {
+                    privateSize = mapUnix(size);
+                }
+            }
+            catch (Exception exception)
+            {
+                close();
+                throw new Exception("There was an error " + (owner ? "creating" : "opening") + " the shared memory " + name + ".", exception);
+            }
+        }
+
+        static void checkName(String name)
+        {
+            if (name == null || name == "" || name == "." || name == "..")
+            {
+                throw new ArgumentException("The shared memory name is empty.");
+            }
+            foreach (char c in name)
+            {
+                if (!Char.IsLetterOrDigit(c) && c != '-' && c != '.' && c != '_')
+                {
+                    throw new ArgumentException("The shared memory name \"" + name + "\" has an invalid character: '" + c + "'.");
+                }
+            }
+        }
+
+        /// <summary>
+        /// The start of the memory.
+        /// </summary>
+        public byte* pointer
+        {
+            get { return privatePointer; }
+        }
+
+        /// <summary>
+        /// The size of the memory in bytes.
+        /// </summary>
+        public int size
+        {
+            get { return privateSize; }
+        }
+
+        /// <summary>
+        /// True if this process can write to the memory.
+        /// </summary>
+        public bool writable
+        {
+            get { return privateWritable; }
+        }
+
+        /// <summary>
+        /// Unmaps the memory.  If this process created it, the name is
+        /// removed so that no new process can open it, but processes that
+        /// already have it open can keep using it.
+        /// </summary>
+        public void close()
+        {
+            if (isWindows)
+            {
+                if (privatePointer != null)
+                {
+                    UnmapViewOfFile((IntPtr)privatePointer);
+                }
+                if (mapping != IntPtr.Zero)
+                {
+                    CloseHandle(mapping);
+                    mapping = IntPtr.Zero;
+                }
+            }
+            else
+            {
+                if (privatePointer != null)
+                {
+                    munmap((IntPtr)privatePointer, (UIntPtr)privateSize);
+                }
+                if (file != null)
+                {
+                    file.Close();
+                    file = null;
+
+                    // Nobody else can have replaced the file while this
+                    // process holds the lock, so it is still ours.
+                    if (owner && lockFile >= 0)
+                    {
+                        try
+                        {
+                            File.Delete(unixPath);
+                        }
+                        catch (IOException)
+                        {
+                        }
+                    }
+                }
+                if (lockFile >= 0)
+                {
+                    sys_close(lockFile);
+                    lockFile = -1;
+                }
+            }
+            privatePointer = null;
+        }
+
+        public void Dispose()
+        {
+            close();
+        }
+
+        #region Unix
+
+        String unixPath
+        {
+            get { return "/dev/shm/" + name; }
+        }
+
+        /// <summary>
+        /// The file that the owner locks with flock while it publishes.  It
+        /// is never deleted, because deleting it would let a second owner
+        /// lock a new file while the first still holds the old one.  The
+        /// lock is released by the operating system if the owner dies.
+        /// </summary>
+        String unixLockPath
+        {
+            get { return "/dev/shm/." + name + ".lock"; }
+        }
+
+        int mapUnix(int size)
+        {
+            if (owner)
+            {
+                lockFile = sys_open(unixLockPath, O_RDWR | O_CREAT | O_CLOEXEC, 0x1B6);
+                if (lockFile < 0)
+                {
+                    throw new Exception("Opening " + unixLockPath + " failed with error " + Marshal.GetLastWin32Error() + ".");
+                }
+                if (flock(lockFile, LOCK_EX | LOCK_NB) != 0)
+                {
+                    int error = Marshal.GetLastWin32Error();
+                    sys_close(lockFile);
+                    lockFile = -1;
+                    if (error == EWOULDBLOCK)
+                    {
+                        throw new Exception("Another process is already publishing shared memory with this name.");
+                    }
+                    throw new Exception("flock failed with error " + error + ".");
+                }
+
+                // A file that is already there was left behind by an owner
+                // that exited.  Delete it instead of truncating it: a process
+                // that still has the old file mapped would crash if it read
+                // past the end of the truncated file.
+                File.Delete(unixPath);
+                file = new FileStream(unixPath, FileMode.CreateNew, FileAccess.ReadWrite, FileShare.ReadWrite);
+                file.SetLength(size);
+            }
+            else
+            {
+                file = new FileStream(unixPath, FileMode.Open, privateWritable ? FileAccess.ReadWrite : FileAccess.Read, FileShare.ReadWrite | FileShare.Delete);
+                size = (int)file.Length;
+            }
+
+            if (size <= 0)
+            {
+                throw new Exception("The shared memory is empty.");
+            }
+
+            IntPtr address = mmap(IntPtr.Zero, (UIntPtr)size, privateWritable ? PROT_READ | PROT_WRITE : PROT_READ,
+                MAP_SHARED, (int)file.SafeFileHandle.DangerousGetHandle(), IntPtr.Zero);
+            if (address == MAP_FAILED)
+            {
+                throw new Exception("mmap failed with error " + Marshal.GetLastWin32Error() + ".");
+            }
+            privatePointer = (byte*)address;
+            return size;
+        }
+
+        const int O_RDWR = 2;
+        const int O_CREAT = 0x40;
+        const int O_CLOEXEC = 0x80000;
+        const int LOCK_EX = 2;
+        const int LOCK_NB = 4;
+        const int EWOULDBLOCK = 11;
+        const int PROT_READ = 1;
+        const int PROT_WRITE = 2;
+        const int MAP_SHARED = 1;
+        static readonly IntPtr MAP_FAILED = new IntPtr(-1);
+
+        [DllImport("libc", SetLastError = true)]
+        static extern IntPtr mmap(IntPtr addr, UIntPtr length, int prot, int flags, int fd, IntPtr offset);
+
+        [DllImport("libc", SetLastError = true)]
+        static extern int munmap(IntPtr addr, UIntPtr length);
+
+        [DllImport("libc", EntryPoint = "open", SetLastError = true)]
+        static extern int sys_open(String path, int flags, int mode);
+
+        [DllImport("libc", EntryPoint = "close", SetLastError = true)]
+        static extern int sys_close(int fd);
+
+        [DllImport("libc", SetLastError = true)]
+        static extern int flock(int fd, int operation);
+
+        #endregion
+
+        #region Windows
+
+        int mapWindows(int size)
+        {
+            // The "Local\" prefix puts the name in the session's namespace,
+            // which does not require any special privileges.
+            String mappingName = "Local\\" + name;
+            if (owner)
+            {
+                mapping = CreateFileMapping(INVALID_HANDLE_VALUE, IntPtr.Zero, PAGE_READWRITE, 0, (UInt32)size, mappingName);
+                if (mapping != IntPtr.Zero && Marshal.GetLastWin32Error() == ERROR_ALREADY_EXISTS)
+                {
+                    throw new Exception("Another process is already publishing shared memory with this name.");
+                }
+            }
+            else
+            {
+                mapping = OpenFileMapping(privateWritable ? FILE_MAP_WRITE : FILE_MAP_READ, false, mappingName);
+            }
+            if (mapping == IntPtr.Zero)
+            {
+                throw new Exception("Windows error " + Marshal.GetLastWin32Error() + ".");
+            }
+
+            IntPtr address = MapViewOfFile(mapping, privateWritable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, UIntPtr.Zero);
+            if (address == IntPtr.Zero)
+            {
+                throw new Exception("MapViewOfFile failed with Windows error " + Marshal.GetLastWin32Error() + ".");
+            }
+            privatePointer = (byte*)address;
+
+            if (!owner)
+            {
+                // The view covers the whole mapping, rounded up to a page.
+                MEMORY_BASIC_INFORMATION info;
+                if (VirtualQuery(address, out info, (UIntPtr)sizeof(MEMORY_BASIC_INFORMATION)) == UIntPtr.Zero)
+                {
+                    throw new Exception("VirtualQuery failed with Windows error " + Marshal.GetLastWin32Error() + ".");
+                }
+                size = (int)(UInt64)info.RegionSize;
+            }
+            return size;
+        }
+
+        static readonly IntPtr INVALID_HANDLE_VALUE = new IntPtr(-1);
+        const UInt32 PAGE_READWRITE = 0x04;
+        const UInt32 FILE_MAP_WRITE = 0x02;
+        const UInt32 FILE_MAP_READ = 0x04;
+        const int ERROR_ALREADY_EXISTS = 183;
+
+        [StructLayout(LayoutKind.Sequential)]
+        struct MEMORY_BASIC_INFORMATION
+        {
+            public IntPtr BaseAddress;
+            public IntPtr AllocationBase;
+            public UInt32 AllocationProtect;
+            public UIntPtr RegionSize;
+            public UInt32 State;
+            public UInt32 Protect;
+            public UInt32 Type;
+        }
+
+        [DllImport("kernel32.dll", SetLastError = true, CharSet = CharSet.Unicode)]
+        static extern IntPtr CreateFileMapping(IntPtr hFile, IntPtr lpAttributes, UInt32 flProtect, UInt32 dwMaximumSizeHigh, UInt32 dwMaximumSizeLow, String lpName);
+
+        [DllImport("kernel32.dll", SetLastError = true, CharSet = CharSet.Unicode)]
+        static extern IntPtr OpenFileMapping(UInt32 dwDesiredAccess, Boolean bInheritHandle, String lpName);
+
+        [DllImport("kernel32.dll", SetLastError = true)]
+        static extern IntPtr MapViewOfFile(IntPtr hFileMappingObject, UInt32 dwDesiredAccess, UInt32 dwFileOffsetHigh, UInt32 dwFileOffsetLow, UIntPtr dwNumberOfBytesToMap);
+
+        [DllImport("kernel32.dll", SetLastError = true)]
+        static extern Boolean UnmapViewOfFile(IntPtr lpBaseAddress);
+
+        [DllImport("kernel32.dll", SetLastError = true)]
+        static extern UIntPtr VirtualQuery(IntPtr lpAddress, out MEMORY_BASIC_INFORMATION lpBuffer, UIntPtr dwLength);
+
+        [DllImport("kernel32.dll", SetLastError = true)]
+        static extern Boolean CloseHandle(IntPtr hObject);
+
+        #endregion
+    }
+}
@@ -0,0 +1,191 @@
+﻿using System;
+using System.Runtime.InteropServices;
+using System.Threading;
+using Pololu.Usc;
+using Pololu.Jrk;
+using Pololu.SimpleMotorControllerG2;
+
+namespace Pololu.SharedState
+{
+    /// <summary>
+    /// The kinds of device that can be published.
+    /// </summary>
+    public enum DeviceKind : byte
+    {
+        None = 0,
+        Maestro = 1,
+        Jrk = 2,
+        Smc = 3,
+    }
+
+    /// <summary>
+    /// Describes one reading of a device's variables.
+    /// </summary>
+    public struct StateStamp
+    {
+        /// <summary>
+        /// The time when the variables were read from the device, from
+        /// Stopwatch.GetTimestamp().  The Stopwatch uses a clock that is
+        /// shared by all processes, so this can be compared to the reader's
+        /// own Stopwatch.GetTimestamp().
+        /// </summary>
+        public Int64 timestamp;
+
+        /// <summary>
+        /// The number of times the variables have been read from the device.
+        /// When this changes, there are new variables.
+        /// </summary>
+        public UInt32 updates;
+
+        /// <summary>
+        /// UsbStatus.Success (0) if the last attempt to read the device
+        /// worked, or the negative UsbStatus error code if it did not (for
+        /// example if the device was unplugged).  If it is an error, the
+        /// variables are the ones from the last attempt that worked.
+        /// </summary>
+        public Int32 status;
+    }
+
+    /// <summary>
+    /// The layout of a shared state segment.
+    /// </summary>
+    /// <remarks>
+    /// <code>
+    ///   segment: header (64 bytes) slot*
+    ///   slot:    slot header (64 bytes) payload
+    ///   payload: Maestro: MaestroVariables ServoStatus[servoCount]
+    ///            Jrk:     jrkVariables
+    ///            Smc:     SmcVariables
+    /// </code>
+    /// There is one writer, the publisher, and any number of readers.
+    /// Each slot is protected by a sequence lock: the sequence number is odd
+    /// while the writer is changing the slot and is incremented again when
+    /// it is done.  A reader copies the slot and then checks that the
+    /// sequence number was even and did not change; if it did, the copy
+    /// might be torn, so it tries again.  Readers never write to the
+    /// segment, so they cannot slow the writer down or each other.
+    /// The slots are a multiple of 64 bytes (the usual cache line size)
+    /// apart so that writing one slot does not disturb readers of another.
+    /// </remarks>
+    internal static unsafe class StateLayout
+    {
+        public const UInt32 magic = 0x54535350;  // "PSST"
+        public const UInt16 version = 1;
+        public const int headerSize = 64;
+        public const int slotHeaderSize = 64;
+        public const int maxServos = 24;
+        public const int serialNumberLength = 32;
+
+        /// <summary>
+        /// The number of attempts a reader makes before giving up.  The
+        /// writer only holds a slot for as long as it takes to copy a few
+        /// hundred bytes, so this is only reached if the publisher died in
+        /// the middle of writing.
+        /// </summary>
+        public const int readAttempts = 100000;
+
+        [StructLayout(LayoutKind.Sequential, Pack = 1)]
+        public struct Header
+        {
+            public UInt32 magic;
+            public UInt16 version;
+            public UInt16 slotCount;
+            public Int32 slotSize;
+            public Int32 processId;
+            public Int64 timestampFrequency;
+
+            /// <summary>
+            /// The number of slots in use.  Incremented after the slot is
+            /// filled in.
+            /// </summary>
+            public Int32 deviceCount;
+
+            /// <summary>
+            /// Protects heartbeat, which is written every time the publisher
+            /// finishes polling all of the devices.
+            /// </summary>
+            public Int32 heartbeatSequence;
+            public Int64 heartbeat;
+        }
+
+        [StructLayout(LayoutKind.Sequential, Pack = 1)]
+        public struct SlotHeader
+        {
+            public Int32 sequence;
+            public Int32 status;
+            public Int64 timestamp;
+            public UInt32 updates;
+
+            // These are written once, before the slot is counted in
+            // deviceCount, and never change.
+            public DeviceKind kind;
+            public Byte servoCount;
+            public UInt16 productId;
+            public fixed byte serialNumber[serialNumberLength];
+        }
+
+        /// <summary>
+        /// The size of the largest payload rounded up so that the slots are
+        /// a multiple of 64 bytes.
+        /// </summary>
+        public static int slotSize
+        {
+            get
+            {
+                int payload = sizeof(MaestroVariables) + maxServos * sizeof(ServoStatus);
+                payload = Math.Max(payload, sizeof(jrkVariables));
+                payload = Math.Max(payload, sizeof(SmcVariables));
+                return slotHeaderSize + (payload + 63) / 64 * 64;
+            }
+        }
+
+        public static void beginWrite(Int32* sequence)
+        {
+            Thread.VolatileWrite(ref *sequence, *sequence + 1);
+
+            // Make sure no reader sees the new data with the old sequence number.
+            Thread.MemoryBarrier();
+        }
+
+        public static void endWrite(Int32* sequence)
+        {
+            // VolatileWrite makes all the writes before it visible first.
+            Thread.VolatileWrite(ref *sequence, *sequence + 1);
+        }
+
+        /// <summary>
+        /// Starts reading data protected by a sequence number.  Returns
+        /// false if the writer is in the middle of writing.
+        /// </summary>
+        public static bool beginRead(Int32* sequence, out Int32 start)
+        {
+            start = Thread.VolatileRead(ref *sequence);
+            return (start & 1) == 0;
+        }
+
+        /// <summary>
+        /// Returns true if the data read since beginRead is consistent.
+        /// </summary>
+        public static bool endRead(Int32* sequence, Int32 start)
+        {
+            // Make sure the data is read before the sequence number is read again.
+            Thread.MemoryBarrier();
+            return Thread.VolatileRead(ref *sequence) == start;
+        }
+
+        /// <summary>
+        /// Waits a little before trying to read again.
+        /// </summary>
+        public static void backOff(int attempt)
+        {
+            if (attempt < 100)
+            {
+                Thread.SpinWait(20);
+            }
+            else
+            {
+                Thread.Sleep(0);
+            }
+        }
+    }
+}
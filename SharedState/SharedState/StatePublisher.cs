@@ -0,0 +1,226 @@
+﻿using System;
+using System.Diagnostics;
+using System.Threading;
+using Pololu.Usc;
+using Pololu.Jrk;
+using Pololu.SimpleMotorControllerG2;
+
+namespace Pololu.SharedState
+{
+    /// <summary>
+    /// Publishes the latest variables of some devices in shared memory so
+    /// that other processes can read them with a StateReader without
+    /// connecting to the devices.
+    /// </summary>
+    /// <remarks>
+    /// Only one process can connect to a device at a time, so when several
+    /// programs need the variables of the same device (for example a GUI, a
+    /// logger and a control loop), one process should own the device, read
+    /// its variables, and publish them with this class.  See the
+    /// SharedStateServer program.
+    /// Only one thread should publish to a given slot at a time.
+    /// </remarks>
+    public unsafe class StatePublisher : IDisposable
+    {
+        readonly SharedMemory memory;
+        readonly StateLayout.Header* header;
+        readonly int slotSize;
+
+        /// <summary>
+        /// Creates the shared memory.
+        /// </summary>
+        /// <param name="name">The name that readers will use to find the memory.</param>
+        /// <param name="maxDevices">The number of devices that can be added.</param>
+        public StatePublisher(String name, int maxDevices)
+        {
+            if (maxDevices < 1 || maxDevices > UInt16.MaxValue)
+            {
+                throw new ArgumentException("The maximum number of devices must be between 1 and " + UInt16.MaxValue + ".");
+            }
+
+            slotSize = StateLayout.slotSize;
+            memory = SharedMemory.create(name, StateLayout.headerSize + maxDevices * slotSize);
+            header = (StateLayout.Header*)memory.pointer;
+            header->version = StateLayout.version;
+            header->slotCount = (UInt16)maxDevices;
+            header->slotSize = slotSize;
+            header->processId = Process.GetCurrentProcess().Id;
+            header->timestampFrequency = Stopwatch.Frequency;
+            header->heartbeat = Stopwatch.GetTimestamp();
+
+            // Readers check the magic number first, so it is written last.
+            Thread.VolatileWrite(ref header->magic, StateLayout.magic);
+        }
+
+        /// <summary>
+        /// The number of devices added so far.
+        /// </summary>
+        public int deviceCount
+        {
+            get { return header->deviceCount; }
+        }
+
+        /// <summary>
+        /// The number of devices that can be added.
+        /// </summary>
+        public int maxDevices
+        {
+            get { return header->slotCount; }
+        }
+
+        StateLayout.SlotHeader* getSlot(int slot)
+        {
+            if (slot < 0 || slot >= header->deviceCount)
+            {
+                throw new ArgumentOutOfRangeException("slot");
+            }
+            return (StateLayout.SlotHeader*)(memory.pointer + StateLayout.headerSize + slot * slotSize);
+        }
+
+        /// <summary>
+        /// Adds a device.  Readers will see it right away, with a stamp whose
+        /// updates count is 0 until the first call to publish.
+        /// </summary>
+        /// <param name="kind">The kind of device.</param>
+        /// <param name="serialNumber">The serial number, which is how readers find the device.</param>
+        /// <param name="productId">The USB product ID, which tells the models of Maestro and Simple Motor Controller apart.</param>
+        /// <param name="servoCount">The number of channels of a Maestro; 0 for other devices.</param>
+        /// <returns>The slot number to pass to publish.</returns>
+        public int addDevice(DeviceKind kind, String serialNumber, UInt16 productId, int servoCount)
+        {
+            if (header->deviceCount >= header->slotCount)
+            {
+                throw new Exception("No more than " + header->slotCount + " devices can be published.");
+            }
+            if (servoCount < 0 || servoCount > StateLayout.maxServos)
+            {
+                throw new ArgumentException("The servo count must be between 0 and " + StateLayout.maxServos + ".");
+            }
+
+            int slot = header->deviceCount;
+            StateLayout.SlotHeader* slotHeader = (StateLayout.SlotHeader*)(memory.pointer + StateLayout.headerSize + slot * slotSize);
+            slotHeader->kind = kind;
+            slotHeader->productId = productId;
+            slotHeader->servoCount = (byte)servoCount;
+            for (int i = 0; i < StateLayout.serialNumberLength - 1 && i < serialNumber.Length; i++)
+            {
+                slotHeader->serialNumber[i] = (byte)serialNumber[i];
+            }
+
+            // The slot must be filled in before readers can see it.
+            Thread.VolatileWrite(ref header->deviceCount, slot + 1);
+            return slot;
+        }
+
+        /// <summary>
+        /// Publishes the variables of a Maestro.
+        /// </summary>
+        /// <param name="slot">The slot returned by addDevice.</param>
+        /// <param name="variables">The variables.</param>
+        /// <param name="servos">The status of each channel; must have at least servoCount elements.</param>
+        public void publish(int slot, ref MaestroVariables variables, ServoStatus[] servos)
+        {
+            StateLayout.SlotHeader* slotHeader = getSlot(slot, DeviceKind.Maestro);
+            if (servos.Length < slotHeader->servoCount)
+            {
+                throw new ArgumentException("There must be at least " + slotHeader->servoCount + " servo statuses.");
+            }
+
+            Int64 timestamp = Stopwatch.GetTimestamp();
+            byte* payload = (byte*)slotHeader + StateLayout.slotHeaderSize;
+            StateLayout.beginWrite(&slotHeader->sequence);
+            *(MaestroVariables*)payload = variables;
+            ServoStatus* status = (ServoStatus*)(payload + sizeof(MaestroVariables));
+            for (int i = 0; i < slotHeader->servoCount; i++)
+            {
+                status[i] = servos[i];
+            }
+            stamp(slotHeader, timestamp);
+            StateLayout.endWrite(&slotHeader->sequence);
+        }
+
+        /// <summary>
+        /// Publishes the variables of a jrk.
+        /// </summary>
+        public void publish(int slot, ref jrkVariables variables)
+        {
+            StateLayout.SlotHeader* slotHeader = getSlot(slot, DeviceKind.Jrk);
+            Int64 timestamp = Stopwatch.GetTimestamp();
+            StateLayout.beginWrite(&slotHeader->sequence);
+            *(jrkVariables*)((byte*)slotHeader + StateLayout.slotHeaderSize) = variables;
+            stamp(slotHeader, timestamp);
+            StateLayout.endWrite(&slotHeader->sequence);
+        }
+
+        /// <summary>
+        /// Publishes the variables of a Simple Motor Controller G2.
+        /// </summary>
+        public void publish(int slot, ref SmcVariables variables)
+        {
+            StateLayout.SlotHeader* slotHeader = getSlot(slot, DeviceKind.Smc);
+            Int64 timestamp = Stopwatch.GetTimestamp();
+            StateLayout.beginWrite(&slotHeader->sequence);
+            *(SmcVariables*)((byte*)slotHeader + StateLayout.slotHeaderSize) = variables;
+            stamp(slotHeader, timestamp);
+            StateLayout.endWrite(&slotHeader->sequence);
+        }
+
+        /// <summary>
+        /// Tells readers that the variables of a device could not be read.
+        /// The last variables that were published stay in the slot.
+        /// </summary>
+        /// <param name="slot">The slot returned by addDevice.</param>
+        /// <param name="status">The negative UsbStatus error code.</param>
+        public void publishError(int slot, int status)
+        {
+            StateLayout.SlotHeader* slotHeader = getSlot(slot);
+            StateLayout.beginWrite(&slotHeader->sequence);
+            slotHeader->status = status;
+            StateLayout.endWrite(&slotHeader->sequence);
+        }
+
+        /// <summary>
+        /// Records that the publisher is still running.  Call this after
+        /// each round of polling, so that readers can tell the difference
+        /// between a device whose variables have not changed and a publisher
+        /// that has stopped.
+        /// </summary>
+        public void heartbeat()
+        {
+            StateLayout.beginWrite(&header->heartbeatSequence);
+            header->heartbeat = Stopwatch.GetTimestamp();
+            StateLayout.endWrite(&header->heartbeatSequence);
+        }
+
+        StateLayout.SlotHeader* getSlot(int slot, DeviceKind kind)
+        {
+            StateLayout.SlotHeader* slotHeader = getSlot(slot);
+            if (slotHeader->kind != kind)
+            {
+                throw new ArgumentException("Slot " + slot + " is for a " + slotHeader->kind + ", not a " + kind + ".");
+            }
+            return slotHeader;
+        }
+
+        static void stamp(StateLayout.SlotHeader* slotHeader, Int64 timestamp)
+        {
+            slotHeader->timestamp = timestamp;
+            slotHeader->updates++;
+            slotHeader->status = 0;
+        }
+
+        /// <summary>
+        /// Removes the shared memory.  Readers that have it open can still
+        /// read the last variables, but the heartbeat stops.
+        /// </summary>
+        public void close()
+        {
+            memory.close();
+        }
+
+        public void Dispose()
+        {
+            close();
+        }
+    }
+}
@@ -0,0 +1,333 @@
+﻿using System;
+using System.Diagnostics;
+using System.Text;
+using System.Threading;
+using Pololu.Usc;
+using Pololu.Jrk;
+using Pololu.SimpleMotorControllerG2;
+
+namespace Pololu.SharedState
+{
+    /// <summary>
+    /// Reads device variables published by a StatePublisher in another
+    /// process (or the same one).
+    /// </summary>
+    /// <remarks>
+    /// Reading does not take any locks, make any system calls, allocate
+    /// memory, or write to the shared memory: the variables are copied
+    /// straight from the shared memory into the caller's variables.  Any
+    /// number of readers in any number of processes can read at the same
+    /// time without slowing each other or the publisher down.
+    /// A reader can be used by several threads at once.
+    /// </remarks>
+    public unsafe class StateReader : IDisposable
+    {
+        readonly SharedMemory memory;
+        readonly StateLayout.Header* header;
+        readonly int slotSize;
+        readonly int slotCount;
+
+        /// <summary>
+        /// Opens the shared memory of a publisher.
+        /// </summary>
+        /// <param name="name">The name that was given to the StatePublisher.</param>
+        public StateReader(String name)
+        {
+            memory = SharedMemory.open(name);
+            try
+            {
+                header = (StateLayout.Header*)memory.pointer;
+                if (memory.size < StateLayout.headerSize || Thread.VolatileRead(ref header->magic) != StateLayout.magic)
+                {
+                    throw new Exception("The shared memory " + name + " does not contain device variables, or the publisher has not finished starting.");
+                }
+                if (header->version != StateLayout.version)
+                {
+                    throw new Exception("The shared memory " + name + " has version " + header->version + ", which is not supported.");
+                }
+
+                slotSize = header->slotSize;
+                slotCount = header->slotCount;
+                if (slotSize < StateLayout.slotSize || StateLayout.headerSize + (long)slotCount * slotSize > memory.size)
+                {
+                    throw new Exception("The shared memory " + name + " is corrupt.");
+                }
+            }
+            catch
+            {
+                memory.close();
+                throw;
+            }
+        }
+
+        /// <summary>
+        /// The number of devices that have been published.  This can go up
+        /// while the reader is open.
+        /// </summary>
+        public int deviceCount
+        {
+            get { return Math.Min(Thread.VolatileRead(ref header->deviceCount), slotCount); }
+        }
+
+        /// <summary>
+        /// The process ID of the publisher.
+        /// </summary>
+        public int publisherProcessId
+        {
+            get { return header->processId; }
+        }
+
+        /// <summary>
+        /// The number of timestamp ticks per second.
+        /// </summary>
+        public Int64 timestampFrequency
+        {
+            get { return header->timestampFrequency; }
+        }
+
+        /// <summary>
+        /// The time when the publisher last finished polling all the
+        /// devices, from Stopwatch.GetTimestamp().  If this stops changing,
+        /// the publisher has stopped.
+        /// </summary>
+        public Int64 heartbeat
+        {
+            get
+            {
+                for (int attempt = 0; attempt < StateLayout.readAttempts; attempt++)
+                {
+                    Int32 start;
+                    if (StateLayout.beginRead(&header->heartbeatSequence, out start))
+                    {
+                        Int64 value = header->heartbeat;
+                        if (StateLayout.endRead(&header->heartbeatSequence, start))
+                        {
+                            return value;
+                        }
+                    }
+                    StateLayout.backOff(attempt);
+                }
+                return 0;
+            }
+        }
+
+        /// <summary>
+        /// Returns how many seconds ago a timestamp (like StateStamp.timestamp
+        /// or heartbeat) was taken.
+        /// </summary>
+        public double secondsSince(Int64 timestamp)
+        {
+            return (double)(Stopwatch.GetTimestamp() - timestamp) / header->timestampFrequency;
+        }
+
+        StateLayout.SlotHeader* getSlot(int slot)
+        {
+            if (slot < 0 || slot >= deviceCount)
+            {
+                throw new ArgumentOutOfRangeException("slot");
+            }
+            return (StateLayout.SlotHeader*)(memory.pointer + StateLayout.headerSize + slot * slotSize);
+        }
+
+        StateLayout.SlotHeader* getSlot(int slot, DeviceKind kind)
+        {
+            StateLayout.SlotHeader* slotHeader = getSlot(slot);
+            if (slotHeader->kind != kind)
+            {
+                throw new ArgumentException("Slot " + slot + " is for a " + slotHeader->kind + ", not a " + kind + ".");
+            }
+            return slotHeader;
+        }
+
+        public DeviceKind getKind(int slot)
+        {
+            return getSlot(slot)->kind;
+        }
+
+        public UInt16 getProductId(int slot)
+        {
+            return getSlot(slot)->productId;
+        }
+
+        /// <summary>
+        /// The number of channels of a Maestro, or 0 for other devices.
+        /// </summary>
+        public int getServoCount(int slot)
+        {
+            return getSlot(slot)->servoCount;
+        }
+
+        public String getSerialNumber(int slot)
+        {
+            StateLayout.SlotHeader* slotHeader = getSlot(slot);
+            StringBuilder serialNumber = new StringBuilder();
+            for (int i = 0; i < StateLayout.serialNumberLength && slotHeader->serialNumber[i] != 0; i++)
+            {
+                serialNumber.Append((char)slotHeader->serialNumber[i]);
+            }
+            return serialNumber.ToString();
+        }
+
+        /// <summary>
+        /// Finds the slot of a device.
+        /// </summary>
+        /// <param name="serialNumber">The serial number of the device.</param>
+        /// <returns>The slot, or -1 if the device has not been published.</returns>
+        public int findDevice(String serialNumber)
+        {
+            int count = deviceCount;
+            for (int slot = 0; slot < count; slot++)
+            {
+                if (getSerialNumber(slot) == serialNumber)
+                {
+                    return slot;
+                }
+            }
+            return -1;
+        }
+
+        /// <summary>
+        /// Reads just the stamp of a device, which is a quick way to find out
+        /// whether there are new variables.
+        /// </summary>
+        /// <returns>False if the publisher stopped in the middle of writing the slot.</returns>
+        public bool tryReadStamp(int slot, out StateStamp stamp)
+        {
+            StateLayout.SlotHeader* slotHeader = getSlot(slot);
+            for (int attempt = 0; attempt < StateLayout.readAttempts; attempt++)
+            {
+                Int32 start;
+                if (StateLayout.beginRead(&slotHeader->sequence, out start))
+                {
+                    readStamp(slotHeader, out stamp);
+                    if (StateLayout.endRead(&slotHeader->sequence, start))
+                    {
+                        return true;
+                    }
+                }
+                StateLayout.backOff(attempt);
+            }
+            stamp = new StateStamp();
+            return false;
+        }
+
+        /// <summary>
+        /// Reads the variables of a Maestro.
+        /// </summary>
+        /// <param name="slot">The slot of the Maestro.</param>
+        /// <param name="variables">Receives the variables.</param>
+        /// <param name="servos">
+        ///   An array of at least getServoCount(slot) elements that receives
+        ///   the status of each channel, or null.
+        /// </param>
+        /// <param name="stamp">Receives the time and number of the update.</param>
+        /// <returns>False if the publisher stopped in the middle of writing the slot.</returns>
+        public bool tryRead(int slot, out MaestroVariables variables, ServoStatus[] servos, out StateStamp stamp)
+        {
+            StateLayout.SlotHeader* slotHeader = getSlot(slot, DeviceKind.Maestro);
+            int servoCount = slotHeader->servoCount;
+            if (servos != null && servos.Length < servoCount)
+            {
+                throw new ArgumentException("There must be room for " + servoCount + " servo statuses.");
+            }
+
+            byte* payload = (byte*)slotHeader + StateLayout.slotHeaderSize;
+            ServoStatus* source = (ServoStatus*)(payload + sizeof(MaestroVariables));
+            for (int attempt = 0; attempt < StateLayout.readAttempts; attempt++)
+            {
+                Int32 start;
+                if (StateLayout.beginRead(&slotHeader->sequence, out start))
+                {
+                    variables = *(MaestroVariables*)payload;
+                    if (servos != null)
+                    {
+                        for (int i = 0; i < servoCount; i++)
+                        {
+                            servos[i] = source[i];
+                        }
+                    }
+                    readStamp(slotHeader, out stamp);
+                    if (StateLayout.endRead(&slotHeader->sequence, start))
+                    {
+                        return true;
+                    }
+                }
+                StateLayout.backOff(attempt);
+            }
+            variables = new MaestroVariables();
+            stamp = new StateStamp();
+            return false;
+        }
+
+        /// <summary>
+        /// Reads the variables of a jrk.
+        /// </summary>
+        /// <returns>False if the publisher stopped in the middle of writing the slot.</returns>
+        public bool tryRead(int slot, out jrkVariables variables, out StateStamp stamp)
+        {
+            StateLayout.SlotHeader* slotHeader = getSlot(slot, DeviceKind.Jrk);
+            jrkVariables* payload = (jrkVariables*)((byte*)slotHeader + StateLayout.slotHeaderSize);
+            for (int attempt = 0; attempt < StateLayout.readAttempts; attempt++)
+            {
+                Int32 start;
+                if (StateLayout.beginRead(&slotHeader->sequence, out start))
+                {
+                    variables = *payload;
+                    readStamp(slotHeader, out stamp);
+                    if (StateLayout.endRead(&slotHeader->sequence, start))
+                    {
+                        return true;
+                    }
+                }
+                StateLayout.backOff(attempt);
+            }
+            variables = new jrkVariables();
+            stamp = new StateStamp();
+            return false;
+        }
+
+        /// <summary>
+        /// Reads the variables of a Simple Motor Controller G2.
+        /// </summary>
+        /// <returns>False if the publisher stopped in the middle of writing the slot.</returns>
+        public bool tryRead(int slot, out SmcVariables variables, out StateStamp stamp)
+        {
+            StateLayout.SlotHeader* slotHeader = getSlot(slot, DeviceKind.Smc);
+            SmcVariables* payload = (SmcVariables*)((byte*)slotHeader + StateLayout.slotHeaderSize);
+            for (int attempt = 0; attempt < StateLayout.readAttempts; attempt++)
+            {
+                Int32 start;
+                if (StateLayout.beginRead(&slotHeader->sequence, out start))
+                {
+                    variables = *payload;
+                    readStamp(slotHeader, out stamp);
+                    if (StateLayout.endRead(&slotHeader->sequence, start))
+                    {
+                        return true;
+                    }
+                }
+                StateLayout.backOff(attempt);
+            }
+            variables = new SmcVariables();
+            stamp = new StateStamp();
+            return false;
+        }
+
+        static void readStamp(StateLayout.SlotHeader* slotHeader, out StateStamp stamp)
+        {
+            stamp.timestamp = slotHeader->timestamp;
+            stamp.updates = slotHeader->updates;
+            stamp.status = slotHeader->status;
+        }
+
+        public void close()
+        {
+            memory.close();
+        }
+
+        public void Dispose()
+        {
+            close();
+        }
+    }
+}
@@ -0,0 +1,9 @@
+SharedState_lib := $(sort $(Usc_lib) $(Jrk_lib) $(SmcG2_lib)) $(SharedState)/SharedState.dll
+Targets += $(SharedState)/SharedState.dll
+
+SharedState_csfiles := $(wildcard $(SharedState)/*.cs) $(SharedState)/Properties/AssemblyInfo.cs
+
+SharedState_dlls := $(Bytecode)/Bytecode.dll $(UsbWrapper)/UsbWrapper.dll $(Usc)/Usc.dll $(Jrk)/Jrk.dll $(SmcG2)/SmcG2.dll
+
+$(SharedState)/SharedState.dll: $(SharedState_dlls) $(SharedState_csfiles)
+	$(CS) -target:library -out:$@ $(foreach dll, $(SharedState_dlls),-r:$(dll)) $(SharedState_csfiles)
@@ -0,0 +1,365 @@
+﻿using System;
+using System.Collections.Generic;
+using System.Diagnostics;
+using System.Reflection;
+using System.Threading;
+using Pololu.UsbWrapper;
+using Pololu.Usc;
+using Pololu.Jrk;
+using Pololu.SimpleMotorControllerG2;
+using Pololu.SharedState;
+
+namespace Pololu.SharedState.SharedStateServer
+{
+    /// <summary>
+    /// One device that the server polls.
+    /// </summary>
+    class PolledDevice
+    {
+        public DeviceKind kind;
+        public String serialNumber;
+        public int slot;
+
+        /// <summary>
+        /// The connection to the device, or null if it is disconnected.
+        /// </summary>
+        public UsbDevice device;
+
+        // Buffers for the variables, so polling does not allocate memory.
+        public MaestroVariables maestroVariables;
+        public ServoStatus[] servos;
+        public jrkVariables jrkVariables;
+        public SmcVariables smcVariables;
+
+        /// <summary>
+        /// Reads the variables of the device and publishes them.
+        /// </summary>
+        /// <returns>UsbStatus.Success (0) or a negative UsbStatus error code.</returns>
+        public int poll(StatePublisher publisher)
+        {
+            int result;
+            switch (kind)
+            {
+                case DeviceKind.Maestro:
+                    result = ((Usc.Usc)device).tryGetVariables(out maestroVariables, servos);
+                    if (result >= 0)
+                    {
+                        publisher.publish(slot, ref maestroVariables, servos);
+                    }
+                    break;
+
+                case DeviceKind.Jrk:
+                    result = ((Jrk.Jrk)device).tryGetVariables(out jrkVariables);
+                    if (result >= 0)
+                    {
+                        publisher.publish(slot, ref jrkVariables);
+                    }
+                    break;
+
+                default:
+                    result = ((Smc)device).tryGetSmcVariables(out smcVariables);
+                    if (result >= 0)
+                    {
+                        publisher.publish(slot, ref smcVariables);
+                    }
+                    break;
+            }
+
+            if (result < 0)
+            {
+                publisher.publishError(slot, result);
+            }
+            return result;
+        }
+
+        /// <summary>
+        /// Carries out a command from the command ring.
+        /// </summary>
+        /// <returns>UsbStatus.Success (0) or a negative UsbStatus error code.</returns>
+        public int execute(ref Command command)
+        {
+            if (device == null)
+            {
+                return UsbStatus.NoDevice;
+            }
+
+            switch (command.type)
+            {
+                case CommandType.MaestroSetTarget:
+                case CommandType.MaestroSetSpeed:
+                case CommandType.MaestroSetAcceleration:
+                    if (kind != DeviceKind.Maestro || command.channel >= servos.Length ||
+                        command.value < 0 || command.value > UInt16.MaxValue)
+                    {
+                        return UsbStatus.InvalidParameter;
+                    }
+                    Usc.Usc usc = (Usc.Usc)device;
+                    if (command.type == CommandType.MaestroSetTarget)
+                    {
+                        return usc.trySetTarget(command.channel, (UInt16)command.value);
+                    }
+                    if (command.type == CommandType.MaestroSetSpeed)
+                    {
+                        return usc.trySetSpeed(command.channel, (UInt16)command.value);
+                    }
+                    return usc.trySetAcceleration(command.channel, (UInt16)command.value);
+
+                case CommandType.JrkSetTarget:
+                    if (kind != DeviceKind.Jrk || command.value < 0 || command.value > UInt16.MaxValue)
+                    {
+                        return UsbStatus.InvalidParameter;
+                    }
+                    return ((Jrk.Jrk)device).trySetTarget((UInt16)command.value);
+
+                case CommandType.JrkMotorOff:
+                    if (kind != DeviceKind.Jrk)
+                    {
+                        return UsbStatus.InvalidParameter;
+                    }
+                    return ((Jrk.Jrk)device).tryMotorOff();
+
+                case CommandType.SmcSetSpeed:
+                    if (kind != DeviceKind.Smc || command.value < Int16.MinValue || command.value > Int16.MaxValue)
+                    {
+                        return UsbStatus.InvalidParameter;
+                    }
+                    return ((Smc)device).trySetSpeed((Int16)command.value);
+
+                default:
+                    return UsbStatus.InvalidParameter;
+            }
+        }
+    }
+
+    /// <summary>
+    /// This class represents the executable commandline utility
+    /// SharedStateServer.exe, which connects to every Maestro, jrk and
+    /// Simple Motor Controller G2, polls their variables, and publishes
+    /// them in shared memory so that any number of other processes can read
+    /// them with the StateReader class.  It also carries out the commands
+    /// that other processes send with the CommandSender class.
+    /// </summary>
+    class Program
+    {
+        static volatile bool stopping;
+        static List<PolledDevice> devices = new List<PolledDevice>();
+
+        static void Main(string[] args)
+        {
+            CommandOptions opts = new CommandOptions(Assembly.GetExecutingAssembly().GetName()+"\n"+
+                "Options:\n"+
+                "  --name NAME              name of the shared memory (default pololu-state)\n"+
+                "  --interval MS            time between polls of each device in\n"+
+                "                           milliseconds (default 10)\n"+
+                "  --max-devices NUM        number of devices to make room for (default 32)\n"+
+                "  --rescan MS              time between checks for new or reconnected\n"+
+                "                           devices in milliseconds (default 1000)\n"+
+                "  --commands NUM           number of commands the command ring holds\n"+
+                "                           (default 1024)\n"+
+                "  --busy-wait MS           after a command arrives, how long to keep\n"+
+                "                           checking for more without sleeping, in\n"+
+                "                           milliseconds (default 5)\n"+
+                "  --virtual                publish emulated devices instead of real ones\n"+
+                "Press Ctrl+C to stop.\n",
+                args);
+
+            String name = opts["name"];
+            if (name == null || name == "")
+            {
+                name = "pololu-state";
+            }
+
+            int interval = 10, maxDevices = 32, rescan = 1000, commandCapacity = 1024, busyWait = 5;
+            try
+            {
+                if (opts["interval"] != null)
+                    interval = int.Parse(opts["interval"]);
+                if (opts["max-devices"] != null)
+                    maxDevices = int.Parse(opts["max-devices"]);
+                if (opts["rescan"] != null)
+                    rescan = int.Parse(opts["rescan"]);
+                if (opts["commands"] != null)
+                    commandCapacity = int.Parse(opts["commands"]);
+                if (opts["busy-wait"] != null)
+                    busyWait = int.Parse(opts["busy-wait"]);
+            }
+            catch (FormatException)
+            {
+                opts.error("Invalid number.");
+            }
+            if (interval < 0 || rescan < 0 || busyWait < 0)
+                opts.error("Times can not be negative.");
+
+            if (opts["virtual"] != null)
+            {
+                Usb.enumerateRealDevices = false;
+                Usb.addVirtualDevice(new VirtualMaestro(6, "00000006"));
+                Usb.addVirtualDevice(new VirtualMaestro(12, "00000012"));
+                Usb.addVirtualDevice(new VirtualJrk(0x0083, "00000083"));
+                Usb.addVirtualDevice(new VirtualSmc(Smc.productIDs[0], "000000A1"));
+            }
+
+            Console.CancelKeyPress += delegate(object sender, ConsoleCancelEventArgs e)
+            {
+                e.Cancel = true;
+                stopping = true;
+            };
+
+            try
+            {
+                using (StatePublisher publisher = new StatePublisher(name, maxDevices))
+                using (CommandRing commands = new CommandRing(name + ".commands", commandCapacity, maxDevices))
+                {
+                    run(publisher, commands, interval, rescan, busyWait);
+                }
+            }
+            catch (Exception exception)
+            {
+                printException(exception);
+                Environment.Exit(1);
+            }
+        }
+
+        static void run(StatePublisher publisher, CommandRing commands, int interval, int rescan, int busyWait)
+        {
+            Stopwatch rescanTimer = new Stopwatch();
+            Stopwatch roundTimer = new Stopwatch();
+            Stopwatch idleTimer = new Stopwatch();
+            CommandExecutor execute = executeCommand;
+
+            while (!stopping)
+            {
+                if (!rescanTimer.IsRunning || rescanTimer.ElapsedMilliseconds >= rescan)
+                {
+                    connect(publisher);
+                    rescanTimer.Reset();
+                    rescanTimer.Start();
+                }
+
+                roundTimer.Reset();
+                roundTimer.Start();
+                foreach (PolledDevice polled in devices)
+                {
+                    if (polled.device != null && polled.poll(publisher) < 0)
+                    {
+                        Console.Error.WriteLine("Lost " + polled.kind + " " + polled.serialNumber + ".");
+                        polled.device.disconnect();
+                        polled.device = null;
+                    }
+                }
+                publisher.heartbeat();
+
+                // Carry out commands until it is time to poll again.  While
+                // commands are arriving, check for more without sleeping,
+                // because sleeping would delay each one by a millisecond or
+                // more.
+                do
+                {
+                    if (commands.drain(execute) != 0)
+                    {
+                        idleTimer.Reset();
+                        idleTimer.Start();
+                    }
+                    else if (idleTimer.IsRunning && idleTimer.ElapsedMilliseconds < busyWait)
+                    {
+                        Thread.SpinWait(100);
+                    }
+                    else
+                    {
+                        idleTimer.Reset();
+                        Thread.Sleep(1);
+                    }
+                }
+                while (roundTimer.ElapsedMilliseconds < interval && !stopping);
+            }
+        }
+
+        static int executeCommand(ref Command command)
+        {
+            if (command.slot >= devices.Count)
+            {
+                return UsbStatus.InvalidParameter;
+            }
+            return devices[command.slot].execute(ref command);
+        }
+
+        /// <summary>
+        /// Connects to any devices that are not connected yet, giving new
+        /// devices a slot and reusing the slot of a device that was
+        /// reconnected.
+        /// </summary>
+        static void connect(StatePublisher publisher)
+        {
+            connect(publisher, DeviceKind.Maestro, Usc.Usc.getConnectedDevices());
+            connect(publisher, DeviceKind.Jrk, Jrk.Jrk.getConnectedDevices());
+            connect(publisher, DeviceKind.Smc, Smc.getConnectedDevices());
+        }
+
+        static void connect(StatePublisher publisher, DeviceKind kind, List<DeviceListItem> items)
+        {
+            foreach (DeviceListItem item in items)
+            {
+                PolledDevice polled = devices.Find(delegate(PolledDevice d) { return d.kind == kind && d.serialNumber == item.serialNumber; });
+                if (polled != null && polled.device != null)
+                {
+                    continue;
+                }
+                if (polled == null && publisher.deviceCount >= publisher.maxDevices)
+                {
+                    continue;
+                }
+
+                UsbDevice device;
+                int servoCount = 0;
+                try
+                {
+                    switch (kind)
+                    {
+                        case DeviceKind.Maestro:
+                            Usc.Usc usc = new Usc.Usc(item);
+                            servoCount = usc.servoCount;
+                            device = usc;
+                            break;
+                        case DeviceKind.Jrk:
+                            device = new Jrk.Jrk(item);
+                            break;
+                        default:
+                            device = new Smc(item);
+                            break;
+                    }
+                }
+                catch (Exception exception)
+                {
+                    Console.Error.WriteLine("Could not connect to " + kind + " " + item.serialNumber + ":");
+                    printException(exception);
+                    continue;
+                }
+
+                if (polled == null)
+                {
+                    polled = new PolledDevice();
+                    polled.kind = kind;
+                    polled.serialNumber = item.serialNumber;
+                    polled.servos = new ServoStatus[servoCount];
+                    // The slot is the same as the index in devices.
+                    polled.slot = publisher.addDevice(kind, item.serialNumber, item.productId, servoCount);
+                    devices.Add(polled);
+                }
+                polled.device = device;
+                Console.Error.WriteLine("Publishing " + kind + " " + item.serialNumber + " in slot " + polled.slot + ".");
+            }
+        }
+
+        /// <summary>
+        /// Prints the exception and all its inner exceptions.
+        /// </summary>
+        static void printException(Exception exception)
+        {
+            while (exception != null)
+            {
+                Console.Error.WriteLine(exception.Message);
+                exception = exception.InnerException;
+            }
+        }
+    }
+}
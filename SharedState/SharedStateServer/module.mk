@@ -0,0 +1,19 @@
+# Generate a unique list of files that need to be in the same
+# directory as SharedStateServer at runtime (runtime dependencies).
+SharedStateServer_runtime := $(sort $(SharedState_lib))
+
+# Compile-time dependencies.
+SharedStateServer_dlls := $(Bytecode)/Bytecode.dll $(UsbWrapper)/UsbWrapper.dll $(Usc)/Usc.dll $(Jrk)/Jrk.dll $(SmcG2)/SmcG2.dll $(SharedState)/SharedState.dll
+SharedStateServer_csfiles := $(SharedStateServer)/CommandOptions.cs $(SharedStateServer)/Program.cs $(SharedStateServer)/Properties/AssemblyInfo.cs
+
+# Required module variables
+Targets += $(SharedStateServer)/SharedStateServer
+Byproducts += $(foreach dll, $(SharedStateServer_runtime), $(SharedStateServer)/$(notdir $(dll)))
+
+$(SharedStateServer)/SharedStateServer: $(SharedStateServer_csfiles) $(SharedStateServer_runtime)
+	cp $(SharedStateServer_runtime) $(SharedStateServer)
+	$(CS) -target:exe -out:$@.exe $(SharedStateServer_csfiles) $(foreach dll, $(SharedStateServer_dlls),-r:$(SharedStateServer)/$(notdir $(dll)))
+	mv $@.exe $@
+
+# Alias so you can type "make sharedstateserver"
+sharedstateserver: $(SharedStateServer)/SharedStateServer
@@ -473,20 +473,32 @@ namespace Pololu.SimpleMotorController
         /// <summary>
         /// Gets the current state of the device.
         /// </summary>
-        public unsafe SmcVariables getSmcVariables()
+        public SmcVariables getSmcVariables()
         {
             SmcVariables vars;
-            try
-            {
-                controlTransfer(0xC0, (byte)SmcRequest.GetVariables, 0, 0, &vars, (ushort)sizeof(SmcVariables));
-            }
-            catch(Exception exception)
+            int status = tryGetSmcVariables(out vars);
+            if (status < 0)
             {
-                throw new Exception("There was an error reading variables from the device.", exception);
+                throw UsbStatus.toException(status, "There was an error reading variables from the device.");
             }
             return vars;
         }
 
+        /// <summary>
+        /// Same as getSmcVariables, but returns a UsbStatus code instead of
+        /// throwing an exception if there is a problem.
+        /// </summary>
+        /// <returns>UsbStatus.Success (0) or a negative UsbStatus error code.</returns>
+        public unsafe int tryGetSmcVariables(out SmcVariables vars)
+        {
+            SmcVariables tmp = new SmcVariables();
+            int result = tryControlTransfer(0xC0, (byte)SmcRequest.GetVariables, 0, 0, &tmp, (UInt16)sizeof(SmcVariables));
+            vars = tmp;
+            if (result < 0) { return result; }
+            if (result != sizeof(SmcVariables)) { return UsbStatus.ShortTransfer; }
+            return UsbStatus.Success;
+        }
+
         SmcResetFlags? cachedResetFlags;
 
         /// <summary>
@@ -619,13 +631,33 @@ namespace Pololu.SimpleMotorController
                 throw new ArgumentOutOfRangeException("speed", "Speed parameter must be between -3200 and 3200.");
             }
 
+            int status = trySetSpeed(speed);
+            if (status < 0)
+            {
+                throw UsbStatus.toException(status, "There was an error setting the speed.");
+            }
+        }
+
+        /// <summary>
+        /// Same as setSpeed(Int16), but returns a UsbStatus code instead of
+        /// throwing an exception if there is a problem.  An out-of-range speed
+        /// gives UsbStatus.InvalidParameter.
+        /// </summary>
+        /// <returns>UsbStatus.Success (0) or a negative UsbStatus error code.</returns>
+        public int trySetSpeed(Int16 speed)
+        {
+            if (speed > 3200 || speed < -3200)
+            {
+                return UsbStatus.InvalidParameter;
+            }
+
             if (speed < 0)
             {
-                setSpeed((UInt16)(-speed), SmcDirection.Reverse);
+                return tryControlTransfer(0x40, (Byte)SmcRequest.SetSpeed, (UInt16)(-speed), (Byte)SmcDirection.Reverse);
             }
             else
             {
-                setSpeed((UInt16)speed, SmcDirection.Forward);
+                return tryControlTransfer(0x40, (Byte)SmcRequest.SetSpeed, (UInt16)speed, (Byte)SmcDirection.Forward);
             }
         }
 
@@ -542,25 +542,37 @@ namespace Pololu.SimpleMotorControllerG2
         /// <summary>
         /// Gets the current state of the device.
         /// </summary>
-        public unsafe SmcVariables getSmcVariables()
+        public SmcVariables getSmcVariables()
         {
-            SmcVariables vars = new SmcVariables();
-            try
+            SmcVariables vars;
+            int status = tryGetSmcVariables(out vars);
+            if (status < 0)
             {
-                // Note: In later versions of this software, this function should have
-                // arguments that allow you to specify which of these flags to set.
-                // For now, just set all of them, meaning that this request will clear
-                // error occurred flags and clear the current chopping occurrence count.
-                UInt16 flags = 3;
-                controlTransfer(0xC0, (byte)SmcRequest.GetVariables, flags, 0, &vars, (UInt16)sizeof(SmcVariables));
-            }
-            catch (Exception exception)
-            {
-                throw new Exception("There was an error reading variables from the device.", exception);
+                throw UsbStatus.toException(status, "There was an error reading variables from the device.");
             }
             return vars;
         }
 
+        /// <summary>
+        /// Same as getSmcVariables, but returns a UsbStatus code instead of
+        /// throwing an exception if there is a problem.
+        /// </summary>
+        /// <returns>UsbStatus.Success (0) or a negative UsbStatus error code.</returns>
+        public unsafe int tryGetSmcVariables(out SmcVariables vars)
+        {
+            // Note: In later versions of this software, this function should have
+            // arguments that allow you to specify which of these flags to set.
+            // For now, just set all of them, meaning that this request will clear
+            // error occurred flags and clear the current chopping occurrence count.
+            UInt16 flags = 3;
+            SmcVariables tmp = new SmcVariables();
+            int result = tryControlTransfer(0xC0, (byte)SmcRequest.GetVariables, flags, 0, &tmp, (UInt16)sizeof(SmcVariables));
+            vars = tmp;
+            if (result < 0) { return result; }
+            if (result != sizeof(SmcVariables)) { return UsbStatus.ShortTransfer; }
+            return UsbStatus.Success;
+        }
+
         SmcResetFlags? cachedResetFlags;
 
         /// <summary>
@@ -686,6 +698,7 @@ namespace Pololu.SimpleMotorControllerG2
                 }
             }
 
+            cancelCoalescedSpeed();
             try
             {
                 controlTransfer(0x40, (Byte)SmcRequest.SetSpeed, speed, (Byte)direction);
@@ -712,13 +725,75 @@ namespace Pololu.SimpleMotorControllerG2
                 throw new ArgumentOutOfRangeException("speed", "Speed parameter must be between -3200 and 3200.");
             }
 
+            int status = trySetSpeed(speed);
+            if (status < 0)
+            {
+                throw UsbStatus.toException(status, "There was an error setting the speed.");
+            }
+        }
+
+        /// <summary>
+        /// Same as setSpeed(Int16), but returns a UsbStatus code instead of
+        /// throwing an exception if there is a problem.  An out-of-range speed
+        /// gives UsbStatus.InvalidParameter.
+        /// </summary>
+        /// <returns>UsbStatus.Success (0) or a negative UsbStatus error code.</returns>
+        public int trySetSpeed(Int16 speed)
+        {
+            if (speed > 3200 || speed < -3200)
+            {
+                return UsbStatus.InvalidParameter;
+            }
+
+            CoalescingWriter writer = coalescer;
+            if (writer != null)
+            {
+                return writer.post(0, speed);
+            }
+            return sendSpeed(speed);
+        }
+
+        /// <summary>
+        /// Sends a speed from -3200 to 3200 to the device right away, even in
+        /// coalescing mode.
+        /// </summary>
+        int sendSpeed(Int16 speed)
+        {
             if (speed < 0)
             {
-                setSpeed((UInt16)(-speed), SmcDirection.Reverse);
+                return tryControlTransfer(0x40, (Byte)SmcRequest.SetSpeed, (UInt16)(-speed), (Byte)SmcDirection.Reverse);
             }
-            else
+            return tryControlTransfer(0x40, (Byte)SmcRequest.SetSpeed, (UInt16)speed, (Byte)SmcDirection.Forward);
+        }
+
+        /// <summary>
+        /// Puts the controller in coalescing mode: setSpeed(Int16) and
+        /// trySetSpeed store the speed and return right away, and a
+        /// background thread sends it.  If a new speed is set before the
+        /// last one was sent, only the new one is sent.  This is for programs
+        /// that calculate speeds faster than USB can send them.  Errors are
+        /// returned by a later call instead of the one that caused them, and
+        /// the counters are in coalescer.  coast, brake, setBrake and stop
+        /// drop a speed that was not sent yet, so they are never undone by
+        /// an older speed.
+        /// Call stopCoalescing to go back to sending speeds right away.
+        /// </summary>
+        public void startCoalescing()
+        {
+            startCoalescing(1, writeCoalesced);
+        }
+
+        int writeCoalesced(int key, int value)
+        {
+            return sendSpeed((Int16)value);
+        }
+
+        void cancelCoalescedSpeed()
+        {
+            CoalescingWriter writer = coalescer;
+            if (writer != null)
             {
-                setSpeed((UInt16)speed, SmcDirection.Forward);
+                writer.cancel(0);
             }
         }
 
@@ -746,6 +821,7 @@ namespace Pololu.SimpleMotorControllerG2
         /// </summary>
         public void stop()
         {
+            cancelCoalescedSpeed();
             setUsbKill(true);
         }
 
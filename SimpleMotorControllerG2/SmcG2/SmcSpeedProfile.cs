@@ -0,0 +1,214 @@
+﻿using System;
+
+namespace Pololu.SimpleMotorControllerG2
+{
+    /// <summary>
+    /// A jerk-limited ("S-curve") change of motor speed, calculated on the
+    /// computer so it can be sent to the Simple Motor Controller as a
+    /// series of speeds by SmcTrajectoryStreamer.
+    /// </summary>
+    /// <remarks>
+    /// <para>
+    /// The device's own acceleration limit changes the speed at a constant
+    /// rate, so the acceleration jumps from zero to the limit and back,
+    /// which jerks the load (for example the items on a conveyor).  A
+    /// profile instead changes the acceleration at a limited rate (the
+    /// jerk): the speed follows an S shape, and the acceleration is a
+    /// trapezoid or, for small changes, a triangle.
+    /// </para>
+    /// <para>
+    /// Speeds are in the units of Smc.setSpeed (-3200 to 3200), the
+    /// acceleration is in speed units per second and the jerk is in speed
+    /// units per second squared.  A profile can start with any
+    /// acceleration, so a new profile can be started from the middle of
+    /// the old one (see getState) without a jump in the acceleration.
+    /// </para>
+    /// <para>
+    /// For the profile to take effect, the device's acceleration and
+    /// deceleration limits must not be lower than the profile's (they are
+    /// in speed units per speed update period, which is usually 1 ms, so
+    /// a maxAcceleration of 6400 needs a device limit of at least 7).
+    /// </para>
+    /// </remarks>
+    public class SmcSpeedProfile
+    {
+        // The profile is a series of segments of constant jerk: at most
+        // one that brings the starting acceleration down to the limit,
+        // then increasing, constant and decreasing acceleration.
+        const int maxSegments = 4;
+        readonly double[] durations = new double[maxSegments];
+        readonly double[] jerks = new double[maxSegments];
+        int segmentCount;
+
+        readonly double startSpeed;
+        readonly double startAcceleration;
+        readonly double privateTargetSpeed;
+        readonly double privateMaxAcceleration;
+        readonly double privateMaxJerk;
+        double privateDuration;
+
+        /// <summary>
+        /// Calculates a profile.
+        /// </summary>
+        /// <param name="startSpeed">The speed at the start.</param>
+        /// <param name="startAcceleration">The acceleration at the start; 0 if the speed is not changing.</param>
+        /// <param name="targetSpeed">The speed at the end (-3200 to 3200).</param>
+        /// <param name="maxAcceleration">The highest acceleration and deceleration, in speed units per second.</param>
+        /// <param name="maxJerk">The highest rate of change of the acceleration, in speed units per second squared.</param>
+        public SmcSpeedProfile(double startSpeed, double startAcceleration, double targetSpeed, double maxAcceleration, double maxJerk)
+        {
+            if (targetSpeed < -3200 || targetSpeed > 3200)
+            {
+                throw new ArgumentOutOfRangeException("targetSpeed", "The target speed must be between -3200 and 3200.");
+            }
+            if (!(maxAcceleration > 0))
+            {
+                throw new ArgumentOutOfRangeException("maxAcceleration", "The maximum acceleration must be greater than 0.");
+            }
+            if (!(maxJerk > 0))
+            {
+                throw new ArgumentOutOfRangeException("maxJerk", "The maximum jerk must be greater than 0.");
+            }
+
+            this.startSpeed = startSpeed;
+            this.startAcceleration = startAcceleration;
+            privateTargetSpeed = targetSpeed;
+            privateMaxAcceleration = maxAcceleration;
+            privateMaxJerk = maxJerk;
+            plan();
+        }
+
+        /// <summary>
+        /// The speed at the end of the profile.
+        /// </summary>
+        public double targetSpeed
+        {
+            get { return privateTargetSpeed; }
+        }
+
+        public double maxAcceleration
+        {
+            get { return privateMaxAcceleration; }
+        }
+
+        public double maxJerk
+        {
+            get { return privateMaxJerk; }
+        }
+
+        /// <summary>
+        /// The time the profile takes, in seconds.
+        /// </summary>
+        public double duration
+        {
+            get { return privateDuration; }
+        }
+
+        void addSegment(double duration, double jerk)
+        {
+            if (duration > 0)
+            {
+                durations[segmentCount] = duration;
+                jerks[segmentCount] = jerk;
+                segmentCount++;
+                privateDuration += duration;
+            }
+        }
+
+        void plan()
+        {
+            double speed = startSpeed;
+            double acceleration = startAcceleration;
+            double jerk = privateMaxJerk;
+
+            // If the profile starts with more acceleration than it allows
+            // (because the limit was lowered), bring the acceleration down
+            // to the limit first.
+            if (Math.Abs(acceleration) > privateMaxAcceleration)
+            {
+                double direction = Math.Sign(acceleration);
+                double time = (Math.Abs(acceleration) - privateMaxAcceleration) / jerk;
+                addSegment(time, -direction * jerk);
+                speed += acceleration * time - direction * jerk * time * time / 2;
+                acceleration = direction * privateMaxAcceleration;
+            }
+
+            // Bringing the acceleration to zero as soon as possible changes
+            // the speed by this much.  If the target is farther than that
+            // in some direction, accelerate in that direction.
+            double stoppingChange = acceleration * Math.Abs(acceleration) / (2 * jerk);
+            double remaining = privateTargetSpeed - speed - stoppingChange;
+            if (Math.Abs(remaining) < 1e-9)
+            {
+                addSegment(Math.Abs(acceleration) / jerk, -Math.Sign(acceleration) * jerk);
+                return;
+            }
+
+            // Work in the direction of the change, so that the change is
+            // positive.  Raising the acceleration from a0 to a peak p and
+            // lowering it to 0 changes the speed by (2 p^2 - a0^2) / (2 jerk);
+            // if that needs a peak above the limit, the acceleration stays
+            // at the limit for a while instead.
+            double sign = Math.Sign(remaining);
+            double a0 = sign * acceleration;
+            double change = sign * (privateTargetSpeed - speed);
+            double peak = Math.Sqrt((2 * jerk * change + a0 * a0) / 2);
+            double plateau = 0;
+            if (peak > privateMaxAcceleration)
+            {
+                peak = privateMaxAcceleration;
+                plateau = (change - (2 * peak * peak - a0 * a0) / (2 * jerk)) / peak;
+            }
+
+            addSegment((peak - a0) / jerk, sign * jerk);
+            addSegment(plateau, 0);
+            addSegment(peak / jerk, -sign * jerk);
+        }
+
+        /// <summary>
+        /// Gets the speed and acceleration at a time during the profile.
+        /// Before the start, they are the starting ones; after the end, the
+        /// speed is the target and the acceleration is 0.
+        /// </summary>
+        /// <param name="time">The time since the start of the profile, in seconds.</param>
+        public void getState(double time, out double speed, out double acceleration)
+        {
+            speed = startSpeed;
+            acceleration = startAcceleration;
+            if (time <= 0)
+            {
+                return;
+            }
+            if (time >= privateDuration)
+            {
+                speed = privateTargetSpeed;
+                acceleration = 0;
+                return;
+            }
+
+            for (int i = 0; i < segmentCount; i++)
+            {
+                double t = Math.Min(time, durations[i]);
+                speed += acceleration * t + jerks[i] * t * t / 2;
+                acceleration += jerks[i] * t;
+                time -= t;
+                if (time <= 0)
+                {
+                    break;
+                }
+            }
+        }
+
+        /// <summary>
+        /// Gets the speed to send to the device at a time during the profile.
+        /// </summary>
+        /// <param name="time">The time since the start of the profile, in seconds.</param>
+        /// <returns>The speed rounded to a whole number between -3200 and 3200.</returns>
+        public Int16 getSpeed(double time)
+        {
+            double speed, acceleration;
+            getState(time, out speed, out acceleration);
+            return (Int16)Math.Max(-3200, Math.Min(3200, Math.Round(speed)));
+        }
+    }
+}
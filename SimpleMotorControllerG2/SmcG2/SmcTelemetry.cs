@@ -0,0 +1,239 @@
+﻿using System;
+
+namespace Pololu.SimpleMotorControllerG2
+{
+    /// <summary>
+    /// A block of Simple Motor Controller variable samples stored as one
+    /// array per variable (columns) instead of one SmcVariables struct per
+    /// sample.  This is the layout to use when analyzing a large number of
+    /// samples: a calculation that only needs a few of the variables reads
+    /// only those arrays, and the conversions below run as simple loops over
+    /// them.
+    /// </summary>
+    /// <remarks>
+    /// Only the variables that describe the state of the motor are kept; the
+    /// channel readings, motor limits and baud rate register are skipped when
+    /// decoding.  The error and limit status bits are stored as numbers; cast
+    /// them to SmcError and SmcLimitStatus to test them.
+    /// Only the first count elements of each array are valid.  The arrays
+    /// are replaced with bigger ones when the capacity runs out, so do not
+    /// hold on to them across calls to add or decode.
+    /// </remarks>
+    public class SmcTelemetry
+    {
+        public UInt16[] errorStatus;
+        public UInt16[] errorOccurred;
+        public UInt16[] limitStatus;
+        public Int16[] targetSpeed;
+        public Int16[] speed;
+        public UInt16[] brakeAmount;
+        public UInt16[] vinMv;
+        public UInt16[] temperatureA;
+        public UInt16[] temperatureB;
+        public UInt32[] timeMs;
+        public UInt16[] currentLimit;
+        public UInt16[] current;
+
+        int privateCount;
+
+        /// <summary>
+        /// The number of samples stored.
+        /// </summary>
+        public int count
+        {
+            get { return privateCount; }
+        }
+
+        /// <summary>
+        /// The number of samples that can be stored before the arrays have
+        /// to be replaced.
+        /// </summary>
+        public int capacity
+        {
+            get { return timeMs.Length; }
+        }
+
+        /// <summary>
+        /// The size of one raw sample: the response to SmcRequest.GetVariables.
+        /// </summary>
+        public static unsafe int rawSampleSize
+        {
+            get { return sizeof(SmcVariables); }
+        }
+
+        public SmcTelemetry(int capacity)
+        {
+            allocate(Math.Max(1, capacity));
+        }
+
+        /// <summary>
+        /// Removes all the samples, keeping the arrays.
+        /// </summary>
+        public void clear()
+        {
+            privateCount = 0;
+        }
+
+        public void add(SmcVariables variables)
+        {
+            ensureCapacity(privateCount + 1);
+            int i = privateCount++;
+            errorStatus[i] = (UInt16)variables.errorStatus;
+            errorOccurred[i] = (UInt16)variables.errorOccurred;
+            limitStatus[i] = (UInt16)variables.limitStatus;
+            targetSpeed[i] = variables.targetSpeed;
+            speed[i] = variables.speed;
+            brakeAmount[i] = variables.brakeAmount;
+            vinMv[i] = variables.vinMv;
+            temperatureA[i] = variables.temperatureA;
+            temperatureB[i] = variables.temperatureB;
+            timeMs[i] = variables.timeMs;
+            currentLimit[i] = variables.currentLimit;
+            current[i] = variables.current;
+        }
+
+        /// <summary>
+        /// Appends samples from a buffer holding raw responses to
+        /// SmcRequest.GetVariables (rawSampleSize bytes each) back to back.
+        /// </summary>
+        /// <param name="buffer">The raw data.</param>
+        /// <param name="offset">The position of the first sample in the buffer.</param>
+        /// <param name="samples">The number of samples to decode.</param>
+        public unsafe void decode(byte[] buffer, int offset, int samples)
+        {
+            if (samples < 0 || offset < 0 || offset + samples * sizeof(SmcVariables) > buffer.Length)
+            {
+                throw new ArgumentOutOfRangeException("samples", "The buffer is not big enough to hold " + samples + " samples.");
+            }
+            if (samples == 0)
+            {
+                return;
+            }
+
+            ensureCapacity(privateCount + samples);
+            int start = privateCount;
+
+            fixed (byte* pointer = &buffer[0])
+            fixed (UInt16* errorStatusColumn = errorStatus, errorOccurredColumn = errorOccurred, limitStatusColumn = limitStatus)
+            fixed (Int16* targetSpeedColumn = targetSpeed, speedColumn = speed)
+            fixed (UInt16* brakeAmountColumn = brakeAmount, vinMvColumn = vinMv, temperatureAColumn = temperatureA, temperatureBColumn = temperatureB)
+            fixed (UInt32* timeMsColumn = timeMs)
+            fixed (UInt16* currentLimitColumn = currentLimit, currentColumn = current)
+            {
+                SmcVariables* source = (SmcVariables*)(pointer + offset);
+                for (int i = 0; i < samples; i++)
+                {
+                    int j = start + i;
+                    errorStatusColumn[j] = (UInt16)source[i].errorStatus;
+                    errorOccurredColumn[j] = (UInt16)source[i].errorOccurred;
+                    limitStatusColumn[j] = (UInt16)source[i].limitStatus;
+                    targetSpeedColumn[j] = source[i].targetSpeed;
+                    speedColumn[j] = source[i].speed;
+                    brakeAmountColumn[j] = source[i].brakeAmount;
+                    vinMvColumn[j] = source[i].vinMv;
+                    temperatureAColumn[j] = source[i].temperatureA;
+                    temperatureBColumn[j] = source[i].temperatureB;
+                    timeMsColumn[j] = source[i].timeMs;
+                    currentLimitColumn[j] = source[i].currentLimit;
+                    currentColumn[j] = source[i].current;
+                }
+            }
+
+            privateCount += samples;
+        }
+
+        /// <summary>
+        /// Converts the input voltages of all the samples to volts.
+        /// </summary>
+        /// <param name="volts">An array of at least count elements that receives the voltages.</param>
+        public unsafe void getVinVolts(double[] volts)
+        {
+            if (volts.Length < privateCount)
+            {
+                throw new ArgumentException("The array is too small.", "volts");
+            }
+            if (privateCount == 0)
+            {
+                return;
+            }
+
+            fixed (UInt16* source = vinMv)
+            fixed (double* result = volts)
+            {
+                for (int i = 0; i < privateCount; i++)
+                {
+                    result[i] = source[i] * 0.001;
+                }
+            }
+        }
+
+        /// <summary>
+        /// Converts temperature readings (temperatureA or temperatureB) from
+        /// tenths of a degree to degrees Celsius.  The error code (3000)
+        /// becomes NaN.  Readings of 0 mean 0 degrees or colder, and are
+        /// left as 0.
+        /// </summary>
+        /// <param name="temperatures">The column to convert.</param>
+        /// <param name="celsius">An array of at least count elements that receives the temperatures.</param>
+        public unsafe void getTemperatureCelsius(UInt16[] temperatures, double[] celsius)
+        {
+            if (temperatures.Length < privateCount || celsius.Length < privateCount)
+            {
+                throw new ArgumentException("The arrays must have at least " + privateCount + " elements.");
+            }
+            if (privateCount == 0)
+            {
+                return;
+            }
+
+            fixed (UInt16* source = temperatures)
+            fixed (double* result = celsius)
+            {
+                for (int i = 0; i < privateCount; i++)
+                {
+                    result[i] = source[i] == 3000 ? Double.NaN : source[i] * 0.1;
+                }
+            }
+        }
+
+        void ensureCapacity(int needed)
+        {
+            if (needed > timeMs.Length)
+            {
+                resize(Math.Max(needed, timeMs.Length * 2));
+            }
+        }
+
+        void allocate(int size)
+        {
+            errorStatus = new UInt16[size];
+            errorOccurred = new UInt16[size];
+            limitStatus = new UInt16[size];
+            targetSpeed = new Int16[size];
+            speed = new Int16[size];
+            brakeAmount = new UInt16[size];
+            vinMv = new UInt16[size];
+            temperatureA = new UInt16[size];
+            temperatureB = new UInt16[size];
+            timeMs = new UInt32[size];
+            currentLimit = new UInt16[size];
+            current = new UInt16[size];
+        }
+
+        void resize(int size)
+        {
+            Array.Resize(ref errorStatus, size);
+            Array.Resize(ref errorOccurred, size);
+            Array.Resize(ref limitStatus, size);
+            Array.Resize(ref targetSpeed, size);
+            Array.Resize(ref speed, size);
+            Array.Resize(ref brakeAmount, size);
+            Array.Resize(ref vinMv, size);
+            Array.Resize(ref temperatureA, size);
+            Array.Resize(ref temperatureB, size);
+            Array.Resize(ref timeMs, size);
+            Array.Resize(ref currentLimit, size);
+            Array.Resize(ref current, size);
+        }
+    }
+}
@@ -0,0 +1,462 @@
+﻿using System;
+using System.Collections.Generic;
+using System.Diagnostics;
+using System.Threading;
+using Pololu.UsbWrapper;
+
+namespace Pololu.SimpleMotorControllerG2
+{
+    /// <summary>
+    /// Sends speed profiles (SmcSpeedProfile) to one or more Simple Motor
+    /// Controllers by setting the speed of each one at a fixed period from
+    /// a thread of its own.
+    /// </summary>
+    /// <remarks>
+    /// <para>
+    /// Call addController for each device, start, and then setTarget
+    /// whenever a motor should go to a new speed.  setTarget can be called
+    /// from any thread at any time, including while a profile is running:
+    /// the new profile starts from the speed and acceleration that the old
+    /// one has at that moment, so the motor does not jerk.  Changing the
+    /// profile only changes what the streamer sends; it does not write the
+    /// device's motor limits.  The devices must be in Serial/USB input mode.
+    /// </para>
+    /// <para>
+    /// The ticks are scheduled at fixed times (start plus a whole number of
+    /// periods), so a late tick does not delay the later ones, and each
+    /// profile is evaluated at the scheduled time of the tick, so the
+    /// speeds sent do not depend on how late the tick was.  The thread
+    /// sleeps until shortly before each tick and then yields until the
+    /// exact time; how shortly is learned from how long sleeping actually
+    /// takes, so the jitter stays small even where the system's timer is
+    /// coarse.  If a tick is more than a whole period late, the streamer
+    /// skips ahead instead of sending a burst of stale speeds, and counts
+    /// the ticks it skipped in missedTicks.
+    /// </para>
+    /// <para>
+    /// A speed is only sent when it differs from the last one the device
+    /// accepted.  If a transfer fails, the speed is sent again at the next
+    /// tick; see getStatus and failures.
+    /// </para>
+    /// </remarks>
+    public class SmcTrajectoryStreamer : IDisposable
+    {
+        class Axis
+        {
+            public Smc device;
+
+            // Protected by sync.
+            public SmcSpeedProfile profile;
+            public long profileStart;
+            public Int16 sentSpeed;
+            public bool sent;
+            public int status;
+
+            // Only used by the streaming thread.
+            public Int16 speed;
+        }
+
+        readonly object sync = new object();
+        readonly List<Axis> axes = new List<Axis>();
+
+        /// <summary>
+        /// A copy of axes for the streaming thread, replaced (not changed)
+        /// when a controller is added.
+        /// </summary>
+        volatile Axis[] activeAxes = new Axis[0];
+
+        readonly int privatePeriod;
+        readonly long periodTicks;
+        double privateMaxAcceleration;
+        double privateMaxJerk;
+
+        Thread thread;
+        volatile bool running;
+
+        // Statistics, written by the streaming thread.
+        long privateTicks;
+        long privateMissedTicks;
+        long privateFailures;
+        long maxLatenessTicks;
+        long totalLatenessTicks;
+
+        /// <summary>
+        /// The longest that Thread.Sleep(1) has been seen to take, in
+        /// Stopwatch ticks.  The thread only sleeps when the next tick is
+        /// further away than this.
+        /// </summary>
+        long sleepTicks;
+
+        /// <param name="period">The time between speed updates, in microseconds.</param>
+        /// <param name="maxAcceleration">The default maximum acceleration, in speed units per second.</param>
+        /// <param name="maxJerk">The default maximum jerk, in speed units per second squared.</param>
+        public SmcTrajectoryStreamer(int period, double maxAcceleration, double maxJerk)
+        {
+            if (period < 100)
+            {
+                throw new ArgumentOutOfRangeException("period", "The period must be at least 100 microseconds.");
+            }
+            privatePeriod = period;
+            periodTicks = Stopwatch.Frequency * period / 1000000;
+            sleepTicks = Stopwatch.Frequency / 500;
+            this.maxAcceleration = maxAcceleration;
+            this.maxJerk = maxJerk;
+        }
+
+        /// <summary>
+        /// The time between speed updates, in microseconds.
+        /// </summary>
+        public int period
+        {
+            get { return privatePeriod; }
+        }
+
+        /// <summary>
+        /// The maximum acceleration used by setTarget(int, Int16), in speed
+        /// units per second.
+        /// </summary>
+        public double maxAcceleration
+        {
+            get { return privateMaxAcceleration; }
+            set
+            {
+                if (!(value > 0))
+                {
+                    throw new ArgumentOutOfRangeException("value", "The maximum acceleration must be greater than 0.");
+                }
+                privateMaxAcceleration = value;
+            }
+        }
+
+        /// <summary>
+        /// The maximum jerk used by setTarget(int, Int16), in speed units
+        /// per second squared.
+        /// </summary>
+        public double maxJerk
+        {
+            get { return privateMaxJerk; }
+            set
+            {
+                if (!(value > 0))
+                {
+                    throw new ArgumentOutOfRangeException("value", "The maximum jerk must be greater than 0.");
+                }
+                privateMaxJerk = value;
+            }
+        }
+
+        /// <summary>
+        /// Adds a device.  Its motor keeps the speed it has (the target speed
+        /// read from the device) until setTarget is called.
+        /// </summary>
+        /// <returns>The number of the axis, for setTarget.</returns>
+        public int addController(Smc device)
+        {
+            Int16 speed = device.getSmcVariables().targetSpeed;
+
+            Axis axis = new Axis();
+            axis.device = device;
+            axis.profile = new SmcSpeedProfile(speed, 0, speed, privateMaxAcceleration, privateMaxJerk);
+            axis.profileStart = Stopwatch.GetTimestamp();
+            axis.speed = speed;
+            axis.sentSpeed = speed;
+            axis.sent = true;
+
+            lock (sync)
+            {
+                axes.Add(axis);
+                activeAxes = axes.ToArray();
+                return axes.Count - 1;
+            }
+        }
+
+        /// <summary>
+        /// The number of devices added.
+        /// </summary>
+        public int axisCount
+        {
+            get { lock (sync) { return axes.Count; } }
+        }
+
+        /// <summary>
+        /// Starts changing the speed of a motor to a new target, using the
+        /// default maxAcceleration and maxJerk.
+        /// </summary>
+        public void setTarget(int axis, Int16 speed)
+        {
+            setTarget(axis, speed, privateMaxAcceleration, privateMaxJerk);
+        }
+
+        /// <summary>
+        /// Starts changing the speed of a motor to a new target.  If the
+        /// motor is in the middle of another profile, the new one takes over
+        /// from the current speed and acceleration.
+        /// </summary>
+        /// <param name="axis">The number returned by addController.</param>
+        /// <param name="speed">The new speed (-3200 to 3200).</param>
+        /// <param name="maxAcceleration">The maximum acceleration, in speed units per second.</param>
+        /// <param name="maxJerk">The maximum jerk, in speed units per second squared.</param>
+        public void setTarget(int axis, Int16 speed, double maxAcceleration, double maxJerk)
+        {
+            long now = Stopwatch.GetTimestamp();
+            lock (sync)
+            {
+                Axis a = axes[axis];
+                double currentSpeed, currentAcceleration;
+                a.profile.getState(seconds(now - a.profileStart), out currentSpeed, out currentAcceleration);
+                a.profile = new SmcSpeedProfile(currentSpeed, currentAcceleration, speed, maxAcceleration, maxJerk);
+                a.profileStart = now;
+            }
+        }
+
+        /// <summary>
+        /// Returns true if the motor has reached the target of its profile
+        /// and the target has been sent to the device.
+        /// </summary>
+        public bool isDone(int axis)
+        {
+            lock (sync)
+            {
+                Axis a = axes[axis];
+                return seconds(Stopwatch.GetTimestamp() - a.profileStart) >= a.profile.duration &&
+                    a.sent && a.sentSpeed == (Int16)Math.Round(a.profile.targetSpeed);
+            }
+        }
+
+        /// <summary>
+        /// Waits until isDone is true for all the axes.
+        /// </summary>
+        /// <param name="timeout">The longest time to wait, in milliseconds.</param>
+        /// <returns>False if the time ran out.</returns>
+        public bool waitUntilDone(int timeout)
+        {
+            Stopwatch stopwatch = Stopwatch.StartNew();
+            while (true)
+            {
+                bool done = true;
+                for (int i = 0; i < axisCount; i++)
+                {
+                    done &= isDone(i);
+                }
+                if (done)
+                {
+                    return true;
+                }
+                if (stopwatch.ElapsedMilliseconds >= timeout)
+                {
+                    return false;
+                }
+                Thread.Sleep(Math.Max(1, privatePeriod / 1000));
+            }
+        }
+
+        /// <summary>
+        /// Gets the result of the last attempt to send a speed to a device.
+        /// </summary>
+        /// <returns>UsbStatus.Success (0) or a negative UsbStatus error code.</returns>
+        public int getStatus(int axis)
+        {
+            lock (sync)
+            {
+                return axes[axis].status;
+            }
+        }
+
+        /// <summary>
+        /// Starts the streaming thread.
+        /// </summary>
+        public void start()
+        {
+            if (thread != null)
+            {
+                return;
+            }
+            running = true;
+            thread = new Thread(stream);
+            thread.IsBackground = true;
+            thread.Priority = ThreadPriority.Highest;
+            thread.Start();
+        }
+
+        /// <summary>
+        /// Stops the streaming thread.  The motors keep the last speed that
+        /// was sent.
+        /// </summary>
+        public void stop()
+        {
+            if (thread == null)
+            {
+                return;
+            }
+            running = false;
+            thread.Join();
+            thread = null;
+        }
+
+        public void Dispose()
+        {
+            stop();
+        }
+
+        /// <summary>
+        /// The number of ticks that have run.
+        /// </summary>
+        public long ticks
+        {
+            get { return Interlocked.Read(ref privateTicks); }
+        }
+
+        /// <summary>
+        /// The number of ticks that were skipped because the streamer fell
+        /// more than a period behind.
+        /// </summary>
+        public long missedTicks
+        {
+            get { return Interlocked.Read(ref privateMissedTicks); }
+        }
+
+        /// <summary>
+        /// The number of speeds that could not be sent.
+        /// </summary>
+        public long failures
+        {
+            get { return Interlocked.Read(ref privateFailures); }
+        }
+
+        /// <summary>
+        /// The latest that a tick has started after its scheduled time, in
+        /// microseconds.
+        /// </summary>
+        public double maxLateness
+        {
+            get { return Interlocked.Read(ref maxLatenessTicks) * 1e6 / Stopwatch.Frequency; }
+        }
+
+        /// <summary>
+        /// The average time that ticks started after their scheduled times,
+        /// in microseconds.
+        /// </summary>
+        public double averageLateness
+        {
+            get
+            {
+                long count = ticks;
+                return count == 0 ? 0 : Interlocked.Read(ref totalLatenessTicks) * 1e6 / Stopwatch.Frequency / count;
+            }
+        }
+
+        /// <summary>
+        /// Sets ticks, missedTicks, failures and the lateness to zero.
+        /// </summary>
+        public void resetStatistics()
+        {
+            Interlocked.Exchange(ref privateTicks, 0);
+            Interlocked.Exchange(ref privateMissedTicks, 0);
+            Interlocked.Exchange(ref privateFailures, 0);
+            Interlocked.Exchange(ref maxLatenessTicks, 0);
+            Interlocked.Exchange(ref totalLatenessTicks, 0);
+        }
+
+        static double seconds(long ticks)
+        {
+            return (double)ticks / Stopwatch.Frequency;
+        }
+
+        void stream()
+        {
+            long next = Stopwatch.GetTimestamp();
+            while (running)
+            {
+                long now = waitUntil(next);
+                long lateness = now - next;
+                if (lateness > maxLatenessTicks)
+                {
+                    Interlocked.Exchange(ref maxLatenessTicks, lateness);
+                }
+                Interlocked.Add(ref totalLatenessTicks, lateness);
+
+                tick(next);
+                Interlocked.Increment(ref privateTicks);
+
+                next += periodTicks;
+                now = Stopwatch.GetTimestamp();
+                if (now - next > periodTicks)
+                {
+                    // Skip the ticks that are already over.
+                    long missed = (now - next) / periodTicks;
+                    Interlocked.Add(ref privateMissedTicks, missed);
+                    next += missed * periodTicks;
+                }
+            }
+        }
+
+        /// <summary>
+        /// Waits until the given time.
+        /// </summary>
+        /// <returns>The time when the wait ended.</returns>
+        long waitUntil(long time)
+        {
+            long now = Stopwatch.GetTimestamp();
+            while (time - now > sleepTicks && running)
+            {
+                Thread.Sleep(1);
+                long after = Stopwatch.GetTimestamp();
+                if (after - now > sleepTicks)
+                {
+                    sleepTicks = after - now;
+                }
+                now = after;
+            }
+
+            // Yield instead of spinning so other threads can still run on
+            // a computer with one processor.
+            while (now < time && running)
+            {
+                Thread.Sleep(0);
+                now = Stopwatch.GetTimestamp();
+            }
+            return now;
+        }
+
+        /// <summary>
+        /// Works out the speed of each axis at the given time and sends the
+        /// speeds that changed.
+        /// </summary>
+        void tick(long time)
+        {
+            Axis[] current = activeAxes;
+            lock (sync)
+            {
+                foreach (Axis axis in current)
+                {
+                    axis.speed = axis.profile.getSpeed(seconds(time - axis.profileStart));
+                }
+            }
+
+            // The transfers are done outside the lock so that setTarget
+            // never waits for USB.
+            foreach (Axis axis in current)
+            {
+                if (axis.sent && axis.speed == axis.sentSpeed)
+                {
+                    continue;
+                }
+
+                int status = axis.device.trySetSpeed(axis.speed);
+                if (status < 0)
+                {
+                    Interlocked.Increment(ref privateFailures);
+                }
+                lock (sync)
+                {
+                    axis.status = status;
+                    axis.sent = status >= 0;
+                    if (axis.sent)
+                    {
+                        axis.sentSpeed = axis.speed;
+                    }
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,355 @@
+﻿using System;
+using Pololu.UsbWrapper;
+
+namespace Pololu.SimpleMotorControllerG2
+{
+    /// <summary>
+    /// An emulated Simple Motor Controller G2.  Add it to the device list with
+    /// Usb.addVirtualDevice to test programs that use the Smc class without
+    /// hardware.
+    /// </summary>
+    /// <remarks>
+    /// The emulator keeps settings like the real device, follows speed
+    /// commands subject to the motor limits (max speed, acceleration and
+    /// deceleration), and implements safe start, the USB kill switch, and the
+    /// command timeout.  The RC and analog channels, the brake duration, and
+    /// the current and temperature limits are not simulated; the voltage and
+    /// temperature readings are constant.
+    /// </remarks>
+    public class VirtualSmc : VirtualUsbDevice
+    {
+        SmcSettingsStruct settings;
+        SmcVariables variables;
+        bool usbKill;
+
+        /// <summary>
+        /// Time since the last speed update, in microseconds.
+        /// </summary>
+        UInt64 updateTime;
+
+        /// <summary>
+        /// Time since the last millisecond tick, in microseconds.
+        /// </summary>
+        UInt64 millisecondTime;
+
+        /// <summary>
+        /// Time since the last motor command, in milliseconds.
+        /// </summary>
+        UInt32 commandTime;
+
+        /// <summary>
+        /// Creates an emulated Simple Motor Controller G2 with default settings.
+        /// </summary>
+        /// <param name="productId">One of the product IDs in Smc.productIDs.</param>
+        /// <param name="serialNumber">The serial number to report.</param>
+        public VirtualSmc(UInt16 productId, String serialNumber)
+            : base(Smc.vendorID, productId, serialNumber)
+        {
+            if (Array.IndexOf(Smc.productIDs, productId) < 0)
+            {
+                throw new ArgumentException("Unknown product ID.", "productId");
+            }
+
+            settings = new SmcSettings(productId).convertToStruct();
+            reset();
+        }
+
+        public override Guid deviceInterfaceGuid
+        {
+            get { return Smc.deviceInterfaceGuid; }
+        }
+
+        protected override UInt16 firmwareVersionBcd
+        {
+            get { return 0x0104; }
+        }
+
+        /// <summary>
+        /// Puts the variables in the state they are in after power-up.
+        /// </summary>
+        private void reset()
+        {
+            variables = new SmcVariables();
+            variables.forwardLimits = settings.forwardLimits;
+            variables.reverseLimits = settings.reverseLimits;
+            variables.currentLimit = settings.currentLimit;
+            variables.vinMv = 12000;
+            variables.temperatureA = 250;
+            variables.temperatureB = 250;
+            usbKill = false;
+            commandTime = 0;
+            if (safeStartEnabled)
+            {
+                variables.errorStatus |= SmcError.SafeStart;
+            }
+            updateLimitStatus();
+        }
+
+        private bool safeStartEnabled
+        {
+            get
+            {
+                return settings.inputMode == SmcInputMode.SerialUsb &&
+                    (settings.b1 & SmcBoolSettings1.DisableSafeStart) == 0;
+            }
+        }
+
+        protected override void advance(UInt64 microseconds)
+        {
+            UInt64 period = (UInt64)Math.Max((UInt16)1, settings.speedUpdatePeriod) * 1000;
+
+            millisecondTime += microseconds;
+            UInt64 milliseconds = millisecondTime / 1000;
+            millisecondTime %= 1000;
+            variables.timeMs += (UInt32)milliseconds;
+            commandTime = (UInt32)Math.Min(UInt32.MaxValue, commandTime + milliseconds);
+
+            if (settings.commandTimeout != 0 && commandTime >= settings.commandTimeout * 10U)
+            {
+                variables.errorStatus |= SmcError.CommandTimeout;
+            }
+
+            updateTime += microseconds;
+            while (updateTime >= period)
+            {
+                updateTime -= period;
+                updateSpeed();
+            }
+            updateLimitStatus();
+        }
+
+        private void updateLimitStatus()
+        {
+            variables.errorOccurred |= variables.errorStatus;
+            if (variables.errorStatus != 0)
+            {
+                variables.limitStatus |= SmcLimitStatus.StartedState;
+            }
+            else
+            {
+                variables.limitStatus &= ~SmcLimitStatus.StartedState;
+            }
+            if (usbKill)
+            {
+                variables.limitStatus |= SmcLimitStatus.UsbKill;
+            }
+            else
+            {
+                variables.limitStatus &= ~SmcLimitStatus.UsbKill;
+            }
+        }
+
+        /// <summary>
+        /// Moves the speed towards the target speed, like the SMC does once per
+        /// speed update period.
+        /// </summary>
+        private void updateSpeed()
+        {
+            int current = variables.speed;
+            int goal = variables.targetSpeed;
+            variables.limitStatus &= ~(SmcLimitStatus.MaxSpeed | SmcLimitStatus.Acceleration);
+
+            if (variables.errorStatus != 0 || usbKill)
+            {
+                variables.speed = 0;
+                return;
+            }
+
+            if (goal > variables.forwardLimits.maxSpeed)
+            {
+                goal = variables.forwardLimits.maxSpeed;
+                variables.limitStatus |= SmcLimitStatus.MaxSpeed;
+            }
+            else if (goal < -variables.reverseLimits.maxSpeed)
+            {
+                goal = -variables.reverseLimits.maxSpeed;
+                variables.limitStatus |= SmcLimitStatus.MaxSpeed;
+            }
+
+            // Changing direction requires decelerating to zero first.
+            if ((current > 0 && goal < 0) || (current < 0 && goal > 0))
+            {
+                goal = 0;
+            }
+
+            int step;
+            if (Math.Abs(goal) > Math.Abs(current))
+            {
+                step = (goal > 0) ? variables.forwardLimits.maxAcceleration : variables.reverseLimits.maxAcceleration;
+            }
+            else
+            {
+                step = (current > 0) ? variables.forwardLimits.maxDeceleration : variables.reverseLimits.maxDeceleration;
+            }
+
+            if (step != 0 && Math.Abs(goal - current) > step)
+            {
+                goal = (goal > current) ? current + step : current - step;
+                variables.limitStatus |= SmcLimitStatus.Acceleration;
+            }
+
+            variables.speed = (Int16)goal;
+            variables.current = (UInt16)Math.Abs(goal);
+        }
+
+        /// <summary>
+        /// Sets a temporary motor limit without exceeding the hard limit from
+        /// the settings.  Returns true if the hard limit had to be used.
+        /// </summary>
+        private static bool setLimit(ref SmcMotorLimitsStruct limits, SmcMotorLimitsStruct hardLimits, int limit, UInt16 value)
+        {
+            switch (limit)
+            {
+                case (int)SmcMotorLimit.MaxSpeed:
+                    limits.maxSpeed = Math.Min(value, hardLimits.maxSpeed);
+                    return value > hardLimits.maxSpeed;
+
+                case (int)SmcMotorLimit.MaxAcceleration:
+                    limits.maxAcceleration = safestAcceleration(value, hardLimits.maxAcceleration);
+                    return limits.maxAcceleration != value;
+
+                case (int)SmcMotorLimit.MaxDeceleration:
+                    limits.maxDeceleration = safestAcceleration(value, hardLimits.maxDeceleration);
+                    return limits.maxDeceleration != value;
+
+                default:
+                    // Brake duration is given in units of 4 ms.
+                    UInt16 duration = (UInt16)(value * 4);
+                    limits.brakeDuration = Math.Max(duration, hardLimits.brakeDuration);
+                    return duration < hardLimits.brakeDuration;
+            }
+        }
+
+        /// <summary>
+        /// Returns the more restrictive of two acceleration limits, where 0
+        /// means no limit.
+        /// </summary>
+        private static UInt16 safestAcceleration(UInt16 a, UInt16 b)
+        {
+            if (a == 0) { return b; }
+            if (b == 0) { return a; }
+            return Math.Min(a, b);
+        }
+
+        protected override unsafe int handleControlTransfer(byte requestType, byte request, ushort value, ushort index, byte* data, ushort length)
+        {
+            switch ((SmcRequest)request)
+            {
+                case SmcRequest.GetSettings:
+                    {
+                        SmcSettingsStruct s = settings;
+                        return respond(data, length, &s, sizeof(SmcSettingsStruct));
+                    }
+
+                case SmcRequest.SetSettings:
+                    if (length != sizeof(SmcSettingsStruct))
+                    {
+                        return UsbStatus.Pipe;
+                    }
+                    settings = *(SmcSettingsStruct*)data;
+                    variables.forwardLimits = settings.forwardLimits;
+                    variables.reverseLimits = settings.reverseLimits;
+                    variables.currentLimit = settings.currentLimit;
+                    return length;
+
+                case SmcRequest.GetVariables:
+                    {
+                        SmcVariables v = variables;
+                        if ((value & 1) != 0)
+                        {
+                            variables.errorOccurred = 0;
+                            variables.serialErrorOccurred = 0;
+                        }
+                        if ((value & 2) != 0)
+                        {
+                            variables.currentLimitingOccurrenceCount = 0;
+                        }
+                        return respond(data, length, &v, sizeof(SmcVariables));
+                    }
+
+                case SmcRequest.ResetSettings:
+                    settings = new SmcSettings(productId).convertToStruct();
+                    reset();
+                    return 0;
+
+                case SmcRequest.GetResetFlags:
+                    {
+                        byte flags = (byte)SmcResetFlags.Power;
+                        return respond(data, length, &flags, 1);
+                    }
+
+                case SmcRequest.SetSpeed:
+                    commandTime = 0;
+                    variables.errorStatus &= ~SmcError.CommandTimeout;
+                    if ((index & (byte)SmcDirection.Brake) != 0)
+                    {
+                        if (value > 32) { return UsbStatus.Pipe; }
+                        variables.targetSpeed = 0;
+                        variables.brakeAmount = value;
+                    }
+                    else
+                    {
+                        if (value > 3200) { return UsbStatus.Pipe; }
+                        variables.targetSpeed = (Int16)(index == (byte)SmcDirection.Reverse ? -value : value);
+                        variables.brakeAmount = 0xFF;
+                    }
+                    updateLimitStatus();
+                    return 0;
+
+                case SmcRequest.ExitSafeStart:
+                    commandTime = 0;
+                    variables.errorStatus &= ~(SmcError.SafeStart | SmcError.CommandTimeout);
+                    updateLimitStatus();
+                    return 0;
+
+                case SmcRequest.SetMotorLimit:
+                    {
+                        if (index >= 12)
+                        {
+                            return UsbStatus.Pipe;
+                        }
+                        int limit = index & 3;
+                        byte problem = (byte)SmcSetMotorLimitProblem.None;
+                        if ((index & (byte)SmcMotorLimit.ReverseOnly) == 0 &&
+                            setLimit(ref variables.forwardLimits, settings.forwardLimits, limit, value))
+                        {
+                            problem |= (byte)SmcSetMotorLimitProblem.ForwardConflict;
+                        }
+                        if ((index & (byte)SmcMotorLimit.ForwardOnly) == 0 &&
+                            setLimit(ref variables.reverseLimits, settings.reverseLimits, limit, value))
+                        {
+                            problem |= (byte)SmcSetMotorLimitProblem.ReverseConflict;
+                        }
+                        return respond(data, length, &problem, 1);
+                    }
+
+                case SmcRequest.UsbKill:
+                    commandTime = 0;
+                    if (value != 0)
+                    {
+                        usbKill = true;
+                    }
+                    else if (usbKill)
+                    {
+                        usbKill = false;
+                        if (safeStartEnabled)
+                        {
+                            variables.errorStatus |= SmcError.SafeStart;
+                        }
+                    }
+                    updateLimitStatus();
+                    return 0;
+
+                case SmcRequest.SetCurrentLimit:
+                    variables.currentLimit = value;
+                    return 0;
+
+                case SmcRequest.StartBootloader:
+                    connected = false;
+                    return 0;
+            }
+
+            return UsbStatus.Pipe;
+        }
+    }
+}
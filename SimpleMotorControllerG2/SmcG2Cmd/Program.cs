@@ -20,6 +20,16 @@ namespace Pololu.SimpleMotorControllerG2.SmcG2Cmd
         /// </summary>
         static bool forceOption = false;
 
+        /// <summary>
+        /// True if the user specifies the "--stats" option.
+        /// </summary>
+        static bool statsOption = false;
+
+        /// <summary>
+        /// The file named by the "--trace" option, or null.
+        /// </summary>
+        static String traceFileName = null;
+
         delegate void Action();
         delegate void ActionOnDevice(Smc device);
 
@@ -39,6 +49,9 @@ namespace Pololu.SimpleMotorControllerG2.SmcG2Cmd
                 "     --stop                   Stop the motor.\n" +
                 "     --resume                 Allow motor to start.\n" +
                 "     --speed NUM              Set motor speed (-3200 to 3200).\n" +
+                "     --ramp NUM ACCEL JERK    Change speed smoothly to NUM, with acceleration\n" +
+                "                              and jerk limits in speed units per second and\n" +
+                "                              per second squared.\n" +
                 "     --brake                  Immediately start braking.\n" +
                 "     --coast                  Immediately start coasting.\n" +
                 "     --current-limit          Set current limit in milliamps.\n" +
@@ -46,6 +59,9 @@ namespace Pololu.SimpleMotorControllerG2.SmcG2Cmd
                 "     --settings FILE          Load settings file into device.\n" +
                 "     --get-settings FILE      Read device settings and write to file.\n" +
                 "     --bootloader             Put device in bootloader (firmware upgrade) mode.\n" +
+                "     --stats                  Print USB transfer statistics at the end.\n" +
+                "     --trace FILE             Record every USB transfer in FILE.\n" +
+                "     --convert-trace FILE     Convert a trace to FILE.json for chrome://tracing.\n" +
                 "Options for changing motor limits until next reset:\n" +
                 "     --max-speed NUM          (3200 means no limit)\n" +
                 "     --max-speed-forward NUM  (3200 means no limit)\n" +
@@ -142,6 +158,9 @@ namespace Pololu.SimpleMotorControllerG2.SmcG2Cmd
                     case "--speed":
                         actionsOnDevice.Add(laterSetSpeed());
                         break;
+                    case "--ramp":
+                        actionsOnDevice.Add(laterRamp());
+                        break;
                     case "--brake":
                         actionsOnDevice.Add(brake);
                         break;
@@ -167,6 +186,15 @@ namespace Pololu.SimpleMotorControllerG2.SmcG2Cmd
                     case "--bootloader":
                         actionsOnDevice.Add(startBootloader);
                         break;
+                    case "--stats":
+                        statsOption = true;
+                        break;
+                    case "--trace":
+                        traceFileName = nextArgument();
+                        break;
+                    case "--convert-trace":
+                        actions.Add(laterConvertTrace());
+                        break;
                     case "--max-speed":
                         actionsOnDevice.Add(laterSetMotorLimit(SmcMotorLimit.MaxSpeed));
                         break;
@@ -208,7 +236,7 @@ namespace Pololu.SimpleMotorControllerG2.SmcG2Cmd
                 }
             }
 
-            if (actions.Count == 0 && actionsOnDevice.Count == 0)
+            if (actions.Count == 0 && actionsOnDevice.Count == 0 && !statsOption)
             {
                 throw new ArgumentException("No actions specified.");
             }
@@ -219,7 +247,7 @@ namespace Pololu.SimpleMotorControllerG2.SmcG2Cmd
                 action();
             }
 
-            if (actionsOnDevice.Count == 0)
+            if (actionsOnDevice.Count == 0 && !statsOption)
             {
                 // There are no actions that require a device, so exit successfully.
                 return;
@@ -311,13 +339,43 @@ namespace Pololu.SimpleMotorControllerG2.SmcG2Cmd
             // connect to it.
             Smc device = new Smc(item);
 
-            // Perform all the previously computed actions on the device.
-            foreach(ActionOnDevice action in actionsOnDevice)
+            if (traceFileName != null)
+            {
+                TransferTracer.start(traceFileName);
+            }
+
+            try
+            {
+                // Perform all the previously computed actions on the device.
+                foreach(ActionOnDevice action in actionsOnDevice)
+                {
+                    action(device);
+                }
+            }
+            finally
+            {
+                // Write out the trace even if an action failed, since that
+                // is when it is most useful.
+                TransferTracer.stop();
+            }
+
+            if (statsOption)
             {
-                action(device);
+                device.transferStatistics.writeReport(Console.Out);
             }
         }
 
+        private static Action laterConvertTrace()
+        {
+            String filename = nextArgument();
+
+            return delegate()
+            {
+                TransferTracer.convertToChromeTrace(filename, filename + ".json");
+                Console.WriteLine("Wrote " + filename + ".json.");
+            };
+        }
+
         private static ActionOnDevice laterSetSettings()
         {
             // Read the entire file before connecting to the device.
@@ -379,6 +437,41 @@ namespace Pololu.SimpleMotorControllerG2.SmcG2Cmd
             };
         }
 
+        private static ActionOnDevice laterRamp()
+        {
+            Int16 speed = nextArgumentAsS16();
+            UInt32 maxAcceleration = nextArgumentAsU32();
+            UInt32 maxJerk = nextArgumentAsU32();
+
+            if (speed < -3200 || speed > 3200)
+            {
+                throw new ArgumentOutOfRangeException("--ramp", "Speed must be between -3200 and 3200; " + speed + " is not valid.");
+            }
+            if (maxAcceleration == 0 || maxJerk == 0)
+            {
+                throw new ArgumentOutOfRangeException("--ramp", "The acceleration and jerk limits must be greater than 0.");
+            }
+
+            return delegate(Smc device)
+            {
+                // Send a new speed every 10 ms until the motor reaches the target.
+                using (SmcTrajectoryStreamer streamer = new SmcTrajectoryStreamer(10000, maxAcceleration, maxJerk))
+                {
+                    int axis = streamer.addController(device);
+                    streamer.start();
+                    streamer.setTarget(axis, speed);
+                    while (!streamer.waitUntilDone(1000))
+                    {
+                        int status = streamer.getStatus(axis);
+                        if (status < 0)
+                        {
+                            throw UsbStatus.toException(status, "There was an error setting the speed.");
+                        }
+                    }
+                }
+            };
+        }
+
         private static void brake(Smc device)
         {
             device.brake();
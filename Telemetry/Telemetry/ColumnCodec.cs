@@ -0,0 +1,259 @@
+﻿using System;
+
+namespace Pololu.Telemetry
+{
+    /// <summary>
+    /// The ways a column of integers can be stored in a block.  Every value
+    /// is written as a zigzag variable-length integer (see ColumnCodec), so
+    /// small numbers, positive or negative, take one byte.
+    /// </summary>
+    public enum ColumnEncoding : byte
+    {
+        /// <summary>
+        /// Every value in the block is the same; it is stored once.
+        /// </summary>
+        Constant = 0,
+
+        /// <summary>
+        /// Each value is stored by itself.  Best for noisy values.
+        /// </summary>
+        Plain = 1,
+
+        /// <summary>
+        /// The first value is stored, followed by the difference between each
+        /// value and the one before it.  Best for slowly-changing values
+        /// like targets, feedback and temperatures.
+        /// </summary>
+        Delta = 2,
+
+        /// <summary>
+        /// The first value and the first difference are stored, followed by
+        /// the change in the difference.  Best for values that change at a
+        /// steady rate, like timestamps taken at a regular interval.
+        /// </summary>
+        DeltaDelta = 3,
+    }
+
+    /// <summary>
+    /// Encodes and decodes columns of integers.  Each column is encoded all
+    /// four ways (see ColumnEncoding) and the shortest one is kept.
+    /// </summary>
+    /// <remarks>
+    /// Zigzag encoding maps signed numbers to unsigned ones so that numbers
+    /// near zero are small: 0, -1, 1, -2, 2... become 0, 1, 2, 3, 4...
+    /// The unsigned number is then written 7 bits per byte, least
+    /// significant first, with the top bit set on every byte but the last.
+    /// </remarks>
+    internal static class ColumnCodec
+    {
+        public static UInt64 zigzag(Int64 value)
+        {
+            return (UInt64)((value << 1) ^ (value >> 63));
+        }
+
+        public static Int64 unzigzag(UInt64 value)
+        {
+            return (Int64)(value >> 1) ^ -(Int64)(value & 1);
+        }
+
+        /// <summary>
+        /// The number of bytes the value takes after zigzag and
+        /// variable-length encoding.
+        /// </summary>
+        public static int size(Int64 value)
+        {
+            UInt64 v = zigzag(value);
+            int bytes = 1;
+            while (v >= 0x80)
+            {
+                v >>= 7;
+                bytes++;
+            }
+            return bytes;
+        }
+
+        /// <summary>
+        /// Encodes the first count values and returns the number of bytes
+        /// written to output, which is resized if it is too small.
+        /// </summary>
+        public static int encode(Int64[] values, int count, ref byte[] output, out ColumnEncoding encoding)
+        {
+            // Find the size of each encoding.
+            bool constant = true;
+            int plain = 0, delta = 0, deltaDelta = 0;
+            for (int i = 0; i < count; i++)
+            {
+                plain += size(values[i]);
+                if (i == 0)
+                {
+                    delta += size(values[0]);
+                    deltaDelta += size(values[0]);
+                    continue;
+                }
+
+                Int64 d = values[i] - values[i - 1];
+                delta += size(d);
+                deltaDelta += size(i == 1 ? d : d - (values[i - 1] - values[i - 2]));
+                if (d != 0)
+                {
+                    constant = false;
+                }
+            }
+
+            int length;
+            if (count == 0 || constant)
+            {
+                encoding = ColumnEncoding.Constant;
+                length = count == 0 ? 0 : size(values[0]);
+            }
+            else if (plain <= delta && plain <= deltaDelta)
+            {
+                encoding = ColumnEncoding.Plain;
+                length = plain;
+            }
+            else if (delta <= deltaDelta)
+            {
+                encoding = ColumnEncoding.Delta;
+                length = delta;
+            }
+            else
+            {
+                encoding = ColumnEncoding.DeltaDelta;
+                length = deltaDelta;
+            }
+
+            if (output == null || output.Length < length)
+            {
+                output = new byte[Math.Max(length, output == null ? 0 : output.Length * 2)];
+            }
+
+            int position = 0;
+            switch (encoding)
+            {
+                case ColumnEncoding.Constant:
+                    if (count != 0)
+                    {
+                        write(output, ref position, values[0]);
+                    }
+                    break;
+
+                case ColumnEncoding.Plain:
+                    for (int i = 0; i < count; i++)
+                    {
+                        write(output, ref position, values[i]);
+                    }
+                    break;
+
+                case ColumnEncoding.Delta:
+                    write(output, ref position, values[0]);
+                    for (int i = 1; i < count; i++)
+                    {
+                        write(output, ref position, values[i] - values[i - 1]);
+                    }
+                    break;
+
+                case ColumnEncoding.DeltaDelta:
+                    write(output, ref position, values[0]);
+                    write(output, ref position, values[1] - values[0]);
+                    for (int i = 2; i < count; i++)
+                    {
+                        write(output, ref position, (values[i] - values[i - 1]) - (values[i - 1] - values[i - 2]));
+                    }
+                    break;
+            }
+            return position;
+        }
+
+        /// <summary>
+        /// Decodes a column of count values into output.
+        /// </summary>
+        public static void decode(byte[] input, int offset, int length, ColumnEncoding encoding, int count, Int64[] output)
+        {
+            int position = offset;
+            int end = offset + length;
+            if (count == 0)
+            {
+                return;
+            }
+
+            switch (encoding)
+            {
+                case ColumnEncoding.Constant:
+                    {
+                        Int64 value = read(input, ref position, end);
+                        for (int i = 0; i < count; i++)
+                        {
+                            output[i] = value;
+                        }
+                        break;
+                    }
+
+                case ColumnEncoding.Plain:
+                    for (int i = 0; i < count; i++)
+                    {
+                        output[i] = read(input, ref position, end);
+                    }
+                    break;
+
+                case ColumnEncoding.Delta:
+                    output[0] = read(input, ref position, end);
+                    for (int i = 1; i < count; i++)
+                    {
+                        output[i] = output[i - 1] + read(input, ref position, end);
+                    }
+                    break;
+
+                case ColumnEncoding.DeltaDelta:
+                    {
+                        output[0] = read(input, ref position, end);
+                        if (count == 1)
+                        {
+                            break;
+                        }
+                        Int64 d = read(input, ref position, end);
+                        output[1] = output[0] + d;
+                        for (int i = 2; i < count; i++)
+                        {
+                            d += read(input, ref position, end);
+                            output[i] = output[i - 1] + d;
+                        }
+                        break;
+                    }
+
+                default:
+                    throw new Exception("Unknown column encoding " + (byte)encoding + ".");
+            }
+        }
+
+        static void write(byte[] output, ref int position, Int64 value)
+        {
+            UInt64 v = zigzag(value);
+            while (v >= 0x80)
+            {
+                output[position++] = (byte)(v | 0x80);
+                v >>= 7;
+            }
+            output[position++] = (byte)v;
+        }
+
+        static Int64 read(byte[] input, ref int position, int end)
+        {
+            UInt64 v = 0;
+            int shift = 0;
+            while (true)
+            {
+                if (position >= end || shift > 63)
+                {
+                    throw new Exception("The column data is corrupt.");
+                }
+                byte b = input[position++];
+                v |= (UInt64)(b & 0x7F) << shift;
+                if (b < 0x80)
+                {
+                    return unzigzag(v);
+                }
+                shift += 7;
+            }
+        }
+    }
+}
@@ -0,0 +1,232 @@
+﻿using System;
+using System.Collections.Generic;
+using System.IO;
+
+namespace Pololu.Telemetry
+{
+    /// <summary>
+    /// Describes one block of a telemetry store: a run of rows from one
+    /// series, stored column by column.
+    /// </summary>
+    public class TelemetryBlock
+    {
+        /// <summary>
+        /// The position of the block in the file.
+        /// </summary>
+        public Int64 offset;
+
+        /// <summary>
+        /// The name of the series the rows belong to (usually a serial number).
+        /// </summary>
+        public String series;
+
+        /// <summary>
+        /// The earliest and latest times of the rows in the block.
+        /// </summary>
+        public Int64 startTime;
+        public Int64 endTime;
+
+        public Int32 rows;
+
+        // The rest is only known after the block header has been read.
+        internal String[] columns;
+        internal ColumnEncoding[] encodings;
+        internal Int64[] columnOffsets;
+        internal Int32[] columnLengths;
+
+        internal int findColumn(String name)
+        {
+            return Array.IndexOf(columns, name);
+        }
+    }
+
+    /// <summary>
+    /// The layout of a telemetry store file.  All numbers are little-endian
+    /// and strings are written by BinaryWriter (a length followed by UTF-8).
+    /// </summary>
+    /// <remarks>
+    /// <code>
+    ///   file:   "PTLM" version:UInt16 block* index?
+    ///   block:  "PTBK" headerLength:Int32 header columnData*
+    ///   header: series:String startTime:Int64 endTime:Int64 rows:Int32
+    ///           columnCount:UInt16 (name:String encoding:Byte length:Int32)*
+    ///   index:  "PTIX" blockCount:Int32 (offset:Int64 series:String
+    ///           startTime:Int64 endTime:Int64 rows:Int32)* indexOffset:Int64 "PTIE"
+    /// </code>
+    /// The first column of every block is the time.  Blocks are only ever
+    /// appended, and the index (a copy of the block headers without the
+    /// columns) is written when the writer is closed, so a reader only has
+    /// to read the end of the file to find the blocks it needs.  If the
+    /// writer did not close the file (the program crashed), there is no
+    /// index and the blocks are found by skipping from one header to the
+    /// next, stopping at the first incomplete block.
+    /// </remarks>
+    internal static class TelemetryFile
+    {
+        public const UInt32 fileMagic = 0x4D4C5450;   // "PTLM"
+        public const UInt32 blockMagic = 0x4B425450;  // "PTBK"
+        public const UInt32 indexMagic = 0x58495450;  // "PTIX"
+        public const UInt32 endMagic = 0x45495450;    // "PTIE"
+        public const UInt16 version = 1;
+        public const int fileHeaderSize = 6;
+        public const String timeColumn = "time";
+
+        public static void writeFileHeader(BinaryWriter writer)
+        {
+            writer.Write(fileMagic);
+            writer.Write(version);
+        }
+
+        public static void readFileHeader(BinaryReader reader)
+        {
+            if (reader.BaseStream.Length < fileHeaderSize || reader.ReadUInt32() != fileMagic)
+            {
+                throw new Exception("The file is not a telemetry store.");
+            }
+            UInt16 fileVersion = reader.ReadUInt16();
+            if (fileVersion != version)
+            {
+                throw new Exception("The telemetry store has version " + fileVersion + ", which is not supported.");
+            }
+        }
+
+        /// <summary>
+        /// Reads the list of blocks, from the index if there is one or by
+        /// scanning the file if not.
+        /// </summary>
+        /// <param name="reader">Reads the file.</param>
+        /// <param name="dataEnd">
+        ///   Receives the position just after the last complete block, which is
+        ///   where the next block should be written.
+        /// </param>
+        public static List<TelemetryBlock> readBlocks(BinaryReader reader, out Int64 dataEnd)
+        {
+            List<TelemetryBlock> blocks = readIndex(reader, out dataEnd);
+            if (blocks != null)
+            {
+                return blocks;
+            }
+            return scanBlocks(reader, out dataEnd);
+        }
+
+        static List<TelemetryBlock> readIndex(BinaryReader reader, out Int64 indexOffset)
+        {
+            Stream stream = reader.BaseStream;
+            indexOffset = 0;
+            if (stream.Length < fileHeaderSize + 20)
+            {
+                return null;
+            }
+
+            stream.Seek(-12, SeekOrigin.End);
+            indexOffset = reader.ReadInt64();
+            if (reader.ReadUInt32() != endMagic || indexOffset < fileHeaderSize || indexOffset > stream.Length - 20)
+            {
+                return null;
+            }
+
+            stream.Seek(indexOffset, SeekOrigin.Begin);
+            if (reader.ReadUInt32() != indexMagic)
+            {
+                return null;
+            }
+
+            int count = reader.ReadInt32();
+            List<TelemetryBlock> blocks = new List<TelemetryBlock>(count);
+            for (int i = 0; i < count; i++)
+            {
+                TelemetryBlock block = new TelemetryBlock();
+                block.offset = reader.ReadInt64();
+                block.series = reader.ReadString();
+                block.startTime = reader.ReadInt64();
+                block.endTime = reader.ReadInt64();
+                block.rows = reader.ReadInt32();
+                blocks.Add(block);
+            }
+            return blocks;
+        }
+
+        static List<TelemetryBlock> scanBlocks(BinaryReader reader, out Int64 dataEnd)
+        {
+            Stream stream = reader.BaseStream;
+            List<TelemetryBlock> blocks = new List<TelemetryBlock>();
+            dataEnd = fileHeaderSize;
+
+            while (true)
+            {
+                TelemetryBlock block = new TelemetryBlock();
+                block.offset = dataEnd;
+                try
+                {
+                    readBlockHeader(reader, block);
+                }
+                catch (EndOfStreamException)
+                {
+                    break;
+                }
+                catch (InvalidDataException)
+                {
+                    break;
+                }
+
+                Int64 end = block.columnOffsets[block.columns.Length - 1] + block.columnLengths[block.columns.Length - 1];
+                if (end > stream.Length)
+                {
+                    break;
+                }
+                blocks.Add(block);
+                dataEnd = end;
+            }
+            return blocks;
+        }
+
+        /// <summary>
+        /// Reads the header of the block at block.offset and fills in the
+        /// rest of the block's fields.
+        /// </summary>
+        public static void readBlockHeader(BinaryReader reader, TelemetryBlock block)
+        {
+            Stream stream = reader.BaseStream;
+            stream.Seek(block.offset, SeekOrigin.Begin);
+            if (stream.Length - block.offset < 8)
+            {
+                throw new EndOfStreamException();
+            }
+            if (reader.ReadUInt32() != blockMagic)
+            {
+                throw new InvalidDataException("There is no block at position " + block.offset + " of the telemetry store.");
+            }
+            int headerLength = reader.ReadInt32();
+            if (headerLength < 0 || headerLength > stream.Length - stream.Position)
+            {
+                throw new EndOfStreamException();
+            }
+
+            // Read the whole header at once rather than a few bytes at a time.
+            BinaryReader header = new BinaryReader(new MemoryStream(reader.ReadBytes(headerLength)));
+            block.series = header.ReadString();
+            block.startTime = header.ReadInt64();
+            block.endTime = header.ReadInt64();
+            block.rows = header.ReadInt32();
+            int columnCount = header.ReadUInt16();
+            if (columnCount == 0)
+            {
+                throw new InvalidDataException("The block at position " + block.offset + " of the telemetry store has no columns.");
+            }
+
+            block.columns = new String[columnCount];
+            block.encodings = new ColumnEncoding[columnCount];
+            block.columnOffsets = new Int64[columnCount];
+            block.columnLengths = new Int32[columnCount];
+            Int64 position = block.offset + 8 + headerLength;
+            for (int i = 0; i < columnCount; i++)
+            {
+                block.columns[i] = header.ReadString();
+                block.encodings[i] = (ColumnEncoding)header.ReadByte();
+                block.columnLengths[i] = header.ReadInt32();
+                block.columnOffsets[i] = position;
+                position += block.columnLengths[i];
+            }
+        }
+    }
+}
@@ -0,0 +1,257 @@
+﻿using System;
+using System.Collections.Generic;
+using System.IO;
+
+namespace Pololu.Telemetry
+{
+    /// <summary>
+    /// Reads a telemetry store written by TelemetryWriter.
+    /// </summary>
+    /// <remarks>
+    /// Opening a store only reads its index.  A query reads just the blocks
+    /// of the requested series that overlap the requested time range, and
+    /// from each of those blocks only the time column and the requested
+    /// columns, so getting one variable of one device for an hour does not
+    /// read or decode the other devices or variables.
+    /// This class is not thread-safe; use one reader per thread.
+    /// </remarks>
+    public class TelemetryReader : IDisposable
+    {
+        readonly FileStream stream;
+        readonly BinaryReader reader;
+        readonly List<TelemetryBlock> blocks;
+        readonly Dictionary<String, List<TelemetryBlock>> blocksOfSeries = new Dictionary<String, List<TelemetryBlock>>();
+        readonly List<String> seriesNames = new List<String>();
+        byte[] buffer = new byte[4096];
+        Int64[] times = new Int64[0];
+        Int64 privateBytesRead;
+
+        /// <summary>
+        /// Opens a telemetry store for reading.  It can be open for writing
+        /// by a TelemetryWriter at the same time, but only the blocks that
+        /// were in the file when it was opened will be seen.
+        /// </summary>
+        public TelemetryReader(String fileName)
+        {
+            stream = new FileStream(fileName, FileMode.Open, FileAccess.Read, FileShare.ReadWrite);
+            try
+            {
+                reader = new BinaryReader(stream);
+                TelemetryFile.readFileHeader(reader);
+                Int64 dataEnd;
+                blocks = TelemetryFile.readBlocks(reader, out dataEnd);
+            }
+            catch (Exception exception)
+            {
+                stream.Close();
+                throw new Exception("There was an error opening the telemetry store " + fileName + ".", exception);
+            }
+
+            foreach (TelemetryBlock block in blocks)
+            {
+                List<TelemetryBlock> list;
+                if (!blocksOfSeries.TryGetValue(block.series, out list))
+                {
+                    list = new List<TelemetryBlock>();
+                    blocksOfSeries[block.series] = list;
+                    seriesNames.Add(block.series);
+                }
+                list.Add(block);
+            }
+        }
+
+        /// <summary>
+        /// All the blocks in the store, in the order they were written.
+        /// </summary>
+        public IList<TelemetryBlock> getBlocks()
+        {
+            return blocks.AsReadOnly();
+        }
+
+        /// <summary>
+        /// The names of the series in the store, in the order they first appear.
+        /// </summary>
+        public IList<String> getSeriesNames()
+        {
+            return seriesNames.AsReadOnly();
+        }
+
+        /// <summary>
+        /// The names of the columns of a series, not including the time.  If
+        /// the columns changed over time, this includes every column that
+        /// any block of the series has.
+        /// </summary>
+        public IList<String> getColumnNames(String series)
+        {
+            List<String> names = new List<String>();
+            foreach (TelemetryBlock block in getBlocks(series))
+            {
+                loadHeader(block);
+                for (int i = 1; i < block.columns.Length; i++)
+                {
+                    if (!names.Contains(block.columns[i]))
+                    {
+                        names.Add(block.columns[i]);
+                    }
+                }
+            }
+            return names;
+        }
+
+        /// <summary>
+        /// The number of bytes read from the file so far, not counting the
+        /// index.  Useful for seeing how much of the file a query needed.
+        /// </summary>
+        public Int64 bytesRead
+        {
+            get { return privateBytesRead; }
+        }
+
+        /// <summary>
+        /// Reads one column of a series over a range of times.
+        /// </summary>
+        /// <param name="series">The series.</param>
+        /// <param name="column">The column.</param>
+        /// <param name="startTime">The earliest time to read (inclusive).</param>
+        /// <param name="endTime">The latest time to read (inclusive).</param>
+        /// <param name="timeList">Receives the time of each row.</param>
+        /// <param name="valueList">Receives the value of each row.</param>
+        /// <returns>The number of rows read.</returns>
+        public int read(String series, String column, Int64 startTime, Int64 endTime, List<Int64> timeList, List<Int64> valueList)
+        {
+            return read(series, new String[] { column }, startTime, endTime, timeList, new List<Int64>[] { valueList });
+        }
+
+        /// <summary>
+        /// Reads several columns of a series over a range of times.  Blocks
+        /// that do not have all of the columns are skipped.
+        /// </summary>
+        /// <param name="series">The series.</param>
+        /// <param name="columns">The columns.</param>
+        /// <param name="startTime">The earliest time to read (inclusive).</param>
+        /// <param name="endTime">The latest time to read (inclusive).</param>
+        /// <param name="timeList">Receives the time of each row.</param>
+        /// <param name="valueLists">Receives the values of each column, in the same order as columns.</param>
+        /// <returns>The number of rows read.</returns>
+        public int read(String series, String[] columns, Int64 startTime, Int64 endTime, List<Int64> timeList, List<Int64>[] valueLists)
+        {
+            if (valueLists.Length != columns.Length)
+            {
+                throw new ArgumentException("There must be one list for each column.");
+            }
+
+            Int64[][] values = new Int64[columns.Length][];
+            int[] indices = new int[columns.Length];
+            int total = 0;
+
+            try
+            {
+                foreach (TelemetryBlock block in getBlocks(series))
+                {
+                    if (block.endTime < startTime || block.startTime > endTime)
+                    {
+                        continue;
+                    }
+
+                    loadHeader(block);
+                    bool complete = true;
+                    for (int c = 0; c < columns.Length; c++)
+                    {
+                        indices[c] = block.findColumn(columns[c]);
+                        complete &= indices[c] > 0;
+                    }
+                    if (!complete)
+                    {
+                        continue;
+                    }
+
+                    if (times.Length < block.rows)
+                    {
+                        times = new Int64[block.rows];
+                    }
+                    readColumn(block, 0, times);
+                    for (int c = 0; c < columns.Length; c++)
+                    {
+                        if (values[c] == null || values[c].Length < block.rows)
+                        {
+                            values[c] = new Int64[block.rows];
+                        }
+                        readColumn(block, indices[c], values[c]);
+                    }
+
+                    for (int row = 0; row < block.rows; row++)
+                    {
+                        if (times[row] < startTime || times[row] > endTime)
+                        {
+                            continue;
+                        }
+                        timeList.Add(times[row]);
+                        for (int c = 0; c < columns.Length; c++)
+                        {
+                            valueLists[c].Add(values[c][row]);
+                        }
+                        total++;
+                    }
+                }
+            }
+            catch (Exception exception)
+            {
+                throw new Exception("There was an error reading series " + series + " from the telemetry store.", exception);
+            }
+            return total;
+        }
+
+        List<TelemetryBlock> getBlocks(String series)
+        {
+            List<TelemetryBlock> list;
+            if (!blocksOfSeries.TryGetValue(series, out list))
+            {
+                throw new ArgumentException("The telemetry store has no series named " + series + ".");
+            }
+            return list;
+        }
+
+        void loadHeader(TelemetryBlock block)
+        {
+            if (block.columns == null)
+            {
+                TelemetryFile.readBlockHeader(reader, block);
+                privateBytesRead += block.columnOffsets[0] - block.offset;
+            }
+        }
+
+        void readColumn(TelemetryBlock block, int column, Int64[] output)
+        {
+            int length = block.columnLengths[column];
+            if (buffer.Length < length)
+            {
+                buffer = new byte[Math.Max(length, buffer.Length * 2)];
+            }
+
+            stream.Seek(block.columnOffsets[column], SeekOrigin.Begin);
+            int position = 0;
+            while (position < length)
+            {
+                int count = stream.Read(buffer, position, length - position);
+                if (count == 0)
+                {
+                    throw new EndOfStreamException();
+                }
+                position += count;
+            }
+            privateBytesRead += length;
+
+            ColumnCodec.decode(buffer, 0, length, block.encodings[column], block.rows, output);
+        }
+
+        public void close()
+        {
+            reader.Close();
+        }
+
+        public void Dispose()
+        {
+            close();
+        }
+    }
+}
@@ -0,0 +1,286 @@
+﻿using System;
+using System.Collections.Generic;
+using System.IO;
+
+namespace Pololu.Telemetry
+{
+    /// <summary>
+    /// Writes device variables to a telemetry store: a compact, column-based
+    /// file that can hold many devices' readings over a long time, and that
+    /// TelemetryReader can query one variable of one device at a time.
+    /// </summary>
+    /// <remarks>
+    /// Each device's readings go in a series, usually named after the
+    /// device's serial number.  A series has a fixed list of columns; each
+    /// row is a time (in any unit, usually milliseconds) and one integer per
+    /// column.  Rows are buffered for each series and written as a block
+    /// when blockSize rows have built up, when flush is called, and when the
+    /// writer is closed.
+    /// Opening an existing store adds to it.  This class is thread-safe, so
+    /// the threads reading different devices can share one writer.
+    /// </remarks>
+    public class TelemetryWriter : IDisposable
+    {
+        class Series
+        {
+            public String name;
+            public String[] columns;
+            public String[] lastColumns;  // the array last passed to add
+            public Int64[][] values;  // [column][row]; column 0 is the time
+            public int rows;
+        }
+
+        readonly Object sync = new Object();
+        readonly FileStream stream;
+        readonly BinaryWriter writer;
+        readonly List<TelemetryBlock> blocks;
+        readonly Dictionary<String, Series> series = new Dictionary<String, Series>();
+        byte[] encoded;
+        bool closed;
+
+        int privateBlockSize = 4096;
+
+        /// <summary>
+        /// The number of rows of a series to collect before writing them as
+        /// a block.  Bigger blocks compress a little better, but a query
+        /// reads whole blocks, so smaller blocks make short time ranges
+        /// faster to read.  The default is 4096.
+        /// </summary>
+        public int blockSize
+        {
+            get { return privateBlockSize; }
+            set
+            {
+                if (value < 1)
+                {
+                    throw new ArgumentException("The block size must be at least 1.");
+                }
+                lock (sync)
+                {
+                    // The buffers are sized for the old block size.
+                    flush();
+                    series.Clear();
+                    privateBlockSize = value;
+                }
+            }
+        }
+
+        /// <summary>
+        /// Opens a telemetry store for writing, creating it if it does not
+        /// exist.
+        /// </summary>
+        public TelemetryWriter(String fileName)
+        {
+            stream = new FileStream(fileName, FileMode.OpenOrCreate, FileAccess.ReadWrite, FileShare.Read);
+            try
+            {
+                writer = new BinaryWriter(stream);
+                if (stream.Length == 0)
+                {
+                    TelemetryFile.writeFileHeader(writer);
+                    blocks = new List<TelemetryBlock>();
+                }
+                else
+                {
+                    BinaryReader reader = new BinaryReader(stream);
+                    TelemetryFile.readFileHeader(reader);
+
+                    // Remove the index (or an incomplete block, if the last
+                    // writer crashed); a new index is written when this
+                    // writer is closed.
+                    Int64 dataEnd;
+                    blocks = TelemetryFile.readBlocks(reader, out dataEnd);
+                    stream.SetLength(dataEnd);
+                }
+                stream.Seek(0, SeekOrigin.End);
+            }
+            catch (Exception exception)
+            {
+                stream.Close();
+                throw new Exception("There was an error opening the telemetry store " + fileName + ".", exception);
+            }
+        }
+
+        /// <summary>
+        /// Adds a row to a series.
+        /// </summary>
+        /// <param name="seriesName">The series, usually the device's serial number.</param>
+        /// <param name="columns">
+        ///   The names of the columns.  This must be the same every time rows
+        ///   are added to the same series, until the writer is closed.
+        ///   "time" is reserved for the time.
+        /// </param>
+        /// <param name="time">The time of the row.</param>
+        /// <param name="values">The value of each column.</param>
+        public void add(String seriesName, String[] columns, Int64 time, Int64[] values)
+        {
+            if (values.Length != columns.Length)
+            {
+                throw new ArgumentException("There must be one value for each column.");
+            }
+
+            lock (sync)
+            {
+                Series s = getSeries(seriesName, columns);
+                s.values[0][s.rows] = time;
+                for (int i = 0; i < values.Length; i++)
+                {
+                    s.values[i + 1][s.rows] = values[i];
+                }
+                s.rows++;
+                if (s.rows == privateBlockSize)
+                {
+                    writeBlock(s);
+                }
+            }
+        }
+
+        Series getSeries(String name, String[] columns)
+        {
+            if (closed)
+            {
+                throw new ObjectDisposedException("TelemetryWriter");
+            }
+
+            Series s;
+            if (series.TryGetValue(name, out s))
+            {
+                if (s.lastColumns == columns)
+                {
+                    return s;
+                }
+                if (s.columns.Length != columns.Length + 1)
+                {
+                    throw new ArgumentException("The columns of series " + name + " do not match the ones it was started with.");
+                }
+                for (int i = 0; i < columns.Length; i++)
+                {
+                    if (s.columns[i + 1] != columns[i])
+                    {
+                        throw new ArgumentException("The columns of series " + name + " do not match the ones it was started with.");
+                    }
+                }
+                s.lastColumns = columns;
+                return s;
+            }
+
+            s = new Series();
+            s.name = name;
+            s.columns = new String[columns.Length + 1];
+            s.columns[0] = TelemetryFile.timeColumn;
+            for (int i = 0; i < columns.Length; i++)
+            {
+                if (columns[i] == TelemetryFile.timeColumn || Array.IndexOf(columns, columns[i]) != i)
+                {
+                    throw new ArgumentException("The column name \"" + columns[i] + "\" is reserved or used twice.");
+                }
+                s.columns[i + 1] = columns[i];
+            }
+            s.lastColumns = columns;
+            s.values = new Int64[s.columns.Length][];
+            for (int i = 0; i < s.values.Length; i++)
+            {
+                s.values[i] = new Int64[privateBlockSize];
+            }
+            series[name] = s;
+            return s;
+        }
+
+        /// <summary>
+        /// Writes the rows that have not been written yet to the file.
+        /// </summary>
+        public void flush()
+        {
+            lock (sync)
+            {
+                foreach (Series s in series.Values)
+                {
+                    if (s.rows != 0)
+                    {
+                        writeBlock(s);
+                    }
+                }
+                writer.Flush();
+            }
+        }
+
+        void writeBlock(Series s)
+        {
+            TelemetryBlock block = new TelemetryBlock();
+            block.offset = stream.Position;
+            block.series = s.name;
+            block.rows = s.rows;
+            block.startTime = Int64.MaxValue;
+            block.endTime = Int64.MinValue;
+            for (int i = 0; i < s.rows; i++)
+            {
+                block.startTime = Math.Min(block.startTime, s.values[0][i]);
+                block.endTime = Math.Max(block.endTime, s.values[0][i]);
+            }
+
+            // Encode the columns first, because their lengths go in the header.
+            MemoryStream data = new MemoryStream();
+            MemoryStream headerStream = new MemoryStream();
+            BinaryWriter header = new BinaryWriter(headerStream);
+            header.Write(block.series);
+            header.Write(block.startTime);
+            header.Write(block.endTime);
+            header.Write(block.rows);
+            header.Write((UInt16)s.columns.Length);
+            for (int i = 0; i < s.columns.Length; i++)
+            {
+                ColumnEncoding encoding;
+                int length = ColumnCodec.encode(s.values[i], s.rows, ref encoded, out encoding);
+                data.Write(encoded, 0, length);
+                header.Write(s.columns[i]);
+                header.Write((byte)encoding);
+                header.Write(length);
+            }
+            header.Flush();
+
+            writer.Write(TelemetryFile.blockMagic);
+            writer.Write((Int32)headerStream.Length);
+            writer.Write(headerStream.GetBuffer(), 0, (int)headerStream.Length);
+            writer.Write(data.GetBuffer(), 0, (int)data.Length);
+
+            blocks.Add(block);
+            s.rows = 0;
+        }
+
+        /// <summary>
+        /// Writes the remaining rows and the index, and closes the file.
+        /// </summary>
+        public void close()
+        {
+            lock (sync)
+            {
+                if (closed)
+                {
+                    return;
+                }
+                flush();
+
+                Int64 indexOffset = stream.Position;
+                writer.Write(TelemetryFile.indexMagic);
+                writer.Write(blocks.Count);
+                foreach (TelemetryBlock block in blocks)
+                {
+                    writer.Write(block.offset);
+                    writer.Write(block.series);
+                    writer.Write(block.startTime);
+                    writer.Write(block.endTime);
+                    writer.Write(block.rows);
+                }
+                writer.Write(indexOffset);
+                writer.Write(TelemetryFile.endMagic);
+                writer.Close();
+                closed = true;
+            }
+        }
+
+        public void Dispose()
+        {
+            close();
+        }
+    }
+}
@@ -0,0 +1,7 @@
+Telemetry_lib := $(Telemetry)/Telemetry.dll
+Targets += $(Telemetry)/Telemetry.dll
+
+Telemetry_csfiles := $(wildcard $(Telemetry)/*.cs) $(Telemetry)/Properties/AssemblyInfo.cs
+
+$(Telemetry)/Telemetry.dll: $(Telemetry_csfiles)
+	$(CS) -target:library -out:$@ $(Telemetry_csfiles)
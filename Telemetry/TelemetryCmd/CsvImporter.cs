@@ -0,0 +1,146 @@
+﻿using System;
+using System.Collections.Generic;
+using System.IO;
+using Pololu.Telemetry;
+
+namespace Pololu.Telemetry.TelemetryCmd
+{
+    /// <summary>
+    /// Converts the text logs written by the SDK's command-line utilities,
+    /// like the output of JrkCmd --stream, into a telemetry store.
+    /// </summary>
+    /// <remarks>
+    /// Each line has the same number of integer fields separated by commas,
+    /// tabs or spaces (padding spaces around the fields are ignored).  The
+    /// first field is the time in milliseconds.  The first line can be a
+    /// header with the names of the fields; if there is none, or if it
+    /// cannot be split because the fields are separated by spaces, the
+    /// columns are named like JrkCmd's header when there are 11 fields (the
+    /// default format) or 12, and "Column 1", "Column 2"... otherwise.
+    /// </remarks>
+    static class CsvImporter
+    {
+        /// <summary>
+        /// The header that JrkCmd --stream prints.  The default format leaves
+        /// out the last column.
+        /// </summary>
+        static readonly String[] jrkStreamColumns = new String[] {
+            "Time (ms)", "PID Period Count", "Input", "Target", "Feedback",
+            "Scaled feedback", "Integral", "Duty cycle target", "Duty cycle",
+            "Current (mA)", "Error code", "PID period exceeded" };
+
+        /// <summary>
+        /// Adds the lines of a CSV file to a series in the store.
+        /// </summary>
+        /// <param name="reader">The CSV file.</param>
+        /// <param name="writer">The store.</param>
+        /// <param name="series">The series to add the rows to.</param>
+        /// <param name="timeOffset">A number to add to every time, for example to turn times relative to the start of a log into absolute times.</param>
+        /// <returns>The number of rows added.</returns>
+        public static int import(TextReader reader, TelemetryWriter writer, String series, Int64 timeOffset)
+        {
+            String[] columns = null;
+            String[] header = null;
+            Int64[] values = null;
+            int lineNumber = 0;
+            int rows = 0;
+            String line;
+
+            while ((line = reader.ReadLine()) != null)
+            {
+                lineNumber++;
+                if (line.Trim() == "")
+                {
+                    continue;
+                }
+
+                String[] fields = split(line);
+                if (columns == null)
+                {
+                    Int64 number;
+                    if (!Int64.TryParse(fields[0], out number))
+                    {
+                        // This is a header line.
+                        if (header != null)
+                        {
+                            throw new Exception("Error on line " + lineNumber + ": expected numbers.");
+                        }
+                        header = fields;
+                        continue;
+                    }
+
+                    columns = columnNames(header, fields.Length);
+                    values = new Int64[fields.Length - 1];
+                }
+
+                if (fields.Length != columns.Length + 1)
+                {
+                    throw new Exception("Error on line " + lineNumber + ": expected " + (columns.Length + 1) + " fields but there are " + fields.Length + ".");
+                }
+
+                Int64 time;
+                if (!Int64.TryParse(fields[0], out time))
+                {
+                    throw new Exception("Error on line " + lineNumber + ": \"" + fields[0] + "\" is not a whole number.");
+                }
+                for (int i = 0; i < values.Length; i++)
+                {
+                    if (!Int64.TryParse(fields[i + 1], out values[i]))
+                    {
+                        throw new Exception("Error on line " + lineNumber + ": \"" + fields[i + 1] + "\" is not a whole number.");
+                    }
+                }
+
+                writer.add(series, columns, time + timeOffset, values);
+                rows++;
+            }
+            return rows;
+        }
+
+        static String[] split(String line)
+        {
+            String[] fields;
+            if (line.IndexOf('\t') >= 0)
+            {
+                fields = line.Split('\t');
+            }
+            else if (line.IndexOf(',') >= 0)
+            {
+                fields = line.Split(',');
+            }
+            else
+            {
+                fields = line.Split(new char[] { ' ' }, StringSplitOptions.RemoveEmptyEntries);
+            }
+
+            for (int i = 0; i < fields.Length; i++)
+            {
+                fields[i] = fields[i].Trim();
+            }
+            return fields;
+        }
+
+        /// <summary>
+        /// Returns the names of the columns after the time.
+        /// </summary>
+        static String[] columnNames(String[] header, int fieldCount)
+        {
+            String[] source = null;
+            if (header != null && header.Length == fieldCount)
+            {
+                source = header;
+            }
+            else if (fieldCount == jrkStreamColumns.Length || fieldCount == jrkStreamColumns.Length - 1)
+            {
+                source = jrkStreamColumns;
+            }
+
+            String[] names = new String[fieldCount - 1];
+            for (int i = 1; i < fieldCount; i++)
+            {
+                names[i - 1] = source != null ? source[i] : "Column " + i;
+            }
+            return names;
+        }
+    }
+}
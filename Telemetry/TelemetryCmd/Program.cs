@@ -0,0 +1,178 @@
+﻿using System;
+using System.Collections.Generic;
+using System.IO;
+using System.Reflection;
+using Pololu.Telemetry;
+
+namespace Pololu.Telemetry.TelemetryCmd
+{
+    /// <summary>
+    /// This class represents the executable commandline utility TelemetryCmd.exe,
+    /// which converts text logs into telemetry stores and reads them back.
+    /// </summary>
+    class Program
+    {
+        static void Main(string[] args)
+        {
+            CommandOptions opts = new CommandOptions(Assembly.GetExecutingAssembly().GetName()+"\n"+
+                "Options:\n"+
+                "  --store FILE             the telemetry store to use (required)\n"+
+                "  --import FILE            add the readings in a CSV file (like the output of\n"+
+                "                           JrkCmd --stream) to the store\n"+
+                "  --series NAME            series to import to or read from, usually the\n"+
+                "                           serial number of the device\n"+
+                "  --time-offset MS         number to add to the times when importing\n"+
+                "  --list                   list the series in the store\n"+
+                "  --query COLUMN           print the time and value of one column of a series\n"+
+                "  --export                 print all the columns of a series as CSV\n"+
+                "  --from TIME              earliest time to print (default: the start)\n"+
+                "  --to TIME                latest time to print (default: the end)\n",
+                args);
+
+            String storeName = opts["store"];
+            if (storeName == null || storeName == "")
+                opts.error("A store is required.");
+
+            Int64 timeOffset = 0, from = Int64.MinValue, to = Int64.MaxValue;
+            try
+            {
+                if (opts["time-offset"] != null)
+                    timeOffset = Int64.Parse(opts["time-offset"]);
+                if (opts["from"] != null)
+                    from = Int64.Parse(opts["from"]);
+                if (opts["to"] != null)
+                    to = Int64.Parse(opts["to"]);
+            }
+            catch (FormatException)
+            {
+                opts.error("Invalid number.");
+            }
+
+            if ((opts["import"] != null || opts["query"] != null || opts["export"] != null) &&
+                (opts["series"] == null || opts["series"] == ""))
+            {
+                opts.error("A series is required.");
+            }
+
+            try
+            {
+                if (opts["import"] != null)
+                {
+                    import(storeName, opts["import"], opts["series"], timeOffset);
+                }
+                if (opts["list"] != null)
+                {
+                    list(storeName);
+                }
+                if (opts["query"] != null)
+                {
+                    query(storeName, opts["series"], opts["query"], from, to);
+                }
+                if (opts["export"] != null)
+                {
+                    export(storeName, opts["series"], from, to);
+                }
+            }
+            catch (Exception exception)
+            {
+                printException(exception);
+                Environment.Exit(1);
+            }
+        }
+
+        static void import(String storeName, String csvName, String series, Int64 timeOffset)
+        {
+            int rows;
+            using (TelemetryWriter writer = new TelemetryWriter(storeName))
+            using (StreamReader reader = new StreamReader(csvName))
+            {
+                rows = CsvImporter.import(reader, writer, series, timeOffset);
+            }
+
+            long csvSize = new FileInfo(csvName).Length;
+            long storeSize = new FileInfo(storeName).Length;
+            Console.Error.WriteLine("Imported " + rows + " rows from " + csvName + " (" + csvSize + " bytes).  " +
+                "The store is now " + storeSize + " bytes.");
+        }
+
+        static void list(String storeName)
+        {
+            using (TelemetryReader reader = new TelemetryReader(storeName))
+            {
+                foreach (String series in reader.getSeriesNames())
+                {
+                    Int64 start = Int64.MaxValue, end = Int64.MinValue, rows = 0;
+                    int blocks = 0;
+                    foreach (TelemetryBlock block in reader.getBlocks())
+                    {
+                        if (block.series == series)
+                        {
+                            start = Math.Min(start, block.startTime);
+                            end = Math.Max(end, block.endTime);
+                            rows += block.rows;
+                            blocks++;
+                        }
+                    }
+                    Console.WriteLine(series + ": " + rows + " rows in " + blocks + " blocks, times " + start + " to " + end);
+                    Console.WriteLine("  Columns: " + String.Join(", ", new List<String>(reader.getColumnNames(series)).ToArray()));
+                }
+            }
+        }
+
+        static void query(String storeName, String series, String column, Int64 from, Int64 to)
+        {
+            using (TelemetryReader reader = new TelemetryReader(storeName))
+            {
+                List<Int64> times = new List<Int64>();
+                List<Int64> values = new List<Int64>();
+                reader.read(series, column, from, to, times, values);
+
+                Console.WriteLine("time," + column);
+                for (int i = 0; i < times.Count; i++)
+                {
+                    Console.WriteLine(times[i] + "," + values[i]);
+                }
+                Console.Error.WriteLine("Read " + reader.bytesRead + " bytes.");
+            }
+        }
+
+        static void export(String storeName, String series, Int64 from, Int64 to)
+        {
+            using (TelemetryReader reader = new TelemetryReader(storeName))
+            {
+                String[] columns = new List<String>(reader.getColumnNames(series)).ToArray();
+                List<Int64> times = new List<Int64>();
+                List<Int64>[] values = new List<Int64>[columns.Length];
+                for (int i = 0; i < columns.Length; i++)
+                {
+                    values[i] = new List<Int64>();
+                }
+                reader.read(series, columns, from, to, times, values);
+
+                Console.WriteLine("time," + String.Join(",", columns));
+                String[] fields = new String[columns.Length + 1];
+                for (int row = 0; row < times.Count; row++)
+                {
+                    fields[0] = times[row].ToString();
+                    for (int i = 0; i < columns.Length; i++)
+                    {
+                        fields[i + 1] = values[i][row].ToString();
+                    }
+                    Console.WriteLine(String.Join(",", fields));
+                }
+            }
+        }
+
+        /// <summary>
+        /// Prints the exception and all its inner exceptions.
+        /// </summary>
+        static void printException(Exception exception)
+        {
+            while (exception != null)
+            {
+                Console.Error.WriteLine(exception.Message);
+                exception = exception.InnerException;
+            }
+        }
+    }
+}
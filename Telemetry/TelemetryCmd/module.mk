@@ -0,0 +1,19 @@
+# Generate a unique list of files that need to be in the same
+# directory as TelemetryCmd at runtime (runtime dependencies).
+TelemetryCmd_runtime := $(sort $(Telemetry_lib))
+
+# Compile-time dependencies.
+TelemetryCmd_dlls := $(Telemetry)/Telemetry.dll
+TelemetryCmd_csfiles := $(TelemetryCmd)/CommandOptions.cs $(TelemetryCmd)/CsvImporter.cs $(TelemetryCmd)/Program.cs $(TelemetryCmd)/Properties/AssemblyInfo.cs
+
+# Required module variables
+Targets += $(TelemetryCmd)/TelemetryCmd
+Byproducts += $(foreach dll, $(TelemetryCmd_runtime), $(TelemetryCmd)/$(notdir $(dll)))
+
+$(TelemetryCmd)/TelemetryCmd: $(TelemetryCmd_csfiles) $(TelemetryCmd_runtime)
+	cp $(TelemetryCmd_runtime) $(TelemetryCmd)
+	$(CS) -target:exe -out:$@.exe $(TelemetryCmd_csfiles) $(foreach dll, $(TelemetryCmd_dlls),-r:$(TelemetryCmd)/$(notdir $(dll)))
+	mv $@.exe $@
+
+# Alias so you can type "make telemetrycmd"
+telemetrycmd: $(TelemetryCmd)/TelemetryCmd
@@ -0,0 +1,1240 @@
+﻿using System;
+using System.Collections.Generic;
+using System.Diagnostics;
+using System.IO;
+using System.Threading;
+using Pololu.UsbWrapper;
+using Pololu.Usc;
+using Pololu.Jrk;
+using Pololu.SimpleMotorControllerG2;
+using Pololu.SharedState;
+
+namespace Pololu.UsbBenchmark
+{
+    delegate void Operation();
+
+    /// <summary>
+    /// Gives the benchmark access to a device's raw control transfers,
+    /// so the latency of the USB layer can be measured without any of the
+    /// work that the device classes do.
+    /// </summary>
+    class RawDevice : UsbDevice
+    {
+        public RawDevice(DeviceListItem deviceListItem) : base(deviceListItem)
+        {
+        }
+
+        /// <summary>
+        /// Reads the standard 18-byte device descriptor, which every USB
+        /// device supports.  Returns the number of bytes read or a negative
+        /// UsbStatus code.
+        /// </summary>
+        public unsafe int tryGetDeviceDescriptor(byte* buffer)
+        {
+            return tryControlTransfer(0x80, 6, 0x0100, 0, buffer, 18);
+        }
+    }
+
+    /// <summary>
+    /// The individual benchmarks.  Each one writes one or more results.
+    /// </summary>
+    class Benchmarks
+    {
+        readonly ResultWriter writer;
+        readonly int iterations;
+        readonly bool saveSettings;
+
+        /// <param name="writer">Where to write the results.</param>
+        /// <param name="iterations">The number of samples to take of fast operations.</param>
+        /// <param name="saveSettings">
+        ///   True to measure how long it takes to save settings.  This writes
+        ///   to the device's non-volatile memory, which has a limited number
+        ///   of write cycles, so it should not be done casually on real devices.
+        /// </param>
+        public Benchmarks(ResultWriter writer, int iterations, bool saveSettings)
+        {
+            this.writer = writer;
+            this.iterations = iterations;
+            this.saveSettings = saveSettings;
+        }
+
+        /// <summary>
+        /// The number of samples to take of operations that take a long
+        /// time, like enumerating devices and reading settings.
+        /// </summary>
+        int slowIterations
+        {
+            get { return Math.Max(1, iterations / 100); }
+        }
+
+        /// <summary>
+        /// Runs an operation the given number of times and records how long
+        /// each run took.  The operation is run once beforehand so that
+        /// just-in-time compilation and first-use initialization are not
+        /// included.
+        /// </summary>
+        static Samples measure(Operation operation, int count)
+        {
+            Samples samples = new Samples(count);
+            operation();
+            for (int i = 0; i < count; i++)
+            {
+                long start = Stopwatch.GetTimestamp();
+                operation();
+                samples.add(Stopwatch.GetTimestamp() - start);
+            }
+            return samples;
+        }
+
+        /// <summary>
+        /// Runs a benchmark, and if it throws an exception, writes a result
+        /// with the error message instead of stopping the whole run.
+        /// </summary>
+        void run(Result result, Operation benchmark)
+        {
+            try
+            {
+                benchmark();
+            }
+            catch (Exception exception)
+            {
+                Exception inner = exception;
+                while (inner.InnerException != null)
+                {
+                    inner = inner.InnerException;
+                }
+                result.add("error", exception.Message + (inner != exception ? " " + inner.Message : ""));
+            }
+            writer.write(result);
+        }
+
+        static Result newResult(String benchmark, String product, DeviceListItem item)
+        {
+            Result result = new Result(benchmark);
+            result.add("product", product);
+            result.add("productId", (long)item.productId);
+            result.add("serialNumber", item.serialNumber);
+            return result;
+        }
+
+        /// <summary>
+        /// Measures the round-trip time of a control transfer that the
+        /// firmware answers without doing any work: reading the device
+        /// descriptor.
+        /// </summary>
+        public void controlTransfer(DeviceListItem item, String product)
+        {
+            Result result = newResult("transfer", product, item);
+            result.add("request", "GET_DESCRIPTOR");
+            run(result, delegate()
+            {
+                using (RawDevice device = new RawDevice(item))
+                {
+                    int errors = 0;
+                    Samples samples = measure(delegate()
+                    {
+                        unsafe
+                        {
+                            byte* buffer = stackalloc byte[18];
+                            if (device.tryGetDeviceDescriptor(buffer) < 0)
+                            {
+                                errors++;
+                            }
+                        }
+                    }, iterations);
+                    result.add("errors", errors);
+                    samples.addTo(result);
+                }
+            });
+        }
+
+        /// <summary>
+        /// Measures how long it takes to get the list of connected devices,
+        /// and how much memory that allocates.  The items are disposed, as
+        /// a program that enumerates often should do.
+        /// </summary>
+        /// <param name="deviceClass">The name of the class whose getConnectedDevices method is called.</param>
+        /// <param name="getConnectedDevices">The method to call.</param>
+        public void enumeration(String deviceClass, GetConnectedDevices getConnectedDevices)
+        {
+            Result result = new Result("enumerate");
+            result.add("class", deviceClass);
+            run(result, delegate()
+            {
+                Operation enumerate = delegate()
+                {
+                    foreach (DeviceListItem item in getConnectedDevices())
+                    {
+                        item.Dispose();
+                    }
+                };
+
+                List<DeviceListItem> items = getConnectedDevices();
+                result.add("devices", items.Count);
+                foreach (DeviceListItem item in items)
+                {
+                    item.Dispose();
+                }
+
+                measure(enumerate, slowIterations).addTo(result);
+
+                // Measured separately so that the samples are not counted.
+                GC.Collect();
+                GC.WaitForPendingFinalizers();
+                long before = GC.GetTotalMemory(true);
+                int collections = GC.CollectionCount(0);
+                for (int i = 0; i < slowIterations; i++)
+                {
+                    enumerate();
+                }
+                collections = GC.CollectionCount(0) - collections;
+                long after = GC.GetTotalMemory(false);
+                if (collections == 0)
+                {
+                    result.add("bytesPerCall", Math.Max(0, after - before) / (double)slowIterations);
+                }
+            });
+        }
+
+        public delegate List<DeviceListItem> GetConnectedDevices();
+
+        /// <summary>
+        /// Measures the cost of a connection's handle: connecting to the
+        /// device, getting its serial number and disconnecting, and getting
+        /// the serial number of a device that is already connected, which
+        /// is cached after the first time.
+        /// </summary>
+        /// <param name="connect">Connects to the device with the device class being measured.</param>
+        public void handles(DeviceListItem item, String product, UsbDeviceFactory connect)
+        {
+            Result result = newResult("handles", product, item);
+            result.add("call", "connect+getSerialNumber+Dispose");
+            run(result, delegate()
+            {
+                measure(delegate()
+                {
+                    using (UsbDevice device = connect(item))
+                    {
+                        device.getSerialNumber();
+                    }
+                }, slowIterations).addTo(result);
+            });
+
+            result = newResult("handles", product, item);
+            result.add("call", "UsbDevice.getSerialNumber");
+            run(result, delegate()
+            {
+                using (UsbDevice device = connect(item))
+                {
+                    measure(delegate() { device.getSerialNumber(); }, iterations).addTo(result);
+                }
+            });
+
+            UsbDevice connected = null;
+            try
+            {
+                connected = connect(item);
+                allocations(item, product, "UsbDevice.getSerialNumber", delegate() { connected.getSerialNumber(); });
+            }
+            catch (Exception)
+            {
+                // The first result above already reported why it failed.
+            }
+            finally
+            {
+                if (connected != null)
+                {
+                    connected.Dispose();
+                }
+            }
+        }
+
+        /// <summary>
+        /// Measures the Maestro's variable reading methods: the one that
+        /// reads everything in to newly-allocated arrays, and the one that
+        /// fills in arrays supplied by the caller.
+        /// </summary>
+        public void maestroVariables(DeviceListItem item, String product)
+        {
+            Result result = newResult("variables", product, item);
+            result.add("call", "Usc.getVariables");
+            run(result, delegate()
+            {
+                using (Usc.Usc usc = new Usc.Usc(item))
+                {
+                    MaestroVariables variables;
+                    short[] stack;
+                    ushort[] callStack;
+                    ServoStatus[] servos;
+                    addThroughput(result, measure(delegate()
+                    {
+                        usc.getVariables(out variables, out stack, out callStack, out servos);
+                    }, iterations));
+                }
+            });
+
+            result = newResult("variables", product, item);
+            result.add("call", "Usc.tryGetVariables");
+            run(result, delegate()
+            {
+                using (Usc.Usc usc = new Usc.Usc(item))
+                {
+                    MaestroVariables variables;
+                    ServoStatus[] servos = new ServoStatus[usc.servoCount];
+                    addThroughput(result, measure(delegate()
+                    {
+                        usc.tryGetVariables(out variables, servos);
+                    }, iterations));
+                }
+            });
+
+            foreach (MaestroFields fields in new MaestroFields[] { MaestroFields.Servos, MaestroFields.All })
+            {
+                result = newResult("variables", product, item);
+                result.add("call", "Usc.tryGetStatus(" + fields + ")");
+                run(result, delegate()
+                {
+                    using (Usc.Usc usc = new Usc.Usc(item))
+                    using (MaestroStatus status = new MaestroStatus(usc.servoCount))
+                    {
+                        addThroughput(result, measure(delegate()
+                        {
+                            usc.tryGetStatus(fields, status);
+                        }, iterations));
+                    }
+                });
+            }
+        }
+
+        public void jrkVariables(DeviceListItem item, String product)
+        {
+            Result result = newResult("variables", product, item);
+            result.add("call", "Jrk.getVariables");
+            run(result, delegate()
+            {
+                using (Jrk.Jrk jrk = new Jrk.Jrk(item))
+                {
+                    addThroughput(result, measure(delegate() { jrk.getVariables(); }, iterations));
+                }
+            });
+        }
+
+        /// <summary>
+        /// Runs a JrkControlLoop at 500 Hz and 1 kHz with a proportional
+        /// controller and reports how well it kept time.
+        /// </summary>
+        public void jrkControlLoop(DeviceListItem item, String product)
+        {
+            foreach (double period in new double[] { 2000, 1000 })
+            {
+                Result result = newResult("controlLoop", product, item);
+                result.add("period", period);
+                run(result, delegate()
+                {
+                    using (Jrk.Jrk jrk = new Jrk.Jrk(item))
+                    {
+                        int cycles = Math.Max(100, iterations);
+                        JrkControlLoop loop = new JrkControlLoop(jrk, period, delegate(JrkControlCycle cycle)
+                        {
+                            int setpoint = (cycle.number / 500) % 2 == 0 ? 1500 : 2500;
+                            int target = cycle.variables.target + (setpoint - cycle.variables.feedback) / 4;
+                            cycle.target = (UInt16)Math.Max(0, Math.Min(4095, target));
+                            cycle.setTarget = true;
+                            cycle.stop = cycle.number >= cycles;
+                        });
+                        using (loop)
+                        {
+                            loop.start();
+                            loop.wait(-1);
+                        }
+                        jrk.motorOff();
+                        if (loop.error != null)
+                        {
+                            throw loop.error;
+                        }
+
+                        result.add("cycles", loop.cycles);
+                        result.add("missedDeadlines", loop.missedDeadlines);
+                        result.add("skippedCycles", loop.skippedCycles);
+                        result.add("failures", loop.readFailures + loop.writeFailures);
+                        result.add("averageJitter", loop.jitter.mean);
+                        result.add("p99Jitter", loop.jitter.getPercentile(99));
+                        result.add("maxJitter", loop.jitter.max);
+                        result.add("averageLoopLatency", loop.loopLatency.mean);
+                        result.add("p99LoopLatency", loop.loopLatency.getPercentile(99));
+                        result.add("maxLoopLatency", loop.loopLatency.max);
+                    }
+                });
+            }
+        }
+
+        /// <summary>
+        /// Records a session of reading a Maestro's variables and setting a
+        /// target, then plays it back with a ReplayUsbDevice as fast as
+        /// possible and with the recorded timing.  The recording shows what
+        /// the SessionRecorder costs, and the fast playback shows the time
+        /// spent in the library without the device.
+        /// </summary>
+        public void replay(DeviceListItem item, String product)
+        {
+            Usc.Usc usc = null;
+            MaestroVariables variables;
+            short[] stack;
+            ushort[] callStack;
+            ServoStatus[] servos;
+            int count = 0;
+            Operation session = delegate()
+            {
+                usc.getVariables(out variables, out stack, out callStack, out servos);
+                usc.setTarget(0, (ushort)(count++ % 2 == 0 ? 6000 : 5000));
+            };
+
+            Result result = newResult("replay", product, item);
+            result.add("mode", "record");
+            byte[] log = null;
+            run(result, delegate()
+            {
+                MemoryStream stream = new MemoryStream();
+                SessionRecorder.start(stream);
+                try
+                {
+                    using (usc = new Usc.Usc(item))
+                    {
+                        addThroughput(result, measure(session, iterations));
+                    }
+                    result.add("transfers", SessionRecorder.recordedTransfers);
+                }
+                finally
+                {
+                    SessionRecorder.stop();
+                }
+                log = stream.ToArray();
+                result.add("logBytes", log.Length);
+            });
+            if (log == null)
+            {
+                return;
+            }
+
+            foreach (bool realTime in new bool[] { false, true })
+            {
+                result = newResult("replay", product, item);
+                result.add("mode", realTime ? "realTime" : "fast");
+                run(result, delegate()
+                {
+                    SessionLog sessionLog = SessionLog.read(new MemoryStream(log));
+                    ReplayUsbDevice device = sessionLog.createReplayDevices()[0];
+                    device.realTime = realTime;
+                    device.loop = true;
+                    count = 0;
+                    using (usc = new Usc.Usc(new DeviceListItem(device)))
+                    {
+                        addThroughput(result, measure(session, iterations));
+                    }
+                    result.add("transfers", device.replayed);
+                    result.add("skipped", device.skipped);
+                    result.add("mismatches", device.mismatches + device.dataMismatches);
+                });
+            }
+        }
+
+        public void smcVariables(DeviceListItem item, String product)
+        {
+            Result result = newResult("variables", product, item);
+            result.add("call", "Smc.getSmcVariables");
+            run(result, delegate()
+            {
+                using (Smc smc = new Smc(item))
+                {
+                    addThroughput(result, measure(delegate() { smc.getSmcVariables(); }, iterations));
+                }
+            });
+        }
+
+        /// <summary>
+        /// Measures how closely an SmcTrajectoryStreamer keeps to its
+        /// schedule while streaming speed profiles to the device, changing
+        /// the target every 50 ticks so that profiles are replaced in the
+        /// middle.  The lateness is how long after its scheduled time each
+        /// tick started, in microseconds.
+        /// </summary>
+        public void smcTrajectory(DeviceListItem item, String product)
+        {
+            const int period = 5000;
+            Result result = newResult("trajectory", product, item);
+            result.add("period", period);
+            run(result, delegate()
+            {
+                using (Smc smc = new Smc(item))
+                using (SmcTrajectoryStreamer streamer = new SmcTrajectoryStreamer(period, 32000, 160000))
+                {
+                    int axis = streamer.addController(smc);
+                    long tickCount = Math.Max(100, iterations / 10);
+                    streamer.start();
+                    for (int i = 0; streamer.ticks < tickCount; i++)
+                    {
+                        streamer.setTarget(axis, (Int16)(i % 2 == 0 ? 3200 : -3200));
+                        Thread.Sleep(period * 50 / 1000);
+                    }
+                    streamer.stop();
+                    smc.setSpeed(0);
+
+                    result.add("ticks", streamer.ticks);
+                    result.add("missedTicks", streamer.missedTicks);
+                    result.add("failures", streamer.failures);
+                    result.add("averageLateness", streamer.averageLateness);
+                    result.add("maxLateness", streamer.maxLateness);
+                }
+            });
+        }
+
+        /// <summary>
+        /// Measures Usc.trySetTarget in coalescing mode, sweeping the targets
+        /// of all channels as fast as possible.  The calls per second are
+        /// for the program; sent and coalesced show how many targets reached
+        /// the device and how many were replaced by newer ones, and the
+        /// latency is how far the device was behind, in microseconds.
+        /// </summary>
+        public void maestroCoalescing(DeviceListItem item, String product)
+        {
+            Result result = newResult("coalescing", product, item);
+            result.add("call", "Usc.trySetTarget");
+            run(result, delegate()
+            {
+                using (Usc.Usc usc = new Usc.Usc(item))
+                {
+                    usc.startCoalescing();
+                    CoalescingWriter writer = usc.coalescer;
+                    int failures = 0;
+                    int call = 0;
+                    addThroughput(result, measure(delegate()
+                    {
+                        byte servo = (byte)(call % usc.servoCount);
+                        if (usc.trySetTarget(servo, (ushort)(4000 + 4 * (call % 2000))) < 0)
+                        {
+                            failures++;
+                        }
+                        call++;
+                    }, iterations));
+                    writer.flush(5000);
+                    usc.stopCoalescing();
+
+                    result.add("posted", writer.posted);
+                    result.add("sent", writer.sent);
+                    result.add("coalesced", writer.coalesced);
+                    result.add("failures", failures + writer.failed);
+                    result.add("averageLatency", writer.latency.mean);
+                    result.add("p99Latency", writer.latency.getPercentile(99));
+                    result.add("maxLatency", writer.latency.max);
+                }
+            });
+        }
+
+        /// <summary>
+        /// Measures how well a ServoFrameScheduler predicts the starts of the
+        /// Maestro's frames while a target is changed several times per
+        /// frame.  The phase errors and uncertainty are in microseconds.
+        /// </summary>
+        /// <param name="framePeriod">The frame period in microseconds, or 0 to read it from the device.</param>
+        public void maestroFrames(DeviceListItem item, String product, double framePeriod)
+        {
+            Result result = newResult("frames", product, item);
+            run(result, delegate()
+            {
+                using (Usc.Usc usc = new Usc.Usc(item))
+                using (ServoFrameScheduler scheduler = framePeriod == 0 ?
+                    new ServoFrameScheduler(usc) : new ServoFrameScheduler(usc, framePeriod))
+                {
+                    result.add("framePeriod", scheduler.framePeriod);
+                    long frameCount = Math.Max(50, iterations / 20);
+                    Stopwatch stopwatch = Stopwatch.StartNew();
+                    scheduler.start();
+                    for (int i = 0; scheduler.frames < frameCount && stopwatch.ElapsedMilliseconds < 10000; i++)
+                    {
+                        scheduler.setTarget(0, (ushort)(4000 + 4 * (i % 1000)));
+                        Thread.Sleep(Math.Max(1, (int)(scheduler.framePeriod / 3000)));
+                    }
+                    scheduler.stop();
+
+                    result.add("frames", scheduler.frames);
+                    result.add("missedFrames", scheduler.missedFrames);
+                    result.add("failures", scheduler.failures);
+                    result.add("observations", scheduler.observations);
+                    result.add("phaseLocked", scheduler.phaseLocked);
+                    result.add("phaseUncertainty", scheduler.phaseUncertainty);
+                    result.add("averagePhaseError", scheduler.averagePhaseError);
+                    result.add("maxPhaseError", scheduler.maxPhaseError);
+                }
+            });
+        }
+
+        /// <summary>
+        /// Measures the skew between the first and the last Maestro when
+        /// restarting their scripts, calling restartScriptAtSubroutine on
+        /// each in turn and with a ScriptTrigger.
+        /// </summary>
+        public void scriptTrigger(List<DeviceListItem> items)
+        {
+            List<Usc.Usc> maestros = new List<Usc.Usc>();
+            try
+            {
+                foreach (DeviceListItem item in items)
+                {
+                    maestros.Add(new Usc.Usc(item));
+                }
+                int rounds = Math.Max(10, slowIterations);
+
+                Result result = new Result("trigger");
+                result.add("devices", items.Count);
+                result.add("call", "Usc.restartScriptAtSubroutine");
+                run(result, delegate()
+                {
+                    Samples skews = new Samples(rounds);
+                    for (int round = 0; round < rounds; round++)
+                    {
+                        long first = 0, last = 0;
+                        for (int i = 0; i < maestros.Count; i++)
+                        {
+                            maestros[i].restartScriptAtSubroutine(0);
+                            last = Stopwatch.GetTimestamp();
+                            if (i == 0)
+                            {
+                                first = last;
+                            }
+                        }
+                        skews.add(last - first);
+                    }
+                    skews.addTo(result);
+                });
+
+                result = new Result("trigger");
+                result.add("devices", items.Count);
+                result.add("call", "ScriptTrigger.fire");
+                run(result, delegate()
+                {
+                    using (ScriptTrigger trigger = new ScriptTrigger(maestros))
+                    {
+                        Samples skews = new Samples(rounds);
+                        int failures = 0;
+                        for (int round = 0; round < rounds; round++)
+                        {
+                            trigger.prepare(0);
+                            ScriptTriggerResult fired = trigger.fire();
+                            failures += fired.failures;
+                            skews.add((long)(fired.skew * Stopwatch.Frequency / 1000000));
+                        }
+                        result.add("failures", failures);
+                        skews.addTo(result);
+                    }
+                });
+            }
+            finally
+            {
+                foreach (Usc.Usc usc in maestros)
+                {
+                    usc.Dispose();
+                }
+            }
+        }
+
+        /// <summary>
+        /// Measures the throughput of a UsbFleet that reads the device
+        /// descriptor of every device over and over, with one worker per
+        /// bus.  The throughput should grow with the number of buses.
+        /// </summary>
+        public void fleet(List<DeviceListItem> items)
+        {
+            Result result = new Result("fleet");
+            result.add("devices", items.Count);
+            run(result, delegate()
+            {
+                using (UsbFleet fleet = new UsbFleet())
+                {
+                    foreach (DeviceListItem item in items)
+                    {
+                        fleet.add(item, delegate(DeviceListItem i) { return new RawDevice(i); });
+                    }
+
+                    int rounds = Math.Max(10, iterations / 100);
+                    int errors = 0;
+                    UsbDeviceWork readDescriptor = delegate(UsbDevice device)
+                    {
+                        unsafe
+                        {
+                            byte* buffer = stackalloc byte[18];
+                            if (((RawDevice)device).tryGetDeviceDescriptor(buffer) < 0)
+                            {
+                                Interlocked.Increment(ref errors);
+                            }
+                        }
+                    };
+
+                    // Connect to all the devices before timing.
+                    UsbFleet.waitAll(fleet.postToAll(readDescriptor), -1);
+
+                    Stopwatch stopwatch = Stopwatch.StartNew();
+                    List<UsbFleetRequest> requests = new List<UsbFleetRequest>();
+                    for (int round = 0; round < rounds; round++)
+                    {
+                        requests.AddRange(fleet.postToAll(readDescriptor));
+                    }
+                    UsbFleet.waitAll(requests, -1);
+                    double seconds = stopwatch.Elapsed.TotalSeconds;
+
+                    List<UsbFleetBus> buses = fleet.getBuses();
+                    long failed = 0;
+                    foreach (UsbFleetBus bus in buses)
+                    {
+                        failed += bus.failed;
+                    }
+                    result.add("buses", buses.Count);
+                    result.add("transfers", requests.Count);
+                    result.add("transfersPerSecond", requests.Count / seconds);
+                    result.add("errors", errors + failed);
+                }
+            });
+        }
+
+        static void addThroughput(Result result, Samples samples)
+        {
+            result.add("callsPerSecond", samples.Count / samples.totalSeconds);
+            samples.addTo(result);
+        }
+
+        /// <summary>
+        /// Measures how long it takes to read the Maestro's settings and,
+        /// if enabled, to write the same settings back.
+        /// </summary>
+        public void maestroSettings(DeviceListItem item, String product)
+        {
+            Result result = newResult("settings", product, item);
+            result.add("operation", "Usc.getUscSettings");
+            run(result, delegate()
+            {
+                using (Usc.Usc usc = new Usc.Usc(item))
+                {
+                    measure(delegate() { usc.getUscSettings(); }, slowIterations).addTo(result);
+                }
+            });
+
+            if (!saveSettings)
+            {
+                return;
+            }
+
+            result = newResult("settings", product, item);
+            result.add("operation", "Usc.setUscSettings");
+            run(result, delegate()
+            {
+                using (Usc.Usc usc = new Usc.Usc(item))
+                {
+                    UscSettings settings = usc.getUscSettings();
+                    measure(delegate() { usc.setUscSettings(settings, false); }, slowIterations).addTo(result);
+                    usc.reinitialize();
+                }
+            });
+        }
+
+        public void smcSettings(DeviceListItem item, String product)
+        {
+            Result result = newResult("settings", product, item);
+            result.add("operation", "Smc.getSmcSettings");
+            run(result, delegate()
+            {
+                using (Smc smc = new Smc(item))
+                {
+                    measure(delegate() { smc.getSmcSettings(); }, slowIterations).addTo(result);
+                }
+            });
+
+            if (!saveSettings)
+            {
+                return;
+            }
+
+            result = newResult("settings", product, item);
+            result.add("operation", "Smc.setSmcSettings");
+            run(result, delegate()
+            {
+                using (Smc smc = new Smc(item))
+                {
+                    SmcSettings settings = smc.getSmcSettings();
+                    measure(delegate() { smc.setSmcSettings(settings); }, slowIterations).addTo(result);
+                }
+            });
+        }
+
+        /// <summary>
+        /// The number of samples in each block of raw telemetry that the
+        /// decoding benchmarks decode.
+        /// </summary>
+        const int decodeBlockSize = 65536;
+
+        /// <summary>
+        /// Compares two ways of decoding blocks of raw variable readings and
+        /// converting them to physical units: one struct per sample with the
+        /// decimal conversions the device classes use ("struct"), and the
+        /// column classes (JrkTelemetry, ServoTelemetry and SmcTelemetry)
+        /// with their batch conversions ("columns").  These do not use any
+        /// devices; the raw data is random.
+        /// </summary>
+        public unsafe void decoding()
+        {
+            Random random = new Random(1);
+
+            byte[] jrkBuffer = new byte[decodeBlockSize * JrkTelemetry.rawSampleSize];
+            random.NextBytes(jrkBuffer);
+            jrkVariables[] jrkStructs = new jrkVariables[decodeBlockSize];
+            int[] milliamps = new int[decodeBlockSize];
+            decodeResult(Jrk.Jrk.productName, "struct", delegate()
+            {
+                fixed (byte* pointer = jrkBuffer)
+                {
+                    jrkVariables* source = (jrkVariables*)pointer;
+                    for (int i = 0; i < decodeBlockSize; i++)
+                    {
+                        jrkStructs[i] = source[i];
+                        milliamps[i] = JrkTelemetry.currentToMilliamps(jrkStructs[i].current, jrkStructs[i].dutyCycle, 100, 100, true);
+                    }
+                }
+            });
+            JrkTelemetry jrkColumns = new JrkTelemetry(decodeBlockSize);
+            decodeResult(Jrk.Jrk.productName, "columns", delegate()
+            {
+                jrkColumns.clear();
+                jrkColumns.decode(jrkBuffer, 0, decodeBlockSize);
+                jrkColumns.getCurrentMilliamps(100, 100, true, milliamps);
+            });
+
+            const byte servoCount = 24;
+            ServoTelemetry servoColumns = new ServoTelemetry(servoCount, decodeBlockSize);
+            byte[] servoBuffer = new byte[decodeBlockSize * servoColumns.rawSampleSize];
+            random.NextBytes(servoBuffer);
+            ServoStatus[] servoStructs = new ServoStatus[decodeBlockSize * servoCount];
+            decimal[] positions = new decimal[decodeBlockSize * servoCount];
+            decodeResult("Mini Maestro 24", "struct", delegate()
+            {
+                fixed (byte* pointer = servoBuffer)
+                {
+                    ServoStatus* source = (ServoStatus*)pointer;
+                    for (int i = 0; i < decodeBlockSize * servoCount; i++)
+                    {
+                        servoStructs[i] = source[i];
+                        positions[i] = Usc.Usc.positionToMicroseconds(servoStructs[i].position);
+                    }
+                }
+            });
+            double[][] microseconds = new double[servoCount][];
+            for (int channel = 0; channel < servoCount; channel++)
+            {
+                microseconds[channel] = new double[decodeBlockSize];
+            }
+            decodeResult("Mini Maestro 24", "columns", delegate()
+            {
+                servoColumns.clear();
+                servoColumns.decode(servoBuffer, 0, servoColumns.rawSampleSize, decodeBlockSize);
+                for (byte channel = 0; channel < servoCount; channel++)
+                {
+                    servoColumns.getPositionMicroseconds(channel, microseconds[channel]);
+                }
+            });
+
+            byte[] smcBuffer = new byte[decodeBlockSize * SmcTelemetry.rawSampleSize];
+            random.NextBytes(smcBuffer);
+            SmcVariables[] smcStructs = new SmcVariables[decodeBlockSize];
+            decimal[] volts = new decimal[decodeBlockSize];
+            decimal[] temperatures = new decimal[decodeBlockSize * 2];
+            decodeResult("Simple Motor Controller G2", "struct", delegate()
+            {
+                fixed (byte* pointer = smcBuffer)
+                {
+                    SmcVariables* source = (SmcVariables*)pointer;
+                    for (int i = 0; i < decodeBlockSize; i++)
+                    {
+                        smcStructs[i] = source[i];
+                        volts[i] = smcStructs[i].vinMv / 1000M;
+                        temperatures[2 * i] = smcStructs[i].temperatureA / 10M;
+                        temperatures[2 * i + 1] = smcStructs[i].temperatureB / 10M;
+                    }
+                }
+            });
+            SmcTelemetry smcColumns = new SmcTelemetry(decodeBlockSize);
+            double[] vinVolts = new double[decodeBlockSize];
+            double[] celsiusA = new double[decodeBlockSize];
+            double[] celsiusB = new double[decodeBlockSize];
+            decodeResult("Simple Motor Controller G2", "columns", delegate()
+            {
+                smcColumns.clear();
+                smcColumns.decode(smcBuffer, 0, decodeBlockSize);
+                smcColumns.getVinVolts(vinVolts);
+                smcColumns.getTemperatureCelsius(smcColumns.temperatureA, celsiusA);
+                smcColumns.getTemperatureCelsius(smcColumns.temperatureB, celsiusB);
+            });
+        }
+
+        /// <summary>
+        /// Measures one way of decoding a block of decodeBlockSize samples.
+        /// Each timing sample is one whole block.
+        /// </summary>
+        void decodeResult(String product, String path, Operation decodeBlock)
+        {
+            Result result = new Result("decode");
+            result.add("product", product);
+            result.add("path", path);
+            result.add("blockSize", decodeBlockSize);
+            run(result, delegate()
+            {
+                Samples samples = measure(decodeBlock, slowIterations);
+                result.add("samplesPerSecond", samples.Count * (double)decodeBlockSize / samples.totalSeconds);
+                samples.addTo(result);
+            });
+        }
+
+        /// <summary>
+        /// The number of microseconds between updates in the shared state
+        /// latency benchmark.
+        /// </summary>
+        const int sharedStatePeriod = 100;
+
+        volatile bool publishing;
+
+        /// <summary>
+        /// Measures the shared state that SharedStateServer publishes: how
+        /// long a StateReader takes to read a Mini Maestro 24's variables
+        /// while the publisher is idle and while it is publishing as fast as
+        /// it can ("read"), and the time from when the publisher starts
+        /// publishing new variables until a reader that is waiting for them
+        /// has them ("latency").  The publisher runs in a thread of this
+        /// process; readers in other processes see the same memory, so
+        /// their latency is the same apart from scheduling.
+        /// These do not use any devices.
+        /// </summary>
+        public void sharedState()
+        {
+            String name = "UsbBenchmark-" + Process.GetCurrentProcess().Id;
+            const int servoCount = 24;
+
+            Result result = new Result("sharedState");
+            result.add("measurement", "read");
+            result.add("publisher", "idle");
+            run(result, delegate()
+            {
+                using (StatePublisher publisher = new StatePublisher(name, 1))
+                using (StateReader reader = new StateReader(name))
+                {
+                    int slot = publisher.addDevice(DeviceKind.Maestro, "00000024", 0x008C, servoCount);
+                    MaestroVariables variables = new MaestroVariables();
+                    ServoStatus[] servos = new ServoStatus[servoCount];
+                    publisher.publish(slot, ref variables, servos);
+
+                    StateStamp stamp;
+                    addThroughput(result, measure(delegate()
+                    {
+                        reader.tryRead(slot, out variables, servos, out stamp);
+                    }, iterations));
+                }
+            });
+
+            result = new Result("sharedState");
+            result.add("measurement", "read");
+            result.add("publisher", "busy");
+            run(result, delegate()
+            {
+                using (StatePublisher publisher = new StatePublisher(name, 1))
+                using (StateReader reader = new StateReader(name))
+                {
+                    int slot = publisher.addDevice(DeviceKind.Maestro, "00000024", 0x008C, servoCount);
+                    Thread thread = startPublishing(delegate()
+                    {
+                        MaestroVariables published = new MaestroVariables();
+                        ServoStatus[] publishedServos = new ServoStatus[servoCount];
+                        while (publishing)
+                        {
+                            publisher.publish(slot, ref published, publishedServos);
+                        }
+                    });
+
+                    try
+                    {
+                        MaestroVariables variables;
+                        ServoStatus[] servos = new ServoStatus[servoCount];
+                        StateStamp stamp;
+                        addThroughput(result, measure(delegate()
+                        {
+                            reader.tryRead(slot, out variables, servos, out stamp);
+                        }, iterations));
+                    }
+                    finally
+                    {
+                        stopPublishing(thread);
+                    }
+                }
+            });
+
+            result = new Result("sharedState");
+            result.add("measurement", "latency");
+            result.add("period", sharedStatePeriod);
+            run(result, delegate()
+            {
+                using (StatePublisher publisher = new StatePublisher(name, 1))
+                using (StateReader reader = new StateReader(name))
+                {
+                    int slot = publisher.addDevice(DeviceKind.Maestro, "00000024", 0x008C, servoCount);
+                    long period = Stopwatch.Frequency * sharedStatePeriod / 1000000;
+                    Thread thread = startPublishing(delegate()
+                    {
+                        MaestroVariables published = new MaestroVariables();
+                        ServoStatus[] publishedServos = new ServoStatus[servoCount];
+                        long next = Stopwatch.GetTimestamp();
+                        while (publishing)
+                        {
+                            // Yield instead of sleeping, so the latency does
+                            // not include the time to wake the thread up but
+                            // the reader can run on a computer with one
+                            // processor.
+                            next += period;
+                            while (Stopwatch.GetTimestamp() < next && publishing)
+                            {
+                                Thread.Sleep(0);
+                            }
+                            publisher.publish(slot, ref published, publishedServos);
+                        }
+                    });
+
+                    try
+                    {
+                        Samples samples = new Samples(iterations);
+                        StateStamp stamp;
+                        UInt32 lastUpdate = 0;
+                        while (samples.Count < iterations)
+                        {
+                            if (!reader.tryReadStamp(slot, out stamp))
+                            {
+                                throw new Exception("The shared state could not be read.");
+                            }
+                            if (stamp.updates != lastUpdate)
+                            {
+                                // Skip the first update: the reader was not
+                                // waiting for it.
+                                if (lastUpdate != 0)
+                                {
+                                    samples.add(Stopwatch.GetTimestamp() - stamp.timestamp);
+                                }
+                                lastUpdate = stamp.updates;
+                            }
+                            else
+                            {
+                                Thread.Sleep(0);
+                            }
+                        }
+                        samples.addTo(result);
+                    }
+                    finally
+                    {
+                        stopPublishing(thread);
+                    }
+                }
+            });
+        }
+
+        /// <summary>
+        /// Measures the time from when a process sends a Maestro target
+        /// with a CommandSender until the owner of the device (here a
+        /// thread of this process draining a CommandRing, like
+        /// SharedStateServer) has finished sending it to the device.  The
+        /// commands are sent every sharedStatePeriod microseconds and go to
+        /// the channels in turn, so none of them are coalesced unless the
+        /// device falls behind.
+        /// </summary>
+        public void commandRing(DeviceListItem item, String product)
+        {
+            Result result = newResult("commandRing", product, item);
+            result.add("period", sharedStatePeriod);
+            run(result, delegate()
+            {
+                String name = "UsbBenchmark-" + Process.GetCurrentProcess().Id + ".commands";
+                using (Usc.Usc usc = new Usc.Usc(item))
+                using (CommandRing ring = new CommandRing(name, 1024, 1))
+                using (CommandSender sender = new CommandSender(name))
+                {
+                    Samples samples = new Samples(iterations);
+                    Thread thread = startPublishing(delegate()
+                    {
+                        CommandExecutor execute = delegate(ref Command command)
+                        {
+                            int status = usc.trySetTarget(command.channel, (UInt16)command.value);
+                            samples.add(Stopwatch.GetTimestamp() - command.timestamp);
+                            return status;
+                        };
+                        for (int attempt = 0; publishing; attempt++)
+                        {
+                            if (ring.drain(execute) != 0)
+                            {
+                                attempt = 0;
+                            }
+                            else
+                            {
+                                backOff(attempt);
+                            }
+                        }
+                    });
+
+                    try
+                    {
+                        long period = Stopwatch.Frequency * sharedStatePeriod / 1000000;
+                        long next = Stopwatch.GetTimestamp();
+                        Int64 sequence = 0;
+                        for (int i = 0; i < iterations; i++)
+                        {
+                            // Yield while waiting so that the owner thread
+                            // can run even on a computer with one processor.
+                            next += period;
+                            while (Stopwatch.GetTimestamp() < next)
+                            {
+                                Thread.Sleep(0);
+                            }
+                            sequence = sender.send(CommandType.MaestroSetTarget, 0, (byte)(i % usc.servoCount), 6000);
+                        }
+                        if (!sender.waitForCompletion(sequence, 10000))
+                        {
+                            throw new Exception("The commands were not carried out.");
+                        }
+                    }
+                    finally
+                    {
+                        stopPublishing(thread);
+                    }
+
+                    result.add("executed", ring.executed);
+                    result.add("coalesced", ring.coalesced);
+                    result.add("failed", ring.failed);
+                    samples.addTo(result);
+                }
+            });
+        }
+
+        /// <summary>
+        /// Waits a little before checking an empty command ring again.
+        /// </summary>
+        static void backOff(int attempt)
+        {
+            if (attempt < 100)
+            {
+                Thread.SpinWait(20);
+            }
+            else
+            {
+                Thread.Sleep(0);
+            }
+        }
+
+        Thread startPublishing(ThreadStart publish)
+        {
+            publishing = true;
+            Thread thread = new Thread(publish);
+            thread.IsBackground = true;
+            thread.Start();
+            return thread;
+        }
+
+        void stopPublishing(Thread thread)
+        {
+            publishing = false;
+            thread.Join();
+        }
+
+        /// <summary>
+        /// Measures how much memory the commonly-used Maestro methods
+        /// allocate per call.
+        /// </summary>
+        public void maestroAllocations(DeviceListItem item, String product)
+        {
+            using (Usc.Usc usc = new Usc.Usc(item))
+            {
+                MaestroVariables variables;
+                short[] stack;
+                ushort[] callStack;
+                ServoStatus[] servos = new ServoStatus[usc.servoCount];
+
+                allocations(item, product, "Usc.getVariables", delegate()
+                {
+                    usc.getVariables(out variables, out stack, out callStack, out servos);
+                });
+                allocations(item, product, "Usc.tryGetVariables", delegate()
+                {
+                    usc.tryGetVariables(out variables, servos);
+                });
+                using (MaestroStatus status = new MaestroStatus(usc.servoCount))
+                {
+                    allocations(item, product, "Usc.tryGetStatus", delegate()
+                    {
+                        usc.tryGetStatus(MaestroFields.All, status);
+                    });
+                }
+                allocations(item, product, "Usc.setTarget", delegate()
+                {
+                    usc.setTarget(0, 6000);
+                });
+                allocations(item, product, "Usc.trySetTarget", delegate()
+                {
+                    usc.trySetTarget(0, 6000);
+                });
+            }
+        }
+
+        public void jrkAllocations(DeviceListItem item, String product)
+        {
+            using (Jrk.Jrk jrk = new Jrk.Jrk(item))
+            {
+                allocations(item, product, "Jrk.getVariables", delegate() { jrk.getVariables(); });
+            }
+        }
+
+        public void smcAllocations(DeviceListItem item, String product)
+        {
+            using (Smc smc = new Smc(item))
+            {
+                allocations(item, product, "Smc.getSmcVariables", delegate() { smc.getSmcVariables(); });
+            }
+        }
+
+        /// <summary>
+        /// Measures the average number of bytes an operation allocates on the
+        /// managed heap.
+        /// </summary>
+        /// <remarks>
+        /// Version 3.5 of the .NET Framework has no allocation counter, so
+        /// this uses the change in GC.GetTotalMemory over many calls.  That is
+        /// only exact if no garbage collection happens during the
+        /// measurement, which is reported in the "exact" field.
+        /// </remarks>
+        void allocations(DeviceListItem item, String product, String call, Operation operation)
+        {
+            Result result = newResult("alloc", product, item);
+            result.add("call", call);
+            run(result, delegate()
+            {
+                int calls = Math.Min(iterations, 1000);
+
+                operation();
+                GC.Collect();
+                GC.WaitForPendingFinalizers();
+                GC.Collect();
+
+                int collections = GC.CollectionCount(0);
+                long before = GC.GetTotalMemory(false);
+                for (int i = 0; i < calls; i++)
+                {
+                    operation();
+                }
+                long after = GC.GetTotalMemory(false);
+                collections = GC.CollectionCount(0) - collections;
+
+                result.add("calls", calls);
+                result.add("bytesPerCall", Math.Max(0, after - before) / (double)calls);
+                result.add("collections", collections);
+                result.add("exact", collections == 0);
+            });
+        }
+    }
+}
@@ -0,0 +1,262 @@
+﻿using System;
+using System.Collections.Generic;
+using System.Diagnostics;
+using System.Reflection;
+using Pololu.UsbWrapper;
+using Pololu.Usc;
+using Pololu.Jrk;
+using Pololu.SimpleMotorControllerG2;
+
+namespace Pololu.UsbBenchmark
+{
+    /// <summary>
+    /// This class represents the executable commandline utility UsbBenchmark.exe,
+    /// which measures the performance of the USB wrapper and the device
+    /// libraries so that regressions between SDK versions can be caught.
+    /// </summary>
+    class Program
+    {
+        static void Main(string[] args)
+        {
+            CommandOptions opts = new CommandOptions(Assembly.GetExecutingAssembly().GetName()+"\n"+
+                "Select which devices to benchmark:\n"+
+                "  --virtual                use in-process emulated devices (a Micro Maestro,\n"+
+                "                           a Mini Maestro, a jrk, and a Simple Motor\n"+
+                "                           Controller G2)\n"+
+                "  --real                   use the devices that are connected\n"+
+                "Options:\n"+
+                "  --iterations NUM         number of samples of fast operations (default 2000)\n"+
+                "  --latency US             simulated transfer time of the emulated devices\n"+
+                "                           in microseconds (default 0)\n"+
+                "  --enumerate N1,N2,...    emulated device counts to measure enumeration\n"+
+                "                           time at (default 1,8,64,512)\n"+
+                "  --save                   also measure saving settings (always done for\n"+
+                "                           emulated devices; on real devices this writes\n"+
+                "                           the current settings back to non-volatile memory)\n"+
+                "  --output FILE            write the results to FILE instead of the console\n"+
+                "Each result is written as a JSON object on a line by itself.\n",
+                args);
+
+            bool useVirtual = opts["virtual"] != null;
+            if (useVirtual == (opts["real"] != null))
+                opts.error("Select either --virtual or --real.");
+
+            int iterations = 2000;
+            UInt32 latency = 0;
+            int[] enumerationCounts = new int[] { 1, 8, 64, 512 };
+            int[] fleetBusCounts = new int[] { 1, 2, 4 };
+            const int fleetDevices = 8;
+            const int triggerDevices = 12;
+            try
+            {
+                if (opts["iterations"] != null)
+                    iterations = int.Parse(opts["iterations"]);
+                if (opts["latency"] != null)
+                    latency = UInt32.Parse(opts["latency"]);
+                if (opts["enumerate"] != null)
+                    enumerationCounts = parseList(opts["enumerate"]);
+            }
+            catch (FormatException)
+            {
+                opts.error("Invalid number.");
+            }
+            if (iterations < 1)
+                opts.error("The number of iterations must be at least 1.");
+
+            using (ResultWriter writer = new ResultWriter(opts["output"]))
+            {
+                Benchmarks benchmarks = new Benchmarks(writer, iterations, useVirtual || opts["save"] != null);
+
+                writer.write(environment(useVirtual, iterations, latency));
+
+                if (useVirtual)
+                {
+                    Usb.enumerateRealDevices = false;
+                    addVirtualDevices(latency);
+                }
+
+                foreach (DeviceListItem item in Usc.Usc.getConnectedDevices())
+                {
+                    String product = maestroName(item.productId);
+                    benchmarks.controlTransfer(item, product);
+                    benchmarks.handles(item, product, delegate(DeviceListItem i) { return new Usc.Usc(i); });
+                    benchmarks.maestroVariables(item, product);
+                    benchmarks.maestroSettings(item, product);
+                    benchmarks.commandRing(item, product);
+                    benchmarks.maestroCoalescing(item, product);
+                    benchmarks.replay(item, product);
+
+                    // The emulator's frames do not depend on its settings.
+                    benchmarks.maestroFrames(item, product, useVirtual ? ScriptEmulator.servoUpdatePeriod : 0);
+                    runAllocations(writer, product, item, delegate() { benchmarks.maestroAllocations(item, product); });
+                }
+
+                foreach (DeviceListItem item in Jrk.Jrk.getConnectedDevices())
+                {
+                    String product = Jrk.Jrk.productName;
+                    benchmarks.controlTransfer(item, product);
+                    benchmarks.handles(item, product, delegate(DeviceListItem i) { return new Jrk.Jrk(i); });
+                    benchmarks.jrkVariables(item, product);
+                    benchmarks.jrkControlLoop(item, product);
+                    runAllocations(writer, product, item, delegate() { benchmarks.jrkAllocations(item, product); });
+                }
+
+                foreach (DeviceListItem item in Smc.getConnectedDevices())
+                {
+                    String product = Smc.productIdToLongModelString(item.productId);
+                    benchmarks.controlTransfer(item, product);
+                    benchmarks.handles(item, product, delegate(DeviceListItem i) { return new Smc(i); });
+                    benchmarks.smcVariables(item, product);
+                    benchmarks.smcSettings(item, product);
+                    benchmarks.smcTrajectory(item, product);
+                    runAllocations(writer, product, item, delegate() { benchmarks.smcAllocations(item, product); });
+                }
+
+                benchmarks.decoding();
+                benchmarks.sharedState();
+
+                if (useVirtual)
+                {
+                    // Enumeration time versus the number of devices connected.
+                    foreach (int count in enumerationCounts)
+                    {
+                        Usb.clearVirtualDevices();
+                        for (int i = 0; i < count; i++)
+                        {
+                            Usb.addVirtualDevice(new VirtualMaestro(12, (i + 1).ToString("D8")));
+                        }
+                        benchmarks.enumeration("Usc", Usc.Usc.getConnectedDevices);
+                    }
+
+                    // Fleet throughput versus the number of buses that the
+                    // same devices are spread over.  The latency is long
+                    // enough that the emulated transfers sleep, so the
+                    // buses can overlap even on one processor.
+                    foreach (int buses in fleetBusCounts)
+                    {
+                        Usb.clearVirtualDevices();
+                        for (int i = 0; i < fleetDevices; i++)
+                        {
+                            VirtualMaestro maestro = new VirtualMaestro(6, (i + 1).ToString("D8"));
+                            maestro.latency = Math.Max(latency, 2000);
+                            maestro.busId = i % buses;
+                            Usb.addVirtualDevice(maestro);
+                        }
+                        benchmarks.fleet(Usc.Usc.getConnectedDevices());
+                    }
+
+                    // Script start skew over a dozen Maestros on four
+                    // buses.  The emulated buses carry one transfer at a
+                    // time, so the skew is about a transfer time per
+                    // Maestro on the same bus.
+                    Usb.clearVirtualDevices();
+                    for (int i = 0; i < triggerDevices; i++)
+                    {
+                        VirtualMaestro maestro = new VirtualMaestro(12, (i + 1).ToString("D8"));
+                        maestro.latency = Math.Max(latency, 2000);
+                        maestro.busId = i % 4;
+                        Usb.addVirtualDevice(maestro);
+                    }
+                    benchmarks.scriptTrigger(Usc.Usc.getConnectedDevices());
+                    Usb.clearVirtualDevices();
+                }
+                else
+                {
+                    List<DeviceListItem> all = new List<DeviceListItem>();
+                    all.AddRange(Usc.Usc.getConnectedDevices());
+                    all.AddRange(Jrk.Jrk.getConnectedDevices());
+                    all.AddRange(Smc.getConnectedDevices());
+                    benchmarks.fleet(all);
+                    benchmarks.scriptTrigger(Usc.Usc.getConnectedDevices());
+
+                    benchmarks.enumeration("Usc", Usc.Usc.getConnectedDevices);
+                    benchmarks.enumeration("Jrk", Jrk.Jrk.getConnectedDevices);
+                    benchmarks.enumeration("Smc", Smc.getConnectedDevices);
+                }
+            }
+        }
+
+        /// <summary>
+        /// Runs the allocation benchmarks for a device.  They connect to the
+        /// device once for all the calls they measure, so if that fails,
+        /// this writes a result with the error.
+        /// </summary>
+        static void runAllocations(ResultWriter writer, String product, DeviceListItem item, Operation allocations)
+        {
+            try
+            {
+                allocations();
+            }
+            catch (Exception exception)
+            {
+                Result result = new Result("alloc");
+                result.add("product", product);
+                result.add("productId", (long)item.productId);
+                result.add("serialNumber", item.serialNumber);
+                result.add("error", exception.Message);
+                writer.write(result);
+            }
+        }
+
+        /// <summary>
+        /// Describes the conditions of the run, so results from different
+        /// computers and SDK versions can be told apart.
+        /// </summary>
+        static Result environment(bool useVirtual, int iterations, UInt32 latency)
+        {
+            Result result = new Result("environment");
+            result.add("sdkVersion", typeof(UsbDevice).Assembly.GetName().Version.ToString());
+            result.add("runtimeVersion", Environment.Version.ToString());
+            result.add("os", Environment.OSVersion.ToString());
+            result.add("processors", Environment.ProcessorCount);
+            result.add("timestampFrequency", Stopwatch.Frequency);
+            result.add("highResolution", Stopwatch.IsHighResolution);
+            result.add("virtual", useVirtual);
+            result.add("iterations", iterations);
+            if (useVirtual)
+            {
+                result.add("latency", latency);
+            }
+            result.add("time", DateTime.UtcNow.ToString("yyyy-MM-ddTHH:mm:ssZ"));
+            return result;
+        }
+
+        static void addVirtualDevices(UInt32 latency)
+        {
+            List<VirtualUsbDevice> devices = new List<VirtualUsbDevice>();
+            devices.Add(new VirtualMaestro(6, "00000006"));
+            devices.Add(new VirtualMaestro(12, "00000012"));
+            devices.Add(new VirtualJrk(0x0083, "00000083"));
+            devices.Add(new VirtualSmc(Smc.productIDs[0], "000000A1"));
+
+            foreach (VirtualUsbDevice device in devices)
+            {
+                device.latency = latency;
+                Usb.addVirtualDevice(device);
+            }
+        }
+
+        static String maestroName(UInt16 productId)
+        {
+            switch (productId)
+            {
+                case 0x0089: return "Micro Maestro 6";
+                case 0x008A: return "Mini Maestro 12";
+                case 0x008B: return "Mini Maestro 18";
+                case 0x008C: return "Mini Maestro 24";
+                default: return "Maestro";
+            }
+        }
+
+        static int[] parseList(String list)
+        {
+            String[] parts = list.Split(',');
+            int[] numbers = new int[parts.Length];
+            for (int i = 0; i < parts.Length; i++)
+            {
+                numbers[i] = int.Parse(parts[i]);
+            }
+            return numbers;
+        }
+    }
+}
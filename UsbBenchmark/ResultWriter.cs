@@ -0,0 +1,135 @@
+﻿using System;
+using System.Globalization;
+using System.IO;
+using System.Text;
+
+namespace Pololu.UsbBenchmark
+{
+    /// <summary>
+    /// One line of benchmark output: a flat JSON object whose fields appear
+    /// in the order they were added.
+    /// </summary>
+    class Result
+    {
+        readonly StringBuilder text = new StringBuilder("{");
+
+        public Result(String benchmark)
+        {
+            add("benchmark", benchmark);
+        }
+
+        public void add(String name, String value)
+        {
+            addName(name);
+            addString(value);
+        }
+
+        public void add(String name, long value)
+        {
+            addName(name);
+            text.Append(value.ToString(CultureInfo.InvariantCulture));
+        }
+
+        public void add(String name, double value)
+        {
+            addName(name);
+            if (Double.IsNaN(value) || Double.IsInfinity(value))
+            {
+                text.Append("null");
+            }
+            else
+            {
+                text.Append(value.ToString("0.###", CultureInfo.InvariantCulture));
+            }
+        }
+
+        public void add(String name, bool value)
+        {
+            addName(name);
+            text.Append(value ? "true" : "false");
+        }
+
+        void addName(String name)
+        {
+            if (text.Length > 1)
+            {
+                text.Append(',');
+            }
+            addString(name);
+            text.Append(':');
+        }
+
+        void addString(String value)
+        {
+            text.Append('"');
+            foreach (char c in value)
+            {
+                switch (c)
+                {
+                    case '"': text.Append("\\\""); break;
+                    case '\\': text.Append("\\\\"); break;
+                    case '\n': text.Append("\\n"); break;
+                    case '\r': text.Append("\\r"); break;
+                    case '\t': text.Append("\\t"); break;
+                    default:
+                        if (c < ' ')
+                        {
+                            text.Append("\\u" + ((int)c).ToString("x4"));
+                        }
+                        else
+                        {
+                            text.Append(c);
+                        }
+                        break;
+                }
+            }
+            text.Append('"');
+        }
+
+        public override String ToString()
+        {
+            return text.ToString() + "}";
+        }
+    }
+
+    /// <summary>
+    /// Writes results in the JSON Lines format (one JSON object per line),
+    /// which is easy to compare between runs and to load into other tools.
+    /// </summary>
+    class ResultWriter : IDisposable
+    {
+        readonly TextWriter writer;
+        readonly bool ownsWriter;
+
+        /// <summary>
+        /// Creates a writer that writes to the given file, or to standard
+        /// output if fileName is null.
+        /// </summary>
+        public ResultWriter(String fileName)
+        {
+            if (fileName == null)
+            {
+                writer = Console.Out;
+            }
+            else
+            {
+                writer = new StreamWriter(fileName);
+                ownsWriter = true;
+            }
+        }
+
+        public void write(Result result)
+        {
+            writer.WriteLine(result.ToString());
+            writer.Flush();
+        }
+
+        public void Dispose()
+        {
+            if (ownsWriter)
+            {
+                writer.Dispose();
+            }
+        }
+    }
+}
@@ -0,0 +1,98 @@
+﻿using System;
+using System.Diagnostics;
+
+namespace Pololu.UsbBenchmark
+{
+    /// <summary>
+    /// Holds the durations of the repetitions of one measurement.
+    /// The storage is allocated up front so that recording a sample does not
+    /// allocate memory or otherwise disturb the thing being measured.
+    /// </summary>
+    class Samples
+    {
+        readonly long[] ticks;
+        int privateCount;
+
+        public Samples(int capacity)
+        {
+            ticks = new long[capacity];
+        }
+
+        /// <summary>
+        /// The number of samples recorded so far.
+        /// </summary>
+        public int Count
+        {
+            get { return privateCount; }
+        }
+
+        /// <summary>
+        /// Records one duration, in Stopwatch ticks.  Samples beyond the
+        /// capacity are ignored.
+        /// </summary>
+        public void add(long duration)
+        {
+            if (privateCount < ticks.Length)
+            {
+                ticks[privateCount++] = duration;
+            }
+        }
+
+        /// <summary>
+        /// The sum of all the samples, in seconds.
+        /// </summary>
+        public double totalSeconds
+        {
+            get
+            {
+                long total = 0;
+                for (int i = 0; i < privateCount; i++)
+                {
+                    total += ticks[i];
+                }
+                return (double)total / Stopwatch.Frequency;
+            }
+        }
+
+        /// <summary>
+        /// Adds the count and the distribution of the samples (minimum,
+        /// mean, percentiles and maximum, in microseconds) to a result.
+        /// </summary>
+        public void addTo(Result result)
+        {
+            result.add("samples", privateCount);
+            if (privateCount == 0)
+            {
+                return;
+            }
+
+            long[] sorted = new long[privateCount];
+            Array.Copy(ticks, sorted, privateCount);
+            Array.Sort(sorted);
+
+            result.add("unit", "us");
+            result.add("min", microseconds(sorted[0]));
+            result.add("mean", totalSeconds * 1000000 / privateCount);
+            result.add("p50", microseconds(percentile(sorted, 0.50)));
+            result.add("p90", microseconds(percentile(sorted, 0.90)));
+            result.add("p99", microseconds(percentile(sorted, 0.99)));
+            result.add("p999", microseconds(percentile(sorted, 0.999)));
+            result.add("max", microseconds(sorted[sorted.Length - 1]));
+        }
+
+        /// <summary>
+        /// Returns the sample that the given fraction of the samples are
+        /// less than or equal to (nearest-rank method).
+        /// </summary>
+        static long percentile(long[] sorted, double fraction)
+        {
+            int rank = (int)Math.Ceiling(fraction * sorted.Length);
+            return sorted[Math.Max(0, Math.Min(sorted.Length - 1, rank - 1))];
+        }
+
+        static double microseconds(long ticks)
+        {
+            return ticks * 1000000.0 / Stopwatch.Frequency;
+        }
+    }
+}
@@ -0,0 +1,28 @@
+# Generate a unique list of files that need to be in the same
+# directory as UsbBenchmark at runtime (runtime dependencies).
+UsbBenchmark_runtime := $(sort $(Usc_lib) $(Jrk_lib) $(SmcG2_lib) $(SharedState_lib))
+
+# Compile-time dependencies.
+UsbBenchmark_dlls := $(Bytecode)/Bytecode.dll $(UsbWrapper)/UsbWrapper.dll $(Usc)/Usc.dll $(Jrk)/Jrk.dll $(SmcG2)/SmcG2.dll $(SharedState)/SharedState.dll
+UsbBenchmark_csfiles := $(UsbBenchmark)/Benchmarks.cs $(UsbBenchmark)/CommandOptions.cs $(UsbBenchmark)/Program.cs $(UsbBenchmark)/ResultWriter.cs $(UsbBenchmark)/Samples.cs $(UsbBenchmark)/Properties/AssemblyInfo.cs
+
+# Required module variables
+Targets += $(UsbBenchmark)/UsbBenchmark
+Byproducts += $(foreach dll, $(UsbBenchmark_runtime), $(UsbBenchmark)/$(notdir $(dll)))
+
+$(UsbBenchmark)/UsbBenchmark: $(UsbBenchmark_csfiles) $(UsbBenchmark_runtime)
+	cp $(UsbBenchmark_runtime) $(UsbBenchmark)
+	$(CS) -target:exe -out:$@.exe $(UsbBenchmark_csfiles) $(foreach dll, $(UsbBenchmark_dlls),-r:$(UsbBenchmark)/$(notdir $(dll)))
+	mv $@.exe $@
+
+# Alias so you can type "make usbbenchmark"
+usbbenchmark: $(UsbBenchmark)/UsbBenchmark
+
+# Type "make bench" to build the benchmark and run it.  By default it uses
+# in-process emulated devices, so the results only depend on the SDK and the
+# computer.  To benchmark the devices that are plugged in, run:
+#   make bench BENCH_ARGS="--real"
+# The results are written to standard output, one JSON object per line.
+BENCH_ARGS ?= --virtual
+bench: $(UsbBenchmark)/UsbBenchmark
+	cd $(UsbBenchmark) && mono UsbBenchmark $(BENCH_ARGS)
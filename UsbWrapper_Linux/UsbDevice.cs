@@ -5,6 +5,7 @@ using System;
 using System.Collections.Generic;
 using System.Text;
 using System.ComponentModel;
+using System.Diagnostics;
 using System.Runtime.InteropServices;
 using System.Threading;
 using System.IO;
@@ -15,7 +16,14 @@ namespace Pololu.UsbWrapper
     /// A class that represents a device connected to the computer.  This
     /// class can be used as an item in the device list dropdown box.
     /// </summary>
-    public class DeviceListItem
+    /// <remarks>
+    /// An item holds a reference to the libusb device, which is released
+    /// by Dispose, or when the item is collected if it was not disposed.
+    /// Programs that enumerate devices often should dispose the items
+    /// they do not keep.  Connections made from an item hold their own
+    /// reference, so the item can be disposed as soon as it is connected.
+    /// </remarks>
+    public class DeviceListItem : IDisposable
     {
         private String privateText;
 
@@ -50,16 +58,51 @@ namespace Pololu.UsbWrapper
             }
         }
 
-        readonly IntPtr privateDevicePointer;
+        readonly LibusbDevice privateDevice;
 
         /// <summary>
-        /// Gets the device pointer.
+        /// Gets the libusb device, or null for virtual devices and dummy
+        /// items.
+        /// </summary>
+        internal LibusbDevice device
+        {
+            get
+            {
+                return privateDevice;
+            }
+        }
+
+        /// <summary>
+        /// Gets the device pointer, or IntPtr.Zero if there is no device or
+        /// the item was disposed.  Only use it to compare devices; pass
+        /// the device to libusb instead, so that it cannot be released
+        /// during the call.
         /// </summary>
         internal IntPtr devicePointer
         {
             get
             {
-                return privateDevicePointer;
+                if (privateDevice == null || privateDevice.IsClosed)
+                {
+                    return IntPtr.Zero;
+                }
+                return privateDevice.DangerousGetHandle();
+            }
+        }
+
+        readonly Int32 privateLocation = -1;
+
+        /// <summary>
+        /// The bus number and address of the device, as (bus << 8) | address,
+        /// or -1 if there is no device.  They identify the device until it
+        /// is unplugged, in any libusb context, and are read when the item is
+        /// created so that they are still known after it is disposed.
+        /// </summary>
+        internal Int32 location
+        {
+            get
+            {
+                return privateLocation;
             }
         }
 
@@ -76,6 +119,80 @@ namespace Pololu.UsbWrapper
             }    
         }
         
+        readonly IUsbTransport privateTransport;
+
+        /// <summary>
+        /// Gets the transport of a virtual device, or null if this item
+        /// refers to a real USB device.
+        /// </summary>
+        public IUsbTransport transport
+        {
+            get
+            {
+                return privateTransport;
+            }
+        }
+
+        /// <summary>
+        /// Identifies the USB bus (host controller) that the device is
+        /// connected to.  Devices with the same busId share the bandwidth
+        /// and the transfer scheduling of one bus.  On Linux this is the
+        /// bus number from libusb.  For virtual devices it is
+        /// VirtualUsbDevice.busId, and for dummy items it is -1.
+        /// </summary>
+        public Int32 busId
+        {
+            get
+            {
+                if (transport != null)
+                {
+                    VirtualUsbDevice virtualDevice = transport as VirtualUsbDevice;
+                    return virtualDevice == null ? -1 : virtualDevice.busId;
+                }
+                if (privateLocation < 0)
+                {
+                    return -1;
+                }
+                return privateLocation >> 8;
+            }
+        }
+
+        /// <summary>
+        /// Identifies the port the device is plugged in to, as the bus
+        /// number and the port numbers of the hubs between the root hub and
+        /// the device, the way Linux names USB devices (for example
+        /// "3-1.4").  Unlike busId, this tells apart devices behind
+        /// different hubs on the same bus.  For virtual devices and dummy
+        /// items it is null.
+        /// </summary>
+        public unsafe String portPath
+        {
+            get
+            {
+                if (transport != null || devicePointer == IntPtr.Zero)
+                {
+                    return null;
+                }
+
+                // USB allows at most 7 tiers of hubs.
+                byte* ports = stackalloc byte[7];
+                int count = UsbDevice.libusbGetPortNumbers(privateDevice, ports, 7);
+                if (count < 0)
+                {
+                    return null;
+                }
+
+                StringBuilder path = new StringBuilder();
+                path.Append(busId);
+                for (int i = 0; i < count; i++)
+                {
+                    path.Append(i == 0 ? '-' : '.');
+                    path.Append(ports[i]);
+                }
+                return path.ToString();
+            }
+        }
+
         /// <summary>
         /// true if the devices are the same
         /// </summary>
@@ -83,7 +200,11 @@ namespace Pololu.UsbWrapper
         /// <returns></returns>
         public bool isSameDeviceAs(DeviceListItem item)
         {
-            return (devicePointer == item.devicePointer);
+            if (transport != null || item.transport != null)
+            {
+                return transport == item.transport;
+            }
+            return (location == item.location);
         }
 
         /// <summary>
@@ -92,22 +213,98 @@ namespace Pololu.UsbWrapper
         /// <param name="text"></param>
         public static DeviceListItem CreateDummyItem(String text)
         {
-            var item = new DeviceListItem(IntPtr.Zero,text,"",0);
+            var item = new DeviceListItem(null,text,"",0);
             return item;
         }
 
-        internal DeviceListItem(IntPtr devicePointer, string text, string serialNumber, UInt16 productId)
+        /// <param name="device">The device, which the item takes ownership of, or null.</param>
+        internal DeviceListItem(LibusbDevice device, string text, string serialNumber, UInt16 productId)
         {
-            privateDevicePointer = devicePointer;
+            privateDevice = device;
+            if (device != null)
+            {
+                privateLocation = (UsbDevice.libusbGetBusNumber(device) << 8) | UsbDevice.libusbGetDeviceAddress(device);
+            }
             privateText = text;
             privateSerialNumber = serialNumber;
             privateProductId = productId;
         }
 
-        ~DeviceListItem()
+        /// <summary>
+        /// Creates an item for a virtual device (for example, an emulator).
+        /// Connecting to the item sends all control transfers to the transport.
+        /// </summary>
+        public DeviceListItem(IUsbTransport transport)
+        {
+            privateText = "#" + transport.serialNumber;
+            privateSerialNumber = transport.serialNumber;
+            privateProductId = transport.productId;
+            privateTransport = transport;
+        }
+
+        /// <summary>
+        /// Releases the reference to the libusb device now instead of when
+        /// the item is collected.  The item can no longer be connected to,
+        /// but connections already made from it keep working.
+        /// </summary>
+        public void Dispose()
+        {
+            if (privateDevice != null)
+            {
+                privateDevice.Dispose();
+            }
+        }
+    }
+
+    /// <summary>
+    /// A reference to a libusb device (libusb_device), released with
+    /// libusb_unref_device.
+    /// </summary>
+    internal class LibusbDevice : SafeHandle
+    {
+        /// <param name="device">A device whose reference this object takes ownership of.</param>
+        internal LibusbDevice(IntPtr device) : base(IntPtr.Zero,true)
+        {
+            SetHandle(device);
+        }
+
+        public override bool IsInvalid
+        {
+            get
+            {
+                return (handle == IntPtr.Zero);
+            }
+        }
+
+        override protected bool ReleaseHandle()
+        {
+            UsbDevice.libusbUnrefDevice(handle);
+            return true;
+        }
+    }
+
+    /// <summary>
+    /// An open libusb device handle (libusb_device_handle), closed with
+    /// libusb_close.  libusb_open returns it.
+    /// </summary>
+    internal class LibusbDeviceHandle : SafeHandle
+    {
+        private LibusbDeviceHandle() : base(IntPtr.Zero,true)
+        {
+        }
+
+        public override bool IsInvalid
+        {
+            get
+            {
+                return (handle == IntPtr.Zero);
+            }
+        }
+
+        override protected bool ReleaseHandle()
         {
-            if(privateDevicePointer != IntPtr.Zero)
-                UsbDevice.libusbUnrefDevice(privateDevicePointer);
+            UsbDevice.libusbClose(handle);
+            return true;
         }
     }
 
@@ -138,6 +335,77 @@ namespace Pololu.UsbWrapper
         }
     }
 
+    /// <summary>
+    /// A libusb context of its own for one thread, such as a UsbFleet
+    /// worker.  Devices opened through it (see bind) handle their events
+    /// in this context, so they do not wait for transfers on other buses.
+    /// </summary>
+    internal class UsbBusContext : IDisposable
+    {
+        LibusbContext context;
+        readonly List<DeviceListItem> boundItems = new List<DeviceListItem>();
+
+        /// <summary>
+        /// Gets an item for the same device that belongs to this context.
+        /// Items for virtual devices are returned as they are.  The device
+        /// must be disconnected before the context is disposed.
+        /// </summary>
+        internal unsafe DeviceListItem bind(DeviceListItem item)
+        {
+            if (item.transport != null || item.device == null)
+            {
+                return item;
+            }
+
+            if (context == null)
+            {
+                LibUsb.throwIfError(UsbDevice.libusbInit(out context), "Error initializing libusb.");
+            }
+
+            // The bus number and address identify the device until it is
+            // unplugged.
+            byte bus = UsbDevice.libusbGetBusNumber(item.device);
+            byte address = UsbDevice.libusbGetDeviceAddress(item.device);
+
+            IntPtr* list;
+            int count = LibUsb.throwIfError(UsbDevice.libusbGetDeviceList(context, out list),
+                                            "Error from libusb_get_device_list.");
+            IntPtr found = IntPtr.Zero;
+            for (int i = 0; i < count; i++)
+            {
+                if (UsbDevice.libusbGetBusNumber(list[i]) == bus && UsbDevice.libusbGetDeviceAddress(list[i]) == address)
+                {
+                    found = UsbDevice.libusbRefDevice(list[i]);
+                    break;
+                }
+            }
+            UsbDevice.libusbFreeDeviceList(list, 1);
+
+            if (found == IntPtr.Zero)
+            {
+                throw new Exception("Could not find device " + item.serialNumber + " on bus " + bus + ".");
+            }
+
+            DeviceListItem bound = new DeviceListItem(new LibusbDevice(found), item.text, item.serialNumber, item.productId);
+            boundItems.Add(bound);
+            return bound;
+        }
+
+        public void Dispose()
+        {
+            foreach (DeviceListItem item in boundItems)
+            {
+                item.Dispose();
+            }
+            boundItems.Clear();
+            if (context != null)
+            {
+                context.Dispose();
+                context = null;
+            }
+        }
+    }
+
     public static class Usb
     {
         public static int WM_DEVICECHANGE { get { return 0; } }        
@@ -169,6 +437,136 @@ namespace Pololu.UsbWrapper
         {
             LibUsb.handleEvents();
         }
+
+        static readonly List<IUsbTransport> virtualDevices = new List<IUsbTransport>();
+
+        static bool privateEnumerateRealDevices = true;
+
+        /// <summary>
+        /// If false, device lists only contain virtual devices and libusb is
+        /// not used to enumerate devices, so the library can be used on a
+        /// computer without libusb.  The default is true.
+        /// </summary>
+        public static bool enumerateRealDevices
+        {
+            get { return privateEnumerateRealDevices; }
+            set { privateEnumerateRealDevices = value; }
+        }
+
+        /// <summary>
+        /// Adds a virtual device (for example, an emulator) to the device
+        /// lists returned by classes like Usc, Jrk, and Smc.
+        /// </summary>
+        public static void addVirtualDevice(IUsbTransport device)
+        {
+            lock (virtualDevices)
+            {
+                virtualDevices.Add(device);
+            }
+        }
+
+        /// <summary>
+        /// Removes a device that was added with addVirtualDevice.
+        /// </summary>
+        public static void removeVirtualDevice(IUsbTransport device)
+        {
+            lock (virtualDevices)
+            {
+                virtualDevices.Remove(device);
+            }
+        }
+
+        /// <summary>
+        /// Removes all devices that were added with addVirtualDevice.
+        /// </summary>
+        public static void clearVirtualDevices()
+        {
+            lock (virtualDevices)
+            {
+                virtualDevices.Clear();
+            }
+        }
+
+        internal static IUsbTransport[] getVirtualDevices()
+        {
+            lock (virtualDevices)
+            {
+                return virtualDevices.ToArray();
+            }
+        }
+    }
+
+    /// <summary>
+    /// Status codes returned by the non-throwing (try*) methods of the
+    /// device classes.  Zero means success and negative numbers are errors.
+    /// The error codes have the same values as the LIBUSB_ERROR codes.
+    /// </summary>
+    public static class UsbStatus
+    {
+        public const int Success = 0;
+        public const int IOError = -1;
+        public const int InvalidParameter = -2;
+        public const int AccessDenied = -3;
+        public const int NoDevice = -4;
+        public const int NotFound = -5;
+        public const int Busy = -6;
+        public const int Timeout = -7;
+        public const int Overflow = -8;
+        public const int Pipe = -9;
+        public const int Interrupted = -10;
+        public const int NoMemory = -11;
+        public const int NotSupported = -12;
+        public const int Other = -99;
+
+        /// <summary>
+        /// The device sent back fewer bytes than were expected.
+        /// This is not a libusb error code.
+        /// </summary>
+        public const int ShortTransfer = -100;
+
+        /// <summary>
+        /// Returns a short description of the status code, like "Timeout.".
+        /// </summary>
+        public static string describe(int status)
+        {
+            if (status >= 0)
+            {
+                return "Success.";
+            }
+            if (status == ShortTransfer)
+            {
+                return "Short transfer.";
+            }
+            return LibUsb.errorDescription(status);
+        }
+
+        /// <summary>
+        /// Creates an exception that describes the given error code.
+        /// Timeouts are represented as TimeoutException.
+        /// </summary>
+        public static Exception toException(int status)
+        {
+            if (status == Timeout)
+            {
+                return new TimeoutException(describe(status));
+            }
+            return new Exception(describe(status));
+        }
+
+        /// <summary>
+        /// Creates an exception with the given message whose InnerException
+        /// describes the given error code.  For a timeout it is a
+        /// TimeoutException, so that catch (TimeoutException) works whatever
+        /// the operation was.
+        /// </summary>
+        public static Exception toException(int status, string message)
+        {
+            if (status == Timeout)
+            {
+                return new TimeoutException(message, toException(status));
+            }
+            return new Exception(message, toException(status));
+        }
     }
 
     internal static class LibUsb
@@ -183,7 +581,7 @@ namespace Pololu.UsbWrapper
             if(code >= 0)
                 return code;
 
-            throw new Exception(LibUsb.errorDescription(code));
+            throw UsbStatus.toException(code);
         }
 
         /// <summary>
@@ -194,14 +592,10 @@ namespace Pololu.UsbWrapper
         /// <returns>the code, if it is non-negative</returns>
         internal static int throwIfError(int code, string message)
         {
-            try
-            {
-                return LibUsb.throwIfError(code);
-            }
-            catch(Exception e)
-            {
-                throw new Exception(message, e);
-            }
+            if(code >= 0)
+                return code;
+
+            throw UsbStatus.toException(code, message);
         }
 
         internal static string errorDescription(int error)
@@ -265,23 +659,190 @@ namespace Pololu.UsbWrapper
         [DllImport("libusb-1.0")]
         static unsafe extern int libusb_handle_events(LibusbContext ctx);
 
+        /// <summary>
+        /// A serial number that was read from a device, with the parts of the
+        /// device descriptor that must match for it to be used again.
+        /// </summary>
+        struct CachedSerialNumber
+        {
+            public ushort idVendor;
+            public ushort idProduct;
+            public ushort bcdDevice;
+            public string portPath;
+            public string serialNumber;
+        }
+
+        /// <summary>
+        /// The serial numbers of the devices that are connected, keyed by bus
+        /// number and address (see getDeviceKey).  Reading a serial number
+        /// takes a control transfer, and during enumeration also opening
+        /// the device, so they are only read the first time a device is
+        /// seen.  Some host controllers give a device that is plugged in
+        /// again the address it had before, so an entry is only used if the
+        /// port path matches too, and it is dropped when a UsbDevice for
+        /// that device disconnects, since the device might be unplugged and
+        /// replaced before the next enumeration notices.
+        /// Protected by itself.
+        /// </summary>
+        static readonly Dictionary<int, CachedSerialNumber> serialNumbers = new Dictionary<int, CachedSerialNumber>();
+
+        static int getDeviceKey(IntPtr device)
+        {
+            return (UsbDevice.libusbGetBusNumber(device) << 8) | UsbDevice.libusbGetDeviceAddress(device);
+        }
+
+        /// <summary>
+        /// Returns the bus number and the port numbers from the root hub to
+        /// the device, in the same form as DeviceListItem.portPath, or null
+        /// if libusb can not tell.
+        /// </summary>
+        static unsafe string getPortPath(IntPtr device)
+        {
+            // USB allows at most 7 tiers of hubs.
+            byte* ports = stackalloc byte[7];
+            int count = UsbDevice.libusbGetPortNumbers(device, ports, 7);
+            if (count < 0)
+            {
+                return null;
+            }
+
+            StringBuilder path = new StringBuilder();
+            path.Append(UsbDevice.libusbGetBusNumber(device));
+            for (int i = 0; i < count; i++)
+            {
+                path.Append(i == 0 ? '-' : '.');
+                path.Append(ports[i]);
+            }
+            return path.ToString();
+        }
+
+        static string findSerialNumber(int key, string portPath, LibusbDeviceDescriptor descriptor)
+        {
+            lock (serialNumbers)
+            {
+                CachedSerialNumber cached;
+                if (serialNumbers.TryGetValue(key, out cached) && cached.idVendor == descriptor.idVendor &&
+                    cached.idProduct == descriptor.idProduct && cached.bcdDevice == descriptor.bcdDevice &&
+                    cached.portPath == portPath)
+                {
+                    return cached.serialNumber;
+                }
+                return null;
+            }
+        }
+
+        static void addSerialNumber(int key, string portPath, LibusbDeviceDescriptor descriptor, string serialNumber)
+        {
+            CachedSerialNumber cached;
+            cached.idVendor = descriptor.idVendor;
+            cached.idProduct = descriptor.idProduct;
+            cached.bcdDevice = descriptor.bcdDevice;
+            cached.portPath = portPath;
+            cached.serialNumber = serialNumber;
+            lock (serialNumbers)
+            {
+                serialNumbers[key] = cached;
+            }
+        }
+
+        /// <summary>
+        /// Forgets the serial number of an open device.  Called when the
+        /// device is closed.
+        /// </summary>
+        internal static void removeSerialNumber(LibusbDeviceHandle device_handle)
+        {
+            int key = getDeviceKey(UsbDevice.libusbGetDevice(device_handle));
+            lock (serialNumbers)
+            {
+                serialNumbers.Remove(key);
+            }
+        }
+
+        /// <summary>
+        /// Forgets the serial numbers of devices that are not in the list,
+        /// so that the cache does not grow as devices come and go.
+        /// </summary>
+        internal static unsafe void removeOldSerialNumbers(IntPtr* list, int count)
+        {
+            Dictionary<int, bool> present = new Dictionary<int, bool>(count);
+            for (int i = 0; i < count; i++)
+            {
+                present[getDeviceKey(list[i])] = true;
+            }
+            lock (serialNumbers)
+            {
+                List<int> old = new List<int>();
+                foreach (int key in serialNumbers.Keys)
+                {
+                    if (!present.ContainsKey(key))
+                    {
+                        old.Add(key);
+                    }
+                }
+                foreach (int key in old)
+                {
+                    serialNumbers.Remove(key);
+                }
+            }
+        }
+
+        /// <summary>
+        /// Gets the serial number of a device that is not open, opening it
+        /// only if its serial number is not cached.
+        /// </summary>
         /// <returns>the serial number</returns>
-        internal static unsafe string getSerialNumber(IntPtr device_handle)
+        internal static string getSerialNumber(LibusbDevice device, string errorMessage)
         {
-            LibusbDeviceDescriptor descriptor = getDeviceDescriptor(device_handle);
-            byte[] buffer = new byte[100];
-            int length;
-            fixed(byte* p = buffer)
+            IntPtr pointer = device.DangerousGetHandle();
+            LibusbDeviceDescriptor descriptor = getDeviceDescriptorFromDevice(pointer);
+            int key = getDeviceKey(pointer);
+            string portPath = getPortPath(pointer);
+            string serialNumber = findSerialNumber(key, portPath, descriptor);
+            if (serialNumber == null)
             {
-                length = LibUsb.throwIfError(UsbDevice.libusbGetStringDescriptorASCII(device_handle, descriptor.iSerialNumber, p, buffer.Length), "Error getting serial number string from device (pid="+descriptor.idProduct.ToString("x")+", vid="+descriptor.idVendor.ToString("x")+").");
+                LibusbDeviceHandle device_handle;
+                LibUsb.throwIfError(UsbDevice.libusbOpen(device, out device_handle), errorMessage);
+                using (device_handle)
+                {
+                    serialNumber = readSerialNumber(device_handle, descriptor);
+                }
+                addSerialNumber(key, portPath, descriptor, serialNumber);
             }
+            return serialNumber;
+        }
 
-            String serial_number = "";
+        /// <summary>
+        /// Gets the serial number of an open device, reading it from the
+        /// device only if it is not cached.
+        /// </summary>
+        /// <returns>the serial number</returns>
+        internal static string getSerialNumber(LibusbDeviceHandle device_handle)
+        {
+            IntPtr device = UsbDevice.libusbGetDevice(device_handle);
+            LibusbDeviceDescriptor descriptor = getDeviceDescriptorFromDevice(device);
+            int key = getDeviceKey(device);
+            string portPath = getPortPath(device);
+            string serialNumber = findSerialNumber(key, portPath, descriptor);
+            if (serialNumber == null)
+            {
+                serialNumber = readSerialNumber(device_handle, descriptor);
+                addSerialNumber(key, portPath, descriptor, serialNumber);
+            }
+            return serialNumber;
+        }
+
+        static unsafe string readSerialNumber(LibusbDeviceHandle device_handle, LibusbDeviceDescriptor descriptor)
+        {
+            // A string descriptor is at most 255 bytes long.
+            byte* buffer = stackalloc byte[256];
+            int length = LibUsb.throwIfError(UsbDevice.libusbGetStringDescriptorASCII(device_handle, descriptor.iSerialNumber, buffer, 256), "Error getting serial number string from device (pid="+descriptor.idProduct.ToString("x")+", vid="+descriptor.idVendor.ToString("x")+").");
+
+            char* chars = stackalloc char[length];
             for(int i=0;i<length;i++)
             {
-                serial_number += (char)buffer[i];
+                chars[i] = (char)buffer[i];
             }
-            return serial_number;
+            return new String(chars, 0, length);
         }
 
         /// <returns>true iff the vendor and product ids match the device</returns>
@@ -292,7 +853,7 @@ namespace Pololu.UsbWrapper
         }
 
         /// <returns>the device descriptor</returns>
-        internal static LibusbDeviceDescriptor getDeviceDescriptor(IntPtr device_handle)
+        internal static LibusbDeviceDescriptor getDeviceDescriptor(LibusbDeviceHandle device_handle)
         {
             return getDeviceDescriptorFromDevice(UsbDevice.libusbGetDevice(device_handle));
         }
@@ -313,65 +874,348 @@ namespace Pololu.UsbWrapper
     {
         protected ushort getProductID()
         {
-            return LibUsb.getDeviceDescriptor(deviceHandle).idProduct;
+            if (transport != null)
+            {
+                return transport.productId;
+            }
+            return privateDescriptor.idProduct;
         }
 
+        String privateSerialNumber;
+
         /// <summary>
-        /// Gets the serial number.
+        /// Gets the serial number.  It is only read from the device the
+        /// first time.
         /// </summary>
         public String getSerialNumber()
         {
-            return LibUsb.getSerialNumber(deviceHandle);
+            if (transport != null)
+            {
+                return transport.serialNumber;
+            }
+            if (privateSerialNumber == null)
+            {
+                privateSerialNumber = LibUsb.getSerialNumber(deviceHandle);
+            }
+            return privateSerialNumber;
         }
 
 
-        protected unsafe void controlTransfer(byte RequestType, byte Request, ushort Value, ushort Index)
+        /// <summary>
+        /// The timeout used for control transfers when no other timeout is
+        /// specified, in milliseconds.
+        /// </summary>
+        public const UInt32 defaultTimeout = 5000;
+
+        UInt32 privateTimeout = defaultTimeout;
+
+        /// <summary>
+        /// The maximum amount of time, in milliseconds, that a control transfer
+        /// on this device is allowed to take before it is cancelled and a
+        /// TimeoutException is thrown.  Zero means no timeout.
+        /// The default is 5000 ms.
+        /// </summary>
+        public UInt32 timeout
         {
-            int ret = libusbControlTransfer(deviceHandle, RequestType, Request,
-                                        Value, Index, (byte*)0, 0, (ushort)5000);
+            get
+            {
+                return privateTimeout;
+            }
+            set
+            {
+                privateTimeout = value;
+            }
+        }
+
+        /// <summary>
+        /// The time (in Stopwatch ticks) by which every transfer must be
+        /// complete, or 0 if there is no deadline.  There is one deadline
+        /// per UsbDevice, shared by all threads that use it.
+        /// </summary>
+        long privateDeadline = 0;
+
+        /// <summary>
+        /// Sets a deadline for all subsequent control transfers on this
+        /// device.  A transfer that starts before the deadline is only given
+        /// the time remaining until the deadline, and is cancelled if it takes
+        /// longer.  A transfer that would start after the deadline is not sent
+        /// at all.  In both cases a TimeoutException is thrown, so the caller
+        /// can move on instead of waiting for stale data.
+        /// The deadline stays in effect until clearDeadline() is called.
+        /// It belongs to the device, not to the calling thread: it applies
+        /// to the transfers of every thread that uses this object, so a
+        /// device shared between threads needs the callers to agree on one
+        /// deadline (setDeadline and clearDeadline are not synchronized).
+        /// </summary>
+        /// <param name="milliseconds">The deadline, measured from now.</param>
+        public void setDeadline(UInt32 milliseconds)
+        {
+            privateDeadline = Stopwatch.GetTimestamp() + milliseconds * Stopwatch.Frequency / 1000;
+        }
+
+        /// <summary>
+        /// Removes the deadline set by setDeadline.
+        /// </summary>
+        public void clearDeadline()
+        {
+            privateDeadline = 0;
+        }
+
+        /// <summary>
+        /// Computes the libusb timeout to use for a transfer that is starting
+        /// now, taking into account the deadline (if any).
+        /// </summary>
+        UInt32 getTransferTimeout(UInt32 timeout)
+        {
+            if (!tryGetTransferTimeout(ref timeout))
+            {
+                throw new TimeoutException("The deadline passed before the control transfer could be started.");
+            }
+            return timeout;
+        }
+
+        /// <summary>
+        /// Reduces the timeout so that the transfer will end by the deadline
+        /// (if any).  Returns false if the deadline has already passed.
+        /// </summary>
+        bool tryGetTransferTimeout(ref UInt32 timeout)
+        {
+            if (privateDeadline == 0)
+            {
+                return true;
+            }
+
+            long remaining = privateDeadline - Stopwatch.GetTimestamp();
+            if (remaining <= 0)
+            {
+                return false;
+            }
+
+            // Round up so that we never pass 0 (no timeout) to libusb.
+            UInt32 remainingMs = (UInt32)Math.Min(UInt32.MaxValue, (remaining * 1000 + Stopwatch.Frequency - 1) / Stopwatch.Frequency);
+            if (timeout == 0 || remainingMs < timeout)
+            {
+                timeout = remainingMs;
+            }
+            return true;
+        }
+
+        protected void controlTransfer(byte RequestType, byte Request, ushort Value, ushort Index)
+        {
+            controlTransfer(RequestType, Request, Value, Index, timeout);
+        }
+
+        /// <summary>
+        /// Performs a control transfer that has no data stage, using the
+        /// specified timeout (in milliseconds) instead of the device's timeout.
+        /// </summary>
+        protected unsafe void controlTransfer(byte RequestType, byte Request, ushort Value, ushort Index, UInt32 timeout)
+        {
+            int ret = rawControlTransfer(RequestType, Request,
+                                         Value, Index, (byte*)0, 0, getTransferTimeout(timeout));
             LibUsb.throwIfError(ret,"Control transfer failed");
         }
 
-        protected unsafe uint controlTransfer(byte RequestType, byte Request, ushort Value, ushort Index, byte[] data)
+        protected uint controlTransfer(byte RequestType, byte Request, ushort Value, ushort Index, byte[] data)
+        {
+            return controlTransfer(RequestType, Request, Value, Index, data, timeout);
+        }
+
+        /// <summary>
+        /// Performs a control transfer that has a data stage, using the
+        /// specified timeout (in milliseconds) instead of the device's timeout.
+        /// </summary>
+        protected unsafe uint controlTransfer(byte RequestType, byte Request, ushort Value, ushort Index, byte[] data, UInt32 timeout)
         {
             fixed(byte* pointer = data)
             {
                 return controlTransfer(RequestType, Request,
-                                            Value, Index, pointer, (ushort)data.Length);
+                                            Value, Index, pointer, (ushort)data.Length, timeout);
             }
         }
 
         protected unsafe uint controlTransfer(byte RequestType, byte Request, ushort Value, ushort Index, void * data, ushort length)
         {
-            int ret = libusbControlTransfer(deviceHandle, RequestType, Request,
-                                        Value, Index, data, length, (ushort)5000);
+            return controlTransfer(RequestType, Request, Value, Index, data, length, timeout);
+        }
+
+        /// <summary>
+        /// Performs a control transfer that has a data stage, using the
+        /// specified timeout (in milliseconds) instead of the device's timeout.
+        /// </summary>
+        protected unsafe uint controlTransfer(byte RequestType, byte Request, ushort Value, ushort Index, void * data, ushort length, UInt32 timeout)
+        {
+            int ret = rawControlTransfer(RequestType, Request,
+                                         Value, Index, data, length, getTransferTimeout(timeout));
             LibUsb.throwIfError(ret,"Control transfer failed");
             return (uint)ret;
         }
 
-        IntPtr privateDeviceHandle;
+        /// <summary>
+        /// Performs a control transfer that has no data stage without
+        /// throwing an exception or allocating memory if it fails.
+        /// </summary>
+        /// <returns>0 on success, or a negative UsbStatus error code.</returns>
+        protected unsafe int tryControlTransfer(byte RequestType, byte Request, ushort Value, ushort Index)
+        {
+            return tryControlTransfer(RequestType, Request, Value, Index, (byte*)0, 0);
+        }
 
-        internal IntPtr deviceHandle
+        /// <summary>
+        /// Performs a control transfer that has a data stage without
+        /// throwing an exception or allocating memory if it fails.
+        /// </summary>
+        /// <returns>The number of bytes transferred, or a negative UsbStatus error code.</returns>
+        protected unsafe int tryControlTransfer(byte RequestType, byte Request, ushort Value, ushort Index, void * data, ushort length)
+        {
+            UInt32 transferTimeout = timeout;
+            if (!tryGetTransferTimeout(ref transferTimeout))
+            {
+                return UsbStatus.Timeout;
+            }
+            return rawControlTransfer(RequestType, Request,
+                                      Value, Index, data, length, transferTimeout);
+        }
+
+        /// <summary>
+        /// Sends a control transfer to the transport, if there is one, or to
+        /// libusb otherwise, and records it in the transfer statistics and
+        /// the trace.  Every control transfer goes through here.
+        /// </summary>
+        /// <returns>The number of bytes transferred, or a negative UsbStatus error code.</returns>
+        unsafe int rawControlTransfer(byte RequestType, byte Request, ushort Value, ushort Index, void * data, ushort length, UInt32 timeout)
+        {
+            long start = Stopwatch.GetTimestamp();
+            if (TransferTracer.tracing)
+            {
+                TransferTracer.submit(privateTransferStatistics.id, RequestType, Request,
+                                      Value, Index, length, start);
+            }
+            int result;
+            if (transport != null)
+            {
+                result = transport.controlTransfer(RequestType, Request, Value, Index, data, length, timeout);
+            }
+            else if (deviceHandle.IsClosed)
+            {
+                result = UsbStatus.NoDevice;
+            }
+            else
+            {
+                result = libusbControlTransfer(deviceHandle, RequestType, Request,
+                                               Value, Index, data, length, timeout);
+            }
+            long end = Stopwatch.GetTimestamp();
+            if (TransferStatistics.enabled)
+            {
+                privateTransferStatistics.record(Request, result, end - start);
+            }
+            if (TransferTracer.tracing)
+            {
+                TransferTracer.record(privateTransferStatistics.id, RequestType, Request,
+                                      Value, Index, length, result, start, end);
+            }
+            if (SessionRecorder.recording)
+            {
+                SessionRecorder.record(this, RequestType, Request, Value, Index,
+                                       data, length, result, start, end);
+            }
+            return result;
+        }
+
+        readonly TransferStatistics privateTransferStatistics;
+
+        /// <summary>
+        /// Counters and latency histograms for the control transfers sent to
+        /// this device.  They are shared with every other connection to the
+        /// same device.
+        /// </summary>
+        public TransferStatistics transferStatistics
+        {
+            get { return privateTransferStatistics; }
+        }
+
+        LibusbDeviceHandle privateDeviceHandle;
+
+        /// <summary>
+        /// The device descriptor, read when the device is connected.
+        /// libusb keeps it in memory, but reading it still takes several
+        /// calls.
+        /// </summary>
+        LibusbDeviceDescriptor privateDescriptor;
+
+        /// <summary>
+        /// The transport used instead of libusb for virtual devices, or null.
+        /// </summary>
+        readonly IUsbTransport transport;
+
+        /// <summary>
+        /// The DeviceListItem.location of the device.
+        /// </summary>
+        readonly Int32 location;
+
+        internal LibusbDeviceHandle deviceHandle
         {
             get { return privateDeviceHandle; }
         }
 
+        /// <summary>
+        /// Gets the vendor ID and device interface GUID for a session log.
+        /// Linux does not use device interface GUIDs, so only virtual devices
+        /// have one.
+        /// </summary>
+        internal void getIdentity(out UInt16 vendorId, out Guid deviceInterfaceGuid)
+        {
+            if (transport != null)
+            {
+                vendorId = transport.vendorId;
+                deviceInterfaceGuid = transport.deviceInterfaceGuid;
+                return;
+            }
+            vendorId = privateDescriptor.idVendor;
+            deviceInterfaceGuid = Guid.Empty;
+        }
+
         /// <summary>
         /// Create a usb device from a deviceListItem
         /// </summary>
         /// <param name="handles"></param>
         protected UsbDevice(DeviceListItem deviceListItem)
         {
-            LibUsb.throwIfError(libusbOpen(deviceListItem.devicePointer,out privateDeviceHandle),
+            privateTransferStatistics = TransferStatistics.forDevice(deviceListItem.productId, deviceListItem.serialNumber);
+
+            if (deviceListItem.transport != null)
+            {
+                transport = deviceListItem.transport;
+                return;
+            }
+
+            if (deviceListItem.device == null || deviceListItem.device.IsClosed)
+            {
+                throw new ObjectDisposedException("DeviceListItem");
+            }
+            LibUsb.throwIfError(libusbOpen(deviceListItem.device,out privateDeviceHandle),
                                "Error connecting to device.");
+            location = deviceListItem.location;
+            privateDescriptor = LibUsb.getDeviceDescriptor(privateDeviceHandle);
         }
 
         /// <summary>
         /// disconnects from the usb device.  This is the same as Dispose().
+        /// Calling it again does nothing.  A transfer running on another
+        /// thread finishes before the handle is closed.
         /// </summary>
         public void disconnect()
         {
-            libusbClose(deviceHandle);
+            stopCoalescing();
+            if (transport == null)
+            {
+                if (!deviceHandle.IsClosed)
+                {
+                    LibUsb.removeSerialNumber(deviceHandle);
+                }
+                deviceHandle.Dispose();
+            }
         }
 
         /// <summary>
@@ -382,11 +1226,53 @@ namespace Pololu.UsbWrapper
         public void Dispose()
         {
             disconnect();
+            GC.SuppressFinalize(this);
+        }
+
+        CoalescingWriter privateCoalescer;
+
+        /// <summary>
+        /// The writer that sends targets and speeds while the device is in
+        /// coalescing mode (see startCoalescing in the classes for each
+        /// device), or null if it is not.  Its counters show how many values
+        /// were coalesced.
+        /// </summary>
+        public CoalescingWriter coalescer
+        {
+            get { return privateCoalescer; }
+        }
+
+        /// <summary>
+        /// Starts coalescing mode, if it is not started already.
+        /// </summary>
+        /// <param name="keyCount">The number of values the device has, such as one target per channel.</param>
+        /// <param name="write">Sends one value to the device.</param>
+        protected void startCoalescing(int keyCount, CoalescedWrite write)
+        {
+            if (privateCoalescer == null)
+            {
+                privateCoalescer = new CoalescingWriter(keyCount, write, "Coalescing writer " + getSerialNumber());
+            }
+        }
+
+        /// <summary>
+        /// Sends the values that are waiting to be sent and leaves coalescing
+        /// mode, so that targets and speeds are sent right away again.  This
+        /// is called by disconnect.
+        /// </summary>
+        public void stopCoalescing()
+        {
+            CoalescingWriter writer = privateCoalescer;
+            if (writer != null)
+            {
+                writer.Dispose();
+                privateCoalescer = null;
+            }
         }
 
         [DllImport("libusb-1.0", EntryPoint = "libusb_control_transfer")]
         /// <returns>the number of bytes transferred or an error code</returns>
-        static extern unsafe int libusbControlTransfer(IntPtr device_handle, byte requesttype,
+        static extern unsafe int libusbControlTransfer(LibusbDeviceHandle device_handle, byte requesttype,
                                                 byte request, ushort value, ushort index,
                                                 void * bytes, ushort size, uint timeout);
 
@@ -424,17 +1310,17 @@ namespace Pololu.UsbWrapper
         /// <summary>
         /// Gets the simplest version of a string descriptor
         /// </summary>
-        internal static unsafe extern int libusbGetStringDescriptorASCII(IntPtr device_handle, byte index, byte *data, int length);
+        internal static unsafe extern int libusbGetStringDescriptorASCII(LibusbDeviceHandle device_handle, byte index, byte *data, int length);
 
         [DllImport("libusb-1.0", EntryPoint = "libusb_open")]
         /// <summary>
         /// Gets a device handle for a device.  Must be closed with libusb_close.
         /// </summary>
-        internal static extern int libusbOpen(IntPtr device, out IntPtr device_handle);
+        internal static extern int libusbOpen(LibusbDevice device, out LibusbDeviceHandle device_handle);
 
         [DllImport("libusb-1.0", EntryPoint = "libusb_close")]
         /// <summary>
-        /// Closes a device handle.
+        /// Closes a device handle.  Only LibusbDeviceHandle calls this.
         /// </summary>
         internal static extern void libusbClose(IntPtr device_handle);
 
@@ -442,7 +1328,42 @@ namespace Pololu.UsbWrapper
         /// <summary>
         /// Gets the device from a device handle.
         /// </summary>
-        internal static extern IntPtr libusbGetDevice(IntPtr device_handle);
+        internal static extern IntPtr libusbGetDevice(LibusbDeviceHandle device_handle);
+
+        [DllImport("libusb-1.0", EntryPoint = "libusb_get_bus_number")]
+        /// <summary>
+        /// Gets the number of the bus that the device is connected to.
+        /// </summary>
+        internal static extern byte libusbGetBusNumber(IntPtr device);
+
+        [DllImport("libusb-1.0", EntryPoint = "libusb_get_bus_number")]
+        internal static extern byte libusbGetBusNumber(LibusbDevice device);
+
+        [DllImport("libusb-1.0", EntryPoint = "libusb_get_device_address")]
+        /// <summary>
+        /// Gets the address of the device on its bus.
+        /// </summary>
+        internal static extern byte libusbGetDeviceAddress(IntPtr device);
+
+        [DllImport("libusb-1.0", EntryPoint = "libusb_get_device_address")]
+        internal static extern byte libusbGetDeviceAddress(LibusbDevice device);
+
+        [DllImport("libusb-1.0", EntryPoint = "libusb_get_port_numbers")]
+        /// <summary>
+        /// Gets the port numbers from the root hub to the device.
+        /// </summary>
+        /// <returns>the number of port numbers, or an error code</returns>
+        internal static unsafe extern int libusbGetPortNumbers(LibusbDevice device, byte* ports, int length);
+
+        [DllImport("libusb-1.0", EntryPoint = "libusb_get_port_numbers")]
+        internal static unsafe extern int libusbGetPortNumbers(IntPtr device, byte* ports, int length);
+
+        [DllImport("libusb-1.0", EntryPoint = "libusb_ref_device")]
+        /// <summary>
+        /// Adds a reference to a device, so that it stays valid after the
+        /// device list it came from is freed.
+        /// </summary>
+        internal static extern IntPtr libusbRefDevice(IntPtr device);
 
         /// <summary>
         /// true if the devices are the same
@@ -451,7 +1372,15 @@ namespace Pololu.UsbWrapper
         /// <returns></returns>
         public bool isSameDeviceAs(DeviceListItem item)
         {
-            return (libusbGetDevice(deviceHandle) == item.devicePointer);
+            if (transport != null || item.transport != null)
+            {
+                return transport == item.transport;
+            }
+            if (deviceHandle.IsClosed)
+            {
+                return false;
+            }
+            return (location == item.location);
         }
 
         /// <summary>
@@ -471,38 +1400,66 @@ namespace Pololu.UsbWrapper
         {
             var list = new List<DeviceListItem>();
 
+            if (Usb.enumerateRealDevices)
+            {
+                addRealDevices(list, vendorId, productIdArray);
+            }
+
+            foreach (IUsbTransport device in Usb.getVirtualDevices())
+            {
+                if (device.vendorId == vendorId && Array.IndexOf(productIdArray, device.productId) >= 0)
+                {
+                    list.Add(new DeviceListItem(device));
+                }
+            }
+
+            return list;
+        }
+
+        static unsafe void addRealDevices(List<DeviceListItem> list, UInt16 vendorId, UInt16[] productIdArray)
+        {
             IntPtr* device_list;
             int count = LibUsb.throwIfError(UsbDevice.libusbGetDeviceList(LibUsb.context, out device_list),
                                             "Error from libusb_get_device_list.");
 
-            int i;
-            for(i=0;i<count;i++)
+            try
             {
-                IntPtr device = device_list[i];
+                LibUsb.removeOldSerialNumbers(device_list, count);
 
-                foreach(UInt16 productId in productIdArray)
+                int i;
+                for(i=0;i<count;i++)
                 {
-                    if(LibUsb.deviceMatchesVendorProduct(device, vendorId, productId))
-                    {
-                        IntPtr device_handle;
-                        LibUsb.throwIfError(UsbDevice.libusbOpen(device,out device_handle),
-                                            "Error connecting to device to get serial number ("+(i+1)+" of "+count+", "+device.ToString("x8")+").");
-
-                        string serialNumber = LibUsb.getSerialNumber(device_handle);
-                        list.Add(new DeviceListItem(device, "#"+serialNumber, serialNumber, productId));
+                    IntPtr device = device_list[i];
 
-                        UsbDevice.libusbClose(device_handle);
+                    foreach(UInt16 productId in productIdArray)
+                    {
+                        if(LibUsb.deviceMatchesVendorProduct(device, vendorId, productId))
+                        {
+                            // Each item holds a reference of its own, which
+                            // it releases when it is disposed.
+                            LibusbDevice item_device = new LibusbDevice(UsbDevice.libusbRefDevice(device));
+                            string serialNumber;
+                            try
+                            {
+                                serialNumber = LibUsb.getSerialNumber(item_device,
+                                    "Error connecting to device to get serial number ("+(i+1)+" of "+count+", "+device.ToString("x8")+").");
+                            }
+                            catch
+                            {
+                                item_device.Dispose();
+                                throw;
+                            }
+                            list.Add(new DeviceListItem(item_device, "#"+serialNumber, serialNumber, productId));
+                        }
                     }
                 }
             }
-
-
-            // Free device list without unreferencing.
-            // Unreference/free the individual devices in the
-            // DeviceListItem destructor.
-            UsbDevice.libusbFreeDeviceList(device_list, 0);
-
-            return list;
+            finally
+            {
+                // Unreference the devices, except for the references
+                // taken by the items.
+                UsbDevice.libusbFreeDeviceList(device_list, 1);
+            }
         }
 
         //protected AsynchronousInTransfer newAsynchronousInTransfer(byte endpoint, uint size, uint timeout)
@@ -1,7 +1,10 @@
 UsbWrapper_lib := $(UsbWrapper)/UsbWrapper.dll
 Targets += $(UsbWrapper_lib)
 
-UsbWrapper_csfiles := $(wildcard $(UsbWrapper)/*.cs)
+# The code that does not depend on libusb is shared with UsbWrapper_Windows.
+UsbWrapper_shared := $(UsbWrapper)/../UsbWrapper_Shared
+
+UsbWrapper_csfiles := $(wildcard $(UsbWrapper)/*.cs) $(wildcard $(UsbWrapper_shared)/*.cs)
 
 $(UsbWrapper)/UsbWrapper.dll: $(UsbWrapper_csfiles)
 	$(CS) -target:library $(UsbWrapper_csfiles) -out:$(UsbWrapper)/UsbWrapper.dll -r:System.dll -r:System.Core.dll
@@ -0,0 +1,357 @@
+// UsbWrapper_Shared/CoalescingWriter.cs:
+//   Sends only the newest of several quickly-changing values (targets,
+//   speeds) to a device, from a background thread.
+
+using System;
+using System.Diagnostics;
+using System.Threading;
+
+namespace Pololu.UsbWrapper
+{
+    /// <summary>
+    /// Sends one value to the device.  Used by CoalescingWriter.
+    /// </summary>
+    /// <param name="key">Which value it is, for example the channel number.</param>
+    /// <param name="value">The value to send.</param>
+    /// <returns>UsbStatus.Success (0) or a negative UsbStatus error code.</returns>
+    public delegate int CoalescedWrite(int key, int value);
+
+    /// <summary>
+    /// Sends values such as targets and speeds to a device from a
+    /// background thread, sending only the newest value for each key.
+    /// </summary>
+    /// <remarks>
+    /// <para>
+    /// A program that calculates a new target every millisecond or so can
+    /// produce values faster than the device can accept them: each control
+    /// transfer takes about a millisecond, and much longer if the bus is
+    /// busy.  Without coalescing, the program either slows down to the
+    /// speed of the bus or builds a queue of old targets that the device
+    /// works through long after they stopped mattering.
+    /// </para>
+    /// <para>
+    /// With this class, post stores the value and returns right away.  The
+    /// thread sends the pending values in order of their keys, and if a key
+    /// gets a new value before the old one was sent, the old one is dropped
+    /// (last writer wins) and counted in coalesced.  So the device is always
+    /// at most one transfer per key behind the program, and
+    /// latency shows how long a value waited before it was sent or
+    /// replaced.
+    /// </para>
+    /// <para>
+    /// Posting does not take a lock, so it can be called from any number of
+    /// threads and is cheap enough for control loops.  Errors from the
+    /// device are counted in failed, and the first error after a post is
+    /// returned by the next post, so the program finds out about them.
+    /// </para>
+    /// </remarks>
+    public class CoalescingWriter : IDisposable
+    {
+        // Each slot holds a value in its low 32 bits and pendingFlag if it
+        // has not been sent yet, so that a value and its flag are always
+        // taken together by one Interlocked.Exchange.
+        const long pendingFlag = 1L << 32;
+
+        readonly long[] slots;
+        readonly long[] pendingSince;
+        readonly CoalescedWrite write;
+        readonly Thread thread;
+        readonly AutoResetEvent wake = new AutoResetEvent(false);
+        readonly LatencyHistogram privateLatency = new LatencyHistogram();
+
+        volatile bool running = true;
+        int idle;
+        int sendingKey = -1;
+        int unreportedStatus;
+
+        long privatePosted;
+        long privateSent;
+        long privateCoalesced;
+        long privateCancelled;
+        long privateFailed;
+        int privateLastFailure;
+
+        /// <summary>
+        /// Starts a writer and its thread.
+        /// </summary>
+        /// <param name="keyCount">The number of keys; keys go from 0 to keyCount - 1 and are sent in that order.</param>
+        /// <param name="write">Sends a value to the device.  It is only called from the writer's thread.</param>
+        /// <param name="name">The name of the thread, for debugging.</param>
+        public CoalescingWriter(int keyCount, CoalescedWrite write, String name)
+        {
+            if (keyCount <= 0)
+            {
+                throw new ArgumentOutOfRangeException("keyCount", "The number of keys must be greater than 0.");
+            }
+            if (write == null)
+            {
+                throw new ArgumentNullException("write");
+            }
+
+            slots = new long[keyCount];
+            pendingSince = new long[keyCount];
+            this.write = write;
+
+            thread = new Thread(run);
+            thread.Name = name;
+            thread.IsBackground = true;
+            thread.Start();
+        }
+
+        /// <summary>
+        /// The number of keys.
+        /// </summary>
+        public int keyCount
+        {
+            get { return slots.Length; }
+        }
+
+        /// <summary>
+        /// The number of values posted.
+        /// </summary>
+        public long posted
+        {
+            get { return Interlocked.Read(ref privatePosted); }
+        }
+
+        /// <summary>
+        /// The number of values sent to the device, including those that
+        /// failed.
+        /// </summary>
+        public long sent
+        {
+            get { return Interlocked.Read(ref privateSent); }
+        }
+
+        /// <summary>
+        /// The number of values that were replaced by a newer value for the
+        /// same key before they were sent.
+        /// </summary>
+        public long coalesced
+        {
+            get { return Interlocked.Read(ref privateCoalesced); }
+        }
+
+        /// <summary>
+        /// The number of values that were dropped by cancel.
+        /// </summary>
+        public long cancelled
+        {
+            get { return Interlocked.Read(ref privateCancelled); }
+        }
+
+        /// <summary>
+        /// The number of values that the device did not accept.
+        /// </summary>
+        public long failed
+        {
+            get { return Interlocked.Read(ref privateFailed); }
+        }
+
+        /// <summary>
+        /// The UsbStatus code of the most recent failure, or 0 if there were
+        /// none.
+        /// </summary>
+        public int lastFailure
+        {
+            get { return Thread.VolatileRead(ref privateLastFailure); }
+        }
+
+        /// <summary>
+        /// How long each key had a pending value before it was sent,
+        /// including the time to send it.  If a value was replaced before it
+        /// was sent, the time counts from the first of the values it
+        /// replaced, so this is how far the device was behind the program.
+        /// </summary>
+        public LatencyHistogram latency
+        {
+            get { return privateLatency; }
+        }
+
+        /// <summary>
+        /// Sets the value to send for a key, replacing the pending value for
+        /// that key if it was not sent yet.  After dispose, this sends the
+        /// value right away instead.
+        /// </summary>
+        /// <returns>
+        /// UsbStatus.Success (0), UsbStatus.InvalidParameter if the key is out
+        /// of range, or the error code of a failed write since the last post.
+        /// </returns>
+        public int post(int key, int value)
+        {
+            if (key < 0 || key >= slots.Length)
+            {
+                return UsbStatus.InvalidParameter;
+            }
+
+            if (!running)
+            {
+                return write(key, value);
+            }
+
+            // The time is only taken when the slot was empty, so replacing a
+            // pending value keeps the time of the oldest one.
+            if ((Interlocked.Read(ref slots[key]) & pendingFlag) == 0)
+            {
+                Thread.VolatileWrite(ref pendingSince[key], Stopwatch.GetTimestamp());
+            }
+
+            long old = Interlocked.Exchange(ref slots[key], pendingFlag | (uint)value);
+            Interlocked.Increment(ref privatePosted);
+            if ((old & pendingFlag) != 0)
+            {
+                Interlocked.Increment(ref privateCoalesced);
+            }
+
+            // This read comes after the exchange, and the thread sets idle
+            // before checking the slots, so either the thread sees the new
+            // value or this sees that it needs waking.
+            if (Thread.VolatileRead(ref idle) != 0 && Interlocked.Exchange(ref idle, 0) != 0)
+            {
+                wake.Set();
+            }
+
+            if (Thread.VolatileRead(ref unreportedStatus) != 0)
+            {
+                return Interlocked.Exchange(ref unreportedStatus, 0);
+            }
+            return UsbStatus.Success;
+        }
+
+        /// <summary>
+        /// Drops the pending value for a key, and waits until the thread is
+        /// not sending a value for that key.  Call this before sending a
+        /// command that must not be overridden by an older value, such as
+        /// turning a motor off.
+        /// </summary>
+        /// <returns>True if a pending value was dropped.</returns>
+        public bool cancel(int key)
+        {
+            if (key < 0 || key >= slots.Length)
+            {
+                return false;
+            }
+
+            bool dropped = (Interlocked.Exchange(ref slots[key], 0) & pendingFlag) != 0;
+            if (dropped)
+            {
+                Interlocked.Increment(ref privateCancelled);
+            }
+
+            // The thread sets sendingKey before it takes a value, so if it
+            // took this key's value before the exchange above, this sees it.
+            while (Thread.VolatileRead(ref sendingKey) == key && Thread.CurrentThread != thread)
+            {
+                Thread.Sleep(0);
+            }
+            return dropped;
+        }
+
+        /// <summary>
+        /// Waits until all pending values have been sent.
+        /// </summary>
+        /// <param name="timeout">The most time to wait, in milliseconds.</param>
+        /// <returns>True if everything was sent, false if the time ran out.</returns>
+        public bool flush(int timeout)
+        {
+            Stopwatch stopwatch = Stopwatch.StartNew();
+            while (hasPending() || Thread.VolatileRead(ref sendingKey) != -1)
+            {
+                if (!running && !thread.IsAlive)
+                {
+                    return !hasPending();
+                }
+                if (stopwatch.ElapsedMilliseconds >= timeout)
+                {
+                    return false;
+                }
+                Thread.Sleep(hasPending() ? 1 : 0);
+            }
+            return true;
+        }
+
+        /// <summary>
+        /// Sends the values that are pending and stops the thread.  Values
+        /// posted after this are sent right away by post.
+        /// </summary>
+        public void Dispose()
+        {
+            if (!running)
+            {
+                return;
+            }
+            running = false;
+            wake.Set();
+            if (Thread.CurrentThread != thread)
+            {
+                thread.Join();
+            }
+        }
+
+        bool hasPending()
+        {
+            for (int key = 0; key < slots.Length; key++)
+            {
+                if ((Interlocked.Read(ref slots[key]) & pendingFlag) != 0)
+                {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void run()
+        {
+            while (true)
+            {
+                bool sentAny = false;
+                for (int key = 0; key < slots.Length; key++)
+                {
+                    Thread.VolatileWrite(ref sendingKey, key);
+                    long slot = Interlocked.Exchange(ref slots[key], 0);
+                    if ((slot & pendingFlag) == 0)
+                    {
+                        continue;
+                    }
+
+                    long since = Thread.VolatileRead(ref pendingSince[key]);
+                    int status = write(key, (int)slot);
+                    privateLatency.record(Stopwatch.GetTimestamp() - since);
+                    Interlocked.Increment(ref privateSent);
+                    if (status < 0)
+                    {
+                        Interlocked.Increment(ref privateFailed);
+                        Thread.VolatileWrite(ref privateLastFailure, status);
+                        Interlocked.Exchange(ref unreportedStatus, status);
+                    }
+                    sentAny = true;
+                }
+                Thread.VolatileWrite(ref sendingKey, -1);
+
+                if (sentAny)
+                {
+                    continue;
+                }
+                if (!running)
+                {
+                    break;
+                }
+
+                Interlocked.Exchange(ref idle, 1);
+                if (hasPending())
+                {
+                    Interlocked.Exchange(ref idle, 0);
+                    continue;
+                }
+                wake.WaitOne();
+            }
+        }
+    }
+}
+
+// Local Variables: **
+// mode: java **
+// c-basic-offset: 4 **
+// tab-width: 4 **
+// indent-tabs-mode: nil **
+// end: **
@@ -0,0 +1,260 @@
+// UsbWrapper_Shared/ReplayUsbDevice.cs:
+//   A virtual device that answers control transfers with the responses
+//   recorded in a session log.
+
+using System;
+using System.Diagnostics;
+using System.Threading;
+
+namespace Pololu.UsbWrapper
+{
+    /// <summary>
+    /// Plays back the transfers of one device in a session log (see
+    /// SessionRecorder), so that code written for the device can be run
+    /// again without it.
+    /// </summary>
+    /// <remarks>
+    /// <para>
+    /// Add it with Usb.addVirtualDevice and connect to it like to any other
+    /// device: the Usc, Jrk and Smc classes send their transfers to it, and
+    /// it answers each one with the result and the data of the recorded
+    /// transfer.  The transfers are expected in the recorded order.  If a
+    /// transfer has a different setup packet than the next recorded one,
+    /// the device looks further ahead for one that matches and skips the
+    /// ones in between (they are counted in skipped); if there is none,
+    /// the transfer fails with UsbStatus.Pipe and is counted in mismatches.
+    /// The data sent to the device is compared with the recorded data, and
+    /// the differences are counted in dataMismatches, so a change in what
+    /// the code sends shows up without failing the transfers.
+    /// </para>
+    /// <para>
+    /// By default the transfers finish as fast as possible, to measure the
+    /// code on the computer without the time spent on the bus.  With
+    /// realTime, each transfer takes as long as the recorded one, like
+    /// VirtualUsbDevice.latency, so the code runs at the speed it ran with
+    /// the real device.  The time between transfers is up to the code.
+    /// </para>
+    /// </remarks>
+    public class ReplayUsbDevice : IUsbTransport
+    {
+        readonly SessionDevice device;
+        readonly SessionTransfer[] transfers;
+        readonly long recordedFrequency;
+        readonly object sync = new object();
+
+        int privatePosition;
+        bool privateRealTime;
+        bool privateLoop;
+        long privateReplayed;
+        long privateSkipped;
+        long privateMismatches;
+        long privateDataMismatches;
+
+        /// <param name="device">The device from a SessionLog.</param>
+        /// <param name="frequency">The SessionLog.frequency of the log.</param>
+        public ReplayUsbDevice(SessionDevice device, long frequency)
+        {
+            this.device = device;
+            transfers = device.transfers.ToArray();
+            recordedFrequency = frequency;
+        }
+
+        public UInt16 vendorId
+        {
+            get { return device.vendorId; }
+        }
+
+        public UInt16 productId
+        {
+            get { return device.productId; }
+        }
+
+        public String serialNumber
+        {
+            get { return device.serialNumber; }
+        }
+
+        public Guid deviceInterfaceGuid
+        {
+            get { return device.deviceInterfaceGuid; }
+        }
+
+        /// <summary>
+        /// If true, every transfer takes as long as it did when it was
+        /// recorded.  The default is false.
+        /// </summary>
+        public bool realTime
+        {
+            get { return privateRealTime; }
+            set { privateRealTime = value; }
+        }
+
+        /// <summary>
+        /// If true, the recording starts over after the last transfer, so a
+        /// short recording of a polling loop can be played back for as long
+        /// as needed.  The default is false.
+        /// </summary>
+        public bool loop
+        {
+            get { return privateLoop; }
+            set { privateLoop = value; }
+        }
+
+        /// <summary>
+        /// The number of recorded transfers.
+        /// </summary>
+        public int count
+        {
+            get { return transfers.Length; }
+        }
+
+        /// <summary>
+        /// The index of the next recorded transfer that is expected.
+        /// </summary>
+        public int position
+        {
+            get { lock (sync) { return privatePosition; } }
+        }
+
+        /// <summary>
+        /// The number of transfers that were answered from the recording.
+        /// </summary>
+        public long replayed
+        {
+            get { lock (sync) { return privateReplayed; } }
+        }
+
+        /// <summary>
+        /// The number of recorded transfers that were passed over to find
+        /// one that matched.
+        /// </summary>
+        public long skipped
+        {
+            get { lock (sync) { return privateSkipped; } }
+        }
+
+        /// <summary>
+        /// The number of transfers that were not in the recording.
+        /// </summary>
+        public long mismatches
+        {
+            get { lock (sync) { return privateMismatches; } }
+        }
+
+        /// <summary>
+        /// The number of transfers to the device whose data was different
+        /// from the recorded data.
+        /// </summary>
+        public long dataMismatches
+        {
+            get { lock (sync) { return privateDataMismatches; } }
+        }
+
+        /// <summary>
+        /// Starts the playback over from the first transfer and clears the
+        /// counters.
+        /// </summary>
+        public void rewind()
+        {
+            lock (sync)
+            {
+                privatePosition = 0;
+                privateReplayed = 0;
+                privateSkipped = 0;
+                privateMismatches = 0;
+                privateDataMismatches = 0;
+            }
+        }
+
+        public unsafe int controlTransfer(byte requestType, byte request, ushort value, ushort index, void* data, ushort length, UInt32 timeout)
+        {
+            SessionTransfer transfer;
+            lock (sync)
+            {
+                int found = find(requestType, request, value, index, length);
+                if (found < 0)
+                {
+                    privateMismatches++;
+                    return UsbStatus.Pipe;
+                }
+
+                privateSkipped += (found - privatePosition + transfers.Length) % transfers.Length;
+                privatePosition = found + 1;
+                if (privatePosition == transfers.Length && privateLoop)
+                {
+                    privatePosition = 0;
+                }
+                privateReplayed++;
+                transfer = transfers[found];
+
+                byte* bytes = (byte*)data;
+                int count = SessionRecorder.getDataLength(requestType, length, transfer.result);
+                if ((requestType & 0x80) != 0)
+                {
+                    for (int i = 0; i < count; i++)
+                    {
+                        bytes[i] = transfer.data[i];
+                    }
+                }
+                else
+                {
+                    for (int i = 0; i < count; i++)
+                    {
+                        if (bytes[i] != transfer.data[i])
+                        {
+                            privateDataMismatches++;
+                            break;
+                        }
+                    }
+                }
+            }
+
+            if (privateRealTime)
+            {
+                wait(transfer.duration * Stopwatch.Frequency / recordedFrequency);
+            }
+            return transfer.result;
+        }
+
+        /// <summary>
+        /// Finds the next recorded transfer with the given setup packet,
+        /// starting at the position.  Returns -1 if there is none.
+        /// </summary>
+        int find(byte requestType, byte request, ushort value, ushort index, ushort length)
+        {
+            int end = privateLoop ? privatePosition + transfers.Length : transfers.Length;
+            for (int i = privatePosition; i < end; i++)
+            {
+                SessionTransfer transfer = transfers[i % transfers.Length];
+                if (transfer.request == request && transfer.requestType == requestType &&
+                    transfer.value == value && transfer.index == index && transfer.length == length)
+                {
+                    return i % transfers.Length;
+                }
+            }
+            return -1;
+        }
+
+        static void wait(long ticks)
+        {
+            if (ticks >= 2 * Stopwatch.Frequency / 1000)
+            {
+                Thread.Sleep((int)(ticks * 1000 / Stopwatch.Frequency));
+                return;
+            }
+
+            long end = Stopwatch.GetTimestamp() + ticks;
+            while (Stopwatch.GetTimestamp() < end)
+            {
+                Thread.SpinWait(20);
+            }
+        }
+    }
+}
+
+// Local Variables: **
+// mode: java **
+// c-basic-offset: 4 **
+// tab-width: 4 **
+// indent-tabs-mode: nil **
+// end: **
@@ -0,0 +1,437 @@
+// UsbWrapper_Shared/SessionRecorder.cs:
+//   Records every control transfer, with its data, to a session log that
+//   ReplayUsbDevice can play back without the devices.
+
+using System;
+using System.Collections.Generic;
+using System.Diagnostics;
+using System.IO;
+using System.Text;
+
+namespace Pololu.UsbWrapper
+{
+    /// <summary>
+    /// Records every control transfer sent by any UsbDevice in to a session
+    /// log: the setup packet, the data sent or received, the result, and
+    /// the times.  Recording is off until start() is called.
+    /// </summary>
+    /// <remarks>
+    /// <para>
+    /// Unlike TransferTracer, which only keeps the setup packets, a session
+    /// log has everything needed to play the session back: SessionLog reads
+    /// it, and ReplayUsbDevice answers the same requests with the same
+    /// responses, so that the Usc, Jrk and Smc classes can be tested and
+    /// benchmarked against a real device's behavior on a computer that
+    /// has no devices.
+    /// </para>
+    /// <para>
+    /// The log is compact: the numbers are stored as variable-length
+    /// integers, times as differences, and the data stage only in the
+    /// direction it went.  A transfer with no data takes about a dozen
+    /// bytes.  Recording takes a lock and copies the transfer in to a
+    /// buffer that is written to the file when it fills up, so it does not
+    /// allocate memory, but it does make transfers on different threads
+    /// wait for each other briefly.
+    /// </para>
+    /// </remarks>
+    public static class SessionRecorder
+    {
+        // Record types in the log.
+        internal const byte recordDevice = 1;
+        internal const byte recordTransfer = 2;
+
+        internal static readonly byte[] magic = Encoding.ASCII.GetBytes("PLSR");
+        internal const ushort fileVersion = 1;
+
+        static readonly object sync = new object();
+        static volatile bool privateRecording;
+        static BinaryWriter writer;
+        static byte[] scratch;
+        static long startTimestamp;
+        static long lastSubmitted;
+        static bool[] devicesWritten;
+        static long privateRecordedTransfers;
+
+        /// <summary>
+        /// True if transfers are being recorded.
+        /// </summary>
+        public static bool recording
+        {
+            get { return privateRecording; }
+        }
+
+        /// <summary>
+        /// The number of transfers recorded since recording started.
+        /// </summary>
+        public static long recordedTransfers
+        {
+            get { lock (sync) { return privateRecordedTransfers; } }
+        }
+
+        /// <summary>
+        /// Starts recording transfers in to a new log file.
+        /// </summary>
+        public static void start(String fileName)
+        {
+            start(new FileStream(fileName, FileMode.Create, FileAccess.Write, FileShare.Read, 65536));
+        }
+
+        /// <summary>
+        /// Starts recording transfers in to a stream, which is closed by
+        /// stop().
+        /// </summary>
+        public static void start(Stream stream)
+        {
+            lock (sync)
+            {
+                if (privateRecording)
+                {
+                    throw new InvalidOperationException("Transfers are already being recorded.");
+                }
+
+                writer = new BinaryWriter(stream);
+                scratch = new byte[65536];
+                startTimestamp = Stopwatch.GetTimestamp();
+                lastSubmitted = 0;
+                devicesWritten = new bool[16];
+                privateRecordedTransfers = 0;
+
+                writer.Write(magic);
+                writer.Write(fileVersion);
+                writer.Write(Stopwatch.Frequency);
+                writer.Write(DateTime.UtcNow.Ticks);
+                privateRecording = true;
+            }
+        }
+
+        /// <summary>
+        /// Stops recording and closes the log.
+        /// </summary>
+        public static void stop()
+        {
+            lock (sync)
+            {
+                if (!privateRecording)
+                {
+                    return;
+                }
+                privateRecording = false;
+                writer.Close();
+                writer = null;
+                scratch = null;
+            }
+        }
+
+        /// <summary>
+        /// Called by UsbDevice when a transfer is complete.
+        /// </summary>
+        /// <param name="data">The data buffer of the transfer, which holds the data sent or received.</param>
+        internal static unsafe void record(UsbDevice device, byte requestType, byte request, ushort value, ushort index, void* data, ushort length, int result, long submitted, long completed)
+        {
+            lock (sync)
+            {
+                if (!privateRecording)
+                {
+                    return;
+                }
+
+                int id = device.transferStatistics.id;
+                if (id >= devicesWritten.Length)
+                {
+                    Array.Resize(ref devicesWritten, Math.Max(id + 1, devicesWritten.Length * 2));
+                }
+                if (!devicesWritten[id])
+                {
+                    UInt16 vendorId;
+                    Guid deviceInterfaceGuid;
+                    device.getIdentity(out vendorId, out deviceInterfaceGuid);
+                    writer.Write(recordDevice);
+                    writer.Write(id);
+                    writer.Write(vendorId);
+                    writer.Write(device.transferStatistics.productId);
+                    writer.Write(device.transferStatistics.serialNumber ?? "");
+                    writer.Write(deviceInterfaceGuid.ToByteArray());
+                    devicesWritten[id] = true;
+                }
+
+                // Transfers on different threads can finish in a different
+                // order than they started, so the difference can be negative.
+                long time = submitted - startTimestamp;
+                writer.Write(recordTransfer);
+                writeVarint(writer, (ulong)id);
+                writeVarint(writer, zigzag(time - lastSubmitted));
+                writeVarint(writer, (ulong)Math.Max(0, completed - submitted));
+                writer.Write(requestType);
+                writer.Write(request);
+                writeVarint(writer, value);
+                writeVarint(writer, index);
+                writeVarint(writer, length);
+                writeVarint(writer, zigzag(result));
+                lastSubmitted = time;
+
+                int count = getDataLength(requestType, length, result);
+                if (count > 0 && data != null)
+                {
+                    byte* bytes = (byte*)data;
+                    for (int i = 0; i < count; i++)
+                    {
+                        scratch[i] = bytes[i];
+                    }
+                    writer.Write(scratch, 0, count);
+                }
+                privateRecordedTransfers++;
+            }
+        }
+
+        /// <summary>
+        /// The number of data bytes stored for a transfer: what the device
+        /// sent for a transfer to the host, or what the host sent for one to
+        /// the device.
+        /// </summary>
+        internal static int getDataLength(byte requestType, ushort length, int result)
+        {
+            if ((requestType & 0x80) != 0)
+            {
+                return Math.Max(0, Math.Min(result, length));
+            }
+            return length;
+        }
+
+        internal static ulong zigzag(long value)
+        {
+            return (ulong)((value << 1) ^ (value >> 63));
+        }
+
+        internal static long unzigzag(ulong value)
+        {
+            return (long)(value >> 1) ^ -(long)(value & 1);
+        }
+
+        internal static void writeVarint(BinaryWriter writer, ulong value)
+        {
+            while (value >= 0x80)
+            {
+                writer.Write((byte)(value | 0x80));
+                value >>= 7;
+            }
+            writer.Write((byte)value);
+        }
+
+        internal static ulong readVarint(BinaryReader reader)
+        {
+            ulong value = 0;
+            for (int shift = 0; shift < 64; shift += 7)
+            {
+                byte b = reader.ReadByte();
+                value |= (ulong)(b & 0x7F) << shift;
+                if ((b & 0x80) == 0)
+                {
+                    return value;
+                }
+            }
+            throw new Exception("Invalid number in session log.");
+        }
+    }
+
+    /// <summary>
+    /// One control transfer in a session log.
+    /// </summary>
+    public class SessionTransfer
+    {
+        /// <summary>
+        /// When the transfer was submitted, in Stopwatch ticks of the
+        /// recording computer (SessionLog.frequency) since the start of the
+        /// recording.
+        /// </summary>
+        public long submitted;
+
+        /// <summary>
+        /// How long the transfer took, in the same ticks.
+        /// </summary>
+        public long duration;
+
+        public byte requestType;
+        public byte request;
+        public ushort value;
+        public ushort index;
+        public ushort length;
+
+        /// <summary>
+        /// The number of bytes transferred, or a negative UsbStatus code.
+        /// </summary>
+        public int result;
+
+        /// <summary>
+        /// The data the device sent, or the data sent to it, depending on
+        /// the direction in requestType.  Null if there was none.
+        /// </summary>
+        public byte[] data;
+    }
+
+    /// <summary>
+    /// One device in a session log, with its transfers in the order they
+    /// were submitted.
+    /// </summary>
+    public class SessionDevice
+    {
+        public UInt16 vendorId;
+        public UInt16 productId;
+        public String serialNumber;
+
+        /// <summary>
+        /// The device interface GUID, which Windows uses to list the
+        /// device.  Logs recorded on Linux do not have it, so set it before
+        /// replaying them on Windows.
+        /// </summary>
+        public Guid deviceInterfaceGuid;
+
+        public readonly List<SessionTransfer> transfers = new List<SessionTransfer>();
+    }
+
+    /// <summary>
+    /// A session log written by SessionRecorder.
+    /// </summary>
+    public class SessionLog
+    {
+        /// <summary>
+        /// The frequency of the recording computer's Stopwatch, in ticks per
+        /// second.
+        /// </summary>
+        public long frequency;
+
+        /// <summary>
+        /// When the recording started (UTC).
+        /// </summary>
+        public DateTime startTime;
+
+        /// <summary>
+        /// The devices, in the order of their first transfer.
+        /// </summary>
+        public readonly List<SessionDevice> devices = new List<SessionDevice>();
+
+        public static SessionLog read(String fileName)
+        {
+            using (FileStream stream = File.OpenRead(fileName))
+            {
+                return read(stream);
+            }
+        }
+
+        public static SessionLog read(Stream input)
+        {
+            BinaryReader reader = new BinaryReader(input);
+            byte[] header = reader.ReadBytes(SessionRecorder.magic.Length);
+            if (header.Length != SessionRecorder.magic.Length || Encoding.ASCII.GetString(header) != "PLSR")
+            {
+                throw new Exception("The file is not a session log.");
+            }
+            ushort version = reader.ReadUInt16();
+            if (version != SessionRecorder.fileVersion)
+            {
+                throw new Exception("Unsupported session log version " + version + ".");
+            }
+
+            SessionLog log = new SessionLog();
+            log.frequency = reader.ReadInt64();
+            log.startTime = new DateTime(reader.ReadInt64(), DateTimeKind.Utc);
+
+            Dictionary<int, SessionDevice> byId = new Dictionary<int, SessionDevice>();
+            long time = 0;
+            while (input.Position < input.Length)
+            {
+                byte type = reader.ReadByte();
+                switch (type)
+                {
+                    case SessionRecorder.recordDevice:
+                    {
+                        int id = reader.ReadInt32();
+                        SessionDevice device = new SessionDevice();
+                        device.vendorId = reader.ReadUInt16();
+                        device.productId = reader.ReadUInt16();
+                        device.serialNumber = reader.ReadString();
+                        device.deviceInterfaceGuid = new Guid(reader.ReadBytes(16));
+                        byId[id] = device;
+                        log.devices.Add(device);
+                        break;
+                    }
+
+                    case SessionRecorder.recordTransfer:
+                    {
+                        int id = (int)SessionRecorder.readVarint(reader);
+                        SessionDevice device;
+                        if (!byId.TryGetValue(id, out device))
+                        {
+                            throw new Exception("Transfer for unknown device " + id + " in session log.");
+                        }
+
+                        SessionTransfer transfer = new SessionTransfer();
+                        time += SessionRecorder.unzigzag(SessionRecorder.readVarint(reader));
+                        transfer.submitted = time;
+                        transfer.duration = (long)SessionRecorder.readVarint(reader);
+                        transfer.requestType = reader.ReadByte();
+                        transfer.request = reader.ReadByte();
+                        transfer.value = (ushort)SessionRecorder.readVarint(reader);
+                        transfer.index = (ushort)SessionRecorder.readVarint(reader);
+                        transfer.length = (ushort)SessionRecorder.readVarint(reader);
+                        transfer.result = (int)SessionRecorder.unzigzag(SessionRecorder.readVarint(reader));
+
+                        int count = SessionRecorder.getDataLength(transfer.requestType, transfer.length, transfer.result);
+                        if (count > 0)
+                        {
+                            transfer.data = reader.ReadBytes(count);
+                            if (transfer.data.Length != count)
+                            {
+                                throw new EndOfStreamException("The session log ends in the middle of a transfer.");
+                            }
+                        }
+                        device.transfers.Add(transfer);
+                        break;
+                    }
+
+                    default:
+                        throw new Exception("Unknown record type " + type + " in session log.");
+                }
+            }
+
+            // Transfers are written when they finish, which is not always
+            // the order they started in.
+            foreach (SessionDevice device in log.devices)
+            {
+                List<SessionTransfer> transfers = device.transfers;
+                for (int i = 1; i < transfers.Count; i++)
+                {
+                    SessionTransfer transfer = transfers[i];
+                    int j = i - 1;
+                    while (j >= 0 && transfers[j].submitted > transfer.submitted)
+                    {
+                        transfers[j + 1] = transfers[j];
+                        j--;
+                    }
+                    transfers[j + 1] = transfer;
+                }
+            }
+            return log;
+        }
+
+        /// <summary>
+        /// Creates a ReplayUsbDevice for each device in the log.  Add them
+        /// with Usb.addVirtualDevice to make getConnectedDevices find them.
+        /// </summary>
+        public List<ReplayUsbDevice> createReplayDevices()
+        {
+            List<ReplayUsbDevice> list = new List<ReplayUsbDevice>();
+            foreach (SessionDevice device in devices)
+            {
+                list.Add(new ReplayUsbDevice(device, frequency));
+            }
+            return list;
+        }
+    }
+}
+
+// Local Variables: **
+// mode: java **
+// c-basic-offset: 4 **
+// tab-width: 4 **
+// indent-tabs-mode: nil **
+// end: **
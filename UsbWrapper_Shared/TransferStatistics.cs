@@ -0,0 +1,588 @@
+// UsbWrapper_Shared/TransferStatistics.cs:
+//   Counters and latency histograms for the control transfers sent to
+//   each device.
+
+using System;
+using System.Collections.Generic;
+using System.Diagnostics;
+using System.IO;
+using System.Threading;
+
+namespace Pololu.UsbWrapper
+{
+    /// <summary>
+    /// A histogram of transfer durations with logarithmically-sized buckets
+    /// like an HdrHistogram: every power of two is split in to 16 buckets, so
+    /// the values it reports are within about 6% of the real values over the
+    /// whole range, and recording a value takes constant time and never
+    /// allocates memory.
+    /// </summary>
+    /// <remarks>
+    /// Values are recorded in Stopwatch ticks and reported in microseconds.
+    /// Recording uses Interlocked operations, so any number of threads can
+    /// record at the same time without locks.  Reading while other threads
+    /// record gives numbers that are consistent to within a few transfers.
+    /// </remarks>
+    public class LatencyHistogram
+    {
+        const int subBucketBits = 4;
+        const int subBucketCount = 1 << subBucketBits;
+
+        /// <summary>
+        /// Values with more bits than this are recorded in the last bucket.
+        /// 2^44 ticks is several hours even with a 1 GHz timestamp counter.
+        /// </summary>
+        const int maxValueBits = 44;
+
+        const int bucketCount = (maxValueBits - subBucketBits) * subBucketCount + 2 * subBucketCount;
+
+        readonly long[] counts = new long[bucketCount];
+        long privateSum;
+        long privateMax;
+
+        /// <summary>
+        /// Records one duration, in Stopwatch ticks.
+        /// </summary>
+        public void record(long ticks)
+        {
+            if (ticks < 0)
+            {
+                ticks = 0;
+            }
+
+            Interlocked.Increment(ref counts[bucketIndex(ticks)]);
+            Interlocked.Add(ref privateSum, ticks);
+
+            // A torn read of the maximum on a 32-bit computer only costs an
+            // extra trip around the loop, because the exchange checks it.
+            long max = privateMax;
+            while (ticks > max)
+            {
+                long seen = Interlocked.CompareExchange(ref privateMax, ticks, max);
+                if (seen == max)
+                {
+                    break;
+                }
+                max = seen;
+            }
+        }
+
+        static int bucketIndex(long value)
+        {
+            if (value >= 1L << maxValueBits)
+            {
+                value = (1L << maxValueBits) - 1;
+            }
+
+            // The shift is the number of low bits that do not fit in the
+            // sub-bucket, so (value >> shift) is between 16 and 31 except for
+            // the smallest values, which get a bucket each.
+            int shift = mostSignificantBit(value) - subBucketBits;
+            if (shift < 0)
+            {
+                shift = 0;
+            }
+            return (shift << subBucketBits) + (int)(value >> shift);
+        }
+
+        /// <summary>
+        /// Returns the largest value that is recorded in the given bucket.
+        /// </summary>
+        static long bucketHighestValue(int index)
+        {
+            int shift = (index >> subBucketBits) - 1;
+            if (shift < 0)
+            {
+                shift = 0;
+            }
+            long subBucket = index - (shift << subBucketBits);
+            return ((subBucket + 1) << shift) - 1;
+        }
+
+        static int mostSignificantBit(long value)
+        {
+            int bit = 0;
+            if (value >= 1L << 32) { value >>= 32; bit += 32; }
+            if (value >= 1L << 16) { value >>= 16; bit += 16; }
+            if (value >= 1L << 8) { value >>= 8; bit += 8; }
+            if (value >= 1L << 4) { value >>= 4; bit += 4; }
+            if (value >= 1L << 2) { value >>= 2; bit += 2; }
+            if (value >= 1L << 1) { bit += 1; }
+            return bit;
+        }
+
+        static double ticksToMicroseconds(long ticks)
+        {
+            return ticks * 1000000.0 / Stopwatch.Frequency;
+        }
+
+        /// <summary>
+        /// Adds the counts from another histogram to this one.
+        /// </summary>
+        internal void add(LatencyHistogram other)
+        {
+            for (int i = 0; i < bucketCount; i++)
+            {
+                Interlocked.Add(ref counts[i], Interlocked.Read(ref other.counts[i]));
+            }
+            Interlocked.Add(ref privateSum, Interlocked.Read(ref other.privateSum));
+            privateMax = Math.Max(privateMax, Interlocked.Read(ref other.privateMax));
+        }
+
+        /// <summary>
+        /// The number of durations recorded.
+        /// </summary>
+        public long count
+        {
+            get
+            {
+                long total = 0;
+                for (int i = 0; i < bucketCount; i++)
+                {
+                    total += Interlocked.Read(ref counts[i]);
+                }
+                return total;
+            }
+        }
+
+        /// <summary>
+        /// The mean duration in microseconds, or 0 if nothing was recorded.
+        /// </summary>
+        public double mean
+        {
+            get
+            {
+                long n = count;
+                if (n == 0)
+                {
+                    return 0;
+                }
+                return ticksToMicroseconds(Interlocked.Read(ref privateSum)) / n;
+            }
+        }
+
+        /// <summary>
+        /// The longest duration in microseconds.
+        /// </summary>
+        public double max
+        {
+            get { return ticksToMicroseconds(Interlocked.Read(ref privateMax)); }
+        }
+
+        /// <summary>
+        /// Returns the duration, in microseconds, that the given percentage
+        /// of the recorded durations were less than or equal to.
+        /// </summary>
+        /// <param name="percentile">A number from 0 to 100, e.g. 99 for the 99th percentile.</param>
+        public double getPercentile(double percentile)
+        {
+            long[] snapshot = new long[bucketCount];
+            long total = 0;
+            for (int i = 0; i < bucketCount; i++)
+            {
+                snapshot[i] = Interlocked.Read(ref counts[i]);
+                total += snapshot[i];
+            }
+            if (total == 0)
+            {
+                return 0;
+            }
+
+            long rank = (long)Math.Ceiling(Math.Max(0, Math.Min(100, percentile)) / 100 * total);
+            if (rank < 1)
+            {
+                rank = 1;
+            }
+
+            long seen = 0;
+            for (int i = 0; i < bucketCount; i++)
+            {
+                seen += snapshot[i];
+                if (seen >= rank)
+                {
+                    // Never report more than the largest value recorded.
+                    return Math.Min(ticksToMicroseconds(bucketHighestValue(i)), max);
+                }
+            }
+            return max;
+        }
+
+        /// <summary>
+        /// Sets all the counts to zero.
+        /// </summary>
+        public void clear()
+        {
+            for (int i = 0; i < bucketCount; i++)
+            {
+                Interlocked.Exchange(ref counts[i], 0);
+            }
+            Interlocked.Exchange(ref privateSum, 0);
+            Interlocked.Exchange(ref privateMax, 0);
+        }
+    }
+
+    /// <summary>
+    /// Counts the control transfers of one kind (or of all kinds) sent to a
+    /// device: how many there were, how many bytes they carried, which
+    /// errors they had, and how long they took.
+    /// </summary>
+    public class TransferCounters
+    {
+        /// <summary>
+        /// The error codes that have their own counters.  Any other code is
+        /// counted as UsbStatus.Other.
+        /// </summary>
+        static readonly int[] errorCodes = new int[] {
+            UsbStatus.IOError, UsbStatus.InvalidParameter, UsbStatus.AccessDenied,
+            UsbStatus.NoDevice, UsbStatus.NotFound, UsbStatus.Busy, UsbStatus.Timeout,
+            UsbStatus.Overflow, UsbStatus.Pipe, UsbStatus.Interrupted, UsbStatus.NoMemory,
+            UsbStatus.NotSupported, UsbStatus.Other, UsbStatus.ShortTransfer
+        };
+
+        long privateBytes;
+        readonly long[] errorCounts = new long[errorCodes.Length];
+        readonly LatencyHistogram privateLatency = new LatencyHistogram();
+
+        /// <summary>
+        /// Records a finished transfer.
+        /// </summary>
+        /// <param name="result">The number of bytes transferred, or a negative UsbStatus code.</param>
+        /// <param name="ticks">How long the transfer took, in Stopwatch ticks.</param>
+        internal void record(int result, long ticks)
+        {
+            if (result > 0)
+            {
+                Interlocked.Add(ref privateBytes, result);
+            }
+            else if (result < 0)
+            {
+                Interlocked.Increment(ref errorCounts[errorIndex(result)]);
+            }
+            privateLatency.record(ticks);
+        }
+
+        /// <summary>
+        /// Adds the counts from other counters to these ones.
+        /// </summary>
+        internal void add(TransferCounters other)
+        {
+            Interlocked.Add(ref privateBytes, other.bytes);
+            for (int i = 0; i < errorCounts.Length; i++)
+            {
+                Interlocked.Add(ref errorCounts[i], Interlocked.Read(ref other.errorCounts[i]));
+            }
+            privateLatency.add(other.privateLatency);
+        }
+
+        static int errorIndex(int status)
+        {
+            if (status >= UsbStatus.NotSupported)
+            {
+                // IOError (-1) through NotSupported (-12).
+                return -status - 1;
+            }
+            if (status == UsbStatus.ShortTransfer)
+            {
+                return errorCodes.Length - 1;
+            }
+            return errorCodes.Length - 2;
+        }
+
+        /// <summary>
+        /// The number of transfers, including failed ones.
+        /// </summary>
+        public long transfers
+        {
+            get { return privateLatency.count; }
+        }
+
+        /// <summary>
+        /// The number of bytes transferred in the data stages of successful transfers.
+        /// </summary>
+        public long bytes
+        {
+            get { return Interlocked.Read(ref privateBytes); }
+        }
+
+        /// <summary>
+        /// The number of transfers that failed.
+        /// </summary>
+        public long errors
+        {
+            get
+            {
+                long total = 0;
+                for (int i = 0; i < errorCounts.Length; i++)
+                {
+                    total += Interlocked.Read(ref errorCounts[i]);
+                }
+                return total;
+            }
+        }
+
+        /// <summary>
+        /// The durations of the transfers, including failed ones.
+        /// </summary>
+        public LatencyHistogram latency
+        {
+            get { return privateLatency; }
+        }
+
+        /// <summary>
+        /// Returns the number of transfers that failed with the given UsbStatus code.
+        /// </summary>
+        public long getErrorCount(int status)
+        {
+            if (status >= 0)
+            {
+                return 0;
+            }
+            return Interlocked.Read(ref errorCounts[errorIndex(status)]);
+        }
+
+        /// <summary>
+        /// Returns the UsbStatus codes of the errors that have occurred.
+        /// </summary>
+        public IList<int> getErrorCodes()
+        {
+            List<int> list = new List<int>();
+            for (int i = 0; i < errorCodes.Length; i++)
+            {
+                if (Interlocked.Read(ref errorCounts[i]) != 0)
+                {
+                    list.Add(errorCodes[i]);
+                }
+            }
+            return list;
+        }
+
+        /// <summary>
+        /// Sets all the counters to zero.
+        /// </summary>
+        public void clear()
+        {
+            Interlocked.Exchange(ref privateBytes, 0);
+            for (int i = 0; i < errorCounts.Length; i++)
+            {
+                Interlocked.Exchange(ref errorCounts[i], 0);
+            }
+            privateLatency.clear();
+        }
+    }
+
+    /// <summary>
+    /// Statistics about the control transfers sent to one device, in total
+    /// and for each request code (bRequest).
+    /// </summary>
+    /// <remarks>
+    /// Every UsbDevice object for the same physical device shares one
+    /// TransferStatistics object, so the numbers include all connections made
+    /// to the device since the program started.  Recording a transfer takes
+    /// two or three Interlocked operations and does not take any locks; the
+    /// first transfer with each request code allocates the counters for that
+    /// code.  The totals are added up when they are read.
+    /// </remarks>
+    public class TransferStatistics
+    {
+        static readonly Dictionary<String, TransferStatistics> devices = new Dictionary<String, TransferStatistics>();
+
+        /// <summary>
+        /// The same objects as in devices, in order of their IDs.
+        /// </summary>
+        static readonly List<TransferStatistics> deviceList = new List<TransferStatistics>();
+
+        static bool privateEnabled = true;
+
+        /// <summary>
+        /// Set this to false to stop recording statistics.  The default is true.
+        /// </summary>
+        public static bool enabled
+        {
+            get { return privateEnabled; }
+            set { privateEnabled = value; }
+        }
+
+        /// <summary>
+        /// Returns the statistics object for the device with the given
+        /// product ID and serial number, creating it if necessary.
+        /// </summary>
+        internal static TransferStatistics forDevice(UInt16 productId, String serialNumber)
+        {
+            String key = productId.ToString("X4") + "#" + serialNumber;
+            lock (devices)
+            {
+                TransferStatistics statistics;
+                if (!devices.TryGetValue(key, out statistics))
+                {
+                    statistics = new TransferStatistics(deviceList.Count, productId, serialNumber);
+                    devices[key] = statistics;
+                    deviceList.Add(statistics);
+                }
+                return statistics;
+            }
+        }
+
+        /// <summary>
+        /// Returns the statistics of every device that has been connected to.
+        /// </summary>
+        public static IList<TransferStatistics> getAll()
+        {
+            lock (devices)
+            {
+                return new List<TransferStatistics>(deviceList);
+            }
+        }
+
+        /// <summary>
+        /// Returns the statistics object with the given ID.
+        /// </summary>
+        internal static TransferStatistics getById(int id)
+        {
+            lock (devices)
+            {
+                return deviceList[id];
+            }
+        }
+
+        /// <summary>
+        /// A small number that identifies the device in trace files.
+        /// </summary>
+        internal readonly int id;
+
+        readonly UInt16 privateProductId;
+        readonly String privateSerialNumber;
+        readonly TransferCounters[] requests = new TransferCounters[256];
+
+        TransferStatistics(int id, UInt16 productId, String serialNumber)
+        {
+            this.id = id;
+            privateProductId = productId;
+            privateSerialNumber = serialNumber;
+        }
+
+        /// <summary>
+        /// The product ID of the device.
+        /// </summary>
+        public UInt16 productId
+        {
+            get { return privateProductId; }
+        }
+
+        /// <summary>
+        /// The serial number of the device.
+        /// </summary>
+        public String serialNumber
+        {
+            get { return privateSerialNumber; }
+        }
+
+        /// <summary>
+        /// Returns the counters for all transfers to the device.  This is
+        /// a snapshot: it is not updated by later transfers.
+        /// </summary>
+        public TransferCounters getTotal()
+        {
+            TransferCounters total = new TransferCounters();
+            foreach (TransferCounters counters in requests)
+            {
+                if (counters != null)
+                {
+                    total.add(counters);
+                }
+            }
+            return total;
+        }
+
+        /// <summary>
+        /// Returns the counters for transfers with the given request code, or
+        /// null if there have been no such transfers.
+        /// </summary>
+        public TransferCounters getRequest(byte request)
+        {
+            return requests[request];
+        }
+
+        /// <summary>
+        /// Returns the request codes that have been used, in increasing order.
+        /// </summary>
+        public IList<byte> getRequestCodes()
+        {
+            List<byte> list = new List<byte>();
+            for (int i = 0; i < requests.Length; i++)
+            {
+                if (requests[i] != null)
+                {
+                    list.Add((byte)i);
+                }
+            }
+            return list;
+        }
+
+        /// <summary>
+        /// Records a finished transfer.
+        /// </summary>
+        /// <param name="request">The bRequest field of the transfer.</param>
+        /// <param name="result">The number of bytes transferred, or a negative UsbStatus code.</param>
+        /// <param name="ticks">How long the transfer took, in Stopwatch ticks.</param>
+        internal void record(byte request, int result, long ticks)
+        {
+            TransferCounters counters = requests[request];
+            if (counters == null)
+            {
+                Interlocked.CompareExchange(ref requests[request], new TransferCounters(), null);
+                counters = requests[request];
+            }
+            counters.record(result, ticks);
+        }
+
+        /// <summary>
+        /// Sets all the counters to zero.
+        /// </summary>
+        public void clear()
+        {
+            foreach (TransferCounters counters in requests)
+            {
+                if (counters != null)
+                {
+                    counters.clear();
+                }
+            }
+        }
+
+        /// <summary>
+        /// Writes a table of the statistics, one line per request code.
+        /// Durations are in microseconds.
+        /// </summary>
+        public void writeReport(TextWriter writer)
+        {
+            writer.WriteLine("Transfer statistics for #" + serialNumber + ":");
+            writer.WriteLine("request  transfers      bytes   errors     mean      p50      p99      max");
+            foreach (byte request in getRequestCodes())
+            {
+                writeLine(writer, "0x" + request.ToString("X2"), requests[request]);
+            }
+            TransferCounters total = getTotal();
+            writeLine(writer, "total", total);
+
+            foreach (int code in total.getErrorCodes())
+            {
+                writer.WriteLine("{0,8} {1}", total.getErrorCount(code), UsbStatus.describe(code));
+            }
+        }
+
+        static void writeLine(TextWriter writer, String name, TransferCounters counters)
+        {
+            LatencyHistogram latency = counters.latency;
+            writer.WriteLine("{0,-7}{1,11}{2,11}{3,9}{4,9:0.0}{5,9:0.0}{6,9:0.0}{7,9:0.0}",
+                name, counters.transfers, counters.bytes, counters.errors,
+                latency.mean, latency.getPercentile(50), latency.getPercentile(99), latency.max);
+        }
+    }
+}
+
+// Local Variables: **
+// mode: java **
+// c-basic-offset: 4 **
+// tab-width: 4 **
+// indent-tabs-mode: nil **
+// end: **
@@ -0,0 +1,613 @@
+// UsbWrapper_Shared/TransferTracer.cs:
+//   Records every control transfer to a binary trace file, and converts
+//   trace files to the Chrome trace event format.
+
+using System;
+using System.Collections.Generic;
+using System.Diagnostics;
+using System.Globalization;
+using System.IO;
+using System.Text;
+using System.Threading;
+
+namespace Pololu.UsbWrapper
+{
+    /// <summary>
+    /// Records every control transfer sent by any UsbDevice in to a trace
+    /// file: the setup packet, the length, the result, the thread, and the
+    /// times when the transfer was submitted and completed.  Tracing is off
+    /// until start() is called.
+    /// </summary>
+    /// <remarks>
+    /// <para>
+    /// Each thread that sends transfers gets its own ring buffer, so recording
+    /// a transfer only copies a few numbers in to memory that no other thread
+    /// writes to: it takes no locks, does no I/O, and does not allocate
+    /// memory (except once per thread for the buffer).  A background thread
+    /// empties the buffers in to the file every flushInterval milliseconds.
+    /// If a buffer fills up before then, new events are dropped and the number
+    /// of dropped events is recorded in the file instead.
+    /// </para>
+    /// <para>
+    /// A transfer is recorded twice: once when it is submitted and again
+    /// when it completes.  The submit event reaches the file within one
+    /// flushInterval, so a transfer that never completes (because the
+    /// device stopped answering, or the program hung or was killed) still
+    /// shows up in the trace, and the transfers that were in flight at any
+    /// moment can be found.  This costs a second copy in to the ring buffer
+    /// per transfer.
+    /// </para>
+    /// <para>
+    /// Use convertToChromeTrace to view a trace file in chrome://tracing or
+    /// Perfetto, with one row per thread and one group of rows per device.
+    /// Transfers that were submitted but not completed are shown up to the
+    /// end of the trace.
+    /// </para>
+    /// </remarks>
+    public static class TransferTracer
+    {
+        /// <summary>
+        /// One transfer, as stored in a ring buffer.
+        /// </summary>
+        struct TraceEvent
+        {
+            /// <summary>
+            /// recordSubmit or recordTransfer.
+            /// </summary>
+            public byte type;
+            public long submitted;
+            public long completed;
+            public int device;
+            public int result;
+            public ushort value;
+            public ushort index;
+            public ushort length;
+            public byte requestType;
+            public byte request;
+        }
+
+        /// <summary>
+        /// A ring buffer that one thread writes events in to and the
+        /// background thread reads them from.
+        /// </summary>
+        class RingBuffer
+        {
+            public readonly TraceEvent[] events;
+            public readonly int threadId;
+            public readonly Thread thread;
+
+            /// <summary>
+            /// The number of events written.  Only the owning thread changes it.
+            /// </summary>
+            public long head;
+
+            /// <summary>
+            /// The number of events read.  Only the background thread changes it.
+            /// </summary>
+            public long tail;
+
+            /// <summary>
+            /// The number of events that did not fit.  Only the owning thread changes it.
+            /// </summary>
+            public long dropped;
+
+            /// <summary>
+            /// The value of dropped that was last written to the file.
+            /// </summary>
+            public long droppedReported;
+
+            public RingBuffer(int size)
+            {
+                events = new TraceEvent[size];
+                thread = Thread.CurrentThread;
+                threadId = thread.ManagedThreadId;
+            }
+        }
+
+        // Record types in the trace file.
+        const byte recordDevice = 1;
+        const byte recordTransfer = 2;
+        const byte recordDropped = 3;
+        const byte recordSubmit = 4;
+        const byte recordTime = 5;
+
+        static readonly byte[] magic = Encoding.ASCII.GetBytes("PLTR");
+        const ushort fileVersion = 2;
+
+        static volatile bool privateTracing;
+
+        /// <summary>
+        /// Incremented every time tracing starts, so that threads notice
+        /// that the buffer they had belongs to an earlier trace.
+        /// </summary>
+        static int generation;
+
+        [ThreadStatic]
+        static RingBuffer threadBuffer;
+
+        [ThreadStatic]
+        static int threadBufferGeneration;
+
+        /// <summary>
+        /// Lock for the list of buffers.
+        /// </summary>
+        static readonly object sync = new object();
+
+        /// <summary>
+        /// Lock held while starting and stopping, so they can not overlap.
+        /// </summary>
+        static readonly object startStopSync = new object();
+        static readonly List<RingBuffer> buffers = new List<RingBuffer>();
+        static Thread writerThread;
+        static AutoResetEvent wakeWriter;
+        static volatile bool stopping;
+        static BinaryWriter writer;
+        static long startTimestamp;
+        static bool[] devicesWritten;
+        static int privateBufferSize = 4096;
+        static int privateFlushInterval = 100;
+
+        /// <summary>
+        /// True if transfers are being traced.
+        /// </summary>
+        public static bool tracing
+        {
+            get { return privateTracing; }
+        }
+
+        /// <summary>
+        /// The number of transfers each thread's ring buffer can hold.  Must
+        /// be a power of two.  Changes take effect the next time tracing
+        /// starts.  The default is 4096.
+        /// </summary>
+        public static int bufferSize
+        {
+            get { return privateBufferSize; }
+            set
+            {
+                if (value <= 0 || (value & (value - 1)) != 0)
+                {
+                    throw new ArgumentException("The buffer size must be a power of two.");
+                }
+                privateBufferSize = value;
+            }
+        }
+
+        /// <summary>
+        /// How often, in milliseconds, the background thread writes the
+        /// buffered events to the file.  The default is 100.
+        /// </summary>
+        public static int flushInterval
+        {
+            get { return privateFlushInterval; }
+            set { privateFlushInterval = Math.Max(1, value); }
+        }
+
+        /// <summary>
+        /// Starts recording transfers in to a new trace file.
+        /// </summary>
+        public static void start(String fileName)
+        {
+            lock (startStopSync)
+            {
+                if (privateTracing)
+                {
+                    throw new InvalidOperationException("Transfers are already being traced.");
+                }
+
+                FileStream stream = new FileStream(fileName, FileMode.Create, FileAccess.Write, FileShare.Read, 65536);
+                writer = new BinaryWriter(stream);
+                startTimestamp = Stopwatch.GetTimestamp();
+                writer.Write(magic);
+                writer.Write(fileVersion);
+                writer.Write(Stopwatch.Frequency);
+                writer.Write(DateTime.UtcNow.Ticks);
+
+                devicesWritten = new bool[16];
+                stopping = false;
+                wakeWriter = new AutoResetEvent(false);
+
+                writerThread = new Thread(writeLoop);
+                writerThread.IsBackground = true;
+                writerThread.Name = "TransferTracer";
+                writerThread.Start();
+
+                lock (sync)
+                {
+                    buffers.Clear();
+                    generation++;
+                    privateTracing = true;
+                }
+            }
+        }
+
+        /// <summary>
+        /// Stops tracing, writes everything that is buffered, and closes the
+        /// trace file.  Transfers that are in progress on other threads
+        /// when this is called might not be recorded, or might be recorded
+        /// as submitted but not completed.
+        /// </summary>
+        public static void stop()
+        {
+            lock (startStopSync)
+            {
+                if (!privateTracing)
+                {
+                    return;
+                }
+                lock (sync)
+                {
+                    privateTracing = false;
+                }
+                stopping = true;
+                wakeWriter.Set();
+                writerThread.Join();
+                writerThread = null;
+                wakeWriter.Close();
+                writer.Close();
+                writer = null;
+            }
+        }
+
+        /// <summary>
+        /// Called by UsbDevice just before a transfer is submitted.
+        /// </summary>
+        internal static void submit(int device, byte requestType, byte request, ushort value, ushort index, ushort length, long submitted)
+        {
+            add(recordSubmit, device, requestType, request, value, index, length, 0, submitted, 0);
+        }
+
+        /// <summary>
+        /// Called by UsbDevice when a transfer is complete.
+        /// </summary>
+        internal static void record(int device, byte requestType, byte request, ushort value, ushort index, ushort length, int result, long submitted, long completed)
+        {
+            add(recordTransfer, device, requestType, request, value, index, length, result, submitted, completed);
+        }
+
+        static void add(byte type, int device, byte requestType, byte request, ushort value, ushort index, ushort length, int result, long submitted, long completed)
+        {
+            RingBuffer buffer = threadBuffer;
+            if (buffer == null || threadBufferGeneration != generation)
+            {
+                buffer = newThreadBuffer();
+                if (buffer == null)
+                {
+                    return;
+                }
+            }
+
+            long head = buffer.head;
+            if (head - Thread.VolatileRead(ref buffer.tail) >= buffer.events.Length)
+            {
+                buffer.dropped++;
+                return;
+            }
+
+            int i = (int)head & (buffer.events.Length - 1);
+            buffer.events[i].type = type;
+            buffer.events[i].submitted = submitted;
+            buffer.events[i].completed = completed;
+            buffer.events[i].device = device;
+            buffer.events[i].result = result;
+            buffer.events[i].value = value;
+            buffer.events[i].index = index;
+            buffer.events[i].length = length;
+            buffer.events[i].requestType = requestType;
+            buffer.events[i].request = request;
+
+            // Publish the event after its fields are written.
+            Thread.VolatileWrite(ref buffer.head, head + 1);
+        }
+
+        static RingBuffer newThreadBuffer()
+        {
+            lock (sync)
+            {
+                if (!privateTracing)
+                {
+                    return null;
+                }
+                RingBuffer buffer = new RingBuffer(privateBufferSize);
+                buffers.Add(buffer);
+                threadBuffer = buffer;
+                threadBufferGeneration = generation;
+                return buffer;
+            }
+        }
+
+        static void writeLoop()
+        {
+            while (!stopping)
+            {
+                wakeWriter.WaitOne(privateFlushInterval, false);
+                drain();
+            }
+            drain();
+            writer.Flush();
+        }
+
+        /// <summary>
+        /// Moves the events from all the ring buffers to the file.
+        /// Runs on the background thread.
+        /// </summary>
+        static void drain()
+        {
+            RingBuffer[] snapshot;
+            lock (sync)
+            {
+                snapshot = buffers.ToArray();
+            }
+
+            foreach (RingBuffer buffer in snapshot)
+            {
+                long head = Thread.VolatileRead(ref buffer.head);
+                long tail = buffer.tail;
+                int mask = buffer.events.Length - 1;
+                for (; tail < head; tail++)
+                {
+                    writeEvent(buffer.threadId, ref buffer.events[(int)tail & mask]);
+                }
+                Thread.VolatileWrite(ref buffer.tail, tail);
+
+                long dropped = Thread.VolatileRead(ref buffer.dropped);
+                if (dropped != buffer.droppedReported)
+                {
+                    writer.Write(recordDropped);
+                    writer.Write(buffer.threadId);
+                    writer.Write(Stopwatch.GetTimestamp() - startTimestamp);
+                    writer.Write(dropped - buffer.droppedReported);
+                    buffer.droppedReported = dropped;
+                }
+
+                if (!buffer.thread.IsAlive && tail == Thread.VolatileRead(ref buffer.head))
+                {
+                    lock (sync)
+                    {
+                        buffers.Remove(buffer);
+                    }
+                }
+            }
+
+            // Record how far the trace reaches, so a transfer that is still
+            // in flight can be shown lasting at least this long.
+            writer.Write(recordTime);
+            writer.Write(Stopwatch.GetTimestamp() - startTimestamp);
+            writer.Flush();
+        }
+
+        static void writeEvent(int threadId, ref TraceEvent e)
+        {
+            if (e.device >= devicesWritten.Length)
+            {
+                Array.Resize(ref devicesWritten, Math.Max(e.device + 1, devicesWritten.Length * 2));
+            }
+            if (!devicesWritten[e.device])
+            {
+                TransferStatistics device = TransferStatistics.getById(e.device);
+                writer.Write(recordDevice);
+                writer.Write(e.device);
+                writer.Write(device.productId);
+                writer.Write(device.serialNumber ?? "");
+                devicesWritten[e.device] = true;
+            }
+
+            writer.Write(e.type);
+            writer.Write(e.device);
+            writer.Write(threadId);
+            writer.Write(e.submitted - startTimestamp);
+            if (e.type == recordTransfer)
+            {
+                writer.Write(e.completed - e.submitted);
+            }
+            writer.Write(e.requestType);
+            writer.Write(e.request);
+            writer.Write(e.value);
+            writer.Write(e.index);
+            writer.Write(e.length);
+            if (e.type == recordTransfer)
+            {
+                writer.Write(e.result);
+            }
+        }
+
+        /// <summary>
+        /// A transfer read from a trace file.
+        /// </summary>
+        class TracedTransfer
+        {
+            public int device;
+            public int threadId;
+            public long submitted;
+            public byte requestType;
+            public byte request;
+            public ushort value;
+            public ushort index;
+            public ushort length;
+        }
+
+        /// <summary>
+        /// Converts a trace file to a JSON file in the Chrome trace event
+        /// format.
+        /// </summary>
+        public static void convertToChromeTrace(String traceFileName, String jsonFileName)
+        {
+            using (FileStream input = File.OpenRead(traceFileName))
+            using (StreamWriter output = new StreamWriter(jsonFileName, false, new UTF8Encoding(false)))
+            {
+                convertToChromeTrace(input, output);
+            }
+        }
+
+        /// <summary>
+        /// Converts a trace file to the Chrome trace event format.  Each
+        /// device is shown as a process and each thread that used it as a
+        /// thread of that process.  Times are in microseconds from the start
+        /// of the trace.  A transfer that was submitted but never completed
+        /// lasts until the end of the trace and has "completed":false
+        /// in its args.
+        /// </summary>
+        public static void convertToChromeTrace(Stream input, TextWriter output)
+        {
+            BinaryReader reader = new BinaryReader(input);
+            byte[] header = reader.ReadBytes(magic.Length);
+            if (header.Length != magic.Length || Encoding.ASCII.GetString(header) != "PLTR")
+            {
+                throw new Exception("The file is not a transfer trace file.");
+            }
+            ushort version = reader.ReadUInt16();
+            if (version != 1 && version != fileVersion)
+            {
+                throw new Exception("Unsupported trace file version " + version + ".");
+            }
+            long frequency = reader.ReadInt64();
+            DateTime startTime = new DateTime(reader.ReadInt64(), DateTimeKind.Utc);
+
+            output.Write("{\"displayTimeUnit\":\"ns\",\"otherData\":{\"startTime\":\"" +
+                startTime.ToString("yyyy-MM-ddTHH:mm:ss.fffffffZ", CultureInfo.InvariantCulture) +
+                "\"},\"traceEvents\":[");
+            bool first = true;
+
+            // The transfer each thread has submitted but not yet completed.
+            // A thread waits for each transfer, so it has at most one.
+            Dictionary<int, TracedTransfer> inFlight = new Dictionary<int, TracedTransfer>();
+            long end = 0;
+
+            while (input.Position < input.Length)
+            {
+                byte type = reader.ReadByte();
+                String line;
+                switch (type)
+                {
+                    case recordDevice:
+                    {
+                        int device = reader.ReadInt32();
+                        ushort productId = reader.ReadUInt16();
+                        String serialNumber = reader.ReadString();
+                        line = "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" + device +
+                            ",\"args\":{\"name\":\"#" + jsonEscape(serialNumber) + " (0x" + productId.ToString("X4") + ")\"}}";
+                        break;
+                    }
+
+                    case recordTransfer:
+                    {
+                        int device = reader.ReadInt32();
+                        int threadId = reader.ReadInt32();
+                        long submitted = reader.ReadInt64();
+                        long duration = reader.ReadInt64();
+                        byte requestType = reader.ReadByte();
+                        byte request = reader.ReadByte();
+                        ushort value = reader.ReadUInt16();
+                        ushort index = reader.ReadUInt16();
+                        ushort length = reader.ReadUInt16();
+                        int result = reader.ReadInt32();
+                        inFlight.Remove(threadId);
+                        end = Math.Max(end, submitted + duration);
+                        line = transferEvent(device, threadId, submitted, duration, requestType, request, value, index, length, frequency) +
+                            ",\"result\":" + result +
+                            (result < 0 ? ",\"error\":\"" + jsonEscape(UsbStatus.describe(result)) + "\"" : "") + "}}";
+                        break;
+                    }
+
+                    case recordSubmit:
+                    {
+                        TracedTransfer transfer = new TracedTransfer();
+                        transfer.device = reader.ReadInt32();
+                        transfer.threadId = reader.ReadInt32();
+                        transfer.submitted = reader.ReadInt64();
+                        transfer.requestType = reader.ReadByte();
+                        transfer.request = reader.ReadByte();
+                        transfer.value = reader.ReadUInt16();
+                        transfer.index = reader.ReadUInt16();
+                        transfer.length = reader.ReadUInt16();
+                        inFlight[transfer.threadId] = transfer;
+                        end = Math.Max(end, transfer.submitted);
+                        continue;
+                    }
+
+                    case recordTime:
+                    {
+                        end = Math.Max(end, reader.ReadInt64());
+                        continue;
+                    }
+
+                    case recordDropped:
+                    {
+                        int threadId = reader.ReadInt32();
+                        long time = reader.ReadInt64();
+                        long count = reader.ReadInt64();
+                        end = Math.Max(end, time);
+                        line = "{\"name\":\"" + count + " transfers not recorded\",\"ph\":\"i\",\"s\":\"g\",\"pid\":0,\"tid\":" + threadId +
+                            ",\"ts\":" + microseconds(time, frequency) + "}";
+                        break;
+                    }
+
+                    default:
+                        throw new Exception("Unknown record type " + type + " in trace file.");
+                }
+
+                output.Write(first ? "\n" : ",\n");
+                output.Write(line);
+                first = false;
+            }
+
+            foreach (TracedTransfer t in inFlight.Values)
+            {
+                output.Write(first ? "\n" : ",\n");
+                output.Write(transferEvent(t.device, t.threadId, t.submitted, end - t.submitted,
+                    t.requestType, t.request, t.value, t.index, t.length, frequency) + ",\"completed\":false}}");
+                first = false;
+            }
+
+            output.WriteLine("\n]}");
+        }
+
+        /// <summary>
+        /// Returns the start of the JSON object for a transfer, up to the
+        /// end of the setup packet in its args.
+        /// </summary>
+        static String transferEvent(int device, int threadId, long submitted, long duration, byte requestType, byte request, ushort value, ushort index, ushort length, long frequency)
+        {
+            return "{\"name\":\"0x" + request.ToString("X2") + "\",\"cat\":\"usb\",\"ph\":\"X\",\"pid\":" + device +
+                ",\"tid\":" + threadId +
+                ",\"ts\":" + microseconds(submitted, frequency) +
+                ",\"dur\":" + microseconds(duration, frequency) +
+                ",\"args\":{\"bmRequestType\":\"0x" + requestType.ToString("X2") +
+                "\",\"wValue\":" + value + ",\"wIndex\":" + index + ",\"wLength\":" + length;
+        }
+
+        static String microseconds(long ticks, long frequency)
+        {
+            return (ticks * 1000000.0 / frequency).ToString("0.###", CultureInfo.InvariantCulture);
+        }
+
+        static String jsonEscape(String text)
+        {
+            StringBuilder builder = new StringBuilder();
+            foreach (char c in text)
+            {
+                if (c == '"' || c == '\\')
+                {
+                    builder.Append('\\');
+                    builder.Append(c);
+                }
+                else if (c < ' ')
+                {
+                    builder.Append("\\u" + ((int)c).ToString("x4"));
+                }
+                else
+                {
+                    builder.Append(c);
+                }
+            }
+            return builder.ToString();
+        }
+    }
+}
+
+// Local Variables: **
+// mode: java **
+// c-basic-offset: 4 **
+// tab-width: 4 **
+// indent-tabs-mode: nil **
+// end: **
@@ -0,0 +1,477 @@
+// UsbWrapper_Shared/UsbFleet.cs:
+//   Runs the work for many devices on one thread per USB bus, so that a
+//   busy bus does not slow down the devices on the others.
+
+using System;
+using System.Collections.Generic;
+using System.Diagnostics;
+using System.Threading;
+
+namespace Pololu.UsbWrapper
+{
+    /// <summary>
+    /// Connects to a device, for example
+    /// delegate(DeviceListItem item) { return new Usc(item); }.
+    /// </summary>
+    public delegate UsbDevice UsbDeviceFactory(DeviceListItem item);
+
+    /// <summary>
+    /// Work to do with a device in a UsbFleet.  The device is the object
+    /// returned by the UsbDeviceFactory it was added with.
+    /// </summary>
+    public delegate void UsbDeviceWork(UsbDevice device);
+
+    /// <summary>
+    /// A piece of work given to a UsbFleet, which can be waited for.
+    /// </summary>
+    public class UsbFleetRequest
+    {
+        internal readonly UsbDeviceWork work;
+        readonly ManualResetEvent done = new ManualResetEvent(false);
+        Exception privateError;
+
+        internal UsbFleetRequest(UsbDeviceWork work)
+        {
+            this.work = work;
+        }
+
+        internal void complete(Exception error)
+        {
+            privateError = error;
+            done.Set();
+        }
+
+        /// <summary>
+        /// True when the work has been done or has failed.
+        /// </summary>
+        public bool isCompleted
+        {
+            get { return done.WaitOne(0, false); }
+        }
+
+        /// <summary>
+        /// The exception thrown by the work (or by connecting to the
+        /// device), or null if it succeeded or is not done yet.
+        /// </summary>
+        public Exception error
+        {
+            get { return isCompleted ? privateError : null; }
+        }
+
+        /// <summary>
+        /// Waits for the work to be done.
+        /// </summary>
+        /// <param name="timeout">The most time to wait, in milliseconds, or -1 to wait as long as it takes.</param>
+        /// <returns>True if the work was done, false if the time ran out.</returns>
+        public bool wait(int timeout)
+        {
+            return done.WaitOne(timeout, false);
+        }
+    }
+
+    /// <summary>
+    /// The statistics of one bus in a UsbFleet.
+    /// </summary>
+    public class UsbFleetBus
+    {
+        /// <summary>
+        /// The DeviceListItem.busId of the devices on the bus.
+        /// </summary>
+        public Int32 busId;
+
+        /// <summary>
+        /// The number of devices on the bus.
+        /// </summary>
+        public int deviceCount;
+
+        /// <summary>
+        /// The number of requests that were done, including failed ones.
+        /// </summary>
+        public long completed;
+
+        /// <summary>
+        /// The number of requests that threw an exception.
+        /// </summary>
+        public long failed;
+
+        /// <summary>
+        /// The number of requests waiting to be done.
+        /// </summary>
+        public int queued;
+
+        /// <summary>
+        /// The time the bus's worker spent doing requests, in milliseconds.
+        /// </summary>
+        public double busyTime;
+    }
+
+    /// <summary>
+    /// Does the USB work for a large number of devices with one worker
+    /// thread per USB bus.
+    /// </summary>
+    /// <remarks>
+    /// <para>
+    /// Devices on the same bus share its bandwidth, so a bus that is
+    /// saturated by some of its devices slows all of them down.  When a
+    /// program calls the devices from its own threads, that also slows down
+    /// the devices on other buses.  A UsbFleet groups the devices by
+    /// DeviceListItem.busId and gives each bus a worker thread that does
+    /// all the transfers for the devices on that bus, in the order the
+    /// requests were posted.  The buses then work in parallel, so the
+    /// throughput grows with the number of buses, and the work on one
+    /// bus is never held up by another.
+    /// </para>
+    /// <para>
+    /// On Linux, each worker has a libusb context of its own, and its
+    /// devices are opened in that context, so each bus handles its own
+    /// events instead of all of them sharing the library's context.  The
+    /// workers are ordinary threads, so the operating system spreads them
+    /// over the processors.
+    /// </para>
+    /// <para>
+    /// Add each device with a UsbDeviceFactory; the worker for its bus
+    /// connects to it.  Then post work for a device, or for all devices
+    /// with postToAll.  A request that fails does not stop the others; its
+    /// exception is in UsbFleetRequest.error.  This class is thread-safe.
+    /// Disposing it waits for the requests that were posted, then
+    /// disconnects the devices.
+    /// </para>
+    /// </remarks>
+    public class UsbFleet : IDisposable
+    {
+        class Member
+        {
+            public DeviceListItem item;
+            public UsbDeviceFactory connect;
+            public Worker worker;
+
+            // Only used by the worker's thread.
+            public UsbDevice device;
+            public Exception connectError;
+        }
+
+        class Job
+        {
+            public Member member;
+            public UsbFleetRequest request;
+        }
+
+        class Worker
+        {
+            public Int32 busId;
+            public Thread thread;
+            public UsbBusContext context = new UsbBusContext();
+            public readonly Queue<Job> queue = new Queue<Job>();
+            public readonly List<Member> members = new List<Member>();
+            public bool stopping;
+
+            // Protected by queue.
+            public long completed;
+            public long failed;
+            public long busyTicks;
+        }
+
+        readonly object sync = new object();
+        readonly Dictionary<Int32, Worker> workers = new Dictionary<Int32, Worker>();
+        readonly List<Member> members = new List<Member>();
+        bool disposed;
+
+        /// <summary>
+        /// Adds a device to the fleet.  The worker for its bus connects to
+        /// it in the background; if that fails, every request for the
+        /// device fails with the same exception.
+        /// </summary>
+        /// <returns>The number of the device, to use with post.</returns>
+        public int add(DeviceListItem item, UsbDeviceFactory connect)
+        {
+            if (item == null)
+            {
+                throw new ArgumentNullException("item");
+            }
+            if (connect == null)
+            {
+                throw new ArgumentNullException("connect");
+            }
+
+            Member member = new Member();
+            member.item = item;
+            member.connect = connect;
+            Int32 busId = item.busId;
+
+            lock (sync)
+            {
+                if (disposed)
+                {
+                    throw new ObjectDisposedException("UsbFleet");
+                }
+
+                Worker worker;
+                if (!workers.TryGetValue(busId, out worker))
+                {
+                    worker = new Worker();
+                    worker.busId = busId;
+                    worker.thread = new Thread(delegate() { run(worker); });
+                    worker.thread.Name = "USB bus " + busId;
+                    worker.thread.IsBackground = true;
+                    worker.thread.Start();
+                    workers[busId] = worker;
+                }
+                member.worker = worker;
+
+                // Connect right away instead of with the first request.
+                Job job = new Job();
+                job.member = member;
+                job.request = new UsbFleetRequest(null);
+                lock (worker.queue)
+                {
+                    worker.members.Add(member);
+                    worker.queue.Enqueue(job);
+                    Monitor.Pulse(worker.queue);
+                }
+                members.Add(member);
+                return members.Count - 1;
+            }
+        }
+
+        /// <summary>
+        /// The number of devices in the fleet.
+        /// </summary>
+        public int count
+        {
+            get { lock (sync) { return members.Count; } }
+        }
+
+        /// <summary>
+        /// Gets the DeviceListItem a device was added with.
+        /// </summary>
+        public DeviceListItem getItem(int device)
+        {
+            lock (sync)
+            {
+                return members[device].item;
+            }
+        }
+
+        /// <summary>
+        /// Queues work for a device.  It is done by the worker for the
+        /// device's bus, after the work posted before it for the same bus.
+        /// </summary>
+        /// <param name="device">The number returned by add.</param>
+        /// <param name="work">The work, which is given the connected device.</param>
+        public UsbFleetRequest post(int device, UsbDeviceWork work)
+        {
+            Member member;
+            lock (sync)
+            {
+                if (disposed)
+                {
+                    throw new ObjectDisposedException("UsbFleet");
+                }
+                member = members[device];
+            }
+
+            UsbFleetRequest request = new UsbFleetRequest(work);
+            Job job = new Job();
+            job.member = member;
+            job.request = request;
+
+            Worker worker = member.worker;
+            lock (worker.queue)
+            {
+                worker.queue.Enqueue(job);
+                Monitor.Pulse(worker.queue);
+            }
+            return request;
+        }
+
+        /// <summary>
+        /// Queues the same work for every device.
+        /// </summary>
+        /// <returns>One request for each device, in the order they were added.</returns>
+        public UsbFleetRequest[] postToAll(UsbDeviceWork work)
+        {
+            UsbFleetRequest[] requests = new UsbFleetRequest[count];
+            for (int i = 0; i < requests.Length; i++)
+            {
+                requests[i] = post(i, work);
+            }
+            return requests;
+        }
+
+        /// <summary>
+        /// Does work for a device and waits for it.
+        /// </summary>
+        /// <exception cref="Exception">The work failed; the inner exception is the one it threw.</exception>
+        public void invoke(int device, UsbDeviceWork work)
+        {
+            UsbFleetRequest request = post(device, work);
+            request.wait(-1);
+            if (request.error != null)
+            {
+                throw new Exception("There was an error with device " + getItem(device).serialNumber + ".", request.error);
+            }
+        }
+
+        /// <summary>
+        /// Waits for all the requests.
+        /// </summary>
+        /// <param name="timeout">The most time to wait, in milliseconds, or -1 to wait as long as it takes.</param>
+        /// <returns>True if they were all done, false if the time ran out.</returns>
+        public static bool waitAll(IEnumerable<UsbFleetRequest> requests, int timeout)
+        {
+            Stopwatch stopwatch = Stopwatch.StartNew();
+            foreach (UsbFleetRequest request in requests)
+            {
+                int remaining = timeout < 0 ? -1 : (int)Math.Max(0, timeout - stopwatch.ElapsedMilliseconds);
+                if (!request.wait(remaining))
+                {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        /// <summary>
+        /// Gets the statistics of each bus, ordered by busId.
+        /// </summary>
+        public List<UsbFleetBus> getBuses()
+        {
+            List<UsbFleetBus> list = new List<UsbFleetBus>();
+            lock (sync)
+            {
+                foreach (Worker worker in workers.Values)
+                {
+                    UsbFleetBus bus = new UsbFleetBus();
+                    bus.busId = worker.busId;
+                    lock (worker.queue)
+                    {
+                        bus.deviceCount = worker.members.Count;
+                        bus.completed = worker.completed;
+                        bus.failed = worker.failed;
+                        bus.queued = worker.queue.Count;
+                        bus.busyTime = worker.busyTicks * 1000.0 / Stopwatch.Frequency;
+                    }
+                    list.Add(bus);
+                }
+            }
+            list.Sort(delegate(UsbFleetBus a, UsbFleetBus b) { return a.busId.CompareTo(b.busId); });
+            return list;
+        }
+
+        /// <summary>
+        /// Waits for the requests that were posted, disconnects from the
+        /// devices and stops the workers.
+        /// </summary>
+        public void Dispose()
+        {
+            List<Worker> stopping;
+            lock (sync)
+            {
+                if (disposed)
+                {
+                    return;
+                }
+                disposed = true;
+                stopping = new List<Worker>(workers.Values);
+            }
+
+            foreach (Worker worker in stopping)
+            {
+                lock (worker.queue)
+                {
+                    worker.stopping = true;
+                    Monitor.Pulse(worker.queue);
+                }
+            }
+            foreach (Worker worker in stopping)
+            {
+                worker.thread.Join();
+            }
+        }
+
+        void run(Worker worker)
+        {
+            while (true)
+            {
+                Job job;
+                lock (worker.queue)
+                {
+                    while (worker.queue.Count == 0 && !worker.stopping)
+                    {
+                        Monitor.Wait(worker.queue);
+                    }
+                    if (worker.queue.Count == 0)
+                    {
+                        break;
+                    }
+                    job = worker.queue.Dequeue();
+                }
+
+                long start = Stopwatch.GetTimestamp();
+                Exception error = null;
+                try
+                {
+                    Member member = job.member;
+                    if (member.device == null && member.connectError == null)
+                    {
+                        try
+                        {
+                            member.device = member.connect(worker.context.bind(member.item));
+                        }
+                        catch (Exception exception)
+                        {
+                            member.connectError = new Exception("There was an error connecting to device " + member.item.serialNumber + ".", exception);
+                        }
+                    }
+                    if (member.connectError != null)
+                    {
+                        throw member.connectError;
+                    }
+                    if (job.request.work != null)
+                    {
+                        job.request.work(member.device);
+                    }
+                }
+                catch (Exception exception)
+                {
+                    error = exception;
+                }
+                long end = Stopwatch.GetTimestamp();
+
+                lock (worker.queue)
+                {
+                    worker.completed++;
+                    if (error != null)
+                    {
+                        worker.failed++;
+                    }
+                    worker.busyTicks += end - start;
+                }
+                job.request.complete(error);
+            }
+
+            // The devices must be closed before their context.
+            List<Member> list;
+            lock (worker.queue)
+            {
+                list = new List<Member>(worker.members);
+            }
+            foreach (Member member in list)
+            {
+                if (member.device != null)
+                {
+                    member.device.disconnect();
+                    member.device = null;
+                }
+            }
+            worker.context.Dispose();
+        }
+    }
+}
+
+// Local Variables: **
+// mode: java **
+// c-basic-offset: 4 **
+// tab-width: 4 **
+// indent-tabs-mode: nil **
+// end: **
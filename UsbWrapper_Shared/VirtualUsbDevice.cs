@@ -0,0 +1,451 @@
+// UsbWrapper_Shared/VirtualUsbDevice.cs:
+//   Support for devices that are not really connected over USB, such
+//   as in-process emulators used for testing and load testing.
+
+using System;
+using System.Collections.Generic;
+using System.Diagnostics;
+using System.Threading;
+
+namespace Pololu.UsbWrapper
+{
+    /// <summary>
+    /// Something that can carry control transfers to a device in place of
+    /// libusb or WinUSB.  A UsbDevice created from a DeviceListItem that has a transport
+    /// sends all of its control transfers to the transport.
+    /// </summary>
+    public interface IUsbTransport
+    {
+        /// <summary>The USB vendor ID of the device.</summary>
+        UInt16 vendorId { get; }
+
+        /// <summary>The USB product ID of the device.</summary>
+        UInt16 productId { get; }
+
+        /// <summary>The USB serial number string of the device.</summary>
+        String serialNumber { get; }
+
+        /// <summary>
+        /// The device interface GUID of the device.  The Windows version of
+        /// this library uses it to decide which device lists the device
+        /// belongs in; the Linux version does not use it.
+        /// </summary>
+        Guid deviceInterfaceGuid { get; }
+
+        /// <summary>
+        /// Performs a control transfer.  The arguments have the same meaning
+        /// as the fields of a USB setup packet, and the timeout is in
+        /// milliseconds (0 means no timeout).  This function must
+        /// not throw exceptions.
+        /// </summary>
+        /// <returns>
+        ///   The number of bytes transferred in the data stage, or a negative
+        ///   UsbStatus error code.
+        /// </returns>
+        unsafe int controlTransfer(byte requestType, byte request, ushort value, ushort index, void* data, ushort length, UInt32 timeout);
+    }
+
+    /// <summary>
+    /// A base class for emulated devices.  It takes care of the things that
+    /// all emulated devices need: the standard device descriptor request,
+    /// simulated latency, injected errors, and keeping the emulated device's
+    /// clock running.  Derived classes implement the vendor-specific requests
+    /// in handleControlTransfer.
+    /// </summary>
+    /// <remarks>
+    /// Every instance has its own lock, so any number of threads can use
+    /// different virtual devices at the same time, while transfers to a single
+    /// device are processed one at a time like on a real device.
+    /// To make a virtual device show up in device lists, pass it to
+    /// Usb.addVirtualDevice.
+    /// </remarks>
+    public abstract class VirtualUsbDevice : IUsbTransport
+    {
+        readonly UInt16 privateVendorId;
+        readonly UInt16 privateProductId;
+        readonly String privateSerialNumber;
+
+        public UInt16 vendorId
+        {
+            get { return privateVendorId; }
+        }
+
+        public UInt16 productId
+        {
+            get { return privateProductId; }
+        }
+
+        public String serialNumber
+        {
+            get { return privateSerialNumber; }
+        }
+
+        public abstract Guid deviceInterfaceGuid { get; }
+
+        /// <summary>
+        /// The firmware version reported in the bcdDevice field of the device
+        /// descriptor, e.g. 0x0107 for version 1.07.
+        /// </summary>
+        protected abstract UInt16 firmwareVersionBcd { get; }
+
+        /// <summary>
+        /// Lock that is held while a transfer is being processed.  Derived
+        /// classes should also hold it when they change the state of the device
+        /// from another thread.
+        /// </summary>
+        protected readonly object sync = new object();
+
+        UInt32 privateLatency;
+        UInt32 privateLatencyJitter;
+        double privateErrorRate;
+        int privateInjectedError = UsbStatus.Pipe;
+        int failuresRemaining;
+        int failureStatus;
+        bool privateConnected = true;
+        bool privateFollowRealTime = true;
+        long lastTimestamp = Stopwatch.GetTimestamp();
+        Random random = new Random(0);
+        UInt64 privateTransferCount;
+        Int32 privateBusId = -1;
+        object busLock;
+
+        /// <summary>
+        /// One lock for each emulated bus, so the devices on a bus carry out
+        /// their transfers one at a time.
+        /// </summary>
+        static readonly Dictionary<Int32, object> busLocks = new Dictionary<Int32, object>();
+
+        protected VirtualUsbDevice(UInt16 vendorId, UInt16 productId, String serialNumber)
+        {
+            privateVendorId = vendorId;
+            privateProductId = productId;
+            privateSerialNumber = serialNumber;
+        }
+
+        /// <summary>
+        /// The emulated USB bus that the device is connected to, which is
+        /// reported as DeviceListItem.busId.  Devices with the same busId
+        /// (0 or more) share the bus: only one of them carries out a
+        /// transfer at a time, so a busy device slows down the others like
+        /// on a real bus.  The default is -1, which means the device has the
+        /// bus to itself.
+        /// </summary>
+        public Int32 busId
+        {
+            get { return privateBusId; }
+            set
+            {
+                lock (busLocks)
+                {
+                    object bus = null;
+                    if (value >= 0 && !busLocks.TryGetValue(value, out bus))
+                    {
+                        bus = new object();
+                        busLocks[value] = bus;
+                    }
+                    busLock = bus;
+                    privateBusId = value;
+                }
+            }
+        }
+
+        /// <summary>
+        /// The time, in microseconds, that every transfer takes.  Latencies
+        /// under 2 ms are simulated by spinning, longer ones by sleeping.
+        /// The default is 0.
+        /// </summary>
+        public UInt32 latency
+        {
+            get { return privateLatency; }
+            set { privateLatency = value; }
+        }
+
+        /// <summary>
+        /// A random amount of time, up to this many microseconds, is added
+        /// to the latency of every transfer.  The default is 0.
+        /// </summary>
+        public UInt32 latencyJitter
+        {
+            get { return privateLatencyJitter; }
+            set { privateLatencyJitter = value; }
+        }
+
+        /// <summary>
+        /// The probability (0 to 1) that a transfer will fail with the
+        /// injectedError status code.  The default is 0.
+        /// </summary>
+        public double errorRate
+        {
+            get { return privateErrorRate; }
+            set { privateErrorRate = value; }
+        }
+
+        /// <summary>
+        /// The status code returned by transfers that fail because of
+        /// errorRate.  The default is UsbStatus.Pipe (the device stalled).
+        /// </summary>
+        public int injectedError
+        {
+            get { return privateInjectedError; }
+            set { privateInjectedError = value; }
+        }
+
+        /// <summary>
+        /// If false, every transfer fails with UsbStatus.NoDevice, as if
+        /// the device had been unplugged.  The default is true.
+        /// </summary>
+        public bool connected
+        {
+            get { return privateConnected; }
+            set { privateConnected = value; }
+        }
+
+        /// <summary>
+        /// If true (the default), the emulated device's clock advances with
+        /// the real time that passes between transfers.  If false, it only
+        /// advances when advanceTime is called, which makes tests repeatable.
+        /// </summary>
+        public bool followRealTime
+        {
+            get { return privateFollowRealTime; }
+            set
+            {
+                lock (sync)
+                {
+                    privateFollowRealTime = value;
+                    lastTimestamp = Stopwatch.GetTimestamp();
+                }
+            }
+        }
+
+        /// <summary>
+        /// The number of transfers the device has received, including failed ones.
+        /// </summary>
+        public UInt64 transferCount
+        {
+            get { return privateTransferCount; }
+        }
+
+        /// <summary>
+        /// Seeds the random number generator used for jitter and errorRate.
+        /// </summary>
+        public void setRandomSeed(int seed)
+        {
+            lock (sync)
+            {
+                random = new Random(seed);
+            }
+        }
+
+        /// <summary>
+        /// Makes the next count transfers fail with the given status code.
+        /// </summary>
+        public void failNextTransfers(int count, int status)
+        {
+            lock (sync)
+            {
+                failuresRemaining = count;
+                failureStatus = status;
+            }
+        }
+
+        /// <summary>
+        /// Advances the emulated device's clock.
+        /// </summary>
+        public void advanceTime(UInt32 milliseconds)
+        {
+            lock (sync)
+            {
+                advance((UInt64)milliseconds * 1000);
+            }
+        }
+
+        /// <summary>
+        /// Called with the lock held to let the emulated device's clock
+        /// advance by the given number of microseconds.
+        /// </summary>
+        protected virtual void advance(UInt64 microseconds)
+        {
+        }
+
+        /// <summary>
+        /// Handles a request that is not a standard request.  Called with
+        /// the lock held.  Returns the number of bytes transferred or a
+        /// negative UsbStatus code; UsbStatus.Pipe means the device does not
+        /// support the request.
+        /// </summary>
+        protected abstract unsafe int handleControlTransfer(byte requestType, byte request, ushort value, ushort index, byte* data, ushort length);
+
+        public unsafe int controlTransfer(byte requestType, byte request, ushort value, ushort index, void* data, ushort length, UInt32 timeout)
+        {
+            object bus = busLock;
+            if (bus == null)
+            {
+                return controlTransferOnBus(requestType, request, value, index, data, length, timeout);
+            }
+            lock (bus)
+            {
+                return controlTransferOnBus(requestType, request, value, index, data, length, timeout);
+            }
+        }
+
+        unsafe int controlTransferOnBus(byte requestType, byte request, ushort value, ushort index, void* data, ushort length, UInt32 timeout)
+        {
+            UInt32 delay;
+            int result;
+
+            lock (sync)
+            {
+                privateTransferCount++;
+
+                delay = privateLatency;
+                if (privateLatencyJitter != 0)
+                {
+                    delay += (UInt32)random.Next((int)Math.Min(privateLatencyJitter, Int32.MaxValue - 1) + 1);
+                }
+
+                if (timeout != 0 && delay > (UInt64)timeout * 1000)
+                {
+                    result = UsbStatus.Timeout;
+                    delay = timeout * 1000;
+                }
+                else if (!privateConnected)
+                {
+                    result = UsbStatus.NoDevice;
+                }
+                else if (failuresRemaining > 0)
+                {
+                    failuresRemaining--;
+                    result = failureStatus;
+                }
+                else if (privateErrorRate > 0 && random.NextDouble() < privateErrorRate)
+                {
+                    result = privateInjectedError;
+                }
+                else
+                {
+                    if (privateFollowRealTime)
+                    {
+                        advanceToNow();
+                    }
+
+                    if (requestType == 0x80 && request == 6)
+                    {
+                        result = getDescriptor(value, (byte*)data, length);
+                    }
+                    else
+                    {
+                        result = handleControlTransfer(requestType, request, value, index, (byte*)data, length);
+                    }
+                }
+
+                // A real device handles one control transfer at a time, so
+                // wait while holding the lock.
+                wait(delay);
+            }
+
+            return result;
+        }
+
+        private void advanceToNow()
+        {
+            long now = Stopwatch.GetTimestamp();
+            long ticks = now - lastTimestamp;
+
+            // Split the ticks in to whole seconds and the rest so this can
+            // not overflow, and carry the fraction of a microsecond that
+            // is left over to the next call.
+            long frequency = Stopwatch.Frequency;
+            long fraction = ticks % frequency;
+            long fractionMicroseconds = fraction * 1000000 / frequency;
+            UInt64 microseconds = (UInt64)(ticks / frequency) * 1000000 + (UInt64)fractionMicroseconds;
+            lastTimestamp = now - (fraction - fractionMicroseconds * frequency / 1000000);
+
+            if (microseconds != 0)
+            {
+                advance(microseconds);
+            }
+        }
+
+        private static void wait(UInt32 microseconds)
+        {
+            if (microseconds == 0)
+            {
+                return;
+            }
+
+            if (microseconds >= 2000)
+            {
+                Thread.Sleep((int)(microseconds / 1000));
+                return;
+            }
+
+            long end = Stopwatch.GetTimestamp() + microseconds * Stopwatch.Frequency / 1000000;
+            while (Stopwatch.GetTimestamp() < end)
+            {
+                Thread.SpinWait(20);
+            }
+        }
+
+        /// <summary>
+        /// Handles the standard GET_DESCRIPTOR request for the device descriptor,
+        /// which is what the device classes use to read the firmware version.
+        /// </summary>
+        private unsafe int getDescriptor(ushort value, byte* data, ushort length)
+        {
+            if (value != 0x0100)
+            {
+                return UsbStatus.Pipe;
+            }
+
+            byte* descriptor = stackalloc byte[18];
+            descriptor[0] = 18;    // bLength
+            descriptor[1] = 1;     // bDescriptorType = DEVICE
+            descriptor[2] = 0x00;  // bcdUSB = 2.00
+            descriptor[3] = 0x02;
+            descriptor[4] = 0xEF;  // bDeviceClass = Miscellaneous
+            descriptor[5] = 0x02;
+            descriptor[6] = 0x01;
+            descriptor[7] = 64;    // bMaxPacketSize0
+            descriptor[8] = (byte)privateVendorId;
+            descriptor[9] = (byte)(privateVendorId >> 8);
+            descriptor[10] = (byte)privateProductId;
+            descriptor[11] = (byte)(privateProductId >> 8);
+            descriptor[12] = (byte)firmwareVersionBcd;
+            descriptor[13] = (byte)(firmwareVersionBcd >> 8);
+            descriptor[14] = 1;    // iManufacturer
+            descriptor[15] = 2;    // iProduct
+            descriptor[16] = 3;    // iSerialNumber
+            descriptor[17] = 1;    // bNumConfigurations
+
+            int count = Math.Min(18, (int)length);
+            for (int i = 0; i < count; i++)
+            {
+                data[i] = descriptor[i];
+            }
+            return count;
+        }
+
+        /// <summary>
+        /// Copies a response in to the data buffer of a transfer, truncating it
+        /// if the host asked for less.  Returns the number of bytes copied.
+        /// </summary>
+        protected static unsafe int respond(byte* data, ushort length, void* response, int responseLength)
+        {
+            int count = Math.Min(responseLength, (int)length);
+            byte* source = (byte*)response;
+            for (int i = 0; i < count; i++)
+            {
+                data[i] = source[i];
+            }
+            return count;
+        }
+    }
+}
+
+// Local Variables: **
+// mode: java **
+// c-basic-offset: 4 **
+// tab-width: 4 **
+// indent-tabs-mode: nil **
+// end: **
@@ -1,4 +1,5 @@
 ﻿using System;
+using Pololu.WinusbHelper;
 
 namespace Pololu.UsbWrapper
 {
@@ -6,7 +7,7 @@ namespace Pololu.UsbWrapper
     /// A class that represents a device connected to the computer.  This
     /// class can be used as an item in the device list dropdown box.
     /// </summary>
-    public class DeviceListItem
+    public class DeviceListItem : IDisposable
     {
         /// <summary>
         /// Gets the device instance (DEVINST) for this device.  This can be
@@ -54,6 +55,12 @@ namespace Pololu.UsbWrapper
         /// </summary>
         public readonly UInt16 productId;
 
+        /// <summary>
+        /// The transport of a virtual device, or null if this item refers to
+        /// a real USB device.
+        /// </summary>
+        public readonly IUsbTransport transport;
+
         /// <summary>
         /// Constructs a new device list item to represent a device connected to
         /// this computer.
@@ -74,6 +81,19 @@ namespace Pololu.UsbWrapper
             this.productId = productId;
         }
 
+        /// <summary>
+        /// Creates an item for a virtual device (for example, an emulator).
+        /// Connecting to the item sends all control transfers to the transport.
+        /// </summary>
+        public DeviceListItem(IUsbTransport transport)
+        {
+            this.guid = transport.deviceInterfaceGuid;
+            this.privateText = "#" + transport.serialNumber;
+            this.serialNumber = transport.serialNumber;
+            this.productId = transport.productId;
+            this.transport = transport;
+        }
+
         /// <summary>
         /// Creates an item that doesn't actually refer to a device; just for populating the list with things like "Disconnected"
         /// </summary>
@@ -82,11 +102,59 @@ namespace Pololu.UsbWrapper
             return new DeviceListItem(0, new Guid(0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0), text, "", 0);
         }
 
+        /// <summary>
+        /// Identifies the USB bus (host controller) that the device is
+        /// connected to.  Devices with the same busId share the bandwidth
+        /// and the transfer scheduling of one bus.  On Windows this is the
+        /// device instance (DEVINST) of the root hub.  For virtual devices it
+        /// is VirtualUsbDevice.busId.  For dummy items and devices whose
+        /// root hub could not be found, it is -1.
+        /// </summary>
+        public Int32 busId
+        {
+            get
+            {
+                if (transport != null)
+                {
+                    VirtualUsbDevice virtualDevice = transport as VirtualUsbDevice;
+                    return virtualDevice == null ? -1 : virtualDevice.busId;
+                }
+                if (deviceInstance == 0)
+                {
+                    return -1;
+                }
+                return Winusb.getRootHubDeviceInstance(deviceInstance);
+            }
+        }
+
+        /// <summary>
+        /// Identifies the port the device is plugged in to.  This is only
+        /// available in Linux; on Windows it is null, so devices are only
+        /// told apart by busId.
+        /// </summary>
+        public String portPath
+        {
+            get { return null; }
+        }
+
+        /// <summary>
+        /// An item only holds a device instance number on Windows, so this
+        /// does nothing.  It is here so that programs that dispose their
+        /// items, as they should in Linux, work the same on both.
+        /// </summary>
+        public void Dispose()
+        {
+        }
+
         /// <summary>
         /// Return true if the two devices are the same.
         /// </summary>
         public bool isSameDeviceAs(DeviceListItem deviceListItem)
         {
+            if (transport != null || deviceListItem.transport != null)
+            {
+                return transport == deviceListItem.transport;
+            }
             return (deviceInstance == deviceListItem.deviceInstance);
         }
     }
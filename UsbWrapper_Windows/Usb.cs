@@ -4,6 +4,23 @@ using Pololu.WinusbHelper;
 
 namespace Pololu.UsbWrapper
 {
+    /// <summary>
+    /// The resources of one UsbFleet worker.  WinUSB has no shared event
+    /// loop, so a device needs nothing of its own to be used from the
+    /// worker's thread, and bind returns the item it is given.
+    /// </summary>
+    internal class UsbBusContext : IDisposable
+    {
+        internal DeviceListItem bind(DeviceListItem item)
+        {
+            return item;
+        }
+
+        public void Dispose()
+        {
+        }
+    }
+
     /// <summary>
     /// A static class that has some methods for interacting with the operating
     /// system's USB support.
@@ -70,5 +87,61 @@ namespace Pololu.UsbWrapper
         {
             return Winusb.notificationRegister(guid, handle);
         }
+
+        static readonly List<IUsbTransport> virtualDevices = new List<IUsbTransport>();
+
+        static bool privateEnumerateRealDevices = true;
+
+        /// <summary>
+        /// If false, device lists only contain virtual devices and WinUSB is
+        /// not used to enumerate devices.  The default is true.
+        /// </summary>
+        public static bool enumerateRealDevices
+        {
+            get { return privateEnumerateRealDevices; }
+            set { privateEnumerateRealDevices = value; }
+        }
+
+        /// <summary>
+        /// Adds a virtual device (for example, an emulator) to the device
+        /// lists returned by classes like Usc, Jrk, and Smc.
+        /// </summary>
+        public static void addVirtualDevice(IUsbTransport device)
+        {
+            lock (virtualDevices)
+            {
+                virtualDevices.Add(device);
+            }
+        }
+
+        /// <summary>
+        /// Removes a device that was added with addVirtualDevice.
+        /// </summary>
+        public static void removeVirtualDevice(IUsbTransport device)
+        {
+            lock (virtualDevices)
+            {
+                virtualDevices.Remove(device);
+            }
+        }
+
+        /// <summary>
+        /// Removes all devices that were added with addVirtualDevice.
+        /// </summary>
+        public static void clearVirtualDevices()
+        {
+            lock (virtualDevices)
+            {
+                virtualDevices.Clear();
+            }
+        }
+
+        internal static IUsbTransport[] getVirtualDevices()
+        {
+            lock (virtualDevices)
+            {
+                return virtualDevices.ToArray();
+            }
+        }
     }
 }
@@ -7,6 +7,7 @@
 using System;
 using System.Collections.Generic;
 using System.ComponentModel;
+using System.Diagnostics;
 using Pololu.WinusbHelper;
 
 namespace Pololu.UsbWrapper
@@ -62,10 +63,26 @@ namespace Pololu.UsbWrapper
                 setupPacket.Length = Length;
                 return controlTransfer(setupPacket, data);
             }
+
+            internal unsafe int tryControlTransfer(byte RequestType, byte Request, ushort Value, ushort Index, void * data, ushort Length)
+            {
+                WINUSB_SETUP_PACKET setupPacket = new WINUSB_SETUP_PACKET();
+                setupPacket.RequestType = RequestType;
+                setupPacket.Request = Request;
+                setupPacket.Value = Value;
+                setupPacket.Index = Index;
+                setupPacket.Length = Length;
+                return tryControlTransfer(setupPacket, data);
+            }
         }
            
         private MyWinUsbDevice device;
 
+        /// <summary>
+        /// The transport used instead of WinUSB for virtual devices, or null.
+        /// </summary>
+        private readonly IUsbTransport transport;
+
         /// <summary>
         /// Returns the serial number of device.  It's a string because that is how they
         /// are transmitted over USB.
@@ -74,6 +91,10 @@ namespace Pololu.UsbWrapper
         /// </summary>
         public string getSerialNumber()
         {
+            if (transport != null)
+            {
+                return transport.serialNumber;
+            }
             return device.serialNumber;
         }
 
@@ -84,19 +105,188 @@ namespace Pololu.UsbWrapper
         /// </summary>
         protected UInt16 getProductID()
         {
+            if (transport != null)
+            {
+                return transport.productId;
+            }
             return device.getProductID();
         }
 
+        /// <summary>
+        /// The timeout used for control transfers when no other timeout is
+        /// specified, in milliseconds.
+        /// </summary>
+        public const UInt32 defaultTimeout = 5000;
+
+        UInt32 privateTimeout = defaultTimeout;
+
+        /// <summary>
+        /// The maximum amount of time, in milliseconds, that a control transfer
+        /// on this device is allowed to take before it is cancelled and an
+        /// exception is thrown.  Zero means no timeout.
+        /// The default is 5000 ms.
+        /// </summary>
+        public UInt32 timeout
+        {
+            get
+            {
+                return privateTimeout;
+            }
+            set
+            {
+                privateTimeout = value;
+            }
+        }
+
+        /// <summary>
+        /// The time (in Stopwatch ticks) by which every transfer must be
+        /// complete, or 0 if there is no deadline.  There is one deadline
+        /// per UsbDevice, shared by all threads that use it.
+        /// </summary>
+        long privateDeadline = 0;
+
+        /// <summary>
+        /// Sets a deadline for all subsequent control transfers on this
+        /// device.  A transfer that starts before the deadline is only given
+        /// the time remaining until the deadline, and is cancelled if it takes
+        /// longer.  A transfer that would start after the deadline is not sent
+        /// at all and a TimeoutException is thrown instead.
+        /// The deadline stays in effect until clearDeadline() is called.
+        /// It belongs to the device, not to the calling thread: it applies
+        /// to the transfers of every thread that uses this object, so a
+        /// device shared between threads needs the callers to agree on one
+        /// deadline (setDeadline and clearDeadline are not synchronized).
+        /// </summary>
+        /// <param name="milliseconds">The deadline, measured from now.</param>
+        public void setDeadline(UInt32 milliseconds)
+        {
+            privateDeadline = Stopwatch.GetTimestamp() + milliseconds * Stopwatch.Frequency / 1000;
+        }
+
+        /// <summary>
+        /// Removes the deadline set by setDeadline.
+        /// </summary>
+        public void clearDeadline()
+        {
+            privateDeadline = 0;
+        }
+
+        /// <summary>
+        /// Applies the timeout for a transfer that is starting now, taking
+        /// into account the deadline (if any).
+        /// </summary>
+        void applyTransferTimeout(UInt32 timeout)
+        {
+            if (!tryGetTransferTimeout(ref timeout))
+            {
+                throw new TimeoutException("The deadline passed before the control transfer could be started.");
+            }
+            device.setControlTimeout(timeout);
+        }
+
+        /// <summary>
+        /// Reduces the timeout so that the transfer will end by the deadline
+        /// (if any).  Returns false if the deadline has already passed.
+        /// </summary>
+        bool tryGetTransferTimeout(ref UInt32 timeout)
+        {
+            if (privateDeadline == 0)
+            {
+                return true;
+            }
+
+            long remaining = privateDeadline - Stopwatch.GetTimestamp();
+            if (remaining <= 0)
+            {
+                return false;
+            }
+
+            // Round up so that we never ask for 0 (no timeout).
+            UInt32 remainingMs = (UInt32)Math.Min(UInt32.MaxValue, (remaining * 1000 + Stopwatch.Frequency - 1) / Stopwatch.Frequency);
+            if (timeout == 0 || remainingMs < timeout)
+            {
+                timeout = remainingMs;
+            }
+            return true;
+        }
+
+        /// <summary>
+        /// Performs a control transfer that has no data stage without
+        /// throwing an exception if it fails.
+        /// </summary>
+        /// <returns>0 on success, or a negative UsbStatus error code.</returns>
+        protected unsafe int tryControlTransfer(byte RequestType, byte Request, ushort Value, ushort Index)
+        {
+            return tryControlTransfer(RequestType, Request, Value, Index, (byte*)0, 0);
+        }
+
+        /// <summary>
+        /// Performs a control transfer that has a data stage without
+        /// throwing an exception if it fails.
+        /// </summary>
+        /// <returns>The number of bytes transferred, or a negative UsbStatus error code.</returns>
+        protected unsafe int tryControlTransfer(byte RequestType, byte Request, ushort Value, ushort Index, void * data, ushort Length)
+        {
+            UInt32 transferTimeout = timeout;
+            if (!tryGetTransferTimeout(ref transferTimeout))
+            {
+                return UsbStatus.Timeout;
+            }
+            if (transport == null && !device.trySetControlTimeout(transferTimeout))
+            {
+                return UsbStatus.fromWin32Error(System.Runtime.InteropServices.Marshal.GetLastWin32Error());
+            }
+
+            long start = beginTransfer(RequestType, Request, Value, Index, Length);
+            int result;
+            if (transport != null)
+            {
+                result = transport.controlTransfer(RequestType, Request, Value, Index, data, Length, transferTimeout);
+            }
+            else
+            {
+                result = device.tryControlTransfer(RequestType, Request, Value, Index, data, Length);
+            }
+            recordTransfer(RequestType, Request, Value, Index, data, Length, result, start);
+            return result;
+        }
+
         /// <summary>
         /// Performs a control transfer that has no data stage.
         /// Returns when the control transfer is complete.
-        /// There is a 50 ms timeout so that a malfunctioning device
+        /// The transfer is cancelled if it takes longer than the
+        /// timeout property so that a malfunctioning device
         /// will not cause your program to hang.
         /// </summary>
         /// <remarks>For more info, see section 9.3 of the USB Specification.</remarks>
         protected void controlTransfer(byte RequestType, byte Request, ushort Value, ushort Index)
         {
-            device.controlTransfer(RequestType, Request, Value, Index);
+            controlTransfer(RequestType, Request, Value, Index, timeout);
+        }
+
+        /// <summary>
+        /// Performs a control transfer that has no data stage, using the
+        /// specified timeout (in milliseconds) instead of the device's timeout.
+        /// </summary>
+        protected unsafe void controlTransfer(byte RequestType, byte Request, ushort Value, ushort Index, UInt32 timeout)
+        {
+            if (transport != null)
+            {
+                transportControlTransfer(RequestType, Request, Value, Index, (byte*)0, 0, timeout);
+                return;
+            }
+            applyTransferTimeout(timeout);
+            long start = beginTransfer(RequestType, Request, Value, Index, 0);
+            try
+            {
+                device.controlTransfer(RequestType, Request, Value, Index);
+            }
+            catch (Exception exception)
+            {
+                recordTransfer(RequestType, Request, Value, Index, null, 0, statusOf(exception), start);
+                throw;
+            }
+            recordTransfer(RequestType, Request, Value, Index, null, 0, 0, start);
         }
 
         /// <summary>
@@ -104,13 +294,49 @@ namespace Pololu.UsbWrapper
         /// The data either flows from the device to the host or the
         /// host to the device.  The direction is determined by RequestType.
         /// Returns when the control transfer is complete.
-        /// There is a 50 ms timeout so that a malfunctioning device
+        /// The transfer is cancelled if it takes longer than the
+        /// timeout property so that a malfunctioning device
         /// will not cause your program to hang.
         /// </summary>
         /// <remarks>For more info, see section 9.3 of the USB Specification.</remarks>
         protected uint controlTransfer(byte RequestType, byte Request, ushort Value, ushort Index, byte[] data)
         {
-            return device.controlTransfer(RequestType, Request, Value, Index, data);
+            return controlTransfer(RequestType, Request, Value, Index, data, timeout);
+        }
+
+        /// <summary>
+        /// Performs a control transfer that has a data stage, using the
+        /// specified timeout (in milliseconds) instead of the device's timeout.
+        /// </summary>
+        protected unsafe uint controlTransfer(byte RequestType, byte Request, ushort Value, ushort Index, byte[] data, UInt32 timeout)
+        {
+            if (transport != null)
+            {
+                fixed (byte* pointer = data)
+                {
+                    return transportControlTransfer(RequestType, Request, Value, Index, pointer, (ushort)data.Length, timeout);
+                }
+            }
+            applyTransferTimeout(timeout);
+            long start = beginTransfer(RequestType, Request, Value, Index, (ushort)data.Length);
+            uint ret;
+            try
+            {
+                ret = device.controlTransfer(RequestType, Request, Value, Index, data);
+            }
+            catch (Exception exception)
+            {
+                fixed (byte* pointer = data)
+                {
+                    recordTransfer(RequestType, Request, Value, Index, pointer, (ushort)data.Length, statusOf(exception), start);
+                }
+                throw;
+            }
+            fixed (byte* pointer = data)
+            {
+                recordTransfer(RequestType, Request, Value, Index, pointer, (ushort)data.Length, (int)ret, start);
+            }
+            return ret;
         }
 
         /// <summary>
@@ -118,13 +344,150 @@ namespace Pololu.UsbWrapper
         /// The data either flows from the device to the host or the
         /// host to the device.  The direction is determined by RequestType.
         /// Returns when the control transfer is complete.
-        /// There is a 50 ms timeout so that a malfunctioning device
+        /// The transfer is cancelled if it takes longer than the
+        /// timeout property so that a malfunctioning device
         /// will not cause your program to hang.
         /// </summary>
         /// <remarks>For more info, see section 9.3 of the USB Specification.</remarks>
         protected unsafe uint controlTransfer(byte RequestType, byte Request, ushort Value, ushort Index, void * data, ushort Length)
         {
-            return device.controlTransfer(RequestType, Request, Value, Index, data, Length);
+            return controlTransfer(RequestType, Request, Value, Index, data, Length, timeout);
+        }
+
+        /// <summary>
+        /// Performs a control transfer that has a data stage, using the
+        /// specified timeout (in milliseconds) instead of the device's timeout.
+        /// </summary>
+        protected unsafe uint controlTransfer(byte RequestType, byte Request, ushort Value, ushort Index, void * data, ushort Length, UInt32 timeout)
+        {
+            if (transport != null)
+            {
+                return transportControlTransfer(RequestType, Request, Value, Index, data, Length, timeout);
+            }
+            applyTransferTimeout(timeout);
+            long start = beginTransfer(RequestType, Request, Value, Index, Length);
+            uint ret;
+            try
+            {
+                ret = device.controlTransfer(RequestType, Request, Value, Index, data, Length);
+            }
+            catch (Exception exception)
+            {
+                recordTransfer(RequestType, Request, Value, Index, data, Length, statusOf(exception), start);
+                throw;
+            }
+            recordTransfer(RequestType, Request, Value, Index, data, Length, (int)ret, start);
+            return ret;
+        }
+
+        /// <summary>
+        /// Performs a control transfer on a virtual device's transport,
+        /// throwing an exception if it fails.
+        /// </summary>
+        unsafe uint transportControlTransfer(byte RequestType, byte Request, ushort Value, ushort Index, void * data, ushort Length, UInt32 timeout)
+        {
+            if (!tryGetTransferTimeout(ref timeout))
+            {
+                throw new TimeoutException("The deadline passed before the control transfer could be started.");
+            }
+            long start = beginTransfer(RequestType, Request, Value, Index, Length);
+            int ret = transport.controlTransfer(RequestType, Request, Value, Index, data, Length, timeout);
+            recordTransfer(RequestType, Request, Value, Index, data, Length, ret, start);
+            if (ret < 0)
+            {
+                throw UsbStatus.toException(ret, "Control transfer failed.");
+            }
+            return (uint)ret;
+        }
+
+        readonly TransferStatistics privateTransferStatistics;
+
+        /// <summary>
+        /// Counters and latency histograms for the control transfers sent to
+        /// this device.  They are shared with every other connection to the
+        /// same device.
+        /// </summary>
+        public TransferStatistics transferStatistics
+        {
+            get { return privateTransferStatistics; }
+        }
+
+        /// <summary>
+        /// Records in the trace that a transfer is being submitted.  Returns
+        /// the Stopwatch timestamp to pass to recordTransfer when it is done.
+        /// </summary>
+        long beginTransfer(byte requestType, byte request, ushort value, ushort index, ushort length)
+        {
+            long start = Stopwatch.GetTimestamp();
+            if (TransferTracer.tracing)
+            {
+                TransferTracer.submit(privateTransferStatistics.id, requestType, request,
+                                      value, index, length, start);
+            }
+            return start;
+        }
+
+        /// <summary>
+        /// Records a finished transfer in the transfer statistics, the trace,
+        /// and the session log.
+        /// </summary>
+        /// <param name="data">The data buffer of the transfer, or null if it has no data stage.</param>
+        /// <param name="result">The number of bytes transferred, or a negative UsbStatus code.</param>
+        /// <param name="start">The Stopwatch timestamp from when the transfer started.</param>
+        unsafe void recordTransfer(byte requestType, byte request, ushort value, ushort index, void* data, ushort length, int result, long start)
+        {
+            long end = Stopwatch.GetTimestamp();
+            if (TransferStatistics.enabled)
+            {
+                privateTransferStatistics.record(request, result, end - start);
+            }
+            if (TransferTracer.tracing)
+            {
+                TransferTracer.record(privateTransferStatistics.id, requestType, request,
+                                      value, index, length, result, start, end);
+            }
+            if (SessionRecorder.recording)
+            {
+                SessionRecorder.record(this, requestType, request, value, index,
+                                       data, length, result, start, end);
+            }
+        }
+
+        /// <summary>
+        /// The device interface GUID the device was found with.
+        /// </summary>
+        readonly Guid privateDeviceInterfaceGuid;
+
+        /// <summary>
+        /// Gets the vendor ID and device interface GUID for a session log.
+        /// </summary>
+        internal void getIdentity(out UInt16 vendorId, out Guid deviceInterfaceGuid)
+        {
+            if (transport != null)
+            {
+                vendorId = transport.vendorId;
+                deviceInterfaceGuid = transport.deviceInterfaceGuid;
+                return;
+            }
+
+            // WinUSB finds devices by their device interface GUID, not their
+            // vendor ID, and every device this library supports is Pololu's.
+            vendorId = 0x1FFB;
+            deviceInterfaceGuid = privateDeviceInterfaceGuid;
+        }
+
+        /// <summary>
+        /// Returns the status code that best describes an exception thrown
+        /// by a WinUSB transfer.
+        /// </summary>
+        static int statusOf(Exception exception)
+        {
+            Win32Exception win32Exception = exception as Win32Exception;
+            if (win32Exception != null)
+            {
+                return UsbStatus.fromWin32Error(win32Exception.NativeErrorCode);
+            }
+            return UsbStatus.Other;
         }
 
         /// <summary>
@@ -134,6 +497,10 @@ namespace Pololu.UsbWrapper
         {
             get
             {
+                if (transport != null)
+                {
+                    return 0;
+                }
                 return device.deviceInstance;
             }
         }
@@ -143,6 +510,15 @@ namespace Pololu.UsbWrapper
         /// </summary>
         protected UsbDevice(DeviceListItem deviceListItem)
         {
+            privateTransferStatistics = TransferStatistics.forDevice(deviceListItem.productId, deviceListItem.serialNumber);
+
+            if (deviceListItem.transport != null)
+            {
+                transport = deviceListItem.transport;
+                return;
+            }
+
+            privateDeviceInterfaceGuid = deviceListItem.guid;
             WinUsbDeviceHandles handles;
 
             try
@@ -172,7 +548,11 @@ namespace Pololu.UsbWrapper
         /// </summary>
         public void disconnect()
         {
-            device.disconnect();
+            stopCoalescing();
+            if (device != null)
+            {
+                device.disconnect();
+            }
         }
 
         /// <summary>
@@ -183,6 +563,48 @@ namespace Pololu.UsbWrapper
         public void Dispose()
         {
             disconnect();
+            GC.SuppressFinalize(this);
+        }
+
+        CoalescingWriter privateCoalescer;
+
+        /// <summary>
+        /// The writer that sends targets and speeds while the device is in
+        /// coalescing mode (see startCoalescing in the classes for each
+        /// device), or null if it is not.  Its counters show how many values
+        /// were coalesced.
+        /// </summary>
+        public CoalescingWriter coalescer
+        {
+            get { return privateCoalescer; }
+        }
+
+        /// <summary>
+        /// Starts coalescing mode, if it is not started already.
+        /// </summary>
+        /// <param name="keyCount">The number of values the device has, such as one target per channel.</param>
+        /// <param name="write">Sends one value to the device.</param>
+        protected void startCoalescing(int keyCount, CoalescedWrite write)
+        {
+            if (privateCoalescer == null)
+            {
+                privateCoalescer = new CoalescingWriter(keyCount, write, "Coalescing writer " + getSerialNumber());
+            }
+        }
+
+        /// <summary>
+        /// Sends the values that are waiting to be sent and leaves coalescing
+        /// mode, so that targets and speeds are sent right away again.  This
+        /// is called by disconnect.
+        /// </summary>
+        public void stopCoalescing()
+        {
+            CoalescingWriter writer = privateCoalescer;
+            if (writer != null)
+            {
+                writer.Dispose();
+                privateCoalescer = null;
+            }
         }
 
         /// <summary>
@@ -190,14 +612,32 @@ namespace Pololu.UsbWrapper
         /// </summary>
         /// <returns></returns>
         protected static List<DeviceListItem> getDeviceList(Guid deviceInterfaceGuid)
+        {
+            var deviceList = new List<DeviceListItem>();
+
+            if (Usb.enumerateRealDevices)
+            {
+                addRealDevices(deviceList, deviceInterfaceGuid);
+            }
+
+            foreach (IUsbTransport transport in Usb.getVirtualDevices())
+            {
+                if (transport.deviceInterfaceGuid == deviceInterfaceGuid)
+                {
+                    deviceList.Add(new DeviceListItem(transport));
+                }
+            }
+
+            return deviceList;
+        }
+
+        private static void addRealDevices(List<DeviceListItem> deviceList, Guid deviceInterfaceGuid)
         {
             IntPtr deviceListHandle = Winusb.listCreate(deviceInterfaceGuid);
             try
             {
                 UInt32 deviceListSize = Winusb.listSize(deviceListHandle);
 
-                var deviceList = new List<DeviceListItem>();
-
                 for (Byte i = 0; i < deviceListSize; i++)
                 {
                     // Get all the needed info in an effecient way.  This is more efficient than
@@ -214,7 +654,6 @@ namespace Pololu.UsbWrapper
                         productId);
                     deviceList.Add(item);
                 }
-                return deviceList;
             }
             finally
             {
@@ -240,6 +679,10 @@ namespace Pololu.UsbWrapper
         /// <returns></returns>
         public bool isSameDeviceAs(DeviceListItem item)
         {
+            if (transport != null || item.transport != null)
+            {
+                return transport == item.transport;
+            }
             return deviceInstance == item.deviceInstance;
         }
 
@@ -0,0 +1,110 @@
+﻿using System;
+
+namespace Pololu.UsbWrapper
+{
+    /// <summary>
+    /// Status codes returned by the non-throwing (try*) methods of the
+    /// device classes.  Zero means success and negative numbers are errors.
+    /// The error codes have the same values as the LIBUSB_ERROR codes used
+    /// by the Linux version of this library.
+    /// </summary>
+    public static class UsbStatus
+    {
+        public const int Success = 0;
+        public const int IOError = -1;
+        public const int InvalidParameter = -2;
+        public const int AccessDenied = -3;
+        public const int NoDevice = -4;
+        public const int NotFound = -5;
+        public const int Busy = -6;
+        public const int Timeout = -7;
+        public const int Overflow = -8;
+        public const int Pipe = -9;
+        public const int Interrupted = -10;
+        public const int NoMemory = -11;
+        public const int NotSupported = -12;
+        public const int Other = -99;
+
+        /// <summary>
+        /// The device sent back fewer bytes than were expected.
+        /// This is not a libusb error code.
+        /// </summary>
+        public const int ShortTransfer = -100;
+
+        /// <summary>
+        /// Converts a Win32 error code from a failed WinUSB call to the
+        /// closest status code.
+        /// </summary>
+        internal static int fromWin32Error(int error)
+        {
+            switch (error)
+            {
+                case 5: return AccessDenied;      // ERROR_ACCESS_DENIED
+                case 31: return Pipe;             // ERROR_GEN_FAILURE (the device stalled)
+                case 87: return InvalidParameter; // ERROR_INVALID_PARAMETER
+                case 121: return Timeout;         // ERROR_SEM_TIMEOUT
+                case 995: return Interrupted;     // ERROR_OPERATION_ABORTED
+                case 1167: return NoDevice;       // ERROR_DEVICE_NOT_CONNECTED
+                default: return IOError;
+            }
+        }
+
+        /// <summary>
+        /// Returns a short description of the status code, like "Timeout.".
+        /// </summary>
+        public static string describe(int status)
+        {
+            switch (status)
+            {
+                case IOError: return "I/O error.";
+                case InvalidParameter: return "Invalid parameter.";
+                case AccessDenied: return "Access denied.";
+                case NoDevice: return "Device does not exist.";
+                case NotFound: return "No such entity.";
+                case Busy: return "Busy.";
+                case Timeout: return "Timeout.";
+                case Overflow: return "Overflow.";
+                case Pipe: return "Pipe error.";
+                case Interrupted: return "System call was interrupted.";
+                case NoMemory: return "Out of memory.";
+                case NotSupported: return "Unsupported/unimplemented operation.";
+                case Other: return "Other error.";
+                case ShortTransfer: return "Short transfer.";
+                default:
+                    if (status >= 0)
+                    {
+                        return "Success.";
+                    }
+                    return "Unknown error code " + status + ".";
+            }
+        }
+
+        /// <summary>
+        /// Creates an exception that describes the given error code.
+        /// Timeouts are represented as TimeoutException.
+        /// </summary>
+        public static Exception toException(int status)
+        {
+            if (status == Timeout)
+            {
+                return new TimeoutException(describe(status));
+            }
+            return new Exception(describe(status));
+        }
+
+        /// <summary>
+        /// Creates an exception with the given message whose InnerException
+        /// describes the given error code.  For a timeout it is a
+        /// TimeoutException, so that catch (TimeoutException) works whatever
+        /// the operation was.
+        /// </summary>
+        public static Exception toException(int status, string message)
+        {
+            if (status == Timeout)
+            {
+                return new TimeoutException(message, toException(status));
+            }
+            return new Exception(message, toException(status));
+        }
+    }
+}
@@ -60,6 +60,49 @@ namespace Pololu.WinusbHelper
             }
         }
 
+        /// <summary>
+        /// The PIPE_TRANSFER_TIMEOUT value currently set for the default
+        /// control pipe, or UInt32.MaxValue if we have not set it.
+        /// </summary>
+        UInt32 controlPipeTimeout = UInt32.MaxValue;
+
+        /// <summary>
+        /// Sets the timeout (in milliseconds) for control transfers on this
+        /// device.  Zero means no timeout.  Does nothing if the timeout is
+        /// already set to the given value.
+        /// </summary>
+        internal void setControlTimeout(UInt32 timeout)
+        {
+            if (!trySetControlTimeout(timeout))
+            {
+                throw new Win32Exception("Unable to set the control transfer timeout.");
+            }
+        }
+
+        /// <summary>
+        /// Same as setControlTimeout, but returns false instead of throwing
+        /// an exception if it fails.
+        /// </summary>
+        internal bool trySetControlTimeout(UInt32 timeout)
+        {
+            if (timeout == controlPipeTimeout)
+            {
+                return true;
+            }
+
+            if (!WinUsb_SetPipePolicy(handles.winusbHandle, 0, PIPE_TRANSFER_TIMEOUT, sizeof(UInt32), ref timeout))
+            {
+                return false;
+            }
+            controlPipeTimeout = timeout;
+            return true;
+        }
+
+        /// <summary>
+        /// A pipe policy type from winusbio.h.
+        /// </summary>
+        const UInt32 PIPE_TRANSFER_TIMEOUT = 0x03;
+
         internal UInt16 getProductID()
         {
             return Winusb.getProductID(deviceInstance);
@@ -138,6 +181,24 @@ namespace Pololu.WinusbHelper
             return lengthTransferred;
         }
 
+        /// <summary>
+        /// Performs a control transfer without throwing an exception if it fails.
+        /// </summary>
+        /// <returns>
+        ///   The number of bytes transferred in the data stage, or a negative
+        ///   UsbStatus error code.
+        /// </returns>
+        protected unsafe Int32 tryControlTransfer(WINUSB_SETUP_PACKET setupPacket, void * buffer)
+        {
+            UInt32 lengthTransferred = 0;
+            Boolean success = WinUsb_ControlTransfer(handles.winusbHandle, setupPacket, buffer, setupPacket.Length, &lengthTransferred, (OVERLAPPED*)0);
+            if (!success)
+            {
+                return Pololu.UsbWrapper.UsbStatus.fromWin32Error(Marshal.GetLastWin32Error());
+            }
+            return (Int32)lengthTransferred;
+        }
+
         [StructLayout(LayoutKind.Sequential)]
         struct OVERLAPPED
         {
@@ -170,6 +231,9 @@ namespace Pololu.WinusbHelper
         [DllImport("winusb.dll", SetLastError = true)]
         static extern Boolean WinUsb_SetPipePolicy(IntPtr InterfaceHandle, Byte PipeID, UInt32 PolicyType, UInt32 ValueLength, ref Byte Value);
 
+        [DllImport("winusb.dll", SetLastError = true)]
+        static extern Boolean WinUsb_SetPipePolicy(IntPtr InterfaceHandle, Byte PipeID, UInt32 PolicyType, UInt32 ValueLength, ref UInt32 Value);
+
         [DllImport("winusb.dll", SetLastError = true)]
         static extern Boolean WinUsb_WritePipe(IntPtr InterfaceHandle, Byte PipeID, ref Byte Buffer, UInt32 BufferLength, ref UInt32 LengthTransferred, IntPtr Overlapped);
 
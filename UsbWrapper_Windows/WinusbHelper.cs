@@ -340,6 +340,33 @@ namespace Pololu.WinusbHelper
             return parent;
         }
 
+        /// <summary>
+        /// Gets the device instance (DEVINST) of the root hub that the given
+        /// device is connected through, by walking up the device tree until
+        /// a device instance id like "USB\ROOT_HUB30\4&amp;1A2B3C4D&amp;0&amp;0"
+        /// is found.  Returns -1 if there is no root hub above the device.
+        /// </summary>
+        internal static Int32 getRootHubDeviceInstance(Int32 deviceInstance)
+        {
+            try
+            {
+                // There are at most 5 tiers of hubs below a root hub, plus a
+                // composite parent, so this is more than enough.
+                for (int depth = 0; depth < 10; depth++)
+                {
+                    if (getDeviceInstanceId(deviceInstance).StartsWith("USB\\ROOT_HUB", StringComparison.OrdinalIgnoreCase))
+                    {
+                        return deviceInstance;
+                    }
+                    deviceInstance = getParentDeviceInstance(deviceInstance);
+                }
+            }
+            catch (Win32Exception)
+            {
+            }
+            return -1;
+        }
+
         /// <summary>
         /// Destroys the list of devices, freeing up the memory.
         /// </summary>